@@ -10,13 +10,30 @@
 	vm16 API
 ]]--
 
-local vm16lib = ...
-if vm16lib.version() ~= "2.7.5" then
-	minetest.log("error", "[vm16] Install Lua library v2.7.5 (see readme.md)!")
+local vm16lib, vm16ffi = ...
+if vm16lib.version() ~= "2.8.0" then
+	minetest.log("error", "[vm16] Install Lua library v2.8.0 (see readme.md)!")
 end
 
 local M = minetest.get_meta
-local VMList = {}
+local OutBuffers = setmetatable({}, {__mode = "k"})  -- VMs with output buffer
+local SysBuffers = setmetatable({}, {__mode = "k"})  -- VMs with system call buffers
+local EventCtx = setmetatable({}, {__mode = "k"})  -- 'vm16lib.run_loop' context per cpu_def
+local Handles = setmetatable({}, {__mode = "v"})  -- CPU handles per registry key (see 'vm16.get')
+local Destroyed = {}  -- VMs to be returned to the pool (see 'remove_unloaded_vms')
+local MAX_JOBS = 64  -- max. number of VM copies queued for the background serializer
+local Evicted = {}  -- registry keys of the VMs evicted to storage (see 'evict_vms')
+local EvictStats = {evicted = 0, evicted_bytes = 0, restored = 0, bytes = 0}
+local DecodeCache = minetest.settings:get_bool("vm16_decode_cache", true)
+local JIT = minetest.settings:get_bool("vm16_jit", false)
+local Threads = tonumber(minetest.settings:get("vm16_threads")) or 1
+if Threads > 1 then
+	vm16lib.threads(Threads)
+end
+local PoolSize = tonumber(minetest.settings:get("vm16_pool_size")) or 16
+vm16lib.pool_limit(PoolSize * 1024 * 1024)
+local MemBudget = (tonumber(minetest.settings:get("vm16_mem_budget")) or 256) * 1024 * 1024
+local IdleTime = math.max(tonumber(minetest.settings:get("vm16_idle_time")) or 60, 1)
 local storage = minetest.get_mod_storage()
 if storage:get_int("version") ~= 2 then
 	storage:from_table()
@@ -25,7 +42,7 @@ if storage:get_int("version") ~= 2 then
 end
 
 -------------------------------------------------------------------------------
-local VERSION     = 3.7  -- See readme.md
+local VERSION     = 3.8  -- See readme.md
 -------------------------------------------------------------------------------
 local VM16_OK     = 0  -- run to the end
 local VM16_NOP    = 1  -- nop command
@@ -44,9 +61,13 @@ vm16.SYS    = VM16_SYS
 vm16.HALT   = VM16_HALT
 vm16.BREAK  = VM16_BREAK
 vm16.ERROR  = VM16_ERROR
+vm16.PORT_NONE  = 0  -- unregister the port
+vm16.PORT_LATCH = 1  -- latched value
+vm16.PORT_RING  = 2  -- ring buffers
 vm16.version  = VERSION
 vm16.testbit  = vm16lib.testbit
 vm16.is_ascii = vm16lib.is_ascii
+vm16.pool_stats = vm16lib.pool_stats
 vm16.CallResults = {[0]="OK", "NOP", "IN", "OUT", "SYS", "HALT", "BREAK", "ERROR"}
 
 function vm16.get_position_from_hash(hash)
@@ -103,67 +124,313 @@ function vm16.reset_breakpoint(pos, addr, breakpoints)
 	end
 end
 
+-- Add/remove the VM to/from the registry and update the CPU handle
+local function register_vm(pos, vm)
+	local key = vm16lib.register_vm(pos, vm)
+	if key and Handles[key] then
+		Handles[key].vm = vm
+	end
+end
+
+local function unregister_vm(pos)
+	local vm = vm16lib.lookup(pos)
+	vm16lib.unregister_vm(pos)
+	local cpu = Handles[vm16lib.pos_key(pos)]
+	if cpu then
+		cpu.vm = nil
+	end
+	return vm
+end
+
+-- Return the VM of the position (or key), an evicted VM is restored
+local function lookup(pos)
+	local vm = vm16lib.lookup(pos)
+	if not vm and next(Evicted) then
+		local key = vm16lib.pos_key(pos)
+		if Evicted[key] then
+			vm16.vm_restore(vm16lib.key_pos(key))
+			vm = vm16lib.lookup(key)
+		end
+	end
+	return vm
+end
+
+local function new_vm(ram_size)
+	local vm = vm16lib.init(ram_size)
+	if vm and DecodeCache then
+		vm16lib.decode_cache(vm, true)
+	end
+	if vm and JIT then
+		vm16lib.jit(vm, true)
+	end
+	return vm
+end
+
+-- Write a VM encoded by the background serializer to the storage
+local function store_encoded(tag, s, typ)
+	if s then
+		storage:set_string(tag, s)
+		if typ == "compressed" then
+			storage:set_string(tag .. "d", "")  -- new checkpoint, delta is obsolete
+		end
+	elseif tag then
+		minetest.log("error", "[vm16] VM could not be stored")
+	end
+end
+
+-- Write the VMs encoded so far (all queued VMs with 'wait') to the storage
+local function write_stored_vms(wait)
+	local tag, s, typ = vm16lib.collect(wait)
+	while tag do
+		store_encoded(tag, s, typ)
+		tag, s, typ = vm16lib.collect(wait)
+	end
+end
+
+local function collect_stored_vms()
+	write_stored_vms(false)
+	if vm16lib.num_jobs() > 0 then
+		minetest.after(0.1, collect_stored_vms)
+	end
+end
+
+-- move VM from active to storage string (compressed snapshot as checkpoint),
+-- or only the pages written since the checkpoint (delta), if these are less than
+-- half of the memory.
+-- The VM is copied and encoded by a background thread, the string is written
+-- by 'write_stored_vms' later.
+local function vm_store(pos, vm)
+	--print("vm_store")
+	local hash = vm16lib.hash_node_position(pos)
+	local pages, num_pages = vm16lib.dirty_pages(vm)
+	if #pages * 2 < num_pages then
+		if not vm16lib.serialize(vm, "delta", hash .. "d") then
+			minetest.log("error", "[vm16] VM could not be stored")
+		end
+	elseif vm16lib.serialize(vm, "compressed", hash) then
+		vm16lib.checkpoint(vm)
+	else
+		minetest.log("error", "[vm16] VM could not be stored")
+	end
+	-- limit the memory used by the VM copies
+	if vm16lib.num_jobs() >= MAX_JOBS then
+		store_encoded(vm16lib.collect(true))
+	end
+end
+
+-- Store and free the least recently used VMs, if the VMs use more memory
+-- than the budget (setting 'vm16_mem_budget'). Only VMs which did not run
+-- (and were not accessed) for 'vm16_idle_time' seconds are evicted, they are
+-- restored on the next access (see 'lookup').
+local function evict_vms()
+	local budget = MemBudget > 0 and MemBudget or math.huge
+	local keys, bytes = vm16lib.evict_vms(minetest.get_us_time() / 1000000, budget, IdleTime)
+	for _, key in ipairs(keys) do
+		local vm = vm16lib.lookup(key)
+		local size = vm16lib.mem_usage(vm)
+		vm_store(vm16lib.key_pos(key), vm)
+		vm16lib.free(unregister_vm(key))
+		Evicted[key] = true
+		bytes = bytes - size
+		EvictStats.evicted = EvictStats.evicted + 1
+		EvictStats.evicted_bytes = EvictStats.evicted_bytes + size
+	end
+	EvictStats.bytes = bytes
+end
+
+-- Returns the memory usage of the loaded VMs and the eviction statistics
+function vm16.eviction_stats()
+	evict_vms()
+	return {
+		budget = MemBudget,
+		bytes = EvictStats.bytes,
+		num_vms = vm16lib.num_vms(),
+		evicted = EvictStats.evicted,
+		evicted_bytes = EvictStats.evicted_bytes,
+		restored = EvictStats.restored,
+	}
+end
+
 -- ram_size is from 0 for 64 words, 1 for 128 words, up to 10 for 64 Kwords
 function vm16.create(pos, ram_size)
 	--print("vm_create")
-	local hash = vm16lib.hash_node_position(pos)
-	VMList[hash] = vm16lib.init(ram_size)
+	local vm = new_vm(ram_size)
+	Evicted[vm16lib.pos_key(pos)] = nil
+	if vm then
+		register_vm(pos, vm)
+		evict_vms()
+	else
+		unregister_vm(pos)
+	end
 	local meta = minetest.get_meta(pos)
 	meta:set_string("vm16", "")
 	meta:set_int("vm16size", ram_size)
 	meta:mark_as_private("vm16")
-	return VMList[hash] ~= nil
+	return vm ~= nil
+end
+
+-- Create the VM at 'pos' as clone of the VM at 'src_pos' (registers and memory,
+-- without I/O state). The memory pages are shared until one of the VMs writes.
+function vm16.clone(pos, src_pos)
+	local src = lookup(src_pos)
+	local vm = src and vm16lib.clone(src)
+	Evicted[vm16lib.pos_key(pos)] = nil
+	if vm then
+		register_vm(pos, vm)
+		evict_vms()
+	else
+		unregister_vm(pos)
+	end
+	local meta = minetest.get_meta(pos)
+	meta:set_string("vm16", "")
+	meta:set_int("vm16size", minetest.get_meta(src_pos):get_int("vm16size"))
+	meta:mark_as_private("vm16")
+	return vm ~= nil
+end
+
+-- Return a ROM image with the H16 data (loaded once for all VMs), or nil.
+function vm16.create_rom(h16)
+	return vm16lib.rom(h16)
+end
+
+-- Map the ROM read-only into the memory of the VM at 'pos' (writes are ignored).
+-- The ROM pages are shared by all VMs. A stored and restored VM keeps the
+-- ROM content as normal memory, the ROM has to be mapped again.
+function vm16.map_rom(pos, rom)
+	local vm = lookup(pos)
+	return vm ~= nil and vm16lib.map_rom(vm, rom)
 end
 
 function vm16.destroy(pos)
 	--print("vm_destroy")
 	minetest.get_meta(pos):set_string("vm16", "")
-	local hash = vm16lib.hash_node_position(pos)
-	VMList[hash] = nil
+	Evicted[vm16lib.pos_key(pos)] = nil
+	-- the VM could be in use by the caller (e.g. 'vm16.run' callback)
+	Destroyed[#Destroyed + 1] = unregister_vm(pos)
 end
 
+-- Evicted VMs are loaded (restored on the next access)
 function vm16.is_loaded(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	return VMList[hash] ~= nil
+	return vm16lib.lookup(pos) ~= nil or Evicted[vm16lib.pos_key(pos)] ~= nil
 end
 
--- move VM from storage string to active
+-- move VM from storage string (snapshot) to active
 function vm16.vm_restore(pos)
 	--print("vm_restore")
 	local meta = minetest.get_meta(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	if not VMList[hash] then
+	if not vm16lib.lookup(pos) then
+		local key = vm16lib.pos_key(pos)
+		if Evicted[key] then
+			Evicted[key] = nil
+			EvictStats.restored = EvictStats.restored + 1
+		end
+		-- the VM could be queued for storage
+		write_stored_vms(true)
+		local hash = vm16lib.hash_node_position(pos)
 		local s = storage:get_string(hash)
 		local size = meta:get_int("vm16size")
-		if s ~= "" and size > 0 then
-			VMList[hash] = vm16lib.init(size)
-			vm16lib.set_vm(VMList[hash], s)
+		local vm = s ~= "" and size > 0 and new_vm(size)
+		if vm then
+			-- binary or ASCII string (old format), the memory pages are decoded on first access
+			if not vm16lib.set_snapshot(vm, s, true) then
+				minetest.log("error", "[vm16] VM could not be restored")
+			end
+			vm16lib.checkpoint(vm)
+			local delta = storage:get_string(hash .. "d")
+			if delta ~= "" and not vm16lib.set_snapshot(vm, delta) then
+				minetest.log("error", "[vm16] VM could not be restored (delta)")
+			end
+			register_vm(pos, vm)
+			evict_vms()
 		end
 	end
 end
 
--- move VM from active to storage string
-local function vm_store(pos, vm)
-	--print("vm_store")
-	local hash = vm16lib.hash_node_position(pos)
-	local s = vm16lib.get_vm(vm)
-	storage:set_string(hash, s)
+-------------------------------------------------------------------------------
+-- CPU handle
+-------------------------------------------------------------------------------
+-- Method based access to a loaded VM, e.g.:
+--   local cpu = vm16.get(pos)
+--   cpu:run(cpu_def)
+--   local val = cpu:peek(addr)
+-- The methods call the C functions without position hash and VM lookup.
+-- The handle can be cached, it is updated if the VM is unloaded (the methods
+-- return nil) and loaded again. An evicted VM is restored by the next method call.
+local Cpu = {}
+Cpu.__index = Cpu
+
+-- Returns the CPU handle, or nil if the VM is not loaded
+function vm16.get(pos)
+	local key = vm16lib.pos_key(pos)
+	local cpu = Handles[key]
+	if not cpu then
+		local vm = lookup(key)
+		if not vm then
+			return
+		end
+		cpu = setmetatable({pos = vm16lib.key_pos(key), key = key, vm = vm}, Cpu)
+		Handles[key] = cpu
+	elseif not cpu.vm then
+		lookup(key)  -- evicted VM
+	end
+	return cpu.vm and cpu
 end
 
--- Read VM memory and return the data as ASCII string
-function vm16.get_vm(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.get_vm(vm)
+-- VM of the handle, an evicted VM is restored (see 'register_vm')
+local function cpu_vm(cpu)
+	if not cpu.vm and Evicted[cpu.key] then
+		lookup(cpu.key)
+	end
+	return cpu.vm
 end
 
--- Write given data string to the VM memory
-function vm16.set_vm(pos, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.set_vm(vm, s)
+function Cpu:is_loaded()
+	return self.vm ~= nil or Evicted[self.key] ~= nil
 end
 
+-- Add the VM function 'func(vm, ...)' as method 'cpu:name(...)'
+-- and as pos based function 'vm16.name(pos, ...)'
+local function add_vm_function(name, func)
+	Cpu[name] = function(self, ...)
+		local vm = self.vm or cpu_vm(self)
+		return vm and func(vm, ...)
+	end
+	vm16[name] = function(pos, ...)
+		local vm = lookup(pos)
+		return vm and func(vm, ...)
+	end
+end
+
+for _, name in ipairs({
+	"get_vm", "set_vm",  -- VM data as ASCII string
+	"get_snapshot", "set_snapshot",  -- VM data as binary string
+	"get_delta", "dirty_pages", "checkpoint",  -- incremental storage
+	"pending_pages",  -- number of memory pages not decoded so far (lazy restore)
+	"mem_size",  -- size in words
+	"fusion_report",  -- number of executed fused instruction sequences per type
+	"set_pc", "get_pc", "deposit", "peek", "poke",
+	"read_mem", "write_mem", "read_mem_bin", "write_mem_bin",
+	"read_mem_as_str", "write_mem_as_str", "read_ascii", "write_ascii", "write_ascii_16",
+	"write_h16", "get_cpu_reg", "set_cpu_reg", "get_io_reg", "set_io_reg",
+	"register_port", "read_ports", "write_ports",  -- I/O ports served by the VM
+}) do
+	add_vm_function(name, vm16lib[name])
+end
+
+-- Generate H16 string from VM memory
+add_vm_function("read_h16", function(vm, start_addr, size)
+	return vm16lib.read_h16(vm, start_addr or 0, size or vm16lib.mem_size(vm))
+end)
+
+-- LuaJIT FFI binding (see vm16ffi.lua), nil if not available
+vm16.ffi = vm16ffi
+
+-- Return the VM as `vm16_t*` pointer for the FFI binding.
+-- The pointer is only valid as long as the VM is loaded (see 'vm16.is_loaded').
+add_vm_function("get_cpu_ptr", function(vm)
+	return vm16ffi and vm16ffi.cast(vm)
+end)
+
 function vm16.on_power_on(pos, ram_size)
 	--print("on_power_on")
 	if not vm16.is_loaded(pos) then
@@ -189,217 +456,221 @@ function vm16.on_load(pos)
 	end
 end
 
--- returns size in words
-function vm16.mem_size(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.mem_size(vm)
-end
-
--- load PC with given address
-function vm16.set_pc(pos, addr)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.set_pc(vm, addr)
-end
-
-function vm16.get_pc(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.get_pc(vm)
-end
-
-function vm16.deposit(pos, value)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.deposit(vm, value)
-end
-
-function vm16.read_mem(pos, addr, num)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.read_mem(vm, addr, num)
-end
-
-function vm16.write_mem(pos, addr, tbl)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_mem(vm, addr, tbl)
-end
-
-function vm16.read_mem_bin(pos, addr, num)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.read_mem_bin(vm, addr, num)
-end
-
-function vm16.write_mem_bin(pos, addr, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_mem_bin(vm, addr, s)
-end
-
-function vm16.read_mem_as_str(pos, addr, num)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.read_mem_as_str(vm, addr, num)
-end
-
-function vm16.write_mem_as_str(pos, addr, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_mem_as_str(vm, addr, s)
-end
-
-function vm16.read_ascii(pos, addr, num)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.read_ascii(vm, addr, num)
-end
-
-function vm16.write_ascii(pos, addr, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_ascii(vm, addr, s)
-end
-
-function vm16.write_ascii_16(pos, addr, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_ascii_16(vm, addr, s)
-end
-
-function vm16.peek(pos, addr)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.peek(vm, addr)
-end
+-- Process the stop event of a VM (VM16_NOP...VM16_ERROR).
+-- Returns the costs in cycles if the VM can continue.
+-- Output buffer (see 'vm16.set_out_buffer')
+add_vm_function("set_out_buffer", function(vm, size, costs)
+	if vm16lib.out_buffer(vm, size, costs) then
+		OutBuffers[vm] = size > 0 or nil
+		return true
+	end
+end)
 
-function vm16.poke(pos, addr, val)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.poke(vm, addr, val)
+-- Register the system call buffers of 'cpu_def.sys_buffers' (once per VM)
+local function register_sys_buffers(vm, cpu_def)
+	for num, def in pairs(cpu_def.sys_buffers) do
+		vm16lib.sys_buffer(vm, num, def.size or 256, def.costs or cpu_def.system_costs, def.result)
+	end
+	SysBuffers[vm] = true
 end
 
-function vm16.get_cpu_reg(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.get_cpu_reg(vm)
+-- Pass the buffered 'out' records and system call values to the CPU,
+-- in one call if possible
+local function flush_buffers(pos, vm, cpu_def)
+	if OutBuffers[vm] then
+		local records = vm16lib.read_out_buffer(vm)
+		if records then
+			if cpu_def.on_output_batch then
+				cpu_def.on_output_batch(pos, records)
+			else
+				for i = 1, #records, 3 do
+					cpu_def.on_output(pos, records[i], records[i + 1], records[i + 2])
+				end
+			end
+		end
+	end
+	if SysBuffers[vm] then
+		for num in pairs(cpu_def.sys_buffers) do
+			local values = vm16lib.read_sys_buffer(vm, num)
+			if values then
+				if cpu_def.on_system_batch then
+					cpu_def.on_system_batch(pos, num, values)
+				else
+					for _, val in ipairs(values) do
+						cpu_def.on_system(pos, num, val)
+					end
+				end
+			end
+		end
+	end
 end
 
-function vm16.set_cpu_reg(pos, regs)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.set_cpu_reg(vm, regs)
+local function handle_event(pos, vm, cpu_def, resp, breakpoints)
+	if resp == VM16_BREAK then
+		store_breakpoint_addr(pos, vm, breakpoints)
+		local cpu = vm16lib.get_cpu_reg(vm)
+		cpu_def.on_update(pos, resp, cpu)
+	elseif resp == VM16_IN then
+		local addr = vm16lib.io_regs(vm)
+		local data, costs = cpu_def.on_input(pos, addr)
+		vm16lib.set_io_value(vm, data)
+		return tonumber(costs) or cpu_def.input_costs
+	elseif resp == VM16_OUT then
+		local addr, data, _, B = vm16lib.io_regs(vm)
+		local costs = cpu_def.on_output(pos, addr, data, B)
+		return tonumber(costs) or cpu_def.output_costs
+	elseif resp == VM16_SYS then
+		local addr, _, A, B, C = vm16lib.io_regs(vm)
+		local data, costs = cpu_def.on_system(pos, addr, A, B, C)
+		vm16lib.set_io_value(vm, data or 0)
+		return tonumber(costs) or cpu_def.system_costs
+	elseif resp == VM16_HALT or resp == VM16_ERROR then
+		local cpu = vm16lib.get_cpu_reg(vm)
+		cpu_def.on_update(pos, resp, cpu)
+	end
 end
 
-function vm16.get_io_reg(pos)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.get_io_reg(vm)
-end
+local function run(pos, vm, cpu_def, breakpoints, steps)
+	local resp = VM16_ERROR
+	local handled, costs
+	local cycles = steps or cpu_def.instr_per_cycle
+	if skip_break_instr(pos, vm, cpu_def, breakpoints) then
+		return VM16_OK
+	end
+	if cpu_def.sys_buffers and not SysBuffers[vm] then
+		register_sys_buffers(vm, cpu_def)
+	end
 
-function vm16.set_io_reg(pos, io)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.set_io_reg(vm, io)
-end
+	-- I/O and system calls are handled by the C event loop
+	local ctx = EventCtx[cpu_def]
+	if not ctx then
+		ctx = vm16lib.event_ctx(cpu_def)
+		EventCtx[cpu_def] = ctx
+	end
 
--- Write H16 string to VM memory
-function vm16.write_h16(pos, s)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	return vm and vm16lib.write_h16(vm, s)
-end
+	while cycles > 0 do
+		resp, cycles, handled = vm16lib.run_loop(vm, ctx, pos, cycles)
+		if OutBuffers[vm] or SysBuffers[vm] then
+			flush_buffers(pos, vm, cpu_def)
+		end
 
--- Generate H16 string from VM memory
-function vm16.read_h16(pos, start_addr, size)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	start_addr = start_addr or 0
-	size = size or vm16lib.mem_size(vm)
-	return vm and vm16lib.read_h16(vm, start_addr, size)
+		if not handled then
+			costs = handle_event(pos, vm, cpu_def, resp, breakpoints)
+			if not costs then
+				return resp
+			end
+			cycles = cycles - costs
+		end
+	end
+	return resp
 end
 
 function vm16.run(pos, cpu_def, breakpoints, steps)
-	local hash = vm16lib.hash_node_position(pos)
-	local vm = VMList[hash]
-	local resp = VM16_ERROR
-	local ran, costs
-
+	local vm = lookup(pos)
 	if not vm then
-		return resp
+		return VM16_ERROR
 	end
+	return run(pos, vm, cpu_def, breakpoints, steps)
+end
 
-	local cycles = steps or cpu_def.instr_per_cycle
-	if skip_break_instr(pos, vm, cpu_def, breakpoints) then
-		return VM16_OK
+function Cpu:run(cpu_def, breakpoints, steps)
+	local vm = self.vm or cpu_vm(self)
+	if not vm then
+		return VM16_ERROR
+	end
+	return run(self.pos, vm, cpu_def, breakpoints, steps)
+end
+
+-- Run several CPUs like 'vm16.run', but with one C call for all CPUs
+-- and one pass over the stopped CPUs per round.
+-- 'cpus' is a list of {pos = pos, cpu_def = cpu_def, breakpoints = breakpoints}.
+-- Returns the list of 'vm16.run' results.
+function vm16.run_batch(cpus)
+	local results = {}
+	local vms, idxs, cycles = {}, {}, {}
+	local buffered = {}  -- CPUs with output buffer
+
+	for i, cpu in ipairs(cpus) do
+		local vm = lookup(cpu.pos)
+		results[i] = vm and VM16_OK or VM16_ERROR
+		if vm and cpu.cpu_def.sys_buffers and not SysBuffers[vm] then
+			register_sys_buffers(vm, cpu.cpu_def)
+		end
+		if vm and (OutBuffers[vm] or SysBuffers[vm]) then
+			buffered[#buffered + 1] = {cpu, vm}
+		end
+		if vm and not skip_break_instr(cpu.pos, vm, cpu.cpu_def, cpu.breakpoints) then
+			vms[#vms + 1] = vm
+			idxs[#idxs + 1] = i
+			cycles[#cycles + 1] = cpu.cpu_def.instr_per_cycle
+		end
 	end
 
-	while cycles > 0 do
-		resp, ran = vm16lib.run(vm, cycles)
-		cycles = cycles - ran
-
-		if resp == VM16_NOP then
-			return VM16_NOP
-		elseif resp == VM16_BREAK then
-			store_breakpoint_addr(pos, vm, breakpoints)
-			local cpu = vm16lib.get_cpu_reg(vm)
-			cpu_def.on_update(pos, resp, cpu)
-			return VM16_BREAK
-		elseif resp == VM16_IN then
-			local io = vm16lib.get_io_reg(vm)
-			io.data, costs = cpu_def.on_input(pos, io.addr)
-			vm16lib.set_io_reg(vm, io)
-			costs = tonumber(costs)
-			cycles = cycles - (costs or cpu_def.input_costs)
-		elseif resp == VM16_OUT then
-			local io = vm16lib.get_io_reg(vm)
-			costs = cpu_def.on_output(pos, io.addr, io.data, io.B)
-			costs = tonumber(costs)
-			cycles = cycles - (costs or cpu_def.output_costs)
-		elseif resp == VM16_SYS then
-			local io = vm16lib.get_io_reg(vm)
-			io.data, costs = cpu_def.on_system(pos, io.addr, io.A, io.B, io.C)
-			io.data = io.data or 0
-			vm16lib.set_io_reg(vm, io)
-			costs = tonumber(costs)
-			cycles = cycles - (costs or cpu_def.system_costs)
-		elseif resp == VM16_HALT then
-			local cpu = vm16lib.get_cpu_reg(vm)
-			cpu_def.on_update(pos, resp, cpu)
-			return VM16_HALT
-		elseif resp == VM16_ERROR then
-			local cpu = vm16lib.get_cpu_reg(vm)
-			cpu_def.on_update(pos, resp, cpu)
-			return VM16_ERROR
+	while #vms > 0 do
+		-- list of 'index, resp, ran' of the stopped VMs
+		local events = vm16lib.run_batch(vms, cycles)
+		local vms2, idxs2, cycles2 = {}, {}, {}
+		for n = 1, #events, 3 do
+			local k, resp, ran = events[n], events[n + 1], events[n + 2]
+			local i = idxs[k]
+			local cpu = cpus[i]
+			if OutBuffers[vms[k]] or SysBuffers[vms[k]] then
+				flush_buffers(cpu.pos, vms[k], cpu.cpu_def)
+			end
+			local costs = handle_event(cpu.pos, vms[k], cpu.cpu_def, resp, cpu.breakpoints)
+			local rest = cycles[k] - ran - (costs or 0)
+			if costs and rest > 0 then
+				results[i] = VM16_OK
+				vms2[#vms2 + 1] = vms[k]
+				idxs2[#idxs2 + 1] = i
+				cycles2[#cycles2 + 1] = rest
+			else
+				results[i] = resp
+			end
 		end
+		vms, idxs, cycles = vms2, idxs2, cycles2
 	end
-	return resp
+	for _, item in ipairs(buffered) do
+		flush_buffers(item[1].pos, item[2], item[1].cpu_def)
+	end
+	return results
 end
 
 minetest.register_on_shutdown(function()
 	--print("register_on_shutdown2")
-	for hash, vm in pairs(VMList) do
-		local pos = vm16.get_position_from_hash(hash)
-		vm_store(pos, vm)
+	local idx, key, vm = vm16lib.next_vm(0)
+	while idx do
+		vm_store(vm16lib.key_pos(key), vm)
+		idx, key, vm = vm16lib.next_vm(idx)
 	end
+	write_stored_vms(true)
 	--print("done")
 end)
 
 local function remove_unloaded_vms()
-	local tbl = table.copy(VMList)
-	local cnt = 0
-	VMList = {}
-	for hash, vm in pairs(tbl) do
-		local pos = vm16.get_position_from_hash(hash)
-		if minetest.get_node_or_nil(pos) then
-			VMList[hash] = vm
-			cnt = cnt + 1
-		else
+	local unloaded = {}
+	local idx, key, vm = vm16lib.next_vm(0)
+	while idx do
+		local pos = vm16lib.key_pos(key)
+		if not minetest.get_node_or_nil(pos) then
+			vm_store(pos, vm)
+			unloaded[#unloaded + 1] = key
+		elseif #vm16lib.dirty_pages(vm, true) > 0 then
+			-- store the changes periodically (crash recovery)
 			vm_store(pos, vm)
 		end
+		idx, key, vm = vm16lib.next_vm(idx)
+	end
+	-- return the VM blocks to the pool, without waiting for the GC
+	for _, key in ipairs(unloaded) do
+		vm16lib.free(unregister_vm(key))
+	end
+	for _, vm in ipairs(Destroyed) do
+		vm16lib.free(vm)
 	end
+	Destroyed = {}
+	evict_vms()
+	minetest.after(0.1, collect_stored_vms)
 	minetest.after(60, remove_unloaded_vms)
 end
 
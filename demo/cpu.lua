@@ -61,6 +61,9 @@ local cpu_def = {
 	input_costs = 1000,  -- number of instructions
 	output_costs = 5000, -- number of instructions
 	system_costs = 2000, -- number of instructions
+	-- 'putchar' calls (sys #0) are buffered in C and passed to 'on_system' per tick,
+	-- 'putchar' returns 0xffff as before
+	sys_buffers = {[0] = {size = 256, costs = 500, result = 0xffff}},
 	startup_code = {
 		"call @init",
 		"call main",
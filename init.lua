@@ -24,11 +24,14 @@ end
 
 local MP = minetest.get_modpath("vm16")
 
-assert(loadfile(MP.."/api.lua"))(vm16lib)
+local vm16ffi = IE.jit and assert(loadfile(MP.."/vm16ffi.lua"))(IE)
+
+assert(loadfile(MP.."/api.lua"))(vm16lib, vm16ffi)
 dofile(MP.."/lib.lua")
 
 IE = nil
 vm16lib = nil
+vm16ffi = nil
 
 vm16.cpu = {}
 dofile(MP.."/asm/asm.lua")
@@ -23,9 +23,9 @@ local function new_table(size)
 	return out
 end
 
-local function mem_dump(pos, mem, x, y)
+local function mem_dump(cpu, mem, x, y)
 	mem.startaddr = mem.startaddr or 0
-	local data = vm16.read_mem(mem.cpu_pos, mem.startaddr, 128) or new_table(128)
+	local data = cpu and cpu:read_mem(mem.startaddr, 128) or new_table(128)
 	local lines = {"container[" .. x .. "," .. y .. "]" ..
 		"label[0,0.5;Memory]" ..
 		"button[2,0.1;1,0.6;dec;" .. minetest.formspec_escape("<") .. "]" ..
@@ -48,9 +48,9 @@ local function mem_dump(pos, mem, x, y)
 	return table.concat(lines, "")
 end
 
-local function stack_dump(pos, mem, x, y)
+local function stack_dump(cpu, mem, x, y)
 	local stack_addr = (mem.mem_size or 64) - 8
-	local data = vm16.read_mem(mem.cpu_pos, stack_addr, 8) or new_table(8)
+	local data = cpu and cpu:read_mem(stack_addr, 8) or new_table(8)
 	local lines = {"container[" .. x .. "," .. y .. "]" ..
 		"box[0,0;9,0.4;#606]" ..
 		"textarea[0,0;9.6,1;;Stack Area;"}
@@ -66,14 +66,14 @@ local function stack_dump(pos, mem, x, y)
 	return table.concat(lines, "")
 end
 
-local function reg_dump(pos, mem, x, y)
-	local cpu = vm16.get_cpu_reg(mem.cpu_pos) or {A=0, B=0, C=0, D=0, X=0, Y=0, SP=0, PC=0, BP=0}
+local function reg_dump(cpu, mem, x, y)
+	local regs = cpu and cpu:get_cpu_reg() or {A=0, B=0, C=0, D=0, X=0, Y=0, SP=0, PC=0, BP=0}
 	return "box[8.8,0.6;9,0.8;#060]" ..
 		"label[8.8,0.4;Registers]" ..
 		"textarea[8.8,0.6;9.6,0.8;;;" ..
 		" A    B    C    D     X    Y    PC   SP\n" ..
-		string.format("%04X %04X %04X %04X", cpu.A, cpu.B, cpu.C, cpu.D) .. "  " ..
-		string.format("%04X %04X %04X %04X", cpu.X, cpu.Y, cpu.PC, cpu.SP) .. "]"
+		string.format("%04X %04X %04X %04X", regs.A, regs.B, regs.C, regs.D) .. "  " ..
+		string.format("%04X %04X %04X %04X", regs.X, regs.Y, regs.PC, regs.SP) .. "]"
 end
 
 function vm16.memory.init(pos, mem)
@@ -82,8 +82,9 @@ end
 
 function vm16.memory.fs_window(pos, mem, x, y, xsize, ysize, fontsize)
 	local color = mem.running and "#AAA" or "#FFF"
+	local cpu = vm16.get(mem.cpu_pos)
 	return "style_type[textarea;font=mono;textcolor=" .. color .. ";border=false;font_size="  .. fontsize .. "]" ..
-		reg_dump(pos, mem, x, 0.6) ..
-		mem_dump(pos, mem, x, 1.7) ..
-		stack_dump(pos, mem, x, 9.8)
+		reg_dump(cpu, mem, x, 0.6) ..
+		mem_dump(cpu, mem, x, 1.7) ..
+		stack_dump(cpu, mem, x, 9.8)
 end
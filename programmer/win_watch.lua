@@ -36,9 +36,9 @@ local function get_string(data)
 	return table.concat(out, "")
 end
 
-local function gen_varlist(pos, mem)
+local function gen_varlist(handle, mem)
 	local out = {}
-	local cpu = vm16.get_cpu_reg(mem.cpu_pos)
+	local cpu = handle and handle:get_cpu_reg()
 	if cpu then
 		-- Globals
 		for _, item in ipairs(mem.lut:get_globals() or {}) do
@@ -60,14 +60,14 @@ local function gen_varlist(pos, mem)
 	return out
 end
 
-local function format_watch(pos, mem)
+local function format_watch(handle, mem)
 	local out = {}
-	mem.watch_varlist = gen_varlist(pos, mem)
+	mem.watch_varlist = gen_varlist(handle, mem)
 	for idx, item in ipairs(mem.watch_varlist) do
 		if item.name == "" then
 			out[#out + 1] = "----------------:----------"
 		else
-			local val = vm16.peek(mem.cpu_pos, item.addr or 0)
+			local val = handle:peek(item.addr or 0)
 			local s = minetest.formspec_escape(string.format("%-16s: %04X %d", item.name, val, val))
 			out[#out + 1] = s
 		end
@@ -75,9 +75,9 @@ local function format_watch(pos, mem)
 	return table.concat(out, ",")
 end
 
-local function memory_bar(pos, mem, x, y, xsize, ysize)
-	local mem_size = vm16.mem_size(mem.cpu_pos)
-	local cpu = vm16.get_cpu_reg(mem.cpu_pos)
+local function memory_bar(handle, mem, x, y, xsize, ysize)
+	local mem_size = handle and handle:mem_size()
+	local cpu = handle and handle:get_cpu_reg()
 	if mem_size and cpu and mem.lut then
 		local x1 = x + xsize * (mem.lut:get_program_size() / mem_size)
 		local x2 = x + xsize * ((cpu.TOS % mem_size) / mem_size)
@@ -90,9 +90,9 @@ local function memory_bar(pos, mem, x, y, xsize, ysize)
 	return ""
 end
 
-local function mem_dump(pos, mem, x, y, xsize, ysize, fontsize)
+local function mem_dump(handle, mem, x, y, xsize, ysize, fontsize)
 	mem.startaddr = mem.startaddr or 0
-	local data = vm16.read_mem(mem.cpu_pos, mem.startaddr, 16)
+	local data = handle and handle:read_mem(mem.startaddr, 16)
 	local item = mem.watch_varlist[mem.last_watch_idx]
 	local str = get_string(data)
 	local var
@@ -136,6 +136,7 @@ end
 function vm16.watch.fs_window(pos, mem, x, y, xsize, ysize, fontsize)
 	local color = mem.running and "#AAA" or "#FFF"
 	local y1, y2, y3, ysize1, ysize2, ysize3, dump
+	local handle = vm16.get(mem.cpu_pos)
 	if mem.last_watch_idx then
 		ysize1 = ysize - 3.6
 		ysize2 = 2.4
@@ -143,7 +144,7 @@ function vm16.watch.fs_window(pos, mem, x, y, xsize, ysize, fontsize)
 		y1 = y
 		y2 = y + ysize - 3.4
 		y3 = y + ysize - 1
-		dump = mem_dump(pos, mem, x, y2, xsize, ysize2, fontsize)
+		dump = mem_dump(handle, mem, x, y2, xsize, ysize2, fontsize)
 	else
 		ysize1 = ysize - 1
 		ysize3 = 1
@@ -155,9 +156,9 @@ function vm16.watch.fs_window(pos, mem, x, y, xsize, ysize, fontsize)
 		"style_type[table;font=mono;font_size="  .. fontsize .. "]" ..
 		"tableoptions[color=" ..color .. ";background=#033003;highlight_text=" ..color .. ";highlight=#036707]" ..
 		"table[" .. x .. "," .. y1 .. ";" .. xsize .. "," .. ysize1 .. ";watch;" ..
-		format_watch(pos, mem) .. ";]" ..
+		format_watch(handle, mem) .. ";]" ..
 		dump ..
-		memory_bar(pos, mem, x, y3, xsize, ysize3)
+		memory_bar(handle, mem, x, y3, xsize, ysize3)
 end
 
 function vm16.watch.on_receive_fields(pos, fields, mem)
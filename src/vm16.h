@@ -37,7 +37,7 @@ LUALIB_API int luaopen_vm16(lua_State *L);
 
 #define IDENT           (0x36314D56)
 #define VERSION         (2)    // VM compatibility
-#define SVERSION        "2.7.5"
+#define SVERSION        "2.8.0"
 #define VM16_WORD_SIZE  (16)
 
 /*
@@ -53,27 +53,151 @@ LUALIB_API int luaopen_vm16(lua_State *L);
 #define VM16_BREAK     (6)  // breakpoint reached
 #define VM16_ERROR     (7)  // invalid opcode
 
+/*
+** Fused instruction sequences (see 'vm16_get_fusion_stats')
+*/
+
+#define VM16_FUSE_SKIP_JUMP       (0)  // skxx + jump #addr
+#define VM16_FUSE_STEP_JUMP       (1)  // inc/dec + jump #addr
+#define VM16_FUSE_LOAD_OP         (2)  // move R, [SP+n] + add/sub R, #k
+#define VM16_FUSE_LOAD_SKIP_JUMP  (3)  // move R, [SP+n] + skxx R, #k + jump #addr
+#define VM16_NUM_FUSIONS          (4)
+
 typedef struct {
     uint32_t ident;     // VM identifier
     uint16_t version;   // VM version
-    uint16_t areg;      // A accu register
-    uint16_t breg;      // B accu register
-    uint16_t creg;      // C accu register
-    uint16_t dreg;      // D accu register
-    uint16_t xreg;      // X index register
-    uint16_t yreg;      // Y index register
-    uint16_t pcnt;      // program counter
-    uint16_t sptr;      // stack pointer
+    union {
+        struct {
+            uint16_t areg;      // A accu register
+            uint16_t breg;      // B accu register
+            uint16_t creg;      // C accu register
+            uint16_t dreg;      // D accu register
+            uint16_t xreg;      // X index register
+            uint16_t yreg;      // Y index register
+            uint16_t pcnt;      // program counter
+            uint16_t sptr;      // stack pointer
+        };
+        uint16_t regs[8];       // same registers, indexed by the register addressing mode
+    };
     uint16_t bptr;      // stack base pointer
     uint16_t tptr;      // Top of stack
     uint16_t l_addr;        // latched address (I/O, examine)
     uint16_t l_data;        // latched data (I/O, examine)
-    uint16_t mem_size;      // RAM size in words
+    uint16_t mem_size;      // RAM size in words (0 for 64 Kwords)
     uint16_t mem_mask;      // mask value (size - 1)
     uint16_t *p_in_dest;    // for IN command
     uint16_t memory[1];     // program/data memory (16 bit)
 }vm16_t;
 
+/*
+** Runtime data of the VM, which is not part of the VM storage string.
+** It is located behind the VM memory, see 'vm16_calc_size'.
+*/
+typedef struct {
+    int32_t handler;        // instruction handler (label offset, 0 = not decoded)
+    uint8_t opd1;           // pre-decoded operand 1 (register number or value)
+    uint8_t opd2;           // pre-decoded operand 2 (register number or value)
+    uint8_t flags;          // DC_FUSED: word is part of a fused instruction sequence
+}vm16_dc_t;
+
+/*
+** I/O port types (see 'vm16_register_port')
+*/
+#define VM16_PORT_NONE      (0)  // no port (unregister)
+#define VM16_PORT_LATCH     (1)  // latched value, 'out' stores, 'in' loads
+#define VM16_PORT_RING      (2)  // ring buffers, 'out' pushes to TX, 'in' pops from RX
+#define VM16_MAX_PORTS      (16) // number of ports per VM
+#define VM16_MAX_RING_SIZE  (1024)
+
+typedef struct {
+    uint16_t addr;          // I/O address
+    uint16_t type;          // VM16_PORT_...
+    uint16_t value;         // latched value
+    uint16_t mask;          // ring buffer size - 1
+    uint16_t rx_rd, rx_wr;  // RX ring buffer indices (Lua -> VM)
+    uint16_t tx_rd, tx_wr;  // TX ring buffer indices (VM -> Lua)
+    uint16_t *p_rx;         // RX ring buffer
+    uint16_t *p_tx;         // TX ring buffer
+}vm16_port_t;
+
+typedef struct {
+    uint32_t num;           // number of registered ports
+    vm16_port_t port[VM16_MAX_PORTS];
+}vm16_ports_t;
+
+/*
+** Output buffer (see 'vm16_set_out_buffer')
+*/
+typedef struct {
+    uint16_t addr;          // I/O address
+    uint16_t data;          // output value
+    uint16_t breg;          // B register
+}vm16_out_t;
+
+typedef struct {
+    uint32_t size;          // max. number of records
+    uint32_t num;           // number of buffered records
+    uint32_t costs;         // cycles charged per record
+    vm16_out_t rec[1];      // buffered 'out' records
+}vm16_outbuf_t;
+
+/*
+** Native system call handlers (see 'vm16_register_sys')
+*/
+#define VM16_MAX_SYS        (8)  // number of native handlers per VM
+
+typedef int32_t (*vm16_sys_func_t)(vm16_t *C, uint16_t num, void *p_ctx);
+
+typedef struct {
+    uint16_t num;           // system call number
+    bool owned;             // 'p_ctx' is freed with the handler
+    vm16_sys_func_t func;   // handler
+    void *p_ctx;            // handler context
+}vm16_sys_t;
+
+typedef struct {
+    uint32_t num;           // number of registered handlers
+    vm16_sys_t sys[VM16_MAX_SYS];
+}vm16_systab_t;
+
+/*
+** Context of the 'vm16_sys_buffer' handler
+*/
+typedef struct {
+    uint32_t size;          // max. number of values
+    uint32_t num;           // number of buffered values
+    int32_t costs;          // cycles charged per call
+    int32_t result;         // value returned in register A (-1 = A unchanged)
+    uint16_t data[1];       // buffered values (register A)
+}vm16_sysbuf_t;
+
+/*
+** Dirty page tracking (see 'vm16_get_dirty_pages')
+*/
+#define VM16_PAGE_WORDS         (256)   // words per memory page
+#define VM16_MAX_PAGES          (256)   // pages of a 64 Kwords VM
+#define VM16_DIRTY_CHECKPOINT   (1)     // page written since the last checkpoint
+#define VM16_DIRTY_DELTA        (2)     // page written since the last delta snapshot
+#define VM16_DIRTY              (VM16_DIRTY_CHECKPOINT | VM16_DIRTY_DELTA)
+#define VM16_SHARED             (4)     // page mapped from a shared memory image (see 'vm16_pool_clone')
+#define VM16_IMAGE              (8)     // page not written since the memory image was taken
+#define VM16_ROM                (16)    // read-only page, writes are ignored (see 'vm16_set_rom')
+#define VM16_USED               (32)    // page written since the VM was initialized (see 'vm16_pool_alloc')
+#define VM16_WRITTEN            (VM16_DIRTY | VM16_USED)    // flags set by memory writes
+
+typedef struct {
+    vm16_dc_t *p_cache;     // decode cache (one entry per memory word)
+    struct vm16_jit_s *p_jit;   // JIT compiler data (see vm16jit.c)
+    uint32_t fusion_hits[VM16_NUM_FUSIONS]; // executed fused sequences
+    vm16_ports_t *p_ports;  // I/O ports served by the VM (see 'vm16_register_port')
+    vm16_outbuf_t *p_outbuf;    // buffered 'out' records (see 'vm16_set_out_buffer')
+    vm16_systab_t *p_sys;   // native system call handlers (see 'vm16_register_sys')
+    int (*run)(vm16_t *C, uint32_t num_cycles, uint32_t *ran, bool cached); // see vm16run.h
+    uint8_t dirty[VM16_MAX_PAGES];  // VM16_DIRTY_... flags per memory page
+    struct vm16_lazy_s *p_lazy; // pages still to be decoded (see 'vm16_set_snapshot_lazy')
+    uint32_t runs;          // number of 'vm16_run' calls (see 'vm16_get_runs')
+}vm16_rt_t;
+
 /*
 ** printf
 */
@@ -95,6 +219,68 @@ uint32_t vm16_get_string_size(vm16_t *C);
 */
 bool vm16_init(vm16_t *C, uint32_t mem_size);
 
+/*
+** Initialize the VM like 'vm16_init', but for an already zeroed memory block.
+*/
+bool vm16_init_zeroed(vm16_t *C, uint32_t vm_size);
+
+/*
+** Initialize the VM 'C' (allocated like 'vm16_init_zeroed') as clone of 'C_src'
+** with registers, memory, ROM pages and decode cache/JIT settings, but without
+** I/O handlers (pending pages of 'C_src' are loaded first). If 'shared' is
+** true, the memory is already mapped from the memory image of 'C_src' and
+** is not copied, but all pages are marked as VM16_SHARED and VM16_IMAGE.
+** Returns false if the memory sizes differ.
+*/
+bool vm16_init_clone(vm16_t *C, vm16_t *C_src, bool shared);
+
+/*
+** Set the page flags 'flags' (VM16_SHARED, VM16_IMAGE) for all memory pages,
+** after a memory image is taken. The flags are cleared by memory writes.
+*/
+void vm16_set_page_flags(vm16_t *C, uint8_t flags);
+
+/*
+** Mark 'num_pages' memory pages from 'addr' on as ROM (and as VM16_SHARED if
+** 'shared'), after the ROM content is written to the memory (without the
+** write functions, see 'vm16_pool_map_rom'). Writes to ROM pages by the VM
+** and by the write functions ('vm16_poke', 'vm16_write_mem', ...) are ignored.
+** Functions which replace the whole memory ('vm16_set_vm', 'vm16_set_snapshot')
+** turn the ROM pages into RAM pages again.
+*/
+void vm16_set_rom(vm16_t *C, uint16_t addr, uint32_t num_pages, bool shared);
+
+/*
+** Free all resources which are allocated in addition to the VM memory block.
+** Has to be called before the VM memory block itself is freed.
+*/
+void vm16_release(vm16_t *C);
+
+/*
+** Enable/disable the decode cache of the VM (only available for
+** the threaded code variant of the interpreter).
+*/
+bool vm16_set_decode_cache(vm16_t *C, bool enable);
+
+/*
+** Enable/disable the x86-64 JIT compiler of the VM (only available for
+** the threaded code variant on x86-64). Enabling the JIT enables the
+** decode cache, disabling the decode cache disables the JIT.
+*/
+bool vm16_set_jit(vm16_t *C, bool enable);
+
+/*
+** Copy the number of executed fused instruction sequences per fusion
+** type (VM16_FUSE_...) to 'p_hits' and reset the counters if 'reset'
+** is set. Returns the number of copied values.
+*/
+uint32_t vm16_get_fusion_stats(vm16_t *C, uint32_t num, uint32_t *p_hits, bool reset);
+
+/*
+** Return the name of the fusion type (for reports), or NULL.
+*/
+const char *vm16_fusion_name(uint32_t type);
+
 /*
 ** Set PC to given memory address
 */
@@ -122,6 +308,105 @@ char *vm16_get_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer);
 */
 uint32_t vm16_set_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer);
 
+/*
+** Binary VM snapshot for storage purposes (registers and memory in
+** little-endian byte order with checksum, see vm16core.c).
+** The snapshot is portable, but can only be restored to a VM with
+** the same memory size.
+*/
+#define VM16_SNAPSHOT_VERSION   (1)
+
+/*
+** Return the size of the snapshot in bytes
+*/
+uint32_t vm16_get_snapshot_size(vm16_t *C);
+
+/*
+** Write the snapshot to 'p_buffer'.
+** Number of written bytes is returned, or 0 on error.
+*/
+uint32_t vm16_get_snapshot(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer);
+
+/*
+** Return the max. size of the compressed snapshot in bytes
+*/
+uint32_t vm16_get_compressed_size(vm16_t *C);
+
+/*
+** Write the compressed snapshot (zero pages are skipped, the other pages
+** are LZ encoded) to 'p_buffer', which needs 'vm16_get_compressed_size' bytes.
+** Number of written bytes is returned, or 0 on error.
+*/
+uint32_t vm16_get_compressed(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer);
+
+/*
+** Write the delta snapshot to 'p_buffer', which needs 'vm16_get_compressed_size'
+** bytes. The delta is a compressed snapshot with the pages written since
+** the last checkpoint (see 'vm16_checkpoint'), the VM16_DIRTY_DELTA flags
+** are cleared. Number of written bytes is returned, or 0 on error.
+*/
+uint32_t vm16_get_delta(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer);
+
+/*
+** Restore the VM from the snapshot (compressed or not), or apply the delta
+** on top of the restored checkpoint snapshot.
+** The compressed pages are decoded directly into the VM memory (the memory
+** is cleared, if the pages are invalid in spite of a valid checksum).
+** Number of read bytes is returned, or 0 if the snapshot is invalid.
+*/
+uint32_t vm16_set_snapshot(vm16_t *C, uint32_t size_buffer, const uint8_t *p_buffer);
+
+/*
+** Restore the VM from the compressed snapshot like 'vm16_set_snapshot', but
+** only the registers are restored immediately. The pages are decoded on the
+** first access by the memory functions, or all remaining pages on the next
+** 'vm16_run' call. Other snapshots are restored immediately.
+** Number of read bytes is returned, or 0 if the snapshot is invalid.
+*/
+uint32_t vm16_set_snapshot_lazy(vm16_t *C, uint32_t size_buffer, const uint8_t *p_buffer);
+
+/*
+** Return the number of memory pages which are not decoded so far
+*/
+uint32_t vm16_get_pending_pages(vm16_t *C);
+
+/*
+** Decode all pending memory pages (needed before the memory is
+** accessed directly, like by the FFI binding).
+*/
+void vm16_load_pages(vm16_t *C);
+
+/*
+** Write the numbers of the memory pages (VM16_PAGE_WORDS) with one of the
+** VM16_DIRTY_... 'flags' to 'p_pages' (VM16_MAX_PAGES bytes, can be NULL).
+** The pages are marked by all memory writes (instructions and API).
+** A new or restored VM has all pages dirty, the pages of a restored delta
+** are dirty since the checkpoint. Returns the number of pages.
+*/
+uint32_t vm16_get_dirty_pages(vm16_t *C, uint8_t flags, uint8_t *p_pages);
+
+/*
+** The memory is stored (as snapshot): Clear all dirty flags.
+*/
+void vm16_checkpoint(vm16_t *C);
+
+/*
+** Return a private copy of the VM (registers, memory, dirty flags and pending
+** pages, without decode cache, JIT, ports, ...), to be serialized by another
+** thread (see vm16ser.h). With 'delta', only the pages of the delta snapshot
+** are copied and the VM16_DIRTY_DELTA flags of 'C' are cleared (like by
+** 'vm16_get_delta'). 'C2' is a released copy of a VM with the same memory
+** size to be reused, or NULL to allocate a new one.
+** The copy is freed with 'vm16_release' and 'free'. Returns NULL on error.
+*/
+vm16_t *vm16_copy(vm16_t *C, vm16_t *C2, bool delta);
+
+/*
+** Return true if the buffer is a binary snapshot (and not an ASCII string
+** of 'vm16_get_vm_as_str')
+*/
+bool vm16_is_snapshot(uint32_t size_buffer, const uint8_t *p_buffer);
+
 /*
 ** Read memory block for debugging purposes / external drives
 */
@@ -169,6 +454,116 @@ uint16_t vm16_peek(vm16_t *C, uint16_t addr);
 bool vm16_poke(vm16_t *C, uint16_t addr, uint16_t val);
 
 
+/*
+** Register the I/O port 'addr' of type VM16_PORT_LATCH or VM16_PORT_RING
+** (with the ring buffer size 'size', rounded up to a power of two).
+** The 'in' and 'out' instructions of registered ports are executed by
+** the VM itself, without leaving 'vm16_run'. Only if the RX buffer is
+** empty ('in') or the TX buffer is full ('out'), 'vm16_run' returns with
+** VM16_IN/VM16_OUT as usual.
+** VM16_PORT_NONE unregisters the port. Returns false on error.
+*/
+bool vm16_register_port(vm16_t *C, uint16_t addr, uint8_t type, uint16_t size);
+
+/*
+** Copy the addresses of up to 'num' registered ports to 'p_addrs'.
+** Returns the number of copied addresses.
+*/
+uint32_t vm16_get_ports(vm16_t *C, uint32_t num, uint16_t *p_addrs);
+
+/*
+** Return the type of the port 'addr' (VM16_PORT_NONE if not registered).
+*/
+uint8_t vm16_port_type(vm16_t *C, uint16_t addr);
+
+/*
+** Read the port 'addr': the latched value, or up to 'num' values from
+** the TX buffer of a ring buffer port. Returns the number of values.
+*/
+uint32_t vm16_read_port(vm16_t *C, uint16_t addr, uint32_t num, uint16_t *p_buffer);
+
+/*
+** Write 'num' values to the port 'addr': the last value is latched, or
+** the values are pushed to the RX buffer of a ring buffer port.
+** Returns the number of written values.
+*/
+uint32_t vm16_write_port(vm16_t *C, uint16_t addr, uint32_t num, uint16_t *p_buffer);
+
+/*
+** Enable the output buffer with 'size' records (0 to disable).
+** With the buffer, the 'out' instruction (if not served by a port) appends
+** the record (addr, data, B) to the buffer and the VM continues. Each record
+** is charged with 'costs' cycles. 'vm16_run' returns with VM16_OUT as usual
+** only if the buffer is full. Returns false on error.
+*/
+bool vm16_set_out_buffer(vm16_t *C, uint32_t size, uint32_t costs);
+
+/*
+** Move up to 'num' buffered records to 'p_records', in the order of the
+** 'out' instructions. Returns the number of records.
+*/
+uint32_t vm16_read_out_buffer(vm16_t *C, uint32_t num, vm16_out_t *p_records);
+
+/*
+** Register the native handler 'func' for the system call 'num' ('sys #num').
+** The handler is called within 'vm16_run' with the VM registers as call
+** parameters ('pcnt' is the address behind the 'sys' instruction) and
+** returns the costs in cycles, or -1 if the call has to be handled by Lua
+** ('vm16_run' returns VM16_SYS as usual).
+** If 'owned' is set, 'p_ctx' is freed with the handler.
+** 'func' = NULL unregisters the handler. Returns false on error.
+*/
+bool vm16_register_sys(vm16_t *C, uint16_t num, vm16_sys_func_t func, void *p_ctx, bool owned);
+
+/*
+** Return the context of the handler for the system call 'num', or NULL.
+*/
+void *vm16_get_sys_ctx(vm16_t *C, uint16_t num);
+
+/*
+** Native handler which appends register A to the buffer 'p_ctx'
+** (vm16_sysbuf_t, e.g. as terminal output buffer) and sets register A to
+** the configured result. Returns -1 if the buffer is full.
+*/
+int32_t vm16_sys_buffer(vm16_t *C, uint16_t num, void *p_ctx);
+
+/*
+** Register 'vm16_sys_buffer' for the system call 'num' with a buffer
+** for 'size' values, each call is charged with 'costs' cycles and returns
+** 'result' in register A (-1 to keep register A unchanged).
+*/
+bool vm16_register_sys_buffer(vm16_t *C, uint16_t num, uint32_t size, uint32_t costs, int32_t result);
+
+/*
+** Move up to 'num' values from the buffer of the system call 'sys_num'
+** to 'p_buffer'. Returns the number of values.
+*/
+uint32_t vm16_read_sys_buffer(vm16_t *C, uint16_t sys_num, uint32_t num, uint16_t *p_buffer);
+
+/*
+** Return the number of values in the output and system call buffers,
+** which have to be processed before the next I/O or system call.
+*/
+uint32_t vm16_num_buffered(vm16_t *C);
+
+/*
+** Return true if the VM has runtime state, which is not part of the
+** snapshot and can't be restored (I/O ports, output buffer, native
+** system call handlers other than 'vm16_sys_buffer').
+*/
+bool vm16_has_io_state(vm16_t *C);
+
+/*
+** Return the number of bytes used by the VM (block, decode cache and
+** pending pages, without JIT code and shared memory pages).
+*/
+uint32_t vm16_get_mem_usage(vm16_t *C);
+
+/*
+** Return the number of 'vm16_run' calls (wraps around), to detect idle VMs
+*/
+uint32_t vm16_get_runs(vm16_t *C);
+
 /*
 ** Run the VM with the given number of machine cycles.
 ** The number of executed cycles is stored in 'ran'
@@ -176,6 +571,22 @@ bool vm16_poke(vm16_t *C, uint16_t addr, uint16_t val);
 */
 int vm16_run(vm16_t *C, uint32_t num_cycles, uint32_t *run);
 
+/*
+** Stop event of a VM of a batch run
+*/
+typedef struct {
+    uint32_t index;         // index of the VM in the batch
+    uint32_t ran;           // number of executed cycles
+    int resp;               // reason for the abort (VM16_NOP...VM16_ERROR)
+}vm16_event_t;
+
+/*
+** Run 'num' VMs, each with the number of machine cycles from 'p_cycles'.
+** An event is stored in 'p_events' (array of 'num' entries) for each VM
+** which did not run to the end (VM16_OK). The number of events is returned.
+*/
+uint32_t vm16_run_batch(vm16_t **pp_vms, uint32_t num, uint32_t *p_cycles, vm16_event_t *p_events);
+
 /*
 ** Write H16 string to the VM memory.
 */
@@ -24,112 +24,65 @@ along with VM16.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <string.h>
 #include "vm16.h"
+#include "vm16op.h"
+#include "vm16jit.h"
+#include "vm16lz.h"
 
-/*
-**      MSB          LSB
-** +-----------+------+------+
-** |  op-code  | opd1 | opd2 |
-** +-----------+------+------+
-**
-*/
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
 /*
-* Addressing modes
+** Instruction dispatch
+**
+** With GCC/Clang the interpreter is built as direct threaded code
+** ("labels as values"): each handler jumps straight to the handler of the
+** next instruction instead of going back to a central 'switch'.
+** Compile with -DVM16_SWITCH_DISPATCH to get the portable switch loop.
+** Both variants share the same handler code and behave identically.
 */
+#if defined(__GNUC__) && !defined(VM16_SWITCH_DISPATCH)
+#define VM16_THREADED_CODE
+#endif
 
-// registers
-#define  AREG  (0x00)
-#define  BREG  (0x01)
-#define  CREG  (0x02)
-#define  DREG  (0x03)
-#define  XREG  (0x04)
-#define  YREG  (0x05)
-#define  PCNT  (0x06)
-#define  SPTR  (0x07)
-
-// addressing
-#define  XIND  (0x08)     // x-indirect: move a, [x]
-#define  YIND  (0x09)     // y-indirect: move [y], b
-#define  XINC  (0x0A)     // x-indirect, post-increment: move a, [x++]
-#define  YINC  (0x0B)     // y-indirect, post-increment: move [y++], b
-#define  REG0  (0x0C)     // #0 register
-#define  REG1  (0x0D)     // #1 register
-
-#define  CNST  (0x10)     // constant: move a, #1234; jump 0
-#define  ABS   (0x11)     // absolute: move a, 100
-#define  REL   (0x12)     // relative: jump (deprecated)
-#define  SREL  (0x13)     // stack relative: inc [SP+1]
-#define  REL2  (0x14)     // relative: jump -10
-#define  XREL  (0x15)     // X register relative [X+1]
-#define  YREL  (0x16)     // Y register relative [Y+1]
-#define  SRE2  (0x17)     // stack relative address: SP+1
-
-
-/* OP codes */
-#define  NOP    (0x00)
-#define  BRK    (0x01)
-#define  SYS    (0x02)
-//#define  INT    (0x03)
-
-#define  JUMP   (0x04)
-#define  CALL   (0x05)
-#define  RETN   (0x06)
-#define  HALT   (0x07)
-
-
-#define  MOVE   (0x08)
-#define  XCHG   (0x09)
-#define  INC    (0x0A)
-#define  DEC    (0x0B)
-
-#define  ADD    (0x0C)
-#define  SUB    (0x0D)
-#define  MUL    (0x0E)
-#define  DIV    (0x0F)
-
-#define  AND    (0x10)
-#define  OR     (0x11)
-#define  XOR    (0x12)
-#define  NOT    (0x13)
-
-#define  BNZE   (0x14)
-#define  BZE    (0x15)
-#define  BPOS   (0x16)
-#define  BNEG   (0x17)
-
-#define  IN     (0x18)
-#define  OUT    (0x19)
-#define  PUSH   (0x1A)
-#define  POP    (0x1B)
-
-#define  SWAP   (0x1C)
-#define  DBNZ   (0x1D)
-#define  MOD    (0x1E)
-
-#define  SHL    (0x1F)
-#define  SHR    (0x20)
-#define  ADDC   (0x21)
-#define  MULC   (0x22)
-
-#define  SKNE   (0x23)
-#define  SKEQ   (0x24)
-#define  SKLT   (0x25)
-#define  SKGT   (0x26)
-
-#define  MSB    (0x27)
+// the JIT is entered from the threaded code interpreter
+#ifndef VM16_THREADED_CODE
+#undef VM16_JIT
+#endif
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#define MAX(a,b) (((a)>(b))?(a):(b))
+// operand helpers have to be inlined into each instruction handler
+#if defined(__GNUC__)
+#define ALWAYS_INLINE           inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE           inline
+#endif
 
 
 #define VMA(C, addr)            (((uint16_t)(addr)) & (C)->mem_mask)  // valid memory address
 #define ADDR_SRC(C, addr)       (&(C)->memory[VMA(C, addr)])
-#define ADDR_DST(C, addr)       (&(C)->memory[VMA(C, addr)])
+#define ADDR_DST(C, addr)       (&(C)->memory[invalidate(C, (C)->mem_mask, VMA(C, addr))])
+
+// memory access within 'vm16_run' (with the local address 'mask')
+#define RUN_VMA(addr)           (((uint16_t)(addr)) & mask)
+#define RUN_SRC(addr)           (&C->memory[RUN_VMA(addr)])
+#define RUN_DST(addr)           (&C->memory[invalidate(C, mask, RUN_VMA(addr))])
 
 
 #define VM_SIZE(size)           (sizeof(vm16_t) + (sizeof(uint16_t) * (size - 1)))
-#define MEM_SIZE(vm_size)       ((vm_size - sizeof(vm16_t) + sizeof(uint16_t)) / sizeof(uint16_t))
+#define RT_OFFS(size)           (sizeof(vm16_t) + (sizeof(uint16_t) * (size)))
+#define MEM_SIZE(vm_size)       ((vm_size - sizeof(vm16_t) - sizeof(vm16_rt_t)) / sizeof(uint16_t))
+#define MEM_WORDS(C)            ((uint32_t)(C)->mem_mask + 1)  // 'mem_size' is 0 for 64 Kwords
+#define RT_ADDR(C, mask)        ((vm16_rt_t *)((uint8_t *)(C) + RT_OFFS((uint32_t)(mask) + 1)))
+#define VM_RT(C)                RT_ADDR(C, (C)->mem_mask)
 #define VM_VALID(C)             ((C != 0) && (C->ident == IDENT) && (C->version == VERSION))
+#define NUM_PAGES(C)            ((MEM_WORDS(C) + VM16_PAGE_WORDS - 1) / VM16_PAGE_WORDS)
+
+// run loop instance for the memory size (see 'vm16_run')
+typedef int (*run_func_t)(vm16_t *C, uint32_t num_cycles, uint32_t *ran, bool cached);
+static run_func_t run_instance(uint16_t mem_mask);
+static void free_ports(vm16_ports_t *p_ports);
+static void free_sys(vm16_systab_t *p_tab);
+static void drop_lazy(vm16_t *C);
+static void load_range(vm16_t *C, uint16_t addr, uint32_t num);
 
 // byte nibble vs ASCII char
 #define NTOA(n)                 ((n) > 9   ? (n) + 55 : (n) + 48)
@@ -152,10 +105,52 @@ static inline char ascii(uint16_t val) {
     return ((val > 126 || val < 32) ? '.' : (char)val);
 }
 
+#define DC_FUSED        (0x01)  // decode cache entry flag
+#define FUSE_SPAN       (6)     // max. number of words of a fused sequence
+
+/*
+** A word of a fused instruction sequence is written:
+** Invalidate all cache entries which could be the start of the sequence.
+*/
+static void invalidate_fused(vm16_t *C, vm16_dc_t *p_cache, uint16_t addr) {
+    for(int i = 1; i < FUSE_SPAN; i++) {
+        p_cache[VMA(C, addr - i)].handler = 0;
+    }
+}
+
+/*
+** The memory word at 'addr' will be written:
+** Mark the page as dirty and invalidate the decode cache entry of this address.
+** Writes to ROM pages go to the spare word behind the memory (with the ROM
+** value, in case the word is read before).
+*/
+static inline uint32_t invalidate(vm16_t *C, uint16_t mask, uint16_t addr) {
+    vm16_rt_t *rt = RT_ADDR(C, mask);
+    uint8_t *p_dirty = &rt->dirty[addr / VM16_PAGE_WORDS];
+    if(*p_dirty & VM16_ROM) {
+        C->memory[(uint32_t)mask + 1] = C->memory[addr];
+        return (uint32_t)mask + 1;
+    }
+    *p_dirty = VM16_WRITTEN;
+    if(rt->p_cache != NULL) {
+        rt->p_cache[addr].handler = 0;
+        if(rt->p_cache[addr].flags & DC_FUSED) {
+            invalidate_fused(C, rt->p_cache, addr);
+        }
+#ifdef VM16_JIT
+        if(rt->p_jit != NULL) {
+            vm16_jit_invalidate(rt->p_jit, addr);
+        }
+#endif
+    }
+    return addr;
+}
+
 /*
 ** Determine the operand destination address (register/memory)
+** 'p_pc' is the PC of the calling 'vm16_run' instance (local or 'C->pcnt')
 */
-static uint16_t *getaddr(vm16_t *C, uint8_t addr_mod) {
+static ALWAYS_INLINE uint16_t *getaddr(vm16_t *C, uint16_t *p_pc, const uint16_t mask, uint8_t addr_mod) {
     switch(addr_mod) {
         case AREG: return &C->areg;
         case BREG: return &C->breg;
@@ -163,52 +158,52 @@ static uint16_t *getaddr(vm16_t *C, uint8_t addr_mod) {
         case DREG: return &C->dreg;
         case XREG: return &C->xreg;
         case YREG: return &C->yreg;
-        case PCNT: return &C->pcnt;
+        case PCNT: return &C->pcnt; // generic instance only
         case SPTR: return &C->sptr;
-        case XIND: return ADDR_DST(C, C->xreg);
-        case YIND: return ADDR_DST(C, C->yreg);
+        case XIND: return RUN_DST(C->xreg);
+        case YIND: return RUN_DST(C->yreg);
         case XINC: {
-            uint16_t *p_res = ADDR_DST(C, C->xreg);
+            uint16_t *p_res = RUN_DST(C->xreg);
             C->xreg++;
             return p_res;
         }
         case YINC: {
-            uint16_t *p_res = ADDR_DST(C, C->yreg);
+            uint16_t *p_res = RUN_DST(C->yreg);
             C->yreg++;
             return p_res;
         }
-        case CNST: return ADDR_DST(C, 0); // invalid
+        case CNST: return RUN_DST(0); // invalid
         case ABS: {
-            uint16_t addr = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return ADDR_DST(C, addr);
+            uint16_t addr = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return RUN_DST(addr);
         }
-        case REL: return ADDR_DST(C, 0); // invalid
+        case REL: return RUN_DST(0); // invalid
         case SREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return ADDR_DST(C, C->sptr + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return RUN_DST(C->sptr + offs);
         }
-        case REL2: return ADDR_DST(C, 0); // invalid
+        case REL2: return RUN_DST(0); // invalid
         case XREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return ADDR_DST(C, C->xreg + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return RUN_DST(C->xreg + offs);
         }
         case YREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return ADDR_DST(C, C->yreg + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return RUN_DST(C->yreg + offs);
         }
-        case SRE2: return ADDR_DST(C, 0); // invalid
-        default: return ADDR_DST(C, 0);
+        case SRE2: return RUN_DST(0); // invalid
+        default: return RUN_DST(0);
     }
 }
 
 /*
 * Determine the operand source value (register/memory)
 */
-static uint16_t getoprnd(vm16_t *C, uint8_t addr_mod) {
+static ALWAYS_INLINE uint16_t getoprnd(vm16_t *C, uint16_t *p_pc, const uint16_t mask, uint8_t addr_mod) {
     switch(addr_mod) {
         case AREG: return C->areg;
         case BREG: return C->breg;
@@ -216,60 +211,60 @@ static uint16_t getoprnd(vm16_t *C, uint8_t addr_mod) {
         case DREG: return C->dreg;
         case XREG: return C->xreg;
         case YREG: return C->yreg;
-        case PCNT: return C->pcnt;
+        case PCNT: return *p_pc;
         case SPTR: return C->sptr;
-        case XIND: return *ADDR_SRC(C, C->xreg);
-        case YIND: return *ADDR_SRC(C, C->yreg);
+        case XIND: return *RUN_SRC(C->xreg);
+        case YIND: return *RUN_SRC(C->yreg);
         case XINC: {
-            uint16_t val = *ADDR_SRC(C, C->xreg);
+            uint16_t val = *RUN_SRC(C->xreg);
             C->xreg++;
             return val;
         }
         case YINC: {
-            uint16_t val = *ADDR_SRC(C, C->yreg);
+            uint16_t val = *RUN_SRC(C->yreg);
             C->yreg++;
             return val;
         }
         case REG0: return 0;
         case REG1: return 1;
         case CNST: {
-            uint16_t val = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
+            uint16_t val = *RUN_SRC(*p_pc);
+            (*p_pc)++;
             return val;
         }
         case ABS: {
-            uint16_t addr = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return *ADDR_SRC(C, addr);
+            uint16_t addr = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *RUN_SRC(addr);
         }
         case REL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return C->pcnt + offs;
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *p_pc + offs;
         }
         case SREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return *ADDR_SRC(C, C->sptr + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *RUN_SRC(C->sptr + offs);
         }
         case REL2: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return C->pcnt + offs - 2;
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *p_pc + offs - 2;
         }
         case XREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return *ADDR_SRC(C, C->xreg + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *RUN_SRC(C->xreg + offs);
         }
         case YREL: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
-            return *ADDR_SRC(C, C->yreg + offs);
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
+            return *RUN_SRC(C->yreg + offs);
         }
         case SRE2: {
-            uint16_t offs = *ADDR_SRC(C, C->pcnt);
-            C->pcnt++;
+            uint16_t offs = *RUN_SRC(*p_pc);
+            (*p_pc)++;
             return C->sptr + offs;
         }
         default: return 0;
@@ -279,20 +274,30 @@ static uint16_t getoprnd(vm16_t *C, uint8_t addr_mod) {
 // size from 0 for 64 words, 1 for 128 words, up to 10 for 64 Kwords
 uint32_t vm16_calc_size(uint8_t size) {
     uint32_t mem_size = 64 << MIN(size, 10);
-    return VM_SIZE(mem_size);
+    return RT_OFFS(mem_size) + sizeof(vm16_rt_t);
 }
 
 uint32_t vm16_get_string_size(vm16_t *C) {
-    return VM_SIZE(C->mem_size) * 2;
+    return VM_SIZE(MEM_WORDS(C)) * 2;
 }
 
 bool vm16_init(vm16_t *C, uint32_t vm_size) {
     if(C != NULL) {
         memset(C, 0, vm_size);
+        return vm16_init_zeroed(C, vm_size);
+    }
+    return false;
+}
+
+bool vm16_init_zeroed(vm16_t *C, uint32_t vm_size) {
+    if(C != NULL) {
         C->ident = IDENT;
         C->version = VERSION;
         C->mem_size = MEM_SIZE(vm_size);
         C->mem_mask = C->mem_size - 1;
+        VM_RT(C)->run = run_instance(C->mem_mask);
+        // no checkpoint so far (but no page is used)
+        memset(VM_RT(C)->dirty, VM16_DIRTY, NUM_PAGES(C));
         C->p_in_dest = &C->areg;
         C->tptr = 0xFFFF;
         return true;
@@ -300,6 +305,128 @@ bool vm16_init(vm16_t *C, uint32_t vm_size) {
     return false;
 }
 
+bool vm16_init_clone(vm16_t *C, vm16_t *C_src, bool shared) {
+    if(VM_VALID(C) && VM_VALID(C_src) && (C->mem_mask == C_src->mem_mask)) {
+        vm16_rt_t *rt_src = VM_RT(C_src);
+        vm16_load_pages(C_src);
+        memcpy(C, C_src, offsetof(vm16_t, memory));
+        C->p_in_dest = (uint16_t *)((uint8_t *)C + ((uint8_t *)C_src->p_in_dest - (uint8_t *)C_src));
+        if(!shared) {
+            memcpy(C->memory, C_src->memory, MEM_WORDS(C) * 2);
+        }
+        // no checkpoint so far, but the same ROM pages
+        for(uint32_t i = 0; i < NUM_PAGES(C); i++) {
+            VM_RT(C)->dirty[i] = (shared ? VM16_DIRTY : VM16_WRITTEN) | (rt_src->dirty[i] & VM16_ROM);
+        }
+        if(shared) {
+            vm16_set_page_flags(C, VM16_SHARED | VM16_IMAGE);
+        }
+        if(rt_src->p_cache != NULL) {
+            vm16_set_decode_cache(C, true);
+        }
+        if(rt_src->p_jit != NULL) {
+            vm16_set_jit(C, true);
+        }
+        return true;
+    }
+    return false;
+}
+
+void vm16_set_page_flags(vm16_t *C, uint8_t flags) {
+    if(VM_VALID(C)) {
+        uint8_t *p_dirty = VM_RT(C)->dirty;
+        for(uint32_t i = 0; i < NUM_PAGES(C); i++) {
+            p_dirty[i] |= flags;
+        }
+        // the destination of a pending 'in' command is written without 'invalidate'
+        if((C->p_in_dest >= C->memory) && (C->p_in_dest < C->memory + MEM_WORDS(C))) {
+            p_dirty[(C->p_in_dest - C->memory) / VM16_PAGE_WORDS] &= ~flags;
+        }
+    }
+}
+
+void vm16_release(vm16_t *C) {
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        vm16_jit_destroy(rt->p_jit);
+        rt->p_jit = NULL;
+        free(rt->p_cache);
+        rt->p_cache = NULL;
+        free_ports(rt->p_ports);
+        rt->p_ports = NULL;
+        free(rt->p_outbuf);
+        rt->p_outbuf = NULL;
+        free_sys(rt->p_sys);
+        rt->p_sys = NULL;
+        drop_lazy(C);
+    }
+}
+
+bool vm16_set_decode_cache(vm16_t *C, bool enable) {
+#ifdef VM16_THREADED_CODE
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        if(enable && (rt->p_cache == NULL)) {
+            rt->p_cache = (vm16_dc_t *)calloc(MEM_WORDS(C), sizeof(vm16_dc_t));
+            return rt->p_cache != NULL;
+        }
+        if(!enable && (rt->p_cache != NULL)) {
+            vm16_jit_destroy(rt->p_jit);
+            rt->p_jit = NULL;
+            free(rt->p_cache);
+            rt->p_cache = NULL;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool vm16_set_jit(vm16_t *C, bool enable) {
+#ifdef VM16_JIT
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        if(enable && (rt->p_jit == NULL)) {
+            if(vm16_set_decode_cache(C, true)) {
+                rt->p_jit = vm16_jit_create(MEM_WORDS(C), (uint32_t)((uint8_t *)rt->dirty - (uint8_t *)C));
+            }
+            return rt->p_jit != NULL;
+        }
+        if(!enable && (rt->p_jit != NULL)) {
+            vm16_jit_destroy(rt->p_jit);
+            rt->p_jit = NULL;
+        }
+        return true;
+    }
+#endif
+    return false;
+}
+
+uint32_t vm16_get_fusion_stats(vm16_t *C, uint32_t num, uint32_t *p_hits, bool reset) {
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        num = MIN(num, VM16_NUM_FUSIONS);
+        for(uint32_t i = 0; i < num; i++) {
+            p_hits[i] = rt->fusion_hits[i];
+        }
+        if(reset) {
+            memset(rt->fusion_hits, 0, sizeof(rt->fusion_hits));
+        }
+        return num;
+    }
+    return 0;
+}
+
+const char *vm16_fusion_name(uint32_t type) {
+    static const char *Names[VM16_NUM_FUSIONS] = {
+        "skip+jump", "step+jump", "load+op", "load+skip+jump"
+    };
+    if(type < VM16_NUM_FUSIONS) {
+        return Names[type];
+    }
+    return NULL;
+}
+
 void vm16_set_pc(vm16_t *C, uint16_t addr) {
     if(VM_VALID(C)) {
         C->pcnt = addr;
@@ -315,6 +442,7 @@ uint16_t vm16_get_pc(vm16_t *C) {
 
 void vm16_deposit(vm16_t *C, uint16_t value) {
     if(VM_VALID(C)) {
+        load_range(C, C->pcnt, 1);
         *ADDR_DST(C, C->pcnt) = value;
         C->l_addr = C->pcnt;
         C->l_data = value;
@@ -324,9 +452,10 @@ void vm16_deposit(vm16_t *C, uint16_t value) {
 
 char *vm16_get_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && ((VM_SIZE(C->mem_size) * 2) == size_buffer)) {
+        if((p_buffer != NULL) && ((VM_SIZE(MEM_WORDS(C)) * 2) == size_buffer)) {
             char *p_src = (char*)C;
             char *p_dst = p_buffer;
+            vm16_load_pages(C);
              for(int i = 0; i < size_buffer/2; i++) {
                 *p_dst++ = NTOA(*p_src >> 4);
                 *p_dst++ = NTOA(*p_src & 0x0f);
@@ -340,10 +469,11 @@ char *vm16_get_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer) {
 
 uint32_t vm16_set_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && ((VM_SIZE(C->mem_size) * 2) == size_buffer)) {
+        if((p_buffer != NULL) && ((VM_SIZE(MEM_WORDS(C)) * 2) == size_buffer)) {
             uint16_t mem_size = C->mem_size;
             char *p_src = p_buffer;
             char *p_dst = (char*)C;
+            drop_lazy(C);
             for(int i = 0; i < size_buffer/2; i++) {
                 *p_dst++ = (ATON(p_src[0]) << 4) + ATON(p_src[1]);
                 p_src += 2;
@@ -353,15 +483,583 @@ uint32_t vm16_set_vm_as_str(vm16_t *C, uint32_t size_buffer, char *p_buffer) {
             C->version = VERSION;
             C->mem_size = mem_size;
             C->p_in_dest = &C->areg;
+            memset(VM_RT(C)->dirty, VM16_WRITTEN, NUM_PAGES(C));
+            if(VM_RT(C)->p_cache != NULL) {
+                memset(VM_RT(C)->p_cache, 0, MEM_WORDS(C) * sizeof(vm16_dc_t));
+            }
+            if(VM_RT(C)->p_jit != NULL) {
+                vm16_jit_flush(VM_RT(C)->p_jit);
+            }
             return size_buffer;
         }
     }
     return 0;
 }
 
+/*
+** Binary snapshot (all values little-endian):
+**
+**   0  magic "V16S" ("V16Z" for the compressed snapshot, "V16D" for the delta)
+**   4  snapshot format version (u16)
+**   6  VM version (u16)
+**   8  memory size in words (u32)
+**  12  A, B, C, D, X, Y, PC, SP, BP, TOS, latched addr/data (12 x u16)
+**  36  IN destination (u32, register number or SNAP_IN_MEM + address,
+**      SNAP_IN_MEM + mem_size if the value is discarded, like for ROM pages)
+**  40  memory (mem_size x u16)
+**   n  checksum of all previous bytes (u32, see 'checksum')
+**
+** The compressed snapshot stores the memory in pages of VM16_PAGE_WORDS
+** words, each with a tag byte:
+**
+**   SNAP_ZERO   page is zero (no data)
+**   SNAP_RAW    page words follow
+**   SNAP_LZ     u16 length and the LZ encoded page follow (see vm16lz.c)
+**   SNAP_KEEP   page is not part of the delta (no data)
+**
+** The delta is a compressed snapshot with the pages written since the last
+** checkpoint. It is restored on top of the checkpoint snapshot.
+*/
+#define SNAP_MAGIC      "V16S"
+#define SNAP_MAGIC_Z    "V16Z"
+#define SNAP_MAGIC_D    "V16D"
+#define SNAP_HDR_SIZE   (40)
+#define SNAP_IN_MEM     (0x10000)
+#define SNAP_ZERO       (0)
+#define SNAP_RAW        (1)
+#define SNAP_LZ         (2)
+#define SNAP_KEEP       (3)
+
+#define PAGE_WORDS(C)   MIN(MEM_WORDS(C), VM16_PAGE_WORDS)
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SNAP_LITTLE_ENDIAN
+#endif
+
+static inline void put16(uint8_t *p, uint16_t val) {
+    p[0] = (uint8_t)val;
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static inline void put32(uint8_t *p, uint32_t val) {
+    put16(p, (uint16_t)val);
+    put16(p + 2, (uint16_t)(val >> 16));
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// Fletcher like checksum over 32-bit words (with the remaining bytes as last word)
+static uint32_t checksum(const uint8_t *p_data, uint32_t len) {
+    uint64_t a = 1, b = 0;
+    uint32_t i;
+    for(i = 0; i + 4 <= len; i += 4) {
+        a += get32(p_data + i);
+        b += a;
+    }
+    if(i < len) {
+        uint8_t tail[4] = {0, 0, 0, 0};
+        memcpy(tail, p_data + i, len - i);
+        a += get32(tail);
+        b += a;
+    }
+    return (uint32_t)(a ^ b ^ (b >> 32));
+}
+
+static void put_words(uint8_t *p, const uint16_t *p_src, uint32_t num) {
+#ifdef SNAP_LITTLE_ENDIAN
+    memcpy(p, p_src, num * 2);
+#else
+    for(uint32_t i = 0; i < num; i++, p += 2) {
+        put16(p, p_src[i]);
+    }
+#endif
+}
+
+static void get_words(uint16_t *p_dst, const uint8_t *p, uint32_t num) {
+#ifdef SNAP_LITTLE_ENDIAN
+    memcpy(p_dst, p, num * 2);
+#else
+    for(uint32_t i = 0; i < num; i++, p += 2) {
+        p_dst[i] = get16(p);
+    }
+#endif
+}
+
+// 'num' is a multiple of 4 (the smallest memory has 64 words)
+static bool is_zero(const uint16_t *p_src, uint32_t num) {
+    uint64_t bits = 0;
+    for(uint32_t i = 0; i < num; i += 4) {
+        uint64_t val;
+        memcpy(&val, &p_src[i], sizeof(val));
+        bits |= val;
+    }
+    return bits == 0;
+}
+
+static void put_header(vm16_t *C, const char *magic, uint8_t *p) {
+    uint32_t in_dest;
+
+    if((C->p_in_dest >= C->regs) && (C->p_in_dest < C->regs + 8)) {
+        in_dest = (uint32_t)(C->p_in_dest - C->regs);
+    } else {
+        // the spare word behind the memory (ROM pages) is the discard marker
+        in_dest = SNAP_IN_MEM + (uint32_t)(C->p_in_dest - C->memory);
+    }
+    memcpy(p, magic, 4);
+    put16(p + 4, VM16_SNAPSHOT_VERSION);
+    put16(p + 6, VERSION);
+    put32(p + 8, MEM_WORDS(C));
+    p += 12;
+    for(int i = 0; i < 8; i++, p += 2) {
+        put16(p, C->regs[i]);
+    }
+    put16(p, C->bptr);
+    put16(p + 2, C->tptr);
+    put16(p + 4, C->l_addr);
+    put16(p + 6, C->l_data);
+    put32(p + 8, in_dest);
+}
+
+static bool check_header(vm16_t *C, const uint8_t *p) {
+    uint32_t in_dest = get32(p + 36);
+    return (get16(p + 4) == VM16_SNAPSHOT_VERSION) &&
+           (get16(p + 6) == VERSION) &&
+           (get32(p + 8) == MEM_WORDS(C)) &&
+           ((in_dest < 8) || (in_dest - SNAP_IN_MEM <= MEM_WORDS(C)));
+}
+
+static void get_header(vm16_t *C, const uint8_t *p) {
+    uint32_t in_dest = get32(p + 36);
+    p += 12;
+    for(int i = 0; i < 8; i++, p += 2) {
+        C->regs[i] = get16(p);
+    }
+    C->bptr = get16(p);
+    C->tptr = get16(p + 2);
+    C->l_addr = get16(p + 4);
+    C->l_data = get16(p + 6);
+    C->p_in_dest = (in_dest < 8) ? &C->regs[in_dest] : &C->memory[in_dest - SNAP_IN_MEM];
+}
+
+/*
+** Lazy restore (see 'vm16_set_snapshot_lazy')
+**
+** The compressed snapshot is kept together with the offsets of the pages,
+** which are not decoded so far. A page is decoded on the first access.
+*/
+typedef struct vm16_lazy_s {
+    uint32_t num;                   // number of pending pages
+    uint32_t size;                  // size of 'data'
+    uint32_t offs[VM16_MAX_PAGES];  // offset of the page tag in 'data', 0 = decoded
+    uint8_t data[1];                // compressed snapshot (without checksum)
+}vm16_lazy_t;
+
+// return the size of the encoded page (with tag), or 0 if invalid
+static uint32_t page_size(const uint8_t *p, const uint8_t *p_end, uint32_t page_words) {
+    uint32_t size;
+    if(p >= p_end) {
+        return 0;
+    }
+    switch(*p) {
+        case SNAP_ZERO: size = 1; break;
+        case SNAP_KEEP: size = 1; break;
+        case SNAP_RAW: size = 1 + page_words * 2; break;
+        case SNAP_LZ:
+            if((p_end - p) < 3) {
+                return 0;
+            }
+            size = 3 + get16(p + 1);
+            break;
+        default: return 0;
+    }
+    return (size <= (uint32_t)(p_end - p)) ? size : 0;
+}
+
+// decode the page (checked by 'page_size') directly into the VM memory
+static bool decode_page(uint16_t *p_dst, const uint8_t *p, uint32_t page_words) {
+    switch(*p) {
+        case SNAP_ZERO:
+            memset(p_dst, 0, page_words * 2);
+            return true;
+        case SNAP_RAW:
+            get_words(p_dst, p + 1, page_words);
+            return true;
+        case SNAP_LZ:
+            return vm16_lz_decode(p + 3, get16(p + 1), p_dst, page_words);
+        default:
+            return true;
+    }
+}
+
+static void drop_lazy(vm16_t *C) {
+    vm16_rt_t *rt = VM_RT(C);
+    free(rt->p_lazy);
+    rt->p_lazy = NULL;
+}
+
+// the page is decoded or overwritten
+static void set_loaded(vm16_t *C, uint32_t page) {
+    vm16_lazy_t *p_lazy = VM_RT(C)->p_lazy;
+    if((p_lazy != NULL) && (p_lazy->offs[page] != 0)) {
+        p_lazy->offs[page] = 0;
+        if(--p_lazy->num == 0) {
+            drop_lazy(C);
+        }
+    }
+}
+
+static void load_page(vm16_t *C, uint32_t page) {
+    vm16_lazy_t *p_lazy = VM_RT(C)->p_lazy;
+    if((p_lazy != NULL) && (p_lazy->offs[page] != 0)) {
+        uint32_t page_words = PAGE_WORDS(C);
+        uint16_t *p_dst = &C->memory[page * page_words];
+        if(!decode_page(p_dst, p_lazy->data + p_lazy->offs[page], page_words)) {
+            // invalid in spite of a valid checksum
+            memset(p_dst, 0, page_words * 2);
+        }
+        set_loaded(C, page);
+    }
+}
+
+// decode the pages of the memory range (the range can wrap around)
+static void load_range(vm16_t *C, uint16_t addr, uint32_t num) {
+    if(VM_RT(C)->p_lazy != NULL) {
+        uint32_t page_words = PAGE_WORDS(C);
+        if(num > MEM_WORDS(C) - page_words) {
+            vm16_load_pages(C);
+        } else if(num > 0) {
+            uint32_t page = VMA(C, addr) / page_words;
+            uint32_t last = VMA(C, addr + num - 1) / page_words;
+            load_page(C, page);
+            while(page != last) {
+                page = (page + 1) % NUM_PAGES(C);
+                load_page(C, page);
+            }
+        }
+    }
+}
+
+// encode the pages (only the dirty pages for the delta)
+static uint8_t *put_pages(vm16_t *C, uint8_t *p, bool delta) {
+    uint32_t page_words = PAGE_WORDS(C);
+    uint8_t *p_dirty = VM_RT(C)->dirty;
+    vm16_lazy_t *p_lazy = VM_RT(C)->p_lazy;
+    for(uint32_t addr = 0; addr < MEM_WORDS(C); addr += page_words) {
+        uint32_t page = addr / page_words;
+        uint16_t *p_src = &C->memory[addr];
+        uint32_t len;
+        if(delta && !(p_dirty[page] & VM16_DIRTY_CHECKPOINT)) {
+            *p++ = SNAP_KEEP;
+        } else if((p_lazy != NULL) && (p_lazy->offs[page] != 0)) {
+            // not decoded so far: copy the encoded page
+            const uint8_t *p_page = p_lazy->data + p_lazy->offs[page];
+            len = page_size(p_page, p_lazy->data + p_lazy->size, page_words);
+            memcpy(p, p_page, len);
+            p += len;
+        } else if(is_zero(p_src, page_words)) {
+            *p++ = SNAP_ZERO;
+        } else if((len = vm16_lz_encode(p_src, page_words, p + 3, page_words * 2 - 3)) > 0) {
+            *p++ = SNAP_LZ;
+            put16(p, (uint16_t)len);
+            p += 2 + len;
+        } else {
+            *p++ = SNAP_RAW;
+            put_words(p, p_src, page_words);
+            p += page_words * 2;
+        }
+    }
+    return p;
+}
+
+// decode the compressed pages directly into the VM memory
+static bool get_pages(vm16_t *C, const uint8_t *p, const uint8_t *p_end, bool delta) {
+    uint32_t page_words = PAGE_WORDS(C);
+    uint8_t *p_dirty = VM_RT(C)->dirty;
+    for(uint32_t addr = 0; addr < MEM_WORDS(C); addr += page_words) {
+        uint32_t page = addr / page_words;
+        uint32_t size = page_size(p, p_end, page_words);
+        if((size == 0) || ((*p == SNAP_KEEP) && !delta)) {
+            return false;
+        }
+        if(*p != SNAP_KEEP) {
+            // the pages of the delta differ from the checkpoint (but not from the delta)
+            p_dirty[page] = delta ? VM16_DIRTY_CHECKPOINT | VM16_USED : VM16_WRITTEN;
+            if(!decode_page(&C->memory[addr], p, page_words)) {
+                return false;
+            }
+            set_loaded(C, page);
+        }
+        p += size;
+    }
+    return p == p_end;
+}
+
+static void flush_decoded(vm16_t *C) {
+    if(VM_RT(C)->p_cache != NULL) {
+        memset(VM_RT(C)->p_cache, 0, MEM_WORDS(C) * sizeof(vm16_dc_t));
+    }
+    if(VM_RT(C)->p_jit != NULL) {
+        vm16_jit_flush(VM_RT(C)->p_jit);
+    }
+}
+
+void vm16_set_rom(vm16_t *C, uint16_t addr, uint32_t num_pages, bool shared) {
+    if(VM_VALID(C)) {
+        uint8_t *p_dirty = VM_RT(C)->dirty;
+        uint32_t page = VMA(C, addr) / VM16_PAGE_WORDS;
+        for(uint32_t i = page; i < MIN(page + num_pages, NUM_PAGES(C)); i++) {
+            p_dirty[i] = shared ? VM16_WRITTEN | VM16_ROM | VM16_SHARED : VM16_WRITTEN | VM16_ROM;
+        }
+        // the memory was written without 'invalidate'
+        flush_decoded(C);
+    }
+}
+
+uint32_t vm16_get_snapshot_size(vm16_t *C) {
+    if(VM_VALID(C)) {
+        return SNAP_HDR_SIZE + MEM_WORDS(C) * 2 + 4;
+    }
+    return 0;
+}
+
+uint32_t vm16_get_snapshot(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer) {
+    uint32_t size = vm16_get_snapshot_size(C);
+    if((size > 0) && (p_buffer != NULL) && (size_buffer >= size)) {
+        vm16_load_pages(C);
+        put_header(C, SNAP_MAGIC, p_buffer);
+        put_words(p_buffer + SNAP_HDR_SIZE, C->memory, MEM_WORDS(C));
+        put32(p_buffer + size - 4, checksum(p_buffer, size - 4));
+        return size;
+    }
+    return 0;
+}
+
+uint32_t vm16_get_compressed_size(vm16_t *C) {
+    if(VM_VALID(C)) {
+        // worst case: all pages raw
+        return SNAP_HDR_SIZE + MEM_WORDS(C) / PAGE_WORDS(C) + MEM_WORDS(C) * 2 + 4;
+    }
+    return 0;
+}
+
+uint32_t vm16_get_compressed(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer) {
+    uint32_t size = vm16_get_compressed_size(C);
+    if((size > 0) && (p_buffer != NULL) && (size_buffer >= size)) {
+        put_header(C, SNAP_MAGIC_Z, p_buffer);
+        size = (uint32_t)(put_pages(C, p_buffer + SNAP_HDR_SIZE, false) - p_buffer);
+        put32(p_buffer + size, checksum(p_buffer, size));
+        return size + 4;
+    }
+    return 0;
+}
+
+uint32_t vm16_get_delta(vm16_t *C, uint32_t size_buffer, uint8_t *p_buffer) {
+    uint32_t size = vm16_get_compressed_size(C);
+    if((size > 0) && (p_buffer != NULL) && (size_buffer >= size)) {
+        uint8_t *p_dirty = VM_RT(C)->dirty;
+        put_header(C, SNAP_MAGIC_D, p_buffer);
+        size = (uint32_t)(put_pages(C, p_buffer + SNAP_HDR_SIZE, true) - p_buffer);
+        put32(p_buffer + size, checksum(p_buffer, size));
+        for(uint32_t i = 0; i < NUM_PAGES(C); i++) {
+            p_dirty[i] &= ~VM16_DIRTY_DELTA;
+        }
+        return size + 4;
+    }
+    return 0;
+}
+
+uint32_t vm16_set_snapshot(vm16_t *C, uint32_t size_buffer, const uint8_t *p_buffer) {
+    if(VM_VALID(C) && vm16_is_snapshot(size_buffer, p_buffer)) {
+        uint32_t size = size_buffer - 4;
+        bool raw = memcmp(p_buffer, SNAP_MAGIC, 4) == 0;
+        bool delta = memcmp(p_buffer, SNAP_MAGIC_D, 4) == 0;
+
+        if(!check_header(C, p_buffer) ||
+           (raw && (size_buffer != vm16_get_snapshot_size(C))) ||
+           (get32(p_buffer + size) != checksum(p_buffer, size))) {
+            return 0;
+        }
+        if(!delta) {
+            // all pages are overwritten
+            drop_lazy(C);
+        }
+        if(raw) {
+            get_words(C->memory, p_buffer + SNAP_HDR_SIZE, MEM_WORDS(C));
+            memset(VM_RT(C)->dirty, VM16_WRITTEN, NUM_PAGES(C));
+        } else if(!get_pages(C, p_buffer + SNAP_HDR_SIZE, p_buffer + size, delta)) {
+            // memory is partly overwritten
+            drop_lazy(C);
+            memset(C->memory, 0, MEM_WORDS(C) * 2);
+            memset(VM_RT(C)->dirty, VM16_WRITTEN, NUM_PAGES(C));
+            flush_decoded(C);
+            return 0;
+        }
+        get_header(C, p_buffer);
+        flush_decoded(C);
+        return size_buffer;
+    }
+    return 0;
+}
+
+uint32_t vm16_set_snapshot_lazy(vm16_t *C, uint32_t size_buffer, const uint8_t *p_buffer) {
+    if(VM_VALID(C) && vm16_is_snapshot(size_buffer, p_buffer) &&
+       (memcmp(p_buffer, SNAP_MAGIC_Z, 4) == 0)) {
+        uint32_t size = size_buffer - 4;
+        uint32_t page_words = PAGE_WORDS(C);
+        uint32_t offs = SNAP_HDR_SIZE;
+        vm16_lazy_t *p_lazy;
+
+        if(!check_header(C, p_buffer) || (get32(p_buffer + size) != checksum(p_buffer, size))) {
+            return 0;
+        }
+        p_lazy = (vm16_lazy_t *)malloc(sizeof(vm16_lazy_t) + size);
+        if(p_lazy == NULL) {
+            return vm16_set_snapshot(C, size_buffer, p_buffer);
+        }
+        memcpy(p_lazy->data, p_buffer, size);
+        p_lazy->size = size;
+        p_lazy->num = NUM_PAGES(C);
+        for(uint32_t page = 0; page < p_lazy->num; page++) {
+            uint32_t len = page_size(p_lazy->data + offs, p_lazy->data + size, page_words);
+            if((len == 0) || (p_lazy->data[offs] == SNAP_KEEP)) {
+                free(p_lazy);
+                return 0;
+            }
+            p_lazy->offs[page] = offs;
+            offs += len;
+        }
+        if(offs != size) {
+            free(p_lazy);
+            return 0;
+        }
+        drop_lazy(C);
+        VM_RT(C)->p_lazy = p_lazy;
+        memset(VM_RT(C)->dirty, VM16_WRITTEN, NUM_PAGES(C));
+        get_header(C, p_buffer);
+        if((C->p_in_dest >= C->memory) && (C->p_in_dest < C->memory + MEM_WORDS(C))) {
+            load_range(C, (uint16_t)(C->p_in_dest - C->memory), 1);
+        }
+        flush_decoded(C);
+        return size_buffer;
+    }
+    return vm16_set_snapshot(C, size_buffer, p_buffer);
+}
+
+uint32_t vm16_get_pending_pages(vm16_t *C) {
+    if(VM_VALID(C) && (VM_RT(C)->p_lazy != NULL)) {
+        return VM_RT(C)->p_lazy->num;
+    }
+    return 0;
+}
+
+void vm16_load_pages(vm16_t *C) {
+    if(VM_VALID(C)) {
+        for(uint32_t page = 0; (page < NUM_PAGES(C)) && (VM_RT(C)->p_lazy != NULL); page++) {
+            load_page(C, page);
+        }
+    }
+}
+
+vm16_t *vm16_copy(vm16_t *C, vm16_t *C2, bool delta) {
+    if(VM_VALID(C)) {
+        uint32_t page_words = PAGE_WORDS(C);
+        vm16_rt_t *rt = VM_RT(C);
+        // zero pages are not copied, but pending zero pages (see 'load_page')
+        uint32_t zero_offs = (rt->p_lazy != NULL) ? rt->p_lazy->size : 1;
+        vm16_lazy_t *p_lazy = (vm16_lazy_t *)malloc(sizeof(vm16_lazy_t) + zero_offs);
+        vm16_rt_t *rt2;
+
+        if(p_lazy == NULL) {
+            return NULL;
+        }
+        if(C2 == NULL) {
+            C2 = (vm16_t *)malloc(RT_OFFS(MEM_WORDS(C)) + sizeof(vm16_rt_t));
+            if(C2 == NULL) {
+                free(p_lazy);
+                return NULL;
+            }
+        }
+        if(rt->p_lazy != NULL) {
+            memcpy(p_lazy, rt->p_lazy, sizeof(vm16_lazy_t) + rt->p_lazy->size - 1);
+        } else {
+            memset(p_lazy, 0, sizeof(vm16_lazy_t));
+        }
+        p_lazy->data[zero_offs] = SNAP_ZERO;
+        p_lazy->size = zero_offs + 1;
+        memcpy(C2, C, sizeof(vm16_t));
+        for(uint32_t page = 0; page < NUM_PAGES(C); page++) {
+            uint16_t *p_src = &C->memory[page * page_words];
+            // the delta snapshot uses the pages written since the checkpoint only
+            if((p_lazy->offs[page] == 0) && (!delta || (rt->dirty[page] & VM16_DIRTY_CHECKPOINT))) {
+                if(is_zero(p_src, page_words)) {
+                    p_lazy->offs[page] = zero_offs;
+                    p_lazy->num++;
+                } else {
+                    memcpy(&C2->memory[page * page_words], p_src, page_words * 2);
+                }
+            }
+        }
+        C2->p_in_dest = (uint16_t *)((uint8_t *)C2 + ((uint8_t *)C->p_in_dest - (uint8_t *)C));
+        rt2 = RT_ADDR(C2, C->mem_mask);
+        memset(rt2, 0, sizeof(vm16_rt_t));
+        memcpy(rt2->dirty, rt->dirty, sizeof(rt->dirty));
+        rt2->run = rt->run;
+        if(p_lazy->num > 0) {
+            rt2->p_lazy = p_lazy;
+        } else {
+            free(p_lazy);
+        }
+        if(delta) {
+            for(uint32_t page = 0; page < NUM_PAGES(C); page++) {
+                rt->dirty[page] &= ~VM16_DIRTY_DELTA;
+            }
+        }
+        return C2;
+    }
+    return NULL;
+}
+
+uint32_t vm16_get_dirty_pages(vm16_t *C, uint8_t flags, uint8_t *p_pages) {
+    uint32_t num = 0;
+    if(VM_VALID(C)) {
+        uint8_t *p_dirty = VM_RT(C)->dirty;
+        for(uint32_t i = 0; i < NUM_PAGES(C); i++) {
+            if(p_dirty[i] & flags) {
+                if(p_pages != NULL) {
+                    p_pages[num] = (uint8_t)i;
+                }
+                num++;
+            }
+        }
+    }
+    return num;
+}
+
+void vm16_checkpoint(vm16_t *C) {
+    if(VM_VALID(C)) {
+        uint8_t *p_dirty = VM_RT(C)->dirty;
+        for(uint32_t i = 0; i < NUM_PAGES(C); i++) {
+            p_dirty[i] &= VM16_SHARED | VM16_IMAGE | VM16_ROM | VM16_USED;
+        }
+    }
+}
+
+bool vm16_is_snapshot(uint32_t size_buffer, const uint8_t *p_buffer) {
+    return (p_buffer != NULL) && (size_buffer >= SNAP_HDR_SIZE + 4) &&
+           ((memcmp(p_buffer, SNAP_MAGIC, 4) == 0) || (memcmp(p_buffer, SNAP_MAGIC_Z, 4) == 0) ||
+            (memcmp(p_buffer, SNAP_MAGIC_D, 4) == 0));
+}
+
 uint32_t vm16_read_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             for(int i=0; i<num; i++) {
                 *p_buffer++ = *ADDR_SRC(C, addr);
                 addr++;
@@ -374,7 +1072,8 @@ uint32_t vm16_read_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buffe
 
 uint32_t vm16_write_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             for(int i=0; i<num; i++) {
                 *ADDR_DST(C, addr) = *p_buffer++;
                 addr++;
@@ -387,7 +1086,8 @@ uint32_t vm16_write_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buff
 
 uint32_t vm16_read_mem_as_str(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             for(int i=0; i<num; i++) {
                 uint16_t val = *ADDR_SRC(C, addr);
                 *p_buffer++ = NTOA((val >> 12) & 0x0f);
@@ -404,7 +1104,8 @@ uint32_t vm16_read_mem_as_str(vm16_t *C, uint16_t addr, uint16_t num, char *p_bu
 
 uint32_t vm16_write_mem_as_str(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             for(int i=0; i<num; i++) {
                 char c1 = *p_buffer++;
                 char c2 = *p_buffer++;
@@ -422,7 +1123,8 @@ uint32_t vm16_write_mem_as_str(vm16_t *C, uint16_t addr, uint16_t num, char *p_b
 
 uint16_t vm16_read_ascii(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             uint16_t i = 0;
             while(i < num) {
                 uint16_t val = *ADDR_SRC(C, addr);
@@ -450,7 +1152,8 @@ uint16_t vm16_read_ascii(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer)
 
 uint32_t vm16_write_ascii(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, num);
             for(int i=0; i<num; i++) {
                 *ADDR_DST(C, addr) = *p_buffer++;
                 addr++;
@@ -463,7 +1166,8 @@ uint32_t vm16_write_ascii(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer
 
 uint32_t vm16_write_ascii_16(vm16_t *C, uint16_t addr, uint16_t num, char *p_buffer) {
     if(VM_VALID(C)) {
-        if((p_buffer != NULL) && (num > 0) && (num <= C->mem_size)) {
+        if((p_buffer != NULL) && (num > 0) && (num <= MEM_WORDS(C))) {
+            load_range(C, addr, (num + 1) / 2);
             for(int i = 0; i < (num + 1) / 2; i++) {
                 if(p_buffer[1] == 0) {
                     *ADDR_DST(C, addr) = p_buffer[0];
@@ -483,6 +1187,7 @@ uint32_t vm16_write_ascii_16(vm16_t *C, uint16_t addr, uint16_t num, char *p_buf
 
 uint16_t vm16_peek(vm16_t *C, uint16_t addr) {
     if(VM_VALID(C)) {
+        load_range(C, addr, 1);
         return *ADDR_SRC(C, addr);
     }
     return 0xFFFF;
@@ -490,296 +1195,912 @@ uint16_t vm16_peek(vm16_t *C, uint16_t addr) {
 
 bool vm16_poke(vm16_t *C, uint16_t addr, uint16_t val) {
     if(VM_VALID(C)) {
+        load_range(C, addr, 1);
         *ADDR_DST(C, addr) = val;
         return true;
     }
     return false;
 }
 
-int vm16_run(vm16_t *C, uint32_t num_cycles, uint32_t *ran) {
-    if(!VM_VALID(C)) {
-        *ran = 0;
-        return VM16_ERROR;
+/*
+** I/O ports
+**
+** Small table of ports per VM (linear search), served by the 'in' and 'out'
+** instructions within the run loop. The ring buffer indices are free running
+** counters, masked with the buffer size on access.
+*/
+static inline vm16_port_t *find_port(vm16_ports_t *p_ports, uint16_t addr) {
+    for(uint32_t i = 0; i < p_ports->num; i++) {
+        if(p_ports->port[i].addr == addr) {
+            return &p_ports->port[i];
+        }
     }
-    uint32_t num = num_cycles;
-    while(num-- > 0) {
-        uint16_t code = *ADDR_SRC(C, C->pcnt);
+    return NULL;
+}
 
-        C->pcnt++;
+// 'in' instruction, returns false if the VM has to leave the run loop
+static inline bool port_in(vm16_ports_t *p_ports, uint16_t addr, uint16_t *p_dst) {
+    vm16_port_t *p = find_port(p_ports, addr);
+    if(p != NULL) {
+        if(p->type == VM16_PORT_LATCH) {
+            *p_dst = p->value;
+            return true;
+        }
+        if(p->rx_rd != p->rx_wr) {
+            *p_dst = p->p_rx[p->rx_rd++ & p->mask];
+            return true;
+        }
+    }
+    return false;
+}
 
-        uint8_t opcode  = (uint8_t)((code >> 10) & 0x003f);
-        uint8_t addr_mode1 = (uint8_t)((code >>  5) & 0x001f);
-        uint8_t addr_mode2 = (uint8_t)((code >>  0) & 0x001f);
-
-        switch(opcode) {
-            case NOP: {
-                C->p_in_dest = &C->areg;
-                *ran = num_cycles - num;
-                return VM16_NOP;
-            }
-            case BRK: {
-                C->p_in_dest = &C->areg;
-                C->l_addr = code & 0x03FF;
-                *ran = num_cycles - num;
-                C->pcnt--;
-                return VM16_BREAK;
-            }
-            case SYS: {
-                C->p_in_dest = &C->areg;
-                C->l_addr = code & 0x03FF;
-                *ran = num_cycles - num;
-                return VM16_SYS;
-            }
-            case JUMP: {
-                C->pcnt = getoprnd(C, addr_mode1);
-                break;
-            }
-            case CALL: {
-                // addr = opd(), push PC, PC = addr
-                uint16_t addr = getoprnd(C, addr_mode1);
-                C->sptr = C->sptr - 1;
-                *ADDR_DST(C, C->sptr) = C->pcnt;
-                C->pcnt = addr;
-                C->bptr = C->sptr;
-                C->tptr = MIN(C->tptr, C->sptr);
-                break;
-            }
-            case RETN: {
-                // PC = pop()
-                uint16_t addr = *ADDR_DST(C, C->sptr);
-                C->sptr = C->sptr + 1;
-                C->pcnt = addr;
-                C->bptr = C->sptr;
-                break;
-            }
-            case HALT: {
-                *ran = num_cycles - num;
-                C->pcnt--;
-                return VM16_HALT;
-            }
-            case MOVE: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = opd2;
-                break;
-            }
-            case XCHG: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t *p_opd2 = getaddr(C, addr_mode2);
-                uint16_t temp = *p_opd1;
-                *p_opd1 = *p_opd2;
-                *p_opd2 = temp;
-                break;
-            }
-            case INC: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                (*p_opd1)++;
-                break;
-            }
-            case DEC: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                (*p_opd1)--;
-                break;
-            }
-            case ADD: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 + opd2;
-                break;
-            }
-            case SUB: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 - opd2;
-                break;
-            }
-            case MUL: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 * opd2;
-                break;
-            }
-            case DIV: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd2 > 0) {
-                    *p_opd1 = *p_opd1 / opd2;
-                }
-                break;
-            }
-            case AND: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 & opd2;
-                break;
-            }
-            case OR: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 | opd2;
-                break;
-            }
-            case XOR: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 ^ opd2;
-                break;
-            }
-            case NOT: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                 *p_opd1 = ~*p_opd1;
-                break;
-            }
-            case BNZE: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 != 0) {
-                    C->pcnt = opd2;
-                }
-                break;
+// 'out' instruction, returns false if the VM has to leave the run loop
+static inline bool port_out(vm16_ports_t *p_ports, uint16_t addr, uint16_t val) {
+    vm16_port_t *p = find_port(p_ports, addr);
+    if(p != NULL) {
+        if(p->type == VM16_PORT_LATCH) {
+            p->value = val;
+            return true;
+        }
+        if((uint16_t)(p->tx_wr - p->tx_rd) <= p->mask) {
+            p->p_tx[p->tx_wr++ & p->mask] = val;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void free_ports(vm16_ports_t *p_ports) {
+    if(p_ports != NULL) {
+        for(uint32_t i = 0; i < p_ports->num; i++) {
+            free(p_ports->port[i].p_rx);
+        }
+        free(p_ports);
+    }
+}
+
+bool vm16_register_port(vm16_t *C, uint16_t addr, uint8_t type, uint16_t size) {
+    if(VM_VALID(C) && (type <= VM16_PORT_RING)) {
+        vm16_rt_t *rt = VM_RT(C);
+        vm16_port_t *p;
+        if(rt->p_ports == NULL) {
+            if(type == VM16_PORT_NONE) {
+                return true;
             }
-            case BZE: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 == 0) {
-                    C->pcnt = opd2;
-                }
-                break;
+            rt->p_ports = (vm16_ports_t *)calloc(1, sizeof(vm16_ports_t));
+            if(rt->p_ports == NULL) {
+                return false;
             }
-            case BPOS: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 <= 0x7FFF) {
-                    C->pcnt = opd2;
-                }
-                break;
+        }
+        // replace an already registered port
+        p = find_port(rt->p_ports, addr);
+        if(p != NULL) {
+            free(p->p_rx);
+            *p = rt->p_ports->port[--rt->p_ports->num];
+        }
+        if(type == VM16_PORT_NONE) {
+            return true;
+        }
+        if(rt->p_ports->num >= VM16_MAX_PORTS) {
+            return false;
+        }
+        p = &rt->p_ports->port[rt->p_ports->num];
+        memset(p, 0, sizeof(vm16_port_t));
+        p->addr = addr;
+        p->type = type;
+        if(type == VM16_PORT_RING) {
+            uint32_t words = 1;
+            while((words < size) && (words < VM16_MAX_RING_SIZE)) {
+                words <<= 1;
             }
-            case BNEG: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 > 0x7FFF) {
-                    C->pcnt = opd2;
-                }
-                break;
-            }
-            case IN: {
-                C->p_in_dest = getaddr(C, addr_mode1);
-                C->l_addr = getoprnd(C, addr_mode2);
-                *ran = num_cycles - num;
-                return VM16_IN;
-            }
-            case OUT: {
-                C->l_addr = getoprnd(C, addr_mode1);
-                C->l_data = getoprnd(C, addr_mode2);
-                *ran = num_cycles - num;
-                return VM16_OUT;
-            }
-            case PUSH: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                C->sptr = C->sptr - 1;
-                C->tptr = MIN(C->tptr, C->sptr);
-                *ADDR_DST(C, C->sptr) = opd1;
-                break;
-            }
-            case POP: {
-               uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                *p_opd1 = *ADDR_DST(C, C->sptr);
-                C->sptr = C->sptr + 1;
-                break;
-            }
-            case SWAP: {
-              uint16_t *p_opd1 = getaddr(C, addr_mode1);
-              *p_opd1 = ((uint16_t)(*p_opd1) >> 8) | ((uint16_t)(*p_opd1) << 8);
-              break;
-            }
-            case DBNZ: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                (*p_opd1)--;
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(*p_opd1 != 0) {
-                    C->pcnt = opd2;
-                }
-                break;
+            p->p_rx = (uint16_t *)malloc(words * 2 * sizeof(uint16_t));
+            if(p->p_rx == NULL) {
+                return false;
             }
-            case MOD: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd2 > 0) {
-                    *p_opd1 = *p_opd1 % opd2;
-                }
-                break;
-            }
-            case SHL: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 << opd2;
-                break;
-            }
-            case SHR: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = *p_opd1 >> opd2;
-                break;
-            }
-            case ADDC: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                uint32_t res = *p_opd1 + opd2;
-                 *p_opd1 = (uint16_t)res;
-                 C->breg = (uint16_t)(res >> 16);
-                break;
-            }
-            case MULC: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                uint32_t res = *p_opd1 * opd2;
-                 *p_opd1 = (uint16_t)res;
-                 C->breg = (uint16_t)(res >> 16);
-                break;
-            }
-            case SKNE: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 != opd2) {
-                    C->pcnt += 2;
-                }
-                break;
+            p->p_tx = p->p_rx + words;
+            p->mask = words - 1;
+        }
+        rt->p_ports->num++;
+        return true;
+    }
+    return false;
+}
+
+uint32_t vm16_get_ports(vm16_t *C, uint32_t num, uint16_t *p_addrs) {
+    if(VM_VALID(C) && (VM_RT(C)->p_ports != NULL)) {
+        vm16_ports_t *p_ports = VM_RT(C)->p_ports;
+        num = MIN(num, p_ports->num);
+        for(uint32_t i = 0; i < num; i++) {
+            p_addrs[i] = p_ports->port[i].addr;
+        }
+        return num;
+    }
+    return 0;
+}
+
+uint8_t vm16_port_type(vm16_t *C, uint16_t addr) {
+    if(VM_VALID(C) && (VM_RT(C)->p_ports != NULL)) {
+        vm16_port_t *p = find_port(VM_RT(C)->p_ports, addr);
+        if(p != NULL) {
+            return (uint8_t)p->type;
+        }
+    }
+    return VM16_PORT_NONE;
+}
+
+uint32_t vm16_read_port(vm16_t *C, uint16_t addr, uint32_t num, uint16_t *p_buffer) {
+    if(VM_VALID(C) && (VM_RT(C)->p_ports != NULL) && (num > 0)) {
+        vm16_port_t *p = find_port(VM_RT(C)->p_ports, addr);
+        uint32_t i = 0;
+        if(p == NULL) {
+            return 0;
+        }
+        if(p->type == VM16_PORT_LATCH) {
+            p_buffer[0] = p->value;
+            return 1;
+        }
+        while((i < num) && (p->tx_rd != p->tx_wr)) {
+            p_buffer[i++] = p->p_tx[p->tx_rd++ & p->mask];
+        }
+        return i;
+    }
+    return 0;
+}
+
+uint32_t vm16_write_port(vm16_t *C, uint16_t addr, uint32_t num, uint16_t *p_buffer) {
+    if(VM_VALID(C) && (VM_RT(C)->p_ports != NULL) && (num > 0)) {
+        vm16_port_t *p = find_port(VM_RT(C)->p_ports, addr);
+        uint32_t i = 0;
+        if(p == NULL) {
+            return 0;
+        }
+        if(p->type == VM16_PORT_LATCH) {
+            p->value = p_buffer[num - 1];
+            return num;
+        }
+        while((i < num) && ((uint16_t)(p->rx_wr - p->rx_rd) <= p->mask)) {
+            p->p_rx[p->rx_wr++ & p->mask] = p_buffer[i++];
+        }
+        return i;
+    }
+    return 0;
+}
+
+/*
+** Native system call handlers
+*/
+static inline vm16_sys_t *find_sys(vm16_systab_t *p_tab, uint16_t num) {
+    for(uint32_t i = 0; i < p_tab->num; i++) {
+        if(p_tab->sys[i].num == num) {
+            return &p_tab->sys[i];
+        }
+    }
+    return NULL;
+}
+
+// 'sys' instruction, returns false if the VM has to leave the run loop
+static inline bool sys_call(vm16_t *C, vm16_systab_t *p_tab, uint16_t num, uint32_t *p_num) {
+    vm16_sys_t *p = find_sys(p_tab, num);
+    if(p != NULL) {
+        int32_t costs = p->func(C, num, p->p_ctx);
+        if(costs >= 0) {
+            *p_num -= MIN(*p_num, (uint32_t)costs);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void free_sys(vm16_systab_t *p_tab) {
+    if(p_tab != NULL) {
+        for(uint32_t i = 0; i < p_tab->num; i++) {
+            if(p_tab->sys[i].owned) {
+                free(p_tab->sys[i].p_ctx);
             }
-            case SKEQ: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 == opd2) {
-                    C->pcnt += 2;
-                }
-                break;
+        }
+        free(p_tab);
+    }
+}
+
+bool vm16_register_sys(vm16_t *C, uint16_t num, vm16_sys_func_t func, void *p_ctx, bool owned) {
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        vm16_sys_t *p;
+        if(rt->p_sys == NULL) {
+            if(func == NULL) {
+                return true;
+            }
+            rt->p_sys = (vm16_systab_t *)calloc(1, sizeof(vm16_systab_t));
+            if(rt->p_sys == NULL) {
+                return false;
+            }
+        }
+        // replace an already registered handler
+        p = find_sys(rt->p_sys, num);
+        if(p != NULL) {
+            if(p->owned) {
+                free(p->p_ctx);
             }
-            case SKLT: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 < opd2) {
-                    C->pcnt += 2;
+            *p = rt->p_sys->sys[--rt->p_sys->num];
+        }
+        if(func == NULL) {
+            return true;
+        }
+        if(rt->p_sys->num >= VM16_MAX_SYS) {
+            return false;
+        }
+        p = &rt->p_sys->sys[rt->p_sys->num++];
+        p->num = num;
+        p->owned = owned;
+        p->func = func;
+        p->p_ctx = p_ctx;
+        return true;
+    }
+    return false;
+}
+
+void *vm16_get_sys_ctx(vm16_t *C, uint16_t num) {
+    if(VM_VALID(C) && (VM_RT(C)->p_sys != NULL)) {
+        vm16_sys_t *p = find_sys(VM_RT(C)->p_sys, num);
+        if(p != NULL) {
+            return p->p_ctx;
+        }
+    }
+    return NULL;
+}
+
+int32_t vm16_sys_buffer(vm16_t *C, uint16_t num, void *p_ctx) {
+    vm16_sysbuf_t *p = (vm16_sysbuf_t *)p_ctx;
+    if(p->num < p->size) {
+        p->data[p->num++] = C->areg;
+        if(p->result >= 0) {
+            C->areg = (uint16_t)p->result;
+        }
+        return p->costs;
+    }
+    return -1;
+}
+
+bool vm16_register_sys_buffer(vm16_t *C, uint16_t num, uint32_t size, uint32_t costs, int32_t result) {
+    if(VM_VALID(C) && (size > 0)) {
+        vm16_sysbuf_t *p = (vm16_sysbuf_t *)malloc(sizeof(vm16_sysbuf_t) + (size - 1) * sizeof(uint16_t));
+        if(p == NULL) {
+            return false;
+        }
+        p->size = size;
+        p->num = 0;
+        p->costs = (int32_t)MIN(costs, 0x7FFFFFFF);
+        p->result = (result >= 0) ? (result & 0xFFFF) : -1;
+        if(!vm16_register_sys(C, num, vm16_sys_buffer, p, true)) {
+            free(p);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+uint32_t vm16_read_sys_buffer(vm16_t *C, uint16_t sys_num, uint32_t num, uint16_t *p_buffer) {
+    if(VM_VALID(C) && (VM_RT(C)->p_sys != NULL)) {
+        vm16_sys_t *p_sys = find_sys(VM_RT(C)->p_sys, sys_num);
+        if((p_sys != NULL) && (p_sys->func == vm16_sys_buffer)) {
+            vm16_sysbuf_t *p = (vm16_sysbuf_t *)p_sys->p_ctx;
+            num = MIN(num, p->num);
+            memcpy(p_buffer, p->data, num * sizeof(uint16_t));
+            p->num -= num;
+            memmove(p->data, &p->data[num], p->num * sizeof(uint16_t));
+            return num;
+        }
+    }
+    return 0;
+}
+
+/*
+** Output buffer
+*/
+// 'out' instruction, returns false if the VM has to leave the run loop
+static inline bool out_buffer(vm16_outbuf_t *p, uint16_t addr, uint16_t data, uint16_t breg, uint32_t *p_num) {
+    if(p->num < p->size) {
+        vm16_out_t *p_rec = &p->rec[p->num++];
+        p_rec->addr = addr;
+        p_rec->data = data;
+        p_rec->breg = breg;
+        *p_num -= MIN(*p_num, p->costs);
+        return true;
+    }
+    return false;
+}
+
+bool vm16_set_out_buffer(vm16_t *C, uint32_t size, uint32_t costs) {
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        free(rt->p_outbuf);
+        rt->p_outbuf = NULL;
+        if(size > 0) {
+            rt->p_outbuf = (vm16_outbuf_t *)malloc(sizeof(vm16_outbuf_t) + (size - 1) * sizeof(vm16_out_t));
+            if(rt->p_outbuf == NULL) {
+                return false;
+            }
+            rt->p_outbuf->size = size;
+            rt->p_outbuf->num = 0;
+            rt->p_outbuf->costs = costs;
+        }
+        return true;
+    }
+    return false;
+}
+
+uint32_t vm16_read_out_buffer(vm16_t *C, uint32_t num, vm16_out_t *p_records) {
+    if(VM_VALID(C) && (VM_RT(C)->p_outbuf != NULL)) {
+        vm16_outbuf_t *p = VM_RT(C)->p_outbuf;
+        num = MIN(num, p->num);
+        memcpy(p_records, p->rec, num * sizeof(vm16_out_t));
+        p->num -= num;
+        memmove(p->rec, &p->rec[num], p->num * sizeof(vm16_out_t));
+        return num;
+    }
+    return 0;
+}
+
+uint32_t vm16_num_buffered(vm16_t *C) {
+    uint32_t num = 0;
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        if(rt->p_outbuf != NULL) {
+            num += rt->p_outbuf->num;
+        }
+        if(rt->p_sys != NULL) {
+            for(uint32_t i = 0; i < rt->p_sys->num; i++) {
+                if(rt->p_sys->sys[i].func == vm16_sys_buffer) {
+                    num += ((vm16_sysbuf_t *)rt->p_sys->sys[i].p_ctx)->num;
                 }
-                break;
             }
-            case SKGT: {
-                uint16_t opd1 = getoprnd(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                if(opd1 > opd2) {
-                    C->pcnt += 2;
+        }
+    }
+    return num;
+}
+
+bool vm16_has_io_state(vm16_t *C) {
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        if((rt->p_ports != NULL) || (rt->p_outbuf != NULL)) {
+            return true;
+        }
+        if(rt->p_sys != NULL) {
+            for(uint32_t i = 0; i < rt->p_sys->num; i++) {
+                if(rt->p_sys->sys[i].func != vm16_sys_buffer) {
+                    return true;
                 }
-                break;
             }
-            case MSB: {
-                uint16_t *p_opd1 = getaddr(C, addr_mode1);
-                uint16_t opd2 = getoprnd(C, addr_mode2);
-                *p_opd1 = most_significant_bit(opd2);
-                break;
+        }
+    }
+    return false;
+}
+
+uint32_t vm16_get_mem_usage(vm16_t *C) {
+    uint32_t size = 0;
+    if(VM_VALID(C)) {
+        vm16_rt_t *rt = VM_RT(C);
+        size = RT_OFFS(MEM_WORDS(C)) + sizeof(vm16_rt_t);
+        if(rt->p_cache != NULL) {
+            size += MEM_WORDS(C) * sizeof(vm16_dc_t);
+        }
+        if(rt->p_lazy != NULL) {
+            size += sizeof(vm16_lazy_t) + rt->p_lazy->size;
+        }
+        // shared memory is saved in units of 4 KB OS pages (8 or 9 memory pages)
+        uint32_t offs = (4096 - ((uintptr_t)C->memory & 4095)) & 4095;
+        for(; offs + 4096 <= MEM_WORDS(C) * 2; offs += 4096) {
+            uint32_t page = offs / 2 / VM16_PAGE_WORDS;
+            uint32_t last = (offs + 4095) / 2 / VM16_PAGE_WORDS;
+            while((page <= last) && (rt->dirty[page] & VM16_SHARED)) {
+                page++;
             }
-            default: {
-                return VM16_ERROR;
+            if(page > last) {
+                size -= 4096;
             }
         }
     }
-    *ran = num_cycles - num;
-    return VM16_OK;
+    return size;
+}
+
+uint32_t vm16_get_runs(vm16_t *C) {
+    if(VM_VALID(C)) {
+        return VM_RT(C)->runs;
+    }
+    return 0;
+}
+
+#define VM_FETCH()                                      \
+    code = *RUN_SRC(VM_PC);                             \
+    VM_PC++;                                            \
+    opcode  = (uint8_t)((code >> 10) & 0x003f);         \
+    addr_mode1 = (uint8_t)((code >>  5) & 0x001f);      \
+    addr_mode2 = (uint8_t)((code >>  0) & 0x001f)
+
+/*
+** Instruction semantics
+**
+** Shared by the generic handlers and the specialized handlers.
+** 'P1' is the destination address, 'V1'/'V2' are operand values.
+** The expressions are evaluated in instruction word order, which is
+** important for operands which read words behind the instruction.
+*/
+#define DO_DST_SRC(P1, V2, expr)    { uint16_t *p_opd1 = P1; uint16_t opd2 = V2; expr; }
+#define DO_SRC_SRC(V1, V2, expr)    { uint16_t opd1 = V1; uint16_t opd2 = V2; expr; }
+#define DO_DST(P1, expr)            { uint16_t *p_opd1 = P1; expr; }
+
+#define DO_MOVE(P1, V2)     DO_DST_SRC(P1, V2, *p_opd1 = opd2)
+#define DO_ADD(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 + opd2)
+#define DO_SUB(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 - opd2)
+#define DO_MUL(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 * opd2)
+#define DO_DIV(P1, V2)      DO_DST_SRC(P1, V2, if(opd2 > 0) { *p_opd1 = *p_opd1 / opd2; })
+#define DO_MOD(P1, V2)      DO_DST_SRC(P1, V2, if(opd2 > 0) { *p_opd1 = *p_opd1 % opd2; })
+#define DO_AND(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 & opd2)
+#define DO_OR(P1, V2)       DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 | opd2)
+#define DO_XOR(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 ^ opd2)
+#define DO_SHL(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 << opd2)
+#define DO_SHR(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = *p_opd1 >> opd2)
+#define DO_MSB(P1, V2)      DO_DST_SRC(P1, V2, *p_opd1 = most_significant_bit(opd2))
+#define DO_ADDC(P1, V2)     DO_DST_SRC(P1, V2, uint32_t res = *p_opd1 + opd2;   \
+                                               *p_opd1 = (uint16_t)res;         \
+                                               C->breg = (uint16_t)(res >> 16))
+#define DO_MULC(P1, V2)     DO_DST_SRC(P1, V2, uint32_t res = *p_opd1 * opd2;   \
+                                               *p_opd1 = (uint16_t)res;         \
+                                               C->breg = (uint16_t)(res >> 16))
+
+#define DO_BNZE(V1, V2)     DO_SRC_SRC(V1, V2, if(opd1 != 0) { VM_PC = opd2; })
+#define DO_BZE(V1, V2)      DO_SRC_SRC(V1, V2, if(opd1 == 0) { VM_PC = opd2; })
+#define DO_BPOS(V1, V2)     DO_SRC_SRC(V1, V2, if(opd1 <= 0x7FFF) { VM_PC = opd2; })
+#define DO_BNEG(V1, V2)     DO_SRC_SRC(V1, V2, if(opd1 > 0x7FFF) { VM_PC = opd2; })
+#define DO_SKNE(V1, V2)     DO_SKIP(V1, V2, opd1 != opd2)
+#define DO_SKEQ(V1, V2)     DO_SKIP(V1, V2, opd1 == opd2)
+#define DO_SKLT(V1, V2)     DO_SKIP(V1, V2, opd1 < opd2)
+#define DO_SKGT(V1, V2)     DO_SKIP(V1, V2, opd1 > opd2)
+#define DO_SKIP(V1, V2, cond)   DO_SRC_SRC(V1, V2, if(cond) { VM_PC += 2; })
+
+#define DO_INC(P1)          DO_DST(P1, (*p_opd1)++)
+#define DO_DEC(P1)          DO_DST(P1, (*p_opd1)--)
+#define DO_NOT(P1)          DO_DST(P1, *p_opd1 = ~*p_opd1)
+#define DO_SWAP(P1)         DO_DST(P1, *p_opd1 = ((uint16_t)(*p_opd1) >> 8) | ((uint16_t)(*p_opd1) << 8))
+#define DO_POP(P1)          DO_DST(P1, *p_opd1 = *RUN_SRC(C->sptr);             \
+                                       C->sptr = C->sptr + 1)
+
+#define DO_DBNZ(P1, V2)                                 \
+    {                                                   \
+        uint16_t *p_opd1 = P1;                          \
+        (*p_opd1)--;                                    \
+        uint16_t opd2 = V2;                             \
+        if(*p_opd1 != 0) {                              \
+            VM_PC = opd2;                               \
+        }                                               \
+    }
+
+#define DO_JUMP(V1)                                     \
+    {                                                   \
+        VM_PC = V1;                                     \
+    }
+
+#define DO_CALL(V1)                                     \
+    {                                                   \
+        /* addr = opd(), push PC, PC = addr */          \
+        uint16_t addr = V1;                             \
+        C->sptr = C->sptr - 1;                          \
+        *RUN_DST(C->sptr) = VM_PC;                      \
+        VM_PC = addr;                                   \
+        C->bptr = C->sptr;                              \
+        C->tptr = MIN(C->tptr, C->sptr);                \
+    }
+
+#define DO_PUSH(V1)                                     \
+    {                                                   \
+        uint16_t opd1 = V1;                             \
+        C->sptr = C->sptr - 1;                          \
+        C->tptr = MIN(C->tptr, C->sptr);                \
+        *RUN_DST(C->sptr) = opd1;                       \
+    }
+
+// generic operand access via the addressing mode
+#define ADDR_G(n)           getaddr(C, &VM_PC, mask, addr_mode##n)
+#define VAL_G(n)            getoprnd(C, &VM_PC, mask, addr_mode##n)
+
+#ifdef VM16_THREADED_CODE
+/*
+** Specialized handlers
+**
+** The decode cache entry of an instruction holds the handler for the
+** instruction's operand classes, so that the operand access is straight-line
+** code without addressing mode switch:
+**   R - register (the entry holds the register number)
+**   K - #0/#1 register (the entry holds the value)
+**   I - constant/immediate value: #1234
+**   S - stack relative: [SP+n]
+** All other addressing modes use the generic handler (class G), also the
+** PC register, which is a local variable of the 'vm16_run' instance.
+*/
+#define OPD_G       0
+#define OPD_R       1
+#define OPD_K       2
+#define OPD_I       3
+#define OPD_S       4
+#define OPD_NUM     5
+
+#define ADDR_R(n)           (&C->regs[dc_opd##n])
+#define ADDR_S(n)           getaddr(C, &VM_PC, mask, SREL)
+#define VAL_R(n)            C->regs[dc_opd##n]
+#define VAL_K(n)            ((uint16_t)dc_opd##n)
+#define VAL_I(n)            getoprnd(C, &VM_PC, mask, CNST)
+#define VAL_S(n)            getoprnd(C, &VM_PC, mask, SREL)
+
+static inline uint8_t opd_class(uint8_t addr_mod, uint8_t *p_opd) {
+    *p_opd = 0;
+    if((addr_mod <= SPTR) && (addr_mod != PCNT)) {
+        *p_opd = addr_mod;
+        return OPD_R;
+    }
+    switch(addr_mod) {
+        case REG0: return OPD_K;
+        case REG1: *p_opd = 1; return OPD_K;
+        case CNST: return OPD_I;
+        case SREL: return OPD_S;
+        default: return OPD_G;
+    }
+}
+
+/*
+** Superinstructions
+**
+** Frequent instruction sequences of the compiler output are executed
+** by one fused handler. The table 'FuseTable' holds the handlers per row
+** (sequence shape) and [opcode][operand class 1][operand class 2]:
+**   FUSE_ROW_JUMP: skxx/inc/dec followed by 'jump #addr', indexed by
+**                  the first instruction
+**   FUSE_ROW_LOAD: 'move R, [SP+n]' followed by an instruction with R as
+**                  first operand (add/sub, or skxx and 'jump #addr'),
+**                  indexed by the second instruction
+** All words of the sequence get the flag DC_FUSED, so that a write
+** invalidates the cache entry of the first instruction.
+*/
+#define FUSE_ROW_JUMP   0
+#define FUSE_ROW_LOAD   1
+#define FUSE_ROW_NUM    2
+
+#define JUMP_CNST       ((JUMP << 10) | (CNST << 5))    // 'jump #addr'
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t c1, c2;         // operand classes
+    uint8_t opd1, opd2;     // pre-decoded operands
+    uint8_t words;          // instruction size
+}instr_t;
+
+typedef struct {
+    uint16_t addr;          // start address
+    uint8_t row;            // table index
+    uint8_t opcode;
+    uint8_t c1, c2;
+    uint8_t opd2;           // pre-decoded operand 2 for the cache entry
+    uint8_t words;          // sequence size
+}fuse_t;
+
+static inline bool is_skip(uint8_t opcode) {
+    return (opcode >= SKNE) && (opcode <= SKGT);
+}
+
+// Decode instruction, returns false for generic operands
+static bool decode_instr(vm16_t *C, uint16_t addr, instr_t *p) {
+    uint16_t code = *ADDR_SRC(C, addr);
+    p->opcode = (uint8_t)((code >> 10) & 0x003f);
+    p->c1 = opd_class((uint8_t)((code >> 5) & 0x001f), &p->opd1);
+    p->c2 = opd_class((uint8_t)(code & 0x001f), &p->opd2);
+    p->words = 1 + (p->c1 == OPD_I || p->c1 == OPD_S) + (p->c2 == OPD_I || p->c2 == OPD_S);
+    return (p->c1 != OPD_G) && (p->c2 != OPD_G);
+}
+
+// Flag the words of the sequence behind the first instruction
+static void mark_fused(vm16_t *C, vm16_dc_t *p_cache, fuse_t *p) {
+    for(int i = 1; i < p->words; i++) {
+        p_cache[VMA(C, p->addr + i)].flags = DC_FUSED;
+    }
+}
+
+// Check if the instruction at 'addr' starts a fused sequence
+static bool fuse(vm16_t *C, uint16_t addr, fuse_t *p) {
+    instr_t i1, i2;
+
+    if(!decode_instr(C, addr, &i1)) {
+        return false;
+    }
+    p->addr = addr;
+    if(is_skip(i1.opcode) || (i1.opcode == INC) || (i1.opcode == DEC)) {
+        if(*ADDR_SRC(C, addr + i1.words) == JUMP_CNST) {
+            p->row = FUSE_ROW_JUMP;
+            p->opcode = i1.opcode;
+            p->c1 = i1.c1;
+            p->c2 = i1.c2;
+            p->opd2 = i1.opd2;
+            p->words = i1.words + 2;
+            return true;
+        }
+        return false;
+    }
+    if((i1.opcode == MOVE) && (i1.c1 == OPD_R) && (i1.c2 == OPD_S)) {
+        if(!decode_instr(C, addr + i1.words, &i2) || (i2.c1 != OPD_R) || (i2.opd1 != i1.opd1)) {
+            return false;
+        }
+        p->row = FUSE_ROW_LOAD;
+        p->opcode = i2.opcode;
+        p->c1 = i2.c1;
+        p->c2 = i2.c2;
+        p->opd2 = i2.opd2;
+        p->words = i1.words + i2.words;
+        if(is_skip(i2.opcode)) {
+            if(*ADDR_SRC(C, addr + p->words) != JUMP_CNST) {
+                return false;
+            }
+            p->words += 2;
+        }
+        return true;
+    }
+    return false;
+}
+
+// 'lbl' and 'do' are the label prefix and the semantics macro of the opcode
+#define VM_SPEC(lbl, c1, c2)            lbl##_##c1##_##c2:
+// 'next' is NEXT or BRANCH (instructions which can change the PC)
+#define VM_SPEC_P1V2(lbl, do, next, c1, c2) VM_SPEC(lbl, c1, c2) { do(ADDR_##c1(1), VAL_##c2(2)); VM_##next; }
+#define VM_SPEC_V1V2(lbl, do, next, c1, c2) VM_SPEC(lbl, c1, c2) { do(VAL_##c1(1), VAL_##c2(2)); VM_##next; }
+#define VM_SPEC_P1(lbl, do, next, c1)       VM_SPEC(lbl, c1, X) { do(ADDR_##c1(1)); VM_##next; }
+#define VM_SPEC_V1(lbl, do, next, c1)       VM_SPEC(lbl, c1, X) { do(VAL_##c1(1)); VM_##next; }
+
+#define VM_HANDLERS_P1V2(op, next)  VM_HANDLERS_2(VM_SPEC_P1V2, L_##op, DO_##op, next)
+#define VM_HANDLERS_V1V2(op, next)  VM_HANDLERS_2(VM_SPEC_V1V2, L_##op, DO_##op, next)
+#define VM_HANDLERS_2(spec, lbl, do, next)                                  \
+    spec(lbl, do, next, R, R) spec(lbl, do, next, R, K)                     \
+    spec(lbl, do, next, R, I) spec(lbl, do, next, R, S)                     \
+    spec(lbl, do, next, S, R) spec(lbl, do, next, S, K)                     \
+    spec(lbl, do, next, S, I) spec(lbl, do, next, S, S)
+#define VM_HANDLERS_P1(op, next)    VM_HANDLERS_P1_(L_##op, DO_##op, next)
+#define VM_HANDLERS_P1_(lbl, do, next)                                      \
+    VM_SPEC_P1(lbl, do, next, R) VM_SPEC_P1(lbl, do, next, S)
+#define VM_HANDLERS_V1(op, next)    VM_HANDLERS_V1_(L_##op, DO_##op, next)
+#define VM_HANDLERS_V1_(lbl, do, next)                                      \
+    VM_SPEC_V1(lbl, do, next, R) VM_SPEC_V1(lbl, do, next, K)               \
+    VM_SPEC_V1(lbl, do, next, I) VM_SPEC_V1(lbl, do, next, S)
+
+// entries of the specialization table (label offsets to 'L_DECODE')
+#define SPEC_ENTRY(op, c1, c2, label)   [op][OPD_##c1][OPD_##c2] = &&label - &&L_DECODE,
+#define SPEC_ENTRY_X(op, c1, label)     [op][OPD_##c1][0 ... OPD_NUM - 1] = &&label - &&L_DECODE,
+
+#define SPEC_ENTRIES_2(op)                                                  \
+    SPEC_ENTRY(op, R, R, L_##op##_R_R) SPEC_ENTRY(op, R, K, L_##op##_R_K)   \
+    SPEC_ENTRY(op, R, I, L_##op##_R_I) SPEC_ENTRY(op, R, S, L_##op##_R_S)   \
+    SPEC_ENTRY(op, S, R, L_##op##_S_R) SPEC_ENTRY(op, S, K, L_##op##_S_K)   \
+    SPEC_ENTRY(op, S, I, L_##op##_S_I) SPEC_ENTRY(op, S, S, L_##op##_S_S)
+#define SPEC_ENTRIES_P1(op)                                                 \
+    SPEC_ENTRY_X(op, R, L_##op##_R_X) SPEC_ENTRY_X(op, S, L_##op##_S_X)
+#define SPEC_ENTRIES_V1(op)                                                 \
+    SPEC_ENTRY_X(op, R, L_##op##_R_X) SPEC_ENTRY_X(op, K, L_##op##_K_X)     \
+    SPEC_ENTRY_X(op, I, L_##op##_I_X) SPEC_ENTRY_X(op, S, L_##op##_S_X)
+// instructions without operands use the generic handler directly
+#define SPEC_ENTRIES_0(op)                                                  \
+    [op][0 ... OPD_NUM - 1][0 ... OPD_NUM - 1] = &&L_##op - &&L_DECODE,
+
+/*
+** Fused handlers
+**
+** Each further instruction of the sequence needs a remaining cycle, so
+** that the cycle accounting is the same as for single instructions.
+** If an instruction modified the sequence (the cache entry is invalidated),
+** the remaining instructions are executed via the normal dispatch.
+*/
+#define FUSE_HIT(kind)      p_hits[VM16_FUSE_##kind]++
+
+// 'jump #addr' as next instruction
+#define DO_TAIL_JUMP()                                  \
+    if((num > 0) && (p_entry->handler != 0)) {          \
+        num--;                                          \
+        VM_PC = *RUN_SRC(VM_PC + 1);                    \
+    }
+
+#define DO_SKNE_JUMP(V1, V2)    DO_SKIP_JUMP(V1, V2, opd1 != opd2)
+#define DO_SKEQ_JUMP(V1, V2)    DO_SKIP_JUMP(V1, V2, opd1 == opd2)
+#define DO_SKLT_JUMP(V1, V2)    DO_SKIP_JUMP(V1, V2, opd1 < opd2)
+#define DO_SKGT_JUMP(V1, V2)    DO_SKIP_JUMP(V1, V2, opd1 > opd2)
+#define DO_SKIP_JUMP(V1, V2, cond)  DO_SRC_SRC(V1, V2, if(cond) { VM_PC += 2; } else { DO_TAIL_JUMP() })
+#define DO_INC_JUMP(P1)         { DO_INC(P1); DO_TAIL_JUMP() }
+#define DO_DEC_JUMP(P1)         { DO_DEC(P1); DO_TAIL_JUMP() }
+
+// 'move R, [SP+n]' followed by 'next' (can't modify the sequence)
+#define DO_LOAD(next)                                   \
+    {                                                   \
+        DO_MOVE(ADDR_R(1), VAL_S(2));                   \
+        if(num > 0) {                                   \
+            num--;                                      \
+            VM_PC++;                                    \
+            next;                                       \
+        }                                               \
+    }
+
+#define VM_FUSED_V1V2(lbl, do, kind, c1, c2)    VM_SPEC(lbl, c1, c2) { FUSE_HIT(kind); do(VAL_##c1(1), VAL_##c2(2)); VM_BRANCH; }
+#define VM_FUSED_P1(lbl, do, kind, c1)          VM_SPEC(lbl, c1, X) { FUSE_HIT(kind); do(ADDR_##c1(1)); VM_BRANCH; }
+
+#define VM_FUSED_SKIP_JUMP(op)  VM_HANDLERS_2(VM_FUSED_V1V2, F_##op, DO_##op##_JUMP, SKIP_JUMP)
+#define VM_FUSED_STEP_JUMP(op)  VM_FUSED_STEP_JUMP_(F_##op, DO_##op##_JUMP)
+#define VM_FUSED_STEP_JUMP_(lbl, do)                                        \
+    VM_FUSED_P1(lbl, do, STEP_JUMP, R) VM_FUSED_P1(lbl, do, STEP_JUMP, S)
+#define VM_FUSED_LOAD_OP(op)    VM_FUSED_LOAD_OP_(F_LOAD_##op, DO_##op)
+#define VM_FUSED_LOAD_OP_(lbl, do)                                          \
+    VM_SPEC(lbl, R, K) { FUSE_HIT(LOAD_OP); DO_LOAD(do(ADDR_R(1), VAL_K(2))); VM_NEXT; }          \
+    VM_SPEC(lbl, R, I) { FUSE_HIT(LOAD_OP); DO_LOAD(do(ADDR_R(1), VAL_I(2))); VM_NEXT; }
+#define VM_FUSED_LOAD_SKIP_JUMP(op)     VM_FUSED_LOAD_SKIP_JUMP_(F_LOAD_##op, DO_##op##_JUMP)
+#define VM_FUSED_LOAD_SKIP_JUMP_(lbl, do)                                   \
+    VM_SPEC(lbl, R, K) { FUSE_HIT(LOAD_SKIP_JUMP); DO_LOAD(do(VAL_R(1), VAL_K(2))); VM_BRANCH; }  \
+    VM_SPEC(lbl, R, I) { FUSE_HIT(LOAD_SKIP_JUMP); DO_LOAD(do(VAL_R(1), VAL_I(2))); VM_BRANCH; }
+
+#define FUSED_HANDLER(fu)   FuseTable[(fu).row][(fu).opcode][(fu).c1][(fu).c2]
+
+// entries of the fusion table
+#define FUSE_ENTRIES_JUMP_2(op)     FUSE_ENTRIES_JUMP_2_(op, F_##op)
+#define FUSE_ENTRIES_JUMP_2_(op, lbl)                                       \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, R, R, lbl##_R_R)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, R, K, lbl##_R_K)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, R, I, lbl##_R_I)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, R, S, lbl##_R_S)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, S, R, lbl##_S_R)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, S, K, lbl##_S_K)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, S, I, lbl##_S_I)                         \
+    [FUSE_ROW_JUMP] SPEC_ENTRY(op, S, S, lbl##_S_S)
+#define FUSE_ENTRIES_JUMP_P1(op)    FUSE_ENTRIES_JUMP_P1_(op, F_##op)
+#define FUSE_ENTRIES_JUMP_P1_(op, lbl)                                      \
+    [FUSE_ROW_JUMP] SPEC_ENTRY_X(op, R, lbl##_R_X)                          \
+    [FUSE_ROW_JUMP] SPEC_ENTRY_X(op, S, lbl##_S_X)
+#define FUSE_ENTRIES_LOAD(op)       FUSE_ENTRIES_LOAD_(op, F_LOAD_##op)
+#define FUSE_ENTRIES_LOAD_(op, lbl)                                         \
+    [FUSE_ROW_LOAD] SPEC_ENTRY(op, R, K, lbl##_R_K)                         \
+    [FUSE_ROW_LOAD] SPEC_ENTRY(op, R, I, lbl##_R_I)
+
+/*
+** Without decode cache, the instruction is decoded and dispatched via
+** 'JumpTable'. With decode cache, the cache entry of the instruction
+** address provides the (specialized) handler and the pre-decoded operands.
+** An empty entry is resolved via 'L_DECODE', instructions without
+** specialized handler are decoded again via 'L_GENERIC'.
+*/
+#define VM_NEXT                                                 \
+    if(num-- > 0) {                                             \
+        if(p_cache != NULL) {                                   \
+            p_entry = &p_cache[RUN_VMA(VM_PC)];                 \
+            VM_PC++;                                            \
+            dc_opd1 = p_entry->opd1;                            \
+            dc_opd2 = p_entry->opd2;                            \
+            goto *(&&L_DECODE + p_entry->handler);              \
+        }                                                       \
+        VM_FETCH();                                             \
+        VM_PC_OPERAND();                                        \
+        goto *JumpTable[opcode];                                \
+    }                                                           \
+    goto vm_end
+/*
+** With JIT, branch targets are the entry points into compiled blocks.
+*/
+#ifdef VM16_JIT
+#define VM_BRANCH                                               \
+    if(p_jit != NULL) {                                         \
+        goto L_JIT;                                             \
+    }                                                           \
+    VM_NEXT
+#define VM_JIT_ENTRY            L_JIT:                                              \
+                                    VM_SAVE_PC();                                   \
+                                    num -= vm16_jit_run(p_jit, C, p_cache, num);    \
+                                    VM_LOAD_PC();                                   \
+                                    VM_NEXT;
+#else
+#define VM_BRANCH               VM_NEXT
+#define VM_JIT_ENTRY
+#endif
+#define VM_DISPATCH_BEGIN       VM_NEXT;                                            \
+                                VM_JIT_ENTRY                                        \
+                                VM_PC_ENTRY                                         \
+                                L_DECODE: {                                         \
+                                    uint8_t c1, c2;                                 \
+                                    int32_t handler;                                \
+                                    fuse_t fu;                                      \
+                                    VM_PC--;                                        \
+                                    VM_FETCH();                                     \
+                                    c1 = opd_class(addr_mode1, &dc_opd1);           \
+                                    c2 = opd_class(addr_mode2, &dc_opd2);           \
+                                    handler = SpecTable[opcode][c1][c2];            \
+                                    if(fuse(C, VM_PC - 1, &fu) &&                   \
+                                       (FUSED_HANDLER(fu) != 0)) {                  \
+                                        handler = FUSED_HANDLER(fu);                \
+                                        dc_opd2 = fu.opd2;                          \
+                                        mark_fused(C, p_cache, &fu);                \
+                                    }                                               \
+                                    p_entry->opd1 = dc_opd1;                        \
+                                    p_entry->opd2 = dc_opd2;                        \
+                                    p_entry->handler = handler != 0 ? handler :     \
+                                        (int32_t)(&&L_GENERIC - &&L_DECODE);        \
+                                    VM_PC_OPERAND();                                \
+                                    goto *JumpTable[opcode];                        \
+                                }                                                   \
+                                L_GENERIC:                                          \
+                                    VM_PC--;                                        \
+                                    VM_FETCH();                                     \
+                                    VM_PC_OPERAND();                                \
+                                    goto *JumpTable[opcode];
+#define VM_CASE(op)             L_##op:
+#define VM_DEFAULT              L_ERROR:
+#define VM_DISPATCH_END         vm_end:
+#else
+#define VM_NEXT                 continue
+#define VM_BRANCH               continue
+#define VM_DISPATCH_BEGIN       while(num-- > 0) { VM_FETCH(); VM_PC_OPERAND(); switch(opcode) {
+#define VM_CASE(op)             case op:
+#define VM_DEFAULT              default:
+#define VM_DISPATCH_END         }}
+#endif
+
+/*
+** Run loop instances
+**
+** The memory size specialized instances use the address mask as constant
+** and hold the PC in a local variable. Each instance is a complete copy of
+** the interpreter, therefore only the sizes in use are specialized: 512 and
+** 1K words (default and demo CPU) and 64K words (the mask is a no-op).
+** The instance of a VM is selected once by 'vm16_init', the generic
+** instance is used for all other sizes.
+*/
+#define RUN_FUNC        run_generic
+#define RUN_MASK        C->mem_mask
+#define RUN_GENERIC
+#include "vm16run.h"
+
+#define RUN_FUNC        run_512
+#define RUN_MASK        0x01FF
+#include "vm16run.h"
+
+#define RUN_FUNC        run_1k
+#define RUN_MASK        0x03FF
+#include "vm16run.h"
+
+#define RUN_FUNC        run_64k
+#define RUN_MASK        0xFFFF
+#include "vm16run.h"
+
+static run_func_t run_instance(uint16_t mem_mask) {
+    switch(mem_mask) {
+        case 0x01FF: return run_512;
+        case 0x03FF: return run_1k;
+        case 0xFFFF: return run_64k;
+        default: return run_generic;
+    }
+}
+
+int vm16_run(vm16_t *C, uint32_t num_cycles, uint32_t *ran) {
+    if(!VM_VALID(C)) {
+        *ran = 0;
+        return VM16_ERROR;
+    }
+    if(VM_RT(C)->p_lazy != NULL) {
+        // the interpreter accesses the memory directly
+        vm16_load_pages(C);
+    }
+    VM_RT(C)->runs++;
+    return VM_RT(C)->run(C, num_cycles, ran, true);
+}
+
+uint32_t vm16_run_batch(vm16_t **pp_vms, uint32_t num, uint32_t *p_cycles, vm16_event_t *p_events) {
+    uint32_t num_events = 0;
+    for(uint32_t i = 0; i < num; i++) {
+        uint32_t ran = 0;
+        int resp = vm16_run(pp_vms[i], p_cycles[i], &ran);
+        if(resp != VM16_OK) {
+            p_events[num_events].index = i;
+            p_events[num_events].ran = ran;
+            p_events[num_events].resp = resp;
+            num_events++;
+        }
+    }
+    return num_events;
 }
@@ -147,6 +147,7 @@ uint32_t vm16_read_h16(vm16_t *C, char *dest_buff, uint16_t start_addr, uint32_t
     if(end_addr < start_addr) {
         return 0;
     }
+    vm16_load_pages(C);
 
     for(uint16_t addr = start_addr; addr < end_addr; addr = addr + 8) {
         is_zero = true;
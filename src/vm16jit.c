@@ -0,0 +1,833 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Basic block JIT compiler for x86-64
+**
+** A basic block is a sequence of instructions starting at a branch target
+** and ending with the next jump/branch/call/return/skip instruction.
+** Blocks end also before an instruction which has to be executed by the
+** interpreter (NOP, BRK, SYS, IN, OUT, HALT, XCHG, PC as destination,
+** invalid opcodes).
+**
+** The interpreter calls 'vm16_jit_run' after each branch instruction.
+** Blocks are compiled when they are hot and executed as a whole, if the
+** remaining number of cycles is sufficient. Each instruction is charged
+** with one cycle, exactly as by the interpreter.
+**
+** Generated code (System V calling convention):
+**   uint32_t block(vm16_t *C, uint16_t *p_mem, uint8_t *p_codemap, vm16_dc_t *p_cache)
+**     rdi = C, rsi = VM memory, r8 = code map, r9 = decode cache,
+**     eax/ecx/edx/r10 = scratch, r11b = "compiled code written" flag
+**   Returns the number of executed instructions. SMC_FLAG is set if the
+**   block wrote to a memory word of a compiled block (self-modifying
+**   code). The block is left after that instruction and all blocks
+**   are flushed.
+**   The code buffer is never writable and executable at the same time:
+**   it is switched to read/write while a block is compiled only.
+**   Stores to ROM pages are skipped (checked at runtime for indirect
+**   addresses, if the VM has ROM pages, see 'vm16_set_rom').
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16.h"
+#include "vm16op.h"
+#include "vm16jit.h"
+
+#ifdef VM16_JIT
+
+#include <sys/mman.h>
+
+#define CODE_SIZE       (128 * 1024)    // code buffer size per VM
+#define CODE_START      (16)            // offset 0 is used as "no block"
+#define MAX_BLK_CODE    (8 * 1024)      // max. code size of one block
+#define MAX_BLK_INSTR   (64)            // max. number of instructions per block
+#define HOT_THRESHOLD   (16)            // number of block entries until compilation
+#define NO_BLOCK        (0xFF)          // 'hits' value for addresses without block
+#define SMC_FLAG        (0x80000000)
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// operand kinds
+#define OK_REG          (0)     // VM register
+#define OK_IMM          (1)     // constant value
+#define OK_ABS          (2)     // memory at constant address
+#define OK_IND          (3)     // memory at (register + offset), optional post-increment
+#define OK_SUM          (4)     // value (register + offset)
+
+// x86 registers
+#define EAX             (0)
+#define ECX             (1)
+#define EDX             (2)
+
+#define MODRM(mod, reg, rm)     (uint8_t)(((mod) << 6) | (((reg) & 7) << 3) | ((rm) & 7))
+#define REG_OFFS(r)             (uint8_t)(offsetof(vm16_t, regs) + 2 * (r))
+#define BP_OFFS                 (uint8_t)offsetof(vm16_t, bptr)
+#define TP_OFFS                 (uint8_t)offsetof(vm16_t, tptr)
+
+typedef uint32_t (*blk_func_t)(vm16_t *C, uint16_t *p_mem, uint8_t *p_codemap, vm16_dc_t *p_cache);
+
+typedef struct {
+    uint8_t kind;
+    uint8_t reg;
+    uint8_t postinc;
+    uint16_t val;       // value, address, or offset
+}opd_t;
+
+typedef struct {
+    uint8_t *p;         // write position
+    uint16_t mask;      // VM memory mask
+    uint32_t dirty;     // offset of the dirty page flags to the VM (rdi)
+    uint8_t *p_dirty;   // dirty page flags of the VM
+    bool rom;           // the VM has ROM pages (memory stores are checked)
+}emit_t;
+
+// the generated code invalidates decode cache entries with 'mov dword [r9+addr*8], 0'
+// and checks for fused instruction sequences with 'or r11b, [r9+addr*8+6]'
+_Static_assert(sizeof(vm16_dc_t) == 8, "decode cache entry size");
+_Static_assert(offsetof(vm16_dc_t, handler) == 0, "decode cache entry layout");
+_Static_assert(offsetof(vm16_dc_t, flags) == 6, "decode cache entry layout");
+// and marks the page as dirty with 'shr edx, 8'
+_Static_assert(VM16_PAGE_WORDS == 256, "page size");
+
+/*
+** Instruction decoding (as 'getaddr'/'getoprnd' in vm16core.c)
+*/
+static uint16_t fetch(vm16_t *C, uint16_t *p_pc) {
+    uint16_t val = C->memory[*p_pc & C->mem_mask];
+    (*p_pc)++;
+    return val;
+}
+
+static void set_opd(opd_t *p, uint8_t kind, uint8_t reg, uint8_t postinc, uint16_t val) {
+    p->kind = kind;
+    p->reg = reg;
+    p->postinc = postinc;
+    p->val = val;
+}
+
+// Returns false for PC as destination (has to be executed by the interpreter)
+static bool decode_dst(vm16_t *C, uint8_t addr_mod, uint16_t *p_pc, opd_t *p) {
+    switch(addr_mod) {
+        case AREG: case BREG: case CREG: case DREG:
+        case XREG: case YREG: case SPTR:
+            set_opd(p, OK_REG, addr_mod, 0, 0); return true;
+        case PCNT: return false;
+        case XIND: set_opd(p, OK_IND, XREG, 0, 0); return true;
+        case YIND: set_opd(p, OK_IND, YREG, 0, 0); return true;
+        case XINC: set_opd(p, OK_IND, XREG, 1, 0); return true;
+        case YINC: set_opd(p, OK_IND, YREG, 1, 0); return true;
+        case ABS:  set_opd(p, OK_ABS, 0, 0, fetch(C, p_pc) & C->mem_mask); return true;
+        case SREL: set_opd(p, OK_IND, SPTR, 0, fetch(C, p_pc)); return true;
+        case XREL: set_opd(p, OK_IND, XREG, 0, fetch(C, p_pc)); return true;
+        case YREL: set_opd(p, OK_IND, YREG, 0, fetch(C, p_pc)); return true;
+        default:   set_opd(p, OK_ABS, 0, 0, 0); return true;  // invalid
+    }
+}
+
+static void decode_src(vm16_t *C, uint8_t addr_mod, uint16_t *p_pc, opd_t *p) {
+    uint16_t offs;
+
+    switch(addr_mod) {
+        case AREG: case BREG: case CREG: case DREG:
+        case XREG: case YREG: case SPTR:
+            set_opd(p, OK_REG, addr_mod, 0, 0); break;
+        case PCNT: set_opd(p, OK_IMM, 0, 0, *p_pc); break;
+        case XIND: set_opd(p, OK_IND, XREG, 0, 0); break;
+        case YIND: set_opd(p, OK_IND, YREG, 0, 0); break;
+        case XINC: set_opd(p, OK_IND, XREG, 1, 0); break;
+        case YINC: set_opd(p, OK_IND, YREG, 1, 0); break;
+        case REG0: set_opd(p, OK_IMM, 0, 0, 0); break;
+        case REG1: set_opd(p, OK_IMM, 0, 0, 1); break;
+        case CNST: set_opd(p, OK_IMM, 0, 0, fetch(C, p_pc)); break;
+        case ABS:  set_opd(p, OK_ABS, 0, 0, fetch(C, p_pc) & C->mem_mask); break;
+        case REL:
+            offs = fetch(C, p_pc);
+            set_opd(p, OK_IMM, 0, 0, *p_pc + offs);
+            break;
+        case SREL: set_opd(p, OK_IND, SPTR, 0, fetch(C, p_pc)); break;
+        case REL2:
+            offs = fetch(C, p_pc);
+            set_opd(p, OK_IMM, 0, 0, *p_pc + offs - 2);
+            break;
+        case XREL: set_opd(p, OK_IND, XREG, 0, fetch(C, p_pc)); break;
+        case YREL: set_opd(p, OK_IND, YREG, 0, fetch(C, p_pc)); break;
+        case SRE2: set_opd(p, OK_SUM, SPTR, 0, fetch(C, p_pc)); break;
+        default:   set_opd(p, OK_IMM, 0, 0, 0); break;  // invalid
+    }
+}
+
+/*
+** Code emitter
+*/
+static inline void e8(emit_t *e, uint8_t val) {
+    *e->p++ = val;
+}
+
+static inline void e16(emit_t *e, uint16_t val) {
+    e8(e, (uint8_t)val);
+    e8(e, (uint8_t)(val >> 8));
+}
+
+static inline void e32(emit_t *e, uint32_t val) {
+    e16(e, (uint16_t)val);
+    e16(e, (uint16_t)(val >> 16));
+}
+
+// jcc/jmp rel8, returns the position of the displacement
+static uint8_t *jump8(emit_t *e, uint8_t opcode) {
+    e8(e, opcode);
+    e8(e, 0);
+    return e->p - 1;
+}
+
+static void patch8(emit_t *e, uint8_t *p_disp) {
+    *p_disp = (uint8_t)(e->p - (p_disp + 1));
+}
+
+// movzx reg, word [rdi + offs]
+static void load_field(emit_t *e, uint8_t reg, uint8_t offs) {
+    e8(e, 0x0F); e8(e, 0xB7); e8(e, MODRM(1, reg, 7)); e8(e, offs);
+}
+
+// mov word [rdi + offs], reg
+static void store_field(emit_t *e, uint8_t reg, uint8_t offs) {
+    e8(e, 0x66); e8(e, 0x89); e8(e, MODRM(1, reg, 7)); e8(e, offs);
+}
+
+// mov word [rdi + offs], imm16
+static void store_field_imm(emit_t *e, uint8_t offs, uint16_t val) {
+    e8(e, 0x66); e8(e, 0xC7); e8(e, MODRM(1, 0, 7)); e8(e, offs); e16(e, val);
+}
+
+// inc/dec word [rdi + offs]
+static void inc_field(emit_t *e, uint8_t offs) {
+    e8(e, 0x66); e8(e, 0xFF); e8(e, MODRM(1, 0, 7)); e8(e, offs);
+}
+
+static void dec_field(emit_t *e, uint8_t offs) {
+    e8(e, 0x66); e8(e, 0xFF); e8(e, MODRM(1, 1, 7)); e8(e, offs);
+}
+
+// and edx, mem_mask
+static void mask_edx(emit_t *e) {
+    e8(e, 0x81); e8(e, MODRM(3, 4, EDX)); e32(e, e->mask);
+}
+
+// edx = (reg + offs) & mem_mask, with optional post-increment of reg
+static void ind_address(emit_t *e, opd_t *p) {
+    load_field(e, EDX, REG_OFFS(p->reg));
+    if(p->val != 0) {
+        e8(e, 0x81); e8(e, MODRM(3, 0, EDX)); e32(e, p->val);
+    }
+    mask_edx(e);
+    if(p->postinc) {
+        inc_field(e, REG_OFFS(p->reg));
+    }
+}
+
+// reg = operand value (32 bit, zero extended)
+static void load_value(emit_t *e, uint8_t reg, opd_t *p) {
+    switch(p->kind) {
+        case OK_REG:
+            load_field(e, reg, REG_OFFS(p->reg));
+            break;
+        case OK_IMM:
+            e8(e, 0xB8 + reg); e32(e, p->val);
+            break;
+        case OK_ABS:    // movzx reg, word [rsi + addr*2]
+            e8(e, 0x0F); e8(e, 0xB7); e8(e, MODRM(2, reg, 6)); e32(e, p->val * 2);
+            break;
+        case OK_IND:    // movzx reg, word [rsi + rdx*2]
+            ind_address(e, p);
+            e8(e, 0x0F); e8(e, 0xB7); e8(e, MODRM(0, reg, 4)); e8(e, 0x56);
+            break;
+        default:        // OK_SUM
+            load_field(e, reg, REG_OFFS(p->reg));
+            e8(e, 0x81); e8(e, MODRM(3, 0, reg)); e32(e, p->val);
+            e8(e, 0x0F); e8(e, 0xB7); e8(e, MODRM(3, reg, reg));
+            break;
+    }
+}
+
+// determine the destination address (r10 = memory index for OK_IND)
+static void prepare_dst(emit_t *e, opd_t *p) {
+    if(p->kind == OK_IND) {
+        ind_address(e, p);
+        e8(e, 0x41); e8(e, 0x89); e8(e, MODRM(3, EDX, 2));  // mov r10d, edx
+    }
+}
+
+// ModR/M for the destination: [rdi + offs], [rsi + addr*2] or [rsi + r10*2]
+static void dst_modrm(emit_t *e, uint8_t reg, opd_t *p) {
+    switch(p->kind) {
+        case OK_REG: e8(e, MODRM(1, reg, 7)); e8(e, REG_OFFS(p->reg)); break;
+        case OK_ABS: e8(e, MODRM(2, reg, 6)); e32(e, p->val * 2); break;
+        default:     e8(e, MODRM(0, reg, 4)); e8(e, 0x56); break;  // needs REX.X
+    }
+}
+
+// movzx ecx, word [dst]
+static void load_dst(emit_t *e, opd_t *p) {
+    if(p->kind == OK_IND) e8(e, 0x42);
+    e8(e, 0x0F); e8(e, 0xB7); dst_modrm(e, ECX, p);
+}
+
+// mov byte [rdi + rdx + dirty], VM16_WRITTEN (edx = page)
+static void mark_page_edx(emit_t *e) {
+    e8(e, 0xC6); e8(e, 0x84); e8(e, 0x17); e32(e, e->dirty); e8(e, VM16_WRITTEN);
+}
+
+// A memory word was written: Mark the page as dirty, check for compiled
+// code or fused instructions and invalidate the decode cache entry.
+static void mark_dst(emit_t *e, opd_t *p) {
+    if(p->kind == OK_ABS) {
+        // mov byte [rdi + dirty + page], VM16_WRITTEN
+        e8(e, 0xC6); e8(e, MODRM(2, 0, 7)); e32(e, e->dirty + p->val / VM16_PAGE_WORDS); e8(e, VM16_WRITTEN);
+        // or r11b, [r8 + addr]
+        e8(e, 0x45); e8(e, 0x0A); e8(e, MODRM(2, 3, 0)); e32(e, p->val);
+        // or r11b, [r9 + addr*8 + 6]
+        e8(e, 0x45); e8(e, 0x0A); e8(e, MODRM(2, 3, 1)); e32(e, p->val * 8 + 6);
+        // mov dword [r9 + addr*8], 0
+        e8(e, 0x41); e8(e, 0xC7); e8(e, MODRM(2, 0, 1)); e32(e, p->val * 8); e32(e, 0);
+    } else if(p->kind == OK_IND) {
+        e8(e, 0x44); e8(e, 0x89); e8(e, 0xD2);  // mov edx, r10d
+        e8(e, 0xC1); e8(e, 0xEA); e8(e, 8);     // shr edx, 8
+        mark_page_edx(e);
+        // or r11b, [r8 + r10]
+        e8(e, 0x47); e8(e, 0x0A); e8(e, 0x1C); e8(e, 0x10);
+        // or r11b, [r9 + r10*8 + 6]
+        e8(e, 0x47); e8(e, 0x0A); e8(e, 0x5C); e8(e, 0xD1); e8(e, 0x06);
+        // mov dword [r9 + r10*8], 0
+        e8(e, 0x43); e8(e, 0xC7); e8(e, 0x04); e8(e, 0xD1); e32(e, 0);
+    }
+}
+
+// edx is changed
+static void mark_edx(emit_t *e) {
+    // or r11b, [r8 + rdx]
+    e8(e, 0x45); e8(e, 0x0A); e8(e, 0x1C); e8(e, 0x10);
+    // or r11b, [r9 + rdx*8 + 6]
+    e8(e, 0x45); e8(e, 0x0A); e8(e, 0x5C); e8(e, 0xD1); e8(e, 0x06);
+    // mov dword [r9 + rdx*8], 0
+    e8(e, 0x41); e8(e, 0xC7); e8(e, 0x04); e8(e, 0xD1); e32(e, 0);
+    e8(e, 0xC1); e8(e, 0xEA); e8(e, 8);         // shr edx, 8
+    mark_page_edx(e);
+}
+
+// test byte [rdi + r + dirty], VM16_ROM (r = page)
+static void test_rom(emit_t *e, uint8_t reg) {
+    e8(e, 0xF6); e8(e, 0x84); e8(e, (uint8_t)((reg << 3) | 7)); e32(e, e->dirty); e8(e, VM16_ROM);
+}
+
+// mov word [dst], cx (stores to ROM pages are skipped)
+static void store_dst(emit_t *e, opd_t *p) {
+    uint8_t *p_disp = NULL;
+
+    if((p->kind == OK_ABS) && (e->p_dirty[p->val / VM16_PAGE_WORDS] & VM16_ROM)) {
+        return;
+    }
+    if((p->kind == OK_IND) && e->rom) {
+        e8(e, 0x44); e8(e, 0x89); e8(e, 0xD2);  // mov edx, r10d
+        e8(e, 0xC1); e8(e, 0xEA); e8(e, 8);     // shr edx, 8
+        test_rom(e, EDX);
+        p_disp = jump8(e, 0x75);                // jnz
+    }
+    e8(e, 0x66);
+    if(p->kind == OK_IND) e8(e, 0x42);
+    e8(e, 0x89); dst_modrm(e, ECX, p);
+    mark_dst(e, p);
+    if(p_disp != NULL) {
+        patch8(e, p_disp);
+    }
+}
+
+// Skip the stack store (at edx) and 'mark_edx', if the page is ROM (ecx is changed)
+static uint8_t *skip_rom_edx(emit_t *e) {
+    if(e->rom) {
+        e8(e, 0x89); e8(e, 0xD1);               // mov ecx, edx
+        e8(e, 0xC1); e8(e, 0xE9); e8(e, 8);     // shr ecx, 8
+        test_rom(e, ECX);
+        return jump8(e, 0x75);                  // jnz
+    }
+    return NULL;
+}
+
+// tptr = MIN(tptr, edx)
+static void update_tptr(emit_t *e) {
+    uint8_t *p_disp;
+
+    load_field(e, ECX, TP_OFFS);
+    e8(e, 0x39); e8(e, MODRM(3, ECX, EDX));     // cmp edx, ecx
+    p_disp = jump8(e, 0x73);                    // jae
+    store_field(e, EDX, TP_OFFS);
+    patch8(e, p_disp);
+}
+
+// Leave the block if compiled code was written
+static void smc_exit(emit_t *e, uint16_t next_pc, uint32_t cnt) {
+    uint8_t *p_disp;
+
+    e8(e, 0x45); e8(e, 0x84); e8(e, 0xDB);      // test r11b, r11b
+    p_disp = jump8(e, 0x74);                    // jz
+    store_field_imm(e, REG_OFFS(PCNT), next_pc);
+    e8(e, 0xB8); e32(e, cnt | SMC_FLAG);        // mov eax, cnt
+    e8(e, 0xC3);                                // ret
+    patch8(e, p_disp);
+}
+
+static void block_return(emit_t *e, uint32_t cnt) {
+    uint8_t *p_disp;
+
+    e8(e, 0xB8); e32(e, cnt);                   // mov eax, cnt
+    e8(e, 0x45); e8(e, 0x84); e8(e, 0xDB);      // test r11b, r11b
+    p_disp = jump8(e, 0x74);                    // jz
+    e8(e, 0x0D); e32(e, SMC_FLAG);              // or eax, SMC_FLAG
+    patch8(e, p_disp);
+    e8(e, 0xC3);                                // ret
+}
+
+// PC = taken ? ax : next_pc ('cc' is the jcc opcode for "not taken")
+static void branch(emit_t *e, uint8_t cc, uint16_t next_pc) {
+    uint8_t *p_disp1, *p_disp2;
+
+    p_disp1 = jump8(e, cc);
+    store_field(e, EAX, REG_OFFS(PCNT));
+    p_disp2 = jump8(e, 0xEB);
+    patch8(e, p_disp1);
+    store_field_imm(e, REG_OFFS(PCNT), next_pc);
+    patch8(e, p_disp2);
+}
+
+// PC = skip ? next_pc + 2 : next_pc ('cc' is the jcc opcode for "no skip")
+static void skip(emit_t *e, uint8_t cc, uint16_t next_pc) {
+    uint8_t *p_disp1, *p_disp2;
+
+    p_disp1 = jump8(e, cc);
+    store_field_imm(e, REG_OFFS(PCNT), next_pc + 2);
+    p_disp2 = jump8(e, 0xEB);
+    patch8(e, p_disp1);
+    store_field_imm(e, REG_OFFS(PCNT), next_pc);
+    patch8(e, p_disp2);
+}
+
+#define INSTR_NONE      (0)     // not compilable
+#define INSTR_NEXT      (1)     // block continues
+#define INSTR_LAST      (2)     // block ends with this instruction
+
+/*
+** Compile one instruction. 'cnt' is the number of block instructions
+** inclusive this one.
+*/
+static int compile_instr(emit_t *e, vm16_t *C, uint16_t *p_pc, uint32_t cnt) {
+    uint16_t code = fetch(C, p_pc);
+    uint8_t opcode = (uint8_t)((code >> 10) & 0x003f);
+    uint8_t addr_mode1 = (uint8_t)((code >>  5) & 0x001f);
+    uint8_t addr_mode2 = (uint8_t)((code >>  0) & 0x001f);
+    uint8_t *p_disp;
+    opd_t opd1, opd2;
+
+    switch(opcode) {
+        case MOVE: case ADD: case SUB: case MUL: case DIV: case MOD:
+        case AND: case OR: case XOR: case SHL: case SHR:
+        case ADDC: case MULC: case MSB:
+            if(!decode_dst(C, addr_mode1, p_pc, &opd1)) {
+                return INSTR_NONE;
+            }
+            decode_src(C, addr_mode2, p_pc, &opd2);
+            prepare_dst(e, &opd1);
+            load_value(e, EAX, &opd2);
+            if(opcode != MOVE && opcode != MSB) {
+                load_dst(e, &opd1);
+            }
+            p_disp = NULL;
+            switch(opcode) {
+                case MOVE: e8(e, 0x89); e8(e, 0xC1); break;                 // mov ecx, eax
+                case ADD:  e8(e, 0x01); e8(e, 0xC1); break;                 // add ecx, eax
+                case SUB:  e8(e, 0x29); e8(e, 0xC1); break;                 // sub ecx, eax
+                case AND:  e8(e, 0x21); e8(e, 0xC1); break;                 // and ecx, eax
+                case OR:   e8(e, 0x09); e8(e, 0xC1); break;                 // or ecx, eax
+                case XOR:  e8(e, 0x31); e8(e, 0xC1); break;                 // xor ecx, eax
+                case ADDC: e8(e, 0x01); e8(e, 0xC1); break;                 // add ecx, eax
+                case MUL:
+                case MULC: e8(e, 0x0F); e8(e, 0xAF); e8(e, 0xC8); break;    // imul ecx, eax
+                case SHL:
+                case SHR:
+                    e8(e, 0x91);                                            // xchg eax, ecx
+                    e8(e, 0xD3); e8(e, opcode == SHL ? 0xE0 : 0xE8);        // shl/shr eax, cl
+                    e8(e, 0x89); e8(e, 0xC1);                               // mov ecx, eax
+                    break;
+                case DIV:
+                case MOD:
+                    e8(e, 0x85); e8(e, 0xC0);                               // test eax, eax
+                    p_disp = jump8(e, 0x74);                                // jz (no store)
+                    e8(e, 0x91);                                            // xchg eax, ecx
+                    e8(e, 0x31); e8(e, 0xD2);                               // xor edx, edx
+                    e8(e, 0xF7); e8(e, 0xF1);                               // div ecx
+                    e8(e, 0x89); e8(e, opcode == DIV ? 0xC1 : 0xD1);        // mov ecx, eax/edx
+                    break;
+                default:    // MSB
+                    e8(e, 0x31); e8(e, 0xC9);                               // xor ecx, ecx
+                    e8(e, 0x85); e8(e, 0xC0);                               // test eax, eax
+                    e8(e, 0x74); e8(e, 5);                                  // jz +5
+                    e8(e, 0x0F); e8(e, 0xBD); e8(e, 0xC8);                  // bsr ecx, eax
+                    e8(e, 0xFF); e8(e, 0xC1);                               // inc ecx
+                    break;
+            }
+            store_dst(e, &opd1);
+            if(p_disp != NULL) {
+                patch8(e, p_disp);
+            }
+            if(opcode == ADDC || opcode == MULC) {
+                e8(e, 0xC1); e8(e, 0xE9); e8(e, 16);                        // shr ecx, 16
+                store_field(e, ECX, REG_OFFS(BREG));
+            }
+            if(opd1.kind != OK_REG) {
+                smc_exit(e, *p_pc, cnt);
+            }
+            return INSTR_NEXT;
+
+        case INC: case DEC: case NOT: case SWAP:
+            if(!decode_dst(C, addr_mode1, p_pc, &opd1)) {
+                return INSTR_NONE;
+            }
+            prepare_dst(e, &opd1);
+            load_dst(e, &opd1);
+            switch(opcode) {
+                case INC: e8(e, 0xFF); e8(e, 0xC1); break;                  // inc ecx
+                case DEC: e8(e, 0xFF); e8(e, 0xC9); break;                  // dec ecx
+                case NOT: e8(e, 0xF7); e8(e, 0xD1); break;                  // not ecx
+                default:  e8(e, 0x66); e8(e, 0xC1); e8(e, 0xC1); e8(e, 8);  // rol cx, 8
+            }
+            store_dst(e, &opd1);
+            if(opd1.kind != OK_REG) {
+                smc_exit(e, *p_pc, cnt);
+            }
+            return INSTR_NEXT;
+
+        case POP:
+            if(!decode_dst(C, addr_mode1, p_pc, &opd1)) {
+                return INSTR_NONE;
+            }
+            prepare_dst(e, &opd1);
+            load_field(e, EDX, REG_OFFS(SPTR));
+            mask_edx(e);
+            e8(e, 0x0F); e8(e, 0xB7); e8(e, 0x0C); e8(e, 0x56);             // movzx ecx, [rsi+rdx*2]
+            store_dst(e, &opd1);
+            inc_field(e, REG_OFFS(SPTR));
+            if(opd1.kind != OK_REG) {
+                smc_exit(e, *p_pc, cnt);
+            }
+            return INSTR_NEXT;
+
+        case PUSH:
+            decode_src(C, addr_mode1, p_pc, &opd1);
+            load_value(e, EAX, &opd1);
+            dec_field(e, REG_OFFS(SPTR));
+            load_field(e, EDX, REG_OFFS(SPTR));
+            update_tptr(e);
+            mask_edx(e);
+            p_disp = skip_rom_edx(e);
+            e8(e, 0x66); e8(e, 0x89); e8(e, 0x04); e8(e, 0x56);             // mov [rsi+rdx*2], ax
+            mark_edx(e);
+            if(p_disp != NULL) {
+                patch8(e, p_disp);
+            }
+            smc_exit(e, *p_pc, cnt);
+            return INSTR_NEXT;
+
+        case JUMP:
+            decode_src(C, addr_mode1, p_pc, &opd1);
+            load_value(e, EAX, &opd1);
+            store_field(e, EAX, REG_OFFS(PCNT));
+            return INSTR_LAST;
+
+        case CALL:
+            decode_src(C, addr_mode1, p_pc, &opd1);
+            load_value(e, EAX, &opd1);
+            dec_field(e, REG_OFFS(SPTR));
+            load_field(e, EDX, REG_OFFS(SPTR));
+            mask_edx(e);
+            p_disp = skip_rom_edx(e);
+            e8(e, 0x66); e8(e, 0xC7); e8(e, 0x04); e8(e, 0x56); e16(e, *p_pc);  // mov [rsi+rdx*2], pc
+            mark_edx(e);
+            if(p_disp != NULL) {
+                patch8(e, p_disp);
+            }
+            store_field(e, EAX, REG_OFFS(PCNT));
+            load_field(e, EDX, REG_OFFS(SPTR));
+            store_field(e, EDX, BP_OFFS);
+            update_tptr(e);
+            return INSTR_LAST;
+
+        case RETN:
+            load_field(e, EDX, REG_OFFS(SPTR));
+            mask_edx(e);
+            e8(e, 0x0F); e8(e, 0xB7); e8(e, 0x04); e8(e, 0x56);             // movzx eax, [rsi+rdx*2]
+            inc_field(e, REG_OFFS(SPTR));
+            store_field(e, EAX, REG_OFFS(PCNT));
+            load_field(e, EDX, REG_OFFS(SPTR));
+            store_field(e, EDX, BP_OFFS);
+            return INSTR_LAST;
+
+        case BNZE: case BZE: case BPOS: case BNEG:
+        case SKNE: case SKEQ: case SKLT: case SKGT:
+            decode_src(C, addr_mode1, p_pc, &opd1);
+            decode_src(C, addr_mode2, p_pc, &opd2);
+            load_value(e, ECX, &opd1);
+            load_value(e, EAX, &opd2);
+            switch(opcode) {
+                case BNZE:
+                    e8(e, 0x85); e8(e, 0xC9);                               // test ecx, ecx
+                    branch(e, 0x74, *p_pc);                                 // jz
+                    break;
+                case BZE:
+                    e8(e, 0x85); e8(e, 0xC9);                               // test ecx, ecx
+                    branch(e, 0x75, *p_pc);                                 // jnz
+                    break;
+                case BPOS:
+                    e8(e, 0x81); e8(e, 0xF9); e32(e, 0x7FFF);               // cmp ecx, 0x7FFF
+                    branch(e, 0x77, *p_pc);                                 // ja
+                    break;
+                case BNEG:
+                    e8(e, 0x81); e8(e, 0xF9); e32(e, 0x7FFF);               // cmp ecx, 0x7FFF
+                    branch(e, 0x76, *p_pc);                                 // jbe
+                    break;
+                case SKNE:
+                    e8(e, 0x39); e8(e, 0xC1);                               // cmp ecx, eax
+                    skip(e, 0x74, *p_pc);                                   // je
+                    break;
+                case SKEQ:
+                    e8(e, 0x39); e8(e, 0xC1);                               // cmp ecx, eax
+                    skip(e, 0x75, *p_pc);                                   // jne
+                    break;
+                case SKLT:
+                    e8(e, 0x39); e8(e, 0xC1);                               // cmp ecx, eax
+                    skip(e, 0x73, *p_pc);                                   // jae
+                    break;
+                default:    // SKGT
+                    e8(e, 0x39); e8(e, 0xC1);                               // cmp ecx, eax
+                    skip(e, 0x76, *p_pc);                                   // jbe
+                    break;
+            }
+            return INSTR_LAST;
+
+        case DBNZ:
+            if(!decode_dst(C, addr_mode1, p_pc, &opd1)) {
+                return INSTR_NONE;
+            }
+            decode_src(C, addr_mode2, p_pc, &opd2);
+            prepare_dst(e, &opd1);
+            load_dst(e, &opd1);
+            e8(e, 0xFF); e8(e, 0xC9);                                       // dec ecx
+            store_dst(e, &opd1);
+            load_value(e, EAX, &opd2);
+            if(opd1.kind == OK_REG) {
+                load_dst(e, &opd1);     // register changed by a post-increment of the source
+            }
+            e8(e, 0x85); e8(e, 0xC9);                                       // test ecx, ecx
+            branch(e, 0x74, *p_pc);                                         // jz
+            return INSTR_LAST;
+
+        default:
+            return INSTR_NONE;
+    }
+}
+
+static bool has_rom(const uint8_t *p_dirty, uint32_t num_pages) {
+    for(uint32_t i = 0; i < num_pages; i++) {
+        if(p_dirty[i] & VM16_ROM) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool compile_block(vm16_jit_t *p_jit, vm16_t *C, vm16_blk_t *p_blk) {
+    uint16_t start_pc = C->pcnt;
+    uint16_t pc = start_pc;
+    uint32_t cnt = 0;
+    uint32_t words;
+    int res = INSTR_NONE;
+    emit_t e;
+
+    if(p_jit->code_pos + MAX_BLK_CODE > CODE_SIZE) {
+        vm16_jit_flush(p_jit);
+    }
+    e.p = p_jit->p_code + p_jit->code_pos;
+    e.mask = C->mem_mask;
+    e.dirty = p_jit->dirty_offs;
+    e.p_dirty = (uint8_t *)C + p_jit->dirty_offs;
+    e.rom = has_rom(e.p_dirty, ((uint32_t)C->mem_mask + VM16_PAGE_WORDS) / VM16_PAGE_WORDS);
+
+    e8(&e, 0x49); e8(&e, 0x89); e8(&e, 0xD0);  // mov r8, rdx
+    e8(&e, 0x49); e8(&e, 0x89); e8(&e, 0xC9);  // mov r9, rcx
+    e8(&e, 0x45); e8(&e, 0x31); e8(&e, 0xDB);  // xor r11d, r11d
+
+    while(cnt < MAX_BLK_INSTR) {
+        uint16_t next_pc = pc;
+        uint8_t *p_start = e.p;
+
+        res = compile_instr(&e, C, &next_pc, cnt + 1);
+        if(res == INSTR_NONE) {
+            e.p = p_start;
+            break;
+        }
+        cnt++;
+        pc = next_pc;
+        if(res == INSTR_LAST) {
+            break;
+        }
+    }
+    if(cnt == 0) {
+        return false;
+    }
+    if(res != INSTR_LAST) {
+        store_field_imm(&e, REG_OFFS(PCNT), pc);
+    }
+    block_return(&e, cnt);
+
+    // mark the block instruction words
+    words = MIN((uint16_t)(pc - start_pc), p_jit->mem_size);
+    for(uint32_t i = 0; i < words; i++) {
+        p_jit->p_codemap[(uint16_t)(start_pc + i) & p_jit->mem_mask] = 1;
+    }
+    p_blk->offs = p_jit->code_pos;
+    p_blk->pc = start_pc;
+    p_blk->len = (uint8_t)cnt;
+    p_jit->code_pos = (uint32_t)(e.p - p_jit->p_code + 15) & ~15;
+    return true;
+}
+
+// Compile the block with a writable code buffer (W^X)
+static bool compile(vm16_jit_t *p_jit, vm16_t *C, vm16_blk_t *p_blk) {
+    bool res;
+
+    if(mprotect(p_jit->p_code, CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    res = compile_block(p_jit, C, p_blk);
+    if(mprotect(p_jit->p_code, CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        // no block can be executed
+        vm16_jit_flush(p_jit);
+        return false;
+    }
+    return res;
+}
+
+vm16_jit_t *vm16_jit_create(uint32_t mem_size, uint32_t dirty_offs) {
+    vm16_jit_t *p_jit = (vm16_jit_t *)calloc(1, sizeof(vm16_jit_t));
+    if(p_jit != NULL) {
+        p_jit->p_code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_EXEC,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        p_jit->p_blocks = (vm16_blk_t *)calloc(mem_size, sizeof(vm16_blk_t));
+        p_jit->p_codemap = (uint8_t *)calloc(mem_size, 1);
+        p_jit->mem_size = mem_size;
+        p_jit->mem_mask = mem_size - 1;
+        p_jit->dirty_offs = dirty_offs;
+        p_jit->code_pos = CODE_START;
+        if((p_jit->p_code == MAP_FAILED) || (p_jit->p_blocks == NULL) || (p_jit->p_codemap == NULL)) {
+            if(p_jit->p_code == MAP_FAILED) {
+                p_jit->p_code = NULL;
+            }
+            vm16_jit_destroy(p_jit);
+            return NULL;
+        }
+    }
+    return p_jit;
+}
+
+void vm16_jit_destroy(vm16_jit_t *p_jit) {
+    if(p_jit != NULL) {
+        if(p_jit->p_code != NULL) {
+            munmap(p_jit->p_code, CODE_SIZE);
+        }
+        free(p_jit->p_blocks);
+        free(p_jit->p_codemap);
+        free(p_jit);
+    }
+}
+
+void vm16_jit_flush(vm16_jit_t *p_jit) {
+    memset(p_jit->p_blocks, 0, p_jit->mem_size * sizeof(vm16_blk_t));
+    memset(p_jit->p_codemap, 0, p_jit->mem_size);
+    p_jit->code_pos = CODE_START;
+    p_jit->num_flush++;
+}
+
+uint32_t vm16_jit_run(vm16_jit_t *p_jit, vm16_t *C, vm16_dc_t *p_cache, uint32_t num) {
+    uint32_t total = 0;
+
+    while(1) {
+        vm16_blk_t *p_blk = &p_jit->p_blocks[C->pcnt & p_jit->mem_mask];
+        uint32_t res, cnt;
+
+        if(p_blk->pc != C->pcnt) {
+            // address is used with another PC value (memory mirror)
+            p_blk->pc = C->pcnt;
+            p_blk->offs = 0;
+            p_blk->hits = 0;
+        }
+        if(p_blk->offs == 0) {
+            if((p_blk->hits == NO_BLOCK) || (++p_blk->hits < HOT_THRESHOLD)) {
+                return total;
+            }
+            if(!compile(p_jit, C, p_blk)) {
+                p_blk->hits = NO_BLOCK;
+                return total;
+            }
+        }
+        if(p_blk->len > num) {
+            return total;
+        }
+        res = ((blk_func_t)(p_jit->p_code + p_blk->offs))(C, C->memory, p_jit->p_codemap, p_cache);
+        cnt = res & ~SMC_FLAG;
+        total += cnt;
+        num -= cnt;
+        if(res & SMC_FLAG) {
+            // compiled code or a fused instruction sequence was written
+            vm16_jit_flush(p_jit);
+            memset(p_cache, 0, p_jit->mem_size * sizeof(vm16_dc_t));
+            return total;
+        }
+    }
+}
+
+#else
+
+vm16_jit_t *vm16_jit_create(uint32_t mem_size, uint32_t dirty_offs) {
+    return NULL;
+}
+
+void vm16_jit_destroy(vm16_jit_t *p_jit) {
+}
+
+void vm16_jit_flush(vm16_jit_t *p_jit) {
+}
+
+uint32_t vm16_jit_run(vm16_jit_t *p_jit, vm16_t *C, vm16_dc_t *p_cache, uint32_t num) {
+    return 0;
+}
+
+#endif
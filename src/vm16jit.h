@@ -0,0 +1,86 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Basic block JIT compiler for x86-64 (internal, used by vm16core.c)
+*/
+
+#ifndef vm16jit_h
+#define vm16jit_h
+
+#include "vm16.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__unix__) && !defined(VM16_NO_JIT)
+#define VM16_JIT
+#endif
+
+typedef struct {
+    uint32_t offs;          // code offset in the code buffer (0 = no block)
+    uint16_t pc;            // block start address (PC value)
+    uint8_t  len;           // number of instructions
+    uint8_t  hits;          // hotness counter
+}vm16_blk_t;
+
+typedef struct vm16_jit_s {
+    uint8_t *p_code;        // executable code buffer
+    uint32_t code_pos;      // next free code byte
+    uint32_t num_flush;     // statistics
+    vm16_blk_t *p_blocks;   // block per memory address
+    uint8_t *p_codemap;     // 1 = memory word is part of a compiled block
+    uint32_t mem_size;
+    uint16_t mem_mask;
+    uint32_t dirty_offs;    // offset of the dirty page flags ('vm16_rt_t') to the VM
+}vm16_jit_t;
+
+/*
+** Allocate the JIT data for a VM with given memory size.
+** 'dirty_offs' is the offset of the dirty page flags to the VM.
+** Returns NULL if the JIT is not available.
+*/
+vm16_jit_t *vm16_jit_create(uint32_t mem_size, uint32_t dirty_offs);
+
+/*
+** Free all JIT data
+*/
+void vm16_jit_destroy(vm16_jit_t *p_jit);
+
+/*
+** Delete all compiled blocks
+*/
+void vm16_jit_flush(vm16_jit_t *p_jit);
+
+/*
+** Execute compiled blocks, starting at the current PC, as long as
+** blocks are available and the remaining 'num' cycles are sufficient.
+** Cold blocks are compiled when they become hot.
+** Returns the number of executed instructions (cycles).
+*/
+uint32_t vm16_jit_run(vm16_jit_t *p_jit, vm16_t *C, vm16_dc_t *p_cache, uint32_t num);
+
+/*
+** The memory word at 'addr' will be written (by the interpreter or the API).
+*/
+static inline void vm16_jit_invalidate(vm16_jit_t *p_jit, uint16_t addr) {
+    if(p_jit->p_codemap[addr] != 0) {
+        vm16_jit_flush(p_jit);
+    }
+}
+
+#endif
@@ -23,10 +23,24 @@ along with VM16.  If not, see <https://www.gnu.org/licenses/>.
 #include "lauxlib.h"
 
 #include "vm16.h"
+#include "vm16sched.h"
+#include "vm16reg.h"
+#include "vm16pool.h"
+#include "vm16ser.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+#define VM16_MAX_THREADS    (64)
+#define OUT_CHUNK           (256)  // records per 'vm16_read_..._buffer' call
+#define MEM_CHUNK           (256)  // words per 'vm16_read_mem' call
+#define POOL_LIMIT          (16 * 1024 * 1024)  // default size of the cached VM blocks
+
+static vm16_sched_t *p_sched = NULL;   // thread pool for 'run_batch'
+static vm16_reg_t *p_reg = NULL;       // active VMs (see 'register_vm')
+static vm16_pool_t *p_pool = NULL;     // VM blocks (see 'init')
+static vm16_ser_t *p_ser = NULL;       // background serializer (see 'serialize')
+
 
 static void setfield(lua_State *L, const char *reg, int value) {
     lua_pushstring(L, reg);
@@ -40,10 +54,22 @@ static void setstrfield(lua_State *L, const char *reg, const char *s) {
     lua_settable(L, -3);
 }
 
+// The VM userdata is a pointer to the VM block from the pool
+static vm16_t *check_vm_at(lua_State *L, int idx) {
+    vm16_t **pp_vm = (vm16_t **)luaL_checkudata(L, idx, "vm16.cpu_dump");
+    luaL_argcheck(L, *pp_vm != NULL, idx, "VM is freed");
+    return *pp_vm;
+}
+
 static vm16_t *check_vm(lua_State *L) {
-    void *ud = luaL_checkudata(L, 1, "vm16.cpu_dump");
-    luaL_argcheck(L, ud != NULL, 1, "'vm16 object' expected");
-    return (vm16_t*)ud;
+    return check_vm_at(L, 1);
+}
+
+static vm16_pool_t *get_pool(void) {
+    if(p_pool == NULL) {
+        p_pool = vm16_pool_create(POOL_LIMIT);
+    }
+    return p_pool;
 }
 
 static int version(lua_State *L) {
@@ -53,9 +79,9 @@ static int version(lua_State *L) {
 
 static int init(lua_State *L) {
     lua_Integer size = luaL_checkinteger(L, 1);
-    uint32_t nbytes = vm16_calc_size(size);
-    vm16_t *C = (vm16_t *)lua_newuserdata(L, nbytes);
-    if((C != NULL) && vm16_init(C, nbytes)) {
+    vm16_t **pp_vm = (vm16_t **)lua_newuserdata(L, sizeof(vm16_t *));
+    *pp_vm = (get_pool() != NULL) ? vm16_pool_alloc(p_pool, MAX(size, 0)) : NULL;
+    if(*pp_vm != NULL) {
         luaL_getmetatable(L, "vm16.cpu_dump");
         lua_setmetatable(L, -2);
         return 1;
@@ -64,12 +90,171 @@ static int init(lua_State *L) {
     return 0;
 }
 
+/*
+** clone(vm)
+** Return a new VM with the registers and memory of 'vm' (without I/O
+** handlers). The memory pages are shared copy-on-write, if supported.
+*/
+static int clone(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    vm16_t **pp_vm = (vm16_t **)lua_newuserdata(L, sizeof(vm16_t *));
+    *pp_vm = vm16_pool_clone(p_pool, C);
+    if(*pp_vm != NULL) {
+        luaL_getmetatable(L, "vm16.cpu_dump");
+        lua_setmetatable(L, -2);
+        return 1;
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+/*
+** rom(h16)
+** Return a ROM image (userdata) with the H16 data, to be mapped into
+** any number of VMs (see 'map_rom'), or nil on error.
+*/
+static int rom(lua_State *L) {
+    size_t size;
+    char *p_data = (char*)luaL_checklstring(L, 1, &size);
+    vm16_rom_t **pp_rom = (vm16_rom_t **)lua_newuserdata(L, sizeof(vm16_rom_t *));
+    *pp_rom = vm16_rom_create(p_data);
+    if(*pp_rom != NULL) {
+        luaL_getmetatable(L, "vm16.rom");
+        lua_setmetatable(L, -2);
+        return 1;
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+static int release_rom(lua_State *L) {
+    vm16_rom_t **pp_rom = (vm16_rom_t **)luaL_checkudata(L, 1, "vm16.rom");
+    vm16_rom_release(*pp_rom);
+    *pp_rom = NULL;
+    return 0;
+}
+
+static vm16_rom_t *check_rom(lua_State *L, int idx) {
+    vm16_rom_t **pp_rom = (vm16_rom_t **)luaL_checkudata(L, idx, "vm16.rom");
+    luaL_argcheck(L, *pp_rom != NULL, idx, "ROM expected");
+    return *pp_rom;
+}
+
+/*
+** map_rom(vm, rom)
+** Map the ROM read-only into the VM memory (writes are ignored).
+** Returns false, if the ROM doesn't fit into the VM memory.
+*/
+static int map_rom(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    vm16_rom_t *p_rom = check_rom(L, 2);
+    lua_pushboolean(L, vm16_pool_map_rom(C, p_rom));
+    return 1;
+}
+
+/*
+** rom_info(rom)
+** Return start address and size (words) of the ROM
+*/
+static int rom_info(lua_State *L) {
+    uint32_t size;
+    uint16_t addr = vm16_rom_addr(check_rom(L, 1), &size);
+    lua_pushinteger(L, addr);
+    lua_pushinteger(L, size);
+    return 2;
+}
+
+/*
+** free(vm)
+** Return the VM block to the pool without waiting for the GC.
+** The VM can't be used afterwards.
+*/
+static int release(lua_State *L) {
+    vm16_t **pp_vm = (vm16_t **)luaL_checkudata(L, 1, "vm16.cpu_dump");
+    vm16_pool_free(p_pool, *pp_vm);
+    *pp_vm = NULL;
+    return 0;
+}
+
+/*
+** pool_limit(bytes)
+** Set the size of the cached free VM blocks.
+*/
+static int pool_limit(lua_State *L) {
+    lua_Integer bytes = luaL_checkinteger(L, 1);
+    if(get_pool() != NULL) {
+        vm16_pool_set_limit(p_pool, (uint32_t)MAX(bytes, 0));
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+** pool_stats()
+** Returns {[mem_size] = {in_use = n, cached = n, allocs = n, reused = n}}
+** for the used memory sizes (in words).
+*/
+static int pool_stats(lua_State *L) {
+    lua_newtable(L);
+    for(uint32_t i = 0; (p_pool != NULL) && (i < VM16_POOL_CLASSES); i++) {
+        vm16_pool_stats_t stats;
+        if(vm16_pool_stats(p_pool, i, &stats) && (stats.allocs > 0)) {
+            lua_createtable(L, 0, 5);
+            setfield(L, "block_size", stats.block_size);
+            setfield(L, "in_use", stats.in_use);
+            setfield(L, "cached", stats.cached);
+            setfield(L, "allocs", stats.allocs);
+            setfield(L, "reused", stats.reused);
+            lua_rawseti(L, -2, 64 << i);
+        }
+    }
+    return 1;
+}
+
+static int decode_cache(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    int enable = lua_toboolean(L, 2);
+    lua_pushboolean(L, vm16_set_decode_cache(C, enable));
+    return 1;
+}
+
+static int jit(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    int enable = lua_toboolean(L, 2);
+    lua_pushboolean(L, vm16_set_jit(C, enable));
+    return 1;
+}
+
+static int fusion_report(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    int reset = lua_toboolean(L, 2);
+    uint32_t hits[VM16_NUM_FUSIONS];
+    uint32_t num = vm16_get_fusion_stats(C, VM16_NUM_FUSIONS, hits, reset);
+    lua_newtable(L);
+    for(uint32_t i = 0; i < num; i++) {
+        lua_pushinteger(L, hits[i]);
+        lua_setfield(L, -2, vm16_fusion_name(i));
+    }
+    return 1;
+}
+
 static int mem_size(lua_State *L) {
     vm16_t *C = check_vm(L);
     lua_pushinteger(L, C->mem_size);
     return 1;
 }
 
+/*
+** mem_usage(vm)
+** Returns the number of bytes used by the VM (see 'vm16_get_mem_usage').
+*/
+static int mem_usage(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    lua_pushinteger(L, vm16_get_mem_usage(C));
+    return 1;
+}
+
 static int set_pc(lua_State *L) {
     vm16_t *C = check_vm(L);
     lua_Integer addr = luaL_checkinteger(L, 2);
@@ -131,19 +316,184 @@ static int set_vm(lua_State *L) {
     return 1;
 }
 
+/*
+** get_snapshot(vm[, compressed])
+** Returns the binary snapshot of the VM as string.
+*/
+static int get_snapshot(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    bool compressed = lua_toboolean(L, 2);
+    uint32_t size = compressed ? vm16_get_compressed_size(C) : vm16_get_snapshot_size(C);
+    if(size > 0) {
+        uint8_t *p_data = (uint8_t*)malloc(size);
+        if(p_data != NULL) {
+            size = compressed ? vm16_get_compressed(C, size, p_data) : vm16_get_snapshot(C, size, p_data);
+            if(size > 0) {
+                lua_pushlstring(L, (const char *)p_data, size);
+                free(p_data);
+                return 1;
+            }
+            free(p_data);
+        }
+    }
+    return 0;
+}
+
+/*
+** set_snapshot(vm, s[, lazy])
+** Restore the VM from a binary snapshot, or from the ASCII string of 'get_vm'.
+** With 'lazy', the pages of a compressed snapshot are decoded on first access.
+*/
+static int set_snapshot(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    size_t size;
+    const uint8_t *p_data = (const uint8_t*)luaL_checklstring(L, 2, &size);
+    uint32_t res;
+    if(vm16_is_snapshot(size, p_data)) {
+        if(lua_toboolean(L, 3)) {
+            res = vm16_set_snapshot_lazy(C, size, p_data);
+        } else {
+            res = vm16_set_snapshot(C, size, p_data);
+        }
+    } else {
+        res = vm16_set_vm_as_str(C, size, (char*)p_data);
+    }
+    lua_pushboolean(L, size == res);
+    return 1;
+}
+
+/*
+** get_delta(vm)
+** Returns the delta snapshot (pages written since the last checkpoint) as string.
+*/
+static int get_delta(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint32_t size = vm16_get_compressed_size(C);
+    if(size > 0) {
+        uint8_t *p_data = (uint8_t*)malloc(size);
+        if(p_data != NULL) {
+            size = vm16_get_delta(C, size, p_data);
+            if(size > 0) {
+                lua_pushlstring(L, (const char *)p_data, size);
+                free(p_data);
+                return 1;
+            }
+            free(p_data);
+        }
+    }
+    return 0;
+}
+
+/*
+** dirty_pages(vm[, since_delta])
+** Returns the list of memory pages (numbers from 0), which are written since
+** the last checkpoint (or since the last delta), and the number of pages.
+*/
+static int dirty_pages(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint8_t flags = lua_toboolean(L, 2) ? VM16_DIRTY_DELTA : VM16_DIRTY_CHECKPOINT;
+    uint8_t pages[VM16_MAX_PAGES];
+    uint32_t num = vm16_get_dirty_pages(C, flags, pages);
+    lua_createtable(L, num, 0);
+    for(uint32_t i = 0; i < num; i++) {
+        lua_pushinteger(L, pages[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, ((uint32_t)C->mem_mask + VM16_PAGE_WORDS) / VM16_PAGE_WORDS);
+    return 2;
+}
+
+static int checkpoint(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    vm16_checkpoint(C);
+    return 0;
+}
+
+/*
+** pending_pages(vm)
+** Returns the number of memory pages, which are not decoded so far (lazy restore).
+*/
+static int pending_pages(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    lua_pushinteger(L, vm16_get_pending_pages(C));
+    return 1;
+}
+
+static const char *const SerTypes[] = {"string", "snapshot", "compressed", "delta", NULL};
+
+/*
+** serialize(vm, type, tag)
+** Copy the VM to be encoded by the background thread, 'type' is one of
+** "string" (see 'get_vm'), "snapshot", "compressed" (see 'get_snapshot')
+** or "delta" (see 'get_delta'). Returns true if the VM is queued.
+*/
+static int serialize(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    int type = luaL_checkoption(L, 2, NULL, SerTypes);
+    size_t len;
+    const char *p_tag = luaL_checklstring(L, 3, &len);
+    if(p_ser == NULL) {
+        p_ser = vm16_ser_create();
+    }
+    lua_pushboolean(L, (p_ser != NULL) && vm16_ser_submit(p_ser, C, (uint8_t)type, p_tag, (uint32_t)len));
+    return 1;
+}
+
+/*
+** collect([wait])
+** Returns tag, string and type of the next encoded VM (in the order of
+** 'serialize'), the string is nil on error. Returns nothing, if no VM is
+** encoded so far (with 'wait', the call blocks until the next VM is encoded).
+*/
+static int collect(lua_State *L) {
+    vm16_ser_job_t *p_job = (p_ser != NULL) ? vm16_ser_collect(p_ser, lua_toboolean(L, 1)) : NULL;
+    if(p_job != NULL) {
+        lua_pushlstring(L, p_job->tag, p_job->tag_len);
+        if(p_job->size > 0) {
+            lua_pushlstring(L, (const char *)p_job->p_data, p_job->size);
+        } else {
+            lua_pushnil(L);
+        }
+        lua_pushstring(L, SerTypes[p_job->type]);
+        vm16_ser_free_job(p_job);
+        return 3;
+    }
+    return 0;
+}
+
+/*
+** num_jobs()
+** Returns the number of VMs which are serialized, but not collected so far.
+*/
+static int num_jobs(lua_State *L) {
+    lua_pushinteger(L, (p_ser != NULL) ? vm16_ser_num_jobs(p_ser) : 0);
+    return 1;
+}
+
+/*
+** read_mem(vm, addr, num[, tbl])
+** Returns a list with 'num' words, stored into 'tbl' if provided.
+*/
 static int read_mem(lua_State *L) {
     vm16_t *C = check_vm(L);
     lua_Integer addr = luaL_checkinteger(L, 2);
     lua_Integer num = luaL_checkinteger(L, 3);
-    uint16_t *p_data = (uint16_t*)malloc(num * 2);
-    if((C != NULL) && (p_data != NULL) && (num > 0)) {
-        uint16_t words = vm16_read_mem(C, addr, num, p_data);
-        lua_newtable(L);
-        for(int i = 0; i < words; i++) {
-            lua_pushinteger(L, p_data[i]);
-            lua_rawseti(L, -2, i+1);
+    uint16_t buffer[MEM_CHUNK];
+    if((C != NULL) && (num > 0)) {
+        if(lua_istable(L, 4)) {
+            lua_pushvalue(L, 4);
+        } else {
+            lua_createtable(L, num, 0);
+        }
+        if(num <= (lua_Integer)C->mem_mask + 1) {
+            for(lua_Integer offs = 0; offs < num; offs += MEM_CHUNK) {
+                uint16_t words = vm16_read_mem(C, addr + offs, MIN(num - offs, MEM_CHUNK), buffer);
+                for(int i = 0; i < words; i++) {
+                    lua_pushinteger(L, buffer[i]);
+                    lua_rawseti(L, -2, offs + i + 1);
+                }
+            }
         }
-        free(p_data);
         return 1;
     }
     return 0;
@@ -304,13 +654,390 @@ static int run(lua_State *L) {
     return 1;
 }
 
+/*
+** run_batch(vms, cycles)
+** 'vms' is a list of VMs, 'cycles' a number or a list with the cycles per VM.
+** Returns a flat list with 'index, resp, ran' of each VM which stopped
+** before the end (resp ~= VM16_OK).
+*/
+static int run_batch(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t num = (uint32_t)lua_objlen(L, 1);
+    uint32_t num_events = 0;
+    // temporary buffers as userdata, freed by the GC also on errors
+    size_t size = num * (sizeof(vm16_t *) + sizeof(uint32_t) + sizeof(vm16_event_t));
+    vm16_t **pp_vms = (vm16_t **)lua_newuserdata(L, MAX(size, 1));
+    vm16_event_t *p_events = (vm16_event_t *)(pp_vms + num);
+    uint32_t *p_cycles = (uint32_t *)(p_events + num);
+    int per_vm = lua_istable(L, 2);
+    lua_Integer cycles = per_vm ? 0 : luaL_checkinteger(L, 2);
+
+    for(uint32_t i = 0; i < num; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        pp_vms[i] = check_vm_at(L, -1);
+        lua_pop(L, 1);
+        if(per_vm) {
+            lua_rawgeti(L, 2, i + 1);
+            cycles = luaL_checkinteger(L, -1);
+            lua_pop(L, 1);
+        }
+        p_cycles[i] = (uint32_t)MAX(cycles, 0);
+    }
+    if(vm16_sched_num_threads(p_sched) > 1) {
+        // drain the per-VM slots in VM order
+        vm16_sched_run(p_sched, pp_vms, num, p_cycles, p_events);
+        for(uint32_t i = 0; i < num; i++) {
+            if(p_events[i].resp != VM16_OK) {
+                p_events[num_events++] = p_events[i];
+            }
+        }
+    } else {
+        num_events = vm16_run_batch(pp_vms, num, p_cycles, p_events);
+    }
+    lua_createtable(L, num_events * 3, 0);
+    for(uint32_t i = 0; i < num_events; i++) {
+        lua_pushinteger(L, p_events[i].index + 1);
+        lua_rawseti(L, -2, i * 3 + 1);
+        lua_pushinteger(L, p_events[i].resp);
+        lua_rawseti(L, -2, i * 3 + 2);
+        lua_pushinteger(L, p_events[i].ran);
+        lua_rawseti(L, -2, i * 3 + 3);
+    }
+    return 1;
+}
+
+/*
+** threads(num)
+** Set the number of threads used by 'run_batch' (1 = no thread pool).
+** Returns the number of threads available.
+*/
+static int threads(lua_State *L) {
+    lua_Integer num = luaL_checkinteger(L, 1);
+    vm16_sched_destroy(p_sched);
+    p_sched = NULL;
+    if(num > 1) {
+        p_sched = vm16_sched_create((uint32_t)MIN(num, VM16_MAX_THREADS));
+    }
+    lua_pushinteger(L, MAX(vm16_sched_num_threads(p_sched), 1));
+    return 1;
+}
+
+static int register_port(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint16_t addr = (uint16_t)luaL_checkinteger(L, 2);
+    uint8_t type = (uint8_t)luaL_checkinteger(L, 3);
+    uint16_t size = (uint16_t)luaL_optinteger(L, 4, 16);
+    lua_pushboolean(L, vm16_register_port(C, addr, type, size));
+    return 1;
+}
+
+/*
+** read_ports(vm)
+** Returns a table with the value of each latch port and the list of
+** TX values of each ring buffer port with data: {[addr] = val/{...}}
+*/
+static int read_ports(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint16_t addrs[VM16_MAX_PORTS];
+    uint16_t buffer[VM16_MAX_RING_SIZE];
+    uint32_t num = vm16_get_ports(C, VM16_MAX_PORTS, addrs);
+    lua_createtable(L, 0, num);
+    for(uint32_t i = 0; i < num; i++) {
+        uint32_t words = vm16_read_port(C, addrs[i], VM16_MAX_RING_SIZE, buffer);
+        if(vm16_port_type(C, addrs[i]) == VM16_PORT_LATCH) {
+            lua_pushinteger(L, buffer[0]);
+            lua_rawseti(L, -2, addrs[i]);
+        } else if(words > 0) {
+            lua_createtable(L, words, 0);
+            for(uint32_t j = 0; j < words; j++) {
+                lua_pushinteger(L, buffer[j]);
+                lua_rawseti(L, -2, j + 1);
+            }
+            lua_rawseti(L, -2, addrs[i]);
+        }
+    }
+    return 1;
+}
+
+/*
+** write_ports(vm, {[addr] = val/{...}})
+** Latch the value or push the list of values to the RX buffer of the port.
+** Returns the number of written values.
+*/
+static int write_ports(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint16_t buffer[VM16_MAX_RING_SIZE];
+    uint32_t written = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_pushnil(L);
+    while(lua_next(L, 2) != 0) {
+        uint16_t addr = (uint16_t)luaL_checkinteger(L, -2);
+        uint32_t num = 1;
+        if(lua_istable(L, -1)) {
+            num = MIN(lua_objlen(L, -1), VM16_MAX_RING_SIZE);
+            for(uint32_t i = 0; i < num; i++) {
+                lua_rawgeti(L, -1, i + 1);
+                buffer[i] = (uint16_t)luaL_checkinteger(L, -1);
+                lua_pop(L, 1);
+            }
+        } else {
+            buffer[0] = (uint16_t)luaL_checkinteger(L, -1);
+        }
+        written += vm16_write_port(C, addr, num, buffer);
+        lua_pop(L, 1);
+    }
+    lua_pushinteger(L, written);
+    return 1;
+}
+
+static int out_buffer(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint32_t size = (uint32_t)MAX(luaL_checkinteger(L, 2), 0);
+    uint32_t costs = (uint32_t)MAX(luaL_optinteger(L, 3, 0), 0);
+    lua_pushboolean(L, vm16_set_out_buffer(C, size, costs));
+    return 1;
+}
+
+/*
+** read_out_buffer(vm)
+** Returns a flat list with 'addr, data, B' of each buffered 'out'
+** instruction, or nil if the buffer is empty.
+*/
+static int read_out_buffer(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    vm16_out_t records[OUT_CHUNK];
+    uint32_t num = vm16_read_out_buffer(C, OUT_CHUNK, records);
+    uint32_t idx = 0;
+    if(num == 0) {
+        return 0;
+    }
+    lua_createtable(L, num * 3, 0);
+    while(num > 0) {
+        for(uint32_t i = 0; i < num; i++) {
+            lua_pushinteger(L, records[i].addr);
+            lua_rawseti(L, -2, ++idx);
+            lua_pushinteger(L, records[i].data);
+            lua_rawseti(L, -2, ++idx);
+            lua_pushinteger(L, records[i].breg);
+            lua_rawseti(L, -2, ++idx);
+        }
+        num = vm16_read_out_buffer(C, OUT_CHUNK, records);
+    }
+    return 1;
+}
+
+/*
+** sys_buffer(vm, num, size, costs[, result])
+** Serve 'sys #num' in C by buffering register A ('size' = 0 to unregister).
+** 'result' is returned in register A (default: A unchanged).
+*/
+static int sys_buffer(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint16_t num = (uint16_t)luaL_checkinteger(L, 2);
+    lua_Integer size = luaL_checkinteger(L, 3);
+    uint32_t costs = (uint32_t)MAX(luaL_optinteger(L, 4, 0), 0);
+    lua_Integer result = luaL_optinteger(L, 5, -1);
+    if(size > 0) {
+        int32_t res = (result >= 0) ? (int32_t)(result & 0xFFFF) : -1;
+        lua_pushboolean(L, vm16_register_sys_buffer(C, num, (uint32_t)size, costs, res));
+    } else {
+        lua_pushboolean(L, vm16_register_sys(C, num, NULL, NULL, false));
+    }
+    return 1;
+}
+
+/*
+** read_sys_buffer(vm, num)
+** Returns the list of buffered values, or nil if the buffer is empty.
+*/
+static int read_sys_buffer(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    uint16_t sys_num = (uint16_t)luaL_checkinteger(L, 2);
+    uint16_t buffer[OUT_CHUNK];
+    uint32_t num = vm16_read_sys_buffer(C, sys_num, OUT_CHUNK, buffer);
+    uint32_t idx = 0;
+    if(num == 0) {
+        return 0;
+    }
+    lua_createtable(L, num, 0);
+    while(num > 0) {
+        for(uint32_t i = 0; i < num; i++) {
+            lua_pushinteger(L, buffer[i]);
+            lua_rawseti(L, -2, ++idx);
+        }
+        num = vm16_read_sys_buffer(C, sys_num, OUT_CHUNK, buffer);
+    }
+    return 1;
+}
+
+/*
+** Event loop of 'vm16.run' with the 'cpu_def' callbacks as registry references
+*/
+typedef struct {
+    int on_input;               // registry references (LUA_NOREF if not defined)
+    int on_output;
+    int on_system;
+    lua_Integer input_costs;    // default costs (-1 if not defined)
+    lua_Integer output_costs;
+    lua_Integer system_costs;
+}event_ctx_t;
+
+static int get_ref(lua_State *L, const char *key) {
+    lua_getfield(L, 1, key);
+    if(lua_isfunction(L, -1)) {
+        return luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_pop(L, 1);
+    return LUA_NOREF;
+}
+
+static lua_Integer get_costs(lua_State *L, const char *key) {
+    lua_Integer costs = -1;
+    lua_getfield(L, 1, key);
+    if(lua_isnumber(L, -1)) {
+        costs = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return costs;
+}
+
+/*
+** event_ctx(cpu_def)
+** Returns the context for 'run_loop' with the callbacks and costs of 'cpu_def'.
+*/
+static int event_ctx(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    event_ctx_t *p_ctx = (event_ctx_t *)lua_newuserdata(L, sizeof(event_ctx_t));
+    p_ctx->on_input = get_ref(L, "on_input");
+    p_ctx->on_output = get_ref(L, "on_output");
+    p_ctx->on_system = get_ref(L, "on_system");
+    p_ctx->input_costs = get_costs(L, "input_costs");
+    p_ctx->output_costs = get_costs(L, "output_costs");
+    p_ctx->system_costs = get_costs(L, "system_costs");
+    luaL_getmetatable(L, "vm16.event_ctx");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int release_event_ctx(lua_State *L) {
+    event_ctx_t *p_ctx = (event_ctx_t *)luaL_checkudata(L, 1, "vm16.event_ctx");
+    luaL_unref(L, LUA_REGISTRYINDEX, p_ctx->on_input);
+    luaL_unref(L, LUA_REGISTRYINDEX, p_ctx->on_output);
+    luaL_unref(L, LUA_REGISTRYINDEX, p_ctx->on_system);
+    return 0;
+}
+
+// returned value of a callback, to be stored in the VM
+static uint16_t check_data(lua_State *L, int idx, const char *func) {
+    if(!lua_isnumber(L, idx)) {
+        luaL_error(L, "%s: number expected", func);
+    }
+    return (uint16_t)lua_tointeger(L, idx);
+}
+
+/*
+** Call the 'cpu_def' callback for the event 'resp' (stack index 3 is 'pos').
+** Returns false if the event has to be handled by Lua.
+*/
+static bool call_event(lua_State *L, vm16_t *C, event_ctx_t *p_ctx, int resp, lua_Integer *p_costs) {
+    lua_Integer costs;
+    int costs_idx = -1;     // stack index of the returned costs
+    switch(resp) {
+        case VM16_IN:
+            if((p_ctx->on_input == LUA_NOREF) || (p_ctx->input_costs < 0)) {
+                return false;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, p_ctx->on_input);
+            lua_pushvalue(L, 3);
+            lua_pushinteger(L, C->l_addr);
+            lua_call(L, 2, 2);
+            *C->p_in_dest = check_data(L, -2, "on_input");
+            costs = p_ctx->input_costs;
+            break;
+        case VM16_OUT:
+            if((p_ctx->on_output == LUA_NOREF) || (p_ctx->output_costs < 0)) {
+                return false;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, p_ctx->on_output);
+            lua_pushvalue(L, 3);
+            lua_pushinteger(L, C->l_addr);
+            lua_pushinteger(L, C->l_data);
+            lua_pushinteger(L, C->breg);
+            lua_call(L, 4, 2);
+            costs = p_ctx->output_costs;
+            costs_idx = -2;
+            break;
+        case VM16_SYS:
+            if((p_ctx->on_system == LUA_NOREF) || (p_ctx->system_costs < 0)) {
+                return false;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, p_ctx->on_system);
+            lua_pushvalue(L, 3);
+            lua_pushinteger(L, C->l_addr);
+            lua_pushinteger(L, C->areg);
+            lua_pushinteger(L, C->breg);
+            lua_pushinteger(L, C->creg);
+            lua_call(L, 5, 2);
+            *C->p_in_dest = lua_isnil(L, -2) ? 0 : check_data(L, -2, "on_system");
+            costs = p_ctx->system_costs;
+            break;
+        default:
+            return false;
+    }
+    *p_costs = lua_isnumber(L, costs_idx) ? lua_tointeger(L, costs_idx) : costs;
+    lua_pop(L, 2);
+    return true;
+}
+
+/*
+** run_loop(vm, ctx, pos, cycles)
+** Run the VM and serve I/O and system calls via the callbacks of 'ctx'
+** until the cycles are used up. Returns 'resp, cycles, handled'.
+** 'handled' is false if the event 'resp' has to be processed by the caller
+** (breakpoint, halt, ..., or buffered values have to be processed first).
+*/
+static int run_loop(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    event_ctx_t *p_ctx = (event_ctx_t *)luaL_checkudata(L, 2, "vm16.event_ctx");
+    lua_Integer cycles = luaL_checkinteger(L, 4);
+    int resp = VM16_OK;
+    int handled = 1;
+
+    lua_settop(L, 4);
+    while(cycles > 0) {
+        uint32_t ran;
+        lua_Integer costs;
+        resp = vm16_run(C, (uint32_t)cycles, &ran);
+        cycles -= ran;
+        if(resp != VM16_OK) {
+            if((vm16_num_buffered(C) > 0) || !call_event(L, C, p_ctx, resp, &costs)) {
+                handled = 0;
+                break;
+            }
+            cycles -= costs;
+        }
+    }
+    lua_pushinteger(L, resp);
+    lua_pushinteger(L, cycles);
+    lua_pushboolean(L, handled);
+    return 3;
+}
+
+/*
+** get_cpu_reg(vm[, tbl])
+** Returns the register table, stored into 'tbl' if provided.
+*/
 static int get_cpu_reg(lua_State *L) {
     vm16_t *C = check_vm(L);
     if(C != NULL) {
         uint16_t mem[2];
         uint16_t words = vm16_read_mem(C, C->pcnt, 2, mem);
         if(words == 2) {
-            lua_newtable(L);               /* creates a table */
+            if(lua_istable(L, 2)) {
+                lua_pushvalue(L, 2);
+            } else {
+                lua_createtable(L, 0, 12);
+            }
             setfield(L, "A", C->areg);
             setfield(L, "B", C->breg);
             setfield(L, "C", C->creg);
@@ -397,6 +1124,35 @@ static int set_io_reg(lua_State *L) {
     return 0;
 }
 
+/*
+** io_regs(vm)
+** Returns 'addr, data, A, B, C' of the last I/O or system call.
+*/
+static int io_regs(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    if(C != NULL) {
+        lua_pushinteger(L, C->l_addr);
+        lua_pushinteger(L, C->l_data);
+        lua_pushinteger(L, C->areg);
+        lua_pushinteger(L, C->breg);
+        lua_pushinteger(L, C->creg);
+        return 5;
+    }
+    return 0;
+}
+
+/*
+** set_io_value(vm, value)
+** Store the result of an input or system call.
+*/
+static int set_io_value(lua_State *L) {
+    vm16_t *C = check_vm(L);
+    if(C != NULL) {
+        *C->p_in_dest = luaL_checkint(L, 2);
+    }
+    return 0;
+}
+
 static int read_h16(lua_State *L) {
     vm16_t *C = check_vm(L);
     uint32_t buff_size = vm16_get_h16_buffer_size(C);
@@ -498,15 +1254,177 @@ static int hash_node_position(lua_State *L) {
     return 0;
 }
 
+/*
+** VM registry
+**
+** The active VMs are registered with the packed block position as key.
+** The key can be used instead of the position table, e.g. as cached handle.
+*/
+
+// registry key from position table or key number (stack index 'idx')
+static uint64_t check_key(lua_State *L, int idx) {
+    uint64_t key;
+    if(lua_type(L, idx) == LUA_TNUMBER) {
+        return (uint64_t)lua_tonumber(L, idx);
+    }
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "x");
+    lua_getfield(L, idx, "y");
+    lua_getfield(L, idx, "z");
+    key = vm16_reg_key(luaL_checkint(L, -3), luaL_checkint(L, -2), luaL_checkint(L, -1));
+    lua_pop(L, 3);
+    return key;
+}
+
+static int pos_key(lua_State *L) {
+    lua_pushnumber(L, (lua_Number)check_key(L, 1));
+    return 1;
+}
+
+static int key_pos(lua_State *L) {
+    int16_t x, y, z;
+    vm16_reg_pos((uint64_t)luaL_checknumber(L, 1), &x, &y, &z);
+    lua_createtable(L, 0, 3);
+    setfield(L, "x", x);
+    setfield(L, "y", y);
+    setfield(L, "z", z);
+    return 1;
+}
+
+/*
+** register_vm(pos, vm)
+** Register (or replace) the VM of the position. Returns the key.
+*/
+static int register_vm(lua_State *L) {
+    uint64_t key = check_key(L, 1);
+    vm16_t *C = check_vm_at(L, 2);
+    vm16_reg_entry_t *p_ent;
+    if(p_reg == NULL) {
+        p_reg = vm16_reg_create();
+    }
+    p_ent = (p_reg != NULL) ? vm16_reg_put(p_reg, key) : NULL;
+    if(p_ent == NULL) {
+        return 0;
+    }
+    if(p_ent->C != NULL) {
+        luaL_unref(L, LUA_REGISTRYINDEX, p_ent->ref);
+    }
+    lua_pushvalue(L, 2);
+    p_ent->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    p_ent->C = C;
+    p_ent->runs = vm16_get_runs(C);
+    vm16_reg_touch(p_ent);
+    lua_pushnumber(L, (lua_Number)key);
+    return 1;
+}
+
+static int unregister_vm(lua_State *L) {
+    uint64_t key = check_key(L, 1);
+    vm16_reg_entry_t old;
+    if((p_reg != NULL) && vm16_reg_remove(p_reg, key, &old)) {
+        luaL_unref(L, LUA_REGISTRYINDEX, old.ref);
+        lua_pushboolean(L, 1);
+    } else {
+        lua_pushboolean(L, 0);
+    }
+    return 1;
+}
+
+/*
+** lookup(pos)
+** Returns the registered VM of the position (or key), or nil.
+** The VM is marked as used (see 'evict_vms').
+*/
+static int lookup(lua_State *L) {
+    if(p_reg != NULL) {
+        vm16_reg_entry_t *p_ent = vm16_reg_get(p_reg, check_key(L, 1));
+        if(p_ent != NULL) {
+            vm16_reg_touch(p_ent);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, p_ent->ref);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+** next_vm(idx)
+** Iterate over the registered VMs, starting with 'idx' = 0.
+** Returns 'idx, key, vm' or nil at the end.
+*/
+static int next_vm(lua_State *L) {
+    uint32_t idx = luaL_optinteger(L, 1, 0);
+    vm16_reg_entry_t *p_ent = (p_reg != NULL) ? vm16_reg_next(p_reg, &idx) : NULL;
+    if(p_ent != NULL) {
+        lua_pushinteger(L, idx);
+        lua_pushnumber(L, (lua_Number)p_ent->key);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, p_ent->ref);
+        return 3;
+    }
+    return 0;
+}
+
+static int num_vms(lua_State *L) {
+    lua_pushinteger(L, (p_reg != NULL) ? vm16_reg_num(p_reg) : 0);
+    return 1;
+}
+
+/*
+** evict_vms(now, budget, min_idle)
+** Update the last run times of the VMs ('now' in seconds) and select the
+** VMs to be evicted, so that all VMs use at most 'budget' bytes (see
+** 'vm16_reg_lru'). Returns the list of keys (least recently used first)
+** and the memory usage of all registered VMs in bytes.
+*/
+static int evict_vms(lua_State *L) {
+    uint32_t now = (uint32_t)luaL_checknumber(L, 1);
+    lua_Number budget = luaL_checknumber(L, 2);
+    lua_Integer min_idle = luaL_checkinteger(L, 3);
+    uint32_t num = (p_reg != NULL) ? vm16_reg_num(p_reg) : 0;
+    // temporary buffer as userdata, freed by the GC
+    uint64_t *p_keys = (uint64_t *)lua_newuserdata(L, MAX(num, 1) * sizeof(uint64_t));
+    uint64_t bytes = 0;
+
+    if(p_reg != NULL) {
+        vm16_reg_update(p_reg, now);
+        budget = MIN(MAX(budget, 0), 1e18);
+        num = vm16_reg_lru(p_reg, (uint64_t)budget, (uint32_t)MAX(min_idle, 0), p_keys, num, &bytes);
+    }
+    lua_createtable(L, num, 0);
+    for(uint32_t i = 0; i < num; i++) {
+        lua_pushnumber(L, (lua_Number)p_keys[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushnumber(L, (lua_Number)bytes);
+    return 2;
+}
+
 static const luaL_Reg R[] = {
     {"version",            version},
     {"init",               init},
+    {"clone",              clone},
+    {"rom",                rom},
+    {"map_rom",            map_rom},
+    {"rom_info",           rom_info},
+    {"decode_cache",       decode_cache},
+    {"jit",                jit},
+    {"fusion_report",      fusion_report},
     {"mem_size",           mem_size},
+    {"mem_usage",          mem_usage},
     {"set_pc",             set_pc},
     {"get_pc",             get_pc},
     {"deposit",            deposit},
     {"get_vm",             get_vm},
     {"set_vm",             set_vm},
+    {"get_snapshot",       get_snapshot},
+    {"set_snapshot",       set_snapshot},
+    {"get_delta",          get_delta},
+    {"dirty_pages",        dirty_pages},
+    {"checkpoint",         checkpoint},
+    {"pending_pages",      pending_pages},
+    {"serialize",          serialize},
+    {"collect",            collect},
+    {"num_jobs",           num_jobs},
     {"read_mem",           read_mem},
     {"write_mem",          write_mem},
     {"write_mem_bin",      write_mem_bin},
@@ -521,13 +1439,38 @@ static const luaL_Reg R[] = {
     {"get_cpu_reg",        get_cpu_reg},
     {"set_cpu_reg",        set_cpu_reg},
     {"run",                run},
+    {"run_batch",          run_batch},
+    {"threads",            threads},
+    {"register_port",      register_port},
+    {"read_ports",         read_ports},
+    {"write_ports",        write_ports},
+    {"out_buffer",         out_buffer},
+    {"read_out_buffer",    read_out_buffer},
+    {"sys_buffer",         sys_buffer},
+    {"read_sys_buffer",    read_sys_buffer},
+    {"event_ctx",          event_ctx},
+    {"run_loop",           run_loop},
     {"get_io_reg",         get_io_reg},
     {"set_io_reg",         set_io_reg},
+    {"io_regs",            io_regs},
+    {"set_io_value",       set_io_value},
     {"read_h16",           read_h16},
     {"write_h16",          write_h16},
     {"is_ascii",           is_ascii},
     {"testbit",            testbit},
     {"hash_node_position", hash_node_position},
+    {"pos_key",            pos_key},
+    {"key_pos",            key_pos},
+    {"register_vm",        register_vm},
+    {"unregister_vm",      unregister_vm},
+    {"lookup",             lookup},
+    {"next_vm",            next_vm},
+    {"num_vms",            num_vms},
+    {"evict_vms",          evict_vms},
+    {"free",               release},
+    {"pool_limit",         pool_limit},
+    {"pool_stats",         pool_stats},
+    {"__gc",               release},
     {NULL, NULL}
 };
 
@@ -535,7 +1478,33 @@ static const luaL_Reg R[] = {
 
 
 
+/*
+** Stop the threads before the library is unloaded (by 'lua_close')
+*/
+static int unload(lua_State *L) {
+    vm16_ser_destroy(p_ser);
+    p_ser = NULL;
+    vm16_sched_destroy(p_sched);
+    p_sched = NULL;
+    return 0;
+}
+
 LUALIB_API int luaopen_vm16lib(lua_State *L) {
+    // finalized before the library handle (created later)
+    lua_newuserdata(L, 1);
+    luaL_newmetatable(L, "vm16.unload");
+    lua_pushcfunction(L, unload);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "vm16.unload");
+    luaL_newmetatable(L, "vm16.event_ctx");
+    lua_pushcfunction(L, release_event_ctx);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    luaL_newmetatable(L, "vm16.rom");
+    lua_pushcfunction(L, release_rom);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
     luaL_newmetatable(L, "vm16.cpu_dump");
     luaL_register(L, NULL, R);
     return 1;
@@ -0,0 +1,143 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Word based LZ77 codec
+**
+** The stream is a sequence of tokens:
+**
+**   0x00..0x7F  literal run, followed by 'token + 1' words (little-endian)
+**   0x80..0xFF  match of '(token & 0x7F) + 2' words, followed by one byte
+**               'offset - 1' (the match starts 1..256 words back)
+**
+** Matches can overlap with the output (offset 1 is a run of equal words,
+** like zeros or 'nop' sequences). The encoder is greedy with a small hash
+** table of word pairs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16lz.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define MAX_LITERALS    (128)
+#define MIN_MATCH       (2)
+#define MAX_MATCH       (129)
+#define MAX_OFFSET      (256)
+#define HASH_BITS       (8)
+
+static inline uint32_t hash(const uint16_t *p) {
+    return ((((uint32_t)p[0] << 16) | p[1]) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_literals(uint8_t *p_dst, const uint16_t *p_src, uint32_t num) {
+    while(num > 0) {
+        uint32_t n = MIN(num, MAX_LITERALS);
+        *p_dst++ = (uint8_t)(n - 1);
+        for(uint32_t i = 0; i < n; i++) {
+            *p_dst++ = (uint8_t)p_src[i];
+            *p_dst++ = (uint8_t)(p_src[i] >> 8);
+        }
+        p_src += n;
+        num -= n;
+    }
+    return p_dst;
+}
+
+uint32_t vm16_lz_encode(const uint16_t *p_src, uint32_t num, uint8_t *p_dst, uint32_t size_dst) {
+    int16_t table[1 << HASH_BITS];
+    // worst case: all literals
+    uint8_t tmp[VM16_LZ_MAX_WORDS * 2 + VM16_LZ_MAX_WORDS / MAX_LITERALS + 1];
+    uint8_t *p = tmp;
+    uint32_t lit = 0;   // start of the pending literals
+    uint32_t i = 0;
+
+    if(num > VM16_LZ_MAX_WORDS) {
+        return 0;
+    }
+    memset(table, 0xFF, sizeof(table));
+    while(i + MIN_MATCH <= num) {
+        uint32_t h = hash(&p_src[i]);
+        int32_t cand = table[h];
+        table[h] = (int16_t)i;
+        if((cand >= 0) && (i - cand <= MAX_OFFSET) &&
+           (p_src[cand] == p_src[i]) && (p_src[cand + 1] == p_src[i + 1])) {
+            uint32_t max = MIN(num - i, MAX_MATCH);
+            uint32_t len = MIN_MATCH;
+            while((len < max) && (p_src[cand + len] == p_src[i + len])) {
+                len++;
+            }
+            p = put_literals(p, &p_src[lit], i - lit);
+            *p++ = (uint8_t)(0x80 | (len - MIN_MATCH));
+            *p++ = (uint8_t)(i - cand - 1);
+            // the last position of the match is added to the hash table
+            i += len;
+            if(i + MIN_MATCH <= num) {
+                table[hash(&p_src[i - 1])] = (int16_t)(i - 1);
+            }
+            lit = i;
+        } else {
+            i++;
+        }
+    }
+    p = put_literals(p, &p_src[lit], num - lit);
+    if((uint32_t)(p - tmp) > size_dst) {
+        return 0;
+    }
+    memcpy(p_dst, tmp, p - tmp);
+    return (uint32_t)(p - tmp);
+}
+
+bool vm16_lz_decode(const uint8_t *p_src, uint32_t size_src, uint16_t *p_dst, uint32_t num) {
+    const uint8_t *p_end = p_src + size_src;
+    uint32_t pos = 0;
+
+    while(p_src < p_end) {
+        uint8_t token = *p_src++;
+        if(token < 0x80) {
+            uint32_t n = token + 1;
+            if((pos + n > num) || ((uint32_t)(p_end - p_src) < n * 2)) {
+                return false;
+            }
+            for(uint32_t i = 0; i < n; i++, p_src += 2) {
+                p_dst[pos++] = (uint16_t)(p_src[0] | (p_src[1] << 8));
+            }
+        } else {
+            uint32_t len = (token & 0x7F) + MIN_MATCH;
+            uint32_t offs;
+            if(p_src >= p_end) {
+                return false;
+            }
+            offs = (uint32_t)*p_src++ + 1;
+            if((offs > pos) || (pos + len > num)) {
+                return false;
+            }
+            // forward copy for overlapping matches
+            for(uint32_t i = 0; i < len; i++, pos++) {
+                p_dst[pos] = p_dst[pos - offs];
+            }
+        }
+    }
+    return pos == num;
+}
@@ -0,0 +1,46 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** LZ codec for 16-bit memory words (used for compressed VM snapshots)
+*/
+
+#ifndef vm16lz_h
+#define vm16lz_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VM16_LZ_MAX_WORDS   (256)   // max. block size in words
+
+/*
+** Compress 'num' words (up to VM16_LZ_MAX_WORDS) to 'p_dst'.
+** Returns the number of written bytes, or 0 if the result does not
+** fit into 'size_dst' bytes.
+*/
+uint32_t vm16_lz_encode(const uint16_t *p_src, uint32_t num, uint8_t *p_dst, uint32_t size_dst);
+
+/*
+** Decompress 'size_src' bytes to exactly 'num' words.
+** Returns false if the data is invalid.
+*/
+bool vm16_lz_decode(const uint8_t *p_src, uint32_t size_src, uint16_t *p_dst, uint32_t num);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** VM16 instruction set (internal, used by the interpreter and the JIT)
+*/
+
+#ifndef vm16op_h
+#define vm16op_h
+
+/*
+**      MSB          LSB
+** +-----------+------+------+
+** |  op-code  | opd1 | opd2 |
+** +-----------+------+------+
+**
+*/
+
+/*
+* Addressing modes
+*/
+
+// registers
+#define  AREG  (0x00)
+#define  BREG  (0x01)
+#define  CREG  (0x02)
+#define  DREG  (0x03)
+#define  XREG  (0x04)
+#define  YREG  (0x05)
+#define  PCNT  (0x06)
+#define  SPTR  (0x07)
+
+// addressing
+#define  XIND  (0x08)     // x-indirect: move a, [x]
+#define  YIND  (0x09)     // y-indirect: move [y], b
+#define  XINC  (0x0A)     // x-indirect, post-increment: move a, [x++]
+#define  YINC  (0x0B)     // y-indirect, post-increment: move [y++], b
+#define  REG0  (0x0C)     // #0 register
+#define  REG1  (0x0D)     // #1 register
+
+#define  CNST  (0x10)     // constant: move a, #1234; jump 0
+#define  ABS   (0x11)     // absolute: move a, 100
+#define  REL   (0x12)     // relative: jump (deprecated)
+#define  SREL  (0x13)     // stack relative: inc [SP+1]
+#define  REL2  (0x14)     // relative: jump -10
+#define  XREL  (0x15)     // X register relative [X+1]
+#define  YREL  (0x16)     // Y register relative [Y+1]
+#define  SRE2  (0x17)     // stack relative address: SP+1
+
+
+/* OP codes */
+#define  NOP    (0x00)
+#define  BRK    (0x01)
+#define  SYS    (0x02)
+//#define  INT    (0x03)
+
+#define  JUMP   (0x04)
+#define  CALL   (0x05)
+#define  RETN   (0x06)
+#define  HALT   (0x07)
+
+
+#define  MOVE   (0x08)
+#define  XCHG   (0x09)
+#define  INC    (0x0A)
+#define  DEC    (0x0B)
+
+#define  ADD    (0x0C)
+#define  SUB    (0x0D)
+#define  MUL    (0x0E)
+#define  DIV    (0x0F)
+
+#define  AND    (0x10)
+#define  OR     (0x11)
+#define  XOR    (0x12)
+#define  NOT    (0x13)
+
+#define  BNZE   (0x14)
+#define  BZE    (0x15)
+#define  BPOS   (0x16)
+#define  BNEG   (0x17)
+
+#define  IN     (0x18)
+#define  OUT    (0x19)
+#define  PUSH   (0x1A)
+#define  POP    (0x1B)
+
+#define  SWAP   (0x1C)
+#define  DBNZ   (0x1D)
+#define  MOD    (0x1E)
+
+#define  SHL    (0x1F)
+#define  SHR    (0x20)
+#define  ADDC   (0x21)
+#define  MULC   (0x22)
+
+#define  SKNE   (0x23)
+#define  SKEQ   (0x24)
+#define  SKLT   (0x25)
+#define  SKGT   (0x26)
+
+#define  MSB    (0x27)
+
+#endif
@@ -0,0 +1,574 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** VM block pool
+**
+** Freed VM blocks are kept in a free list per size class (up to a limit
+** of cached bytes) and recycled by the next allocation of the same size.
+** Each block has a small header in front of the cache line aligned VM.
+** Blocks are zeroed lazily: new blocks come zeroed from 'calloc' (large
+** blocks as untouched pages from the OS). Of recycled blocks, only the
+** memory pages which were written since the VM was initialized (VM16_USED)
+** are cleared, together with the header and the runtime data, when the
+** block is handed out again.
+** The pool is not thread-safe (it is used by the Lua thread only).
+**
+** With VM16_COW, clones of larger VMs share their memory pages: The memory
+** content of the original VM is written once to an image (a memory file),
+** which is mapped copy-on-write over the memory of all clones. The clone
+** blocks are mapped from the OS, with the memory at an OS page boundary
+** (instead of the cache line aligned VM), and are not recycled.
+** The original VM keeps its image (and private memory) as long as no page
+** is written, to share it with further clones.
+**
+** ROM images are mapped the same way into the memory of any VM (pool block
+** or clone): All OS pages inside the ROM range are mapped from an image of
+** the ROM (one per offset of the ROM start to the OS page boundaries), the
+** words at the edges of the range are copied. The mapped pages of a pool
+** block are replaced by anonymous pages again, when the block is freed.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // memfd_create, mremap
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16.h"
+#include "vm16pool.h"
+
+#ifdef VM16_COW
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define CACHE_LINE      (64)
+#define OS_PAGE         (4096)
+#define MEM_BYTES(cls)  ((64u << (cls)) * sizeof(uint16_t))
+
+typedef struct {
+    int fd;                     // memory file with the shared pages
+    uint32_t refs;              // number of blocks using the image
+}image_t;
+
+typedef struct rom_image_s {
+    struct rom_image_s *p_next;
+    uint32_t shift;             // offset of the ROM start to the OS page boundary
+    image_t *p_image;
+}rom_image_t;
+
+struct vm16_rom_s {
+    uint32_t refs;              // number of owners (creator and VM blocks)
+    uint16_t addr;              // start address (page aligned)
+    uint32_t size;              // number of words (whole pages)
+    rom_image_t *p_images;      // images for mapping (see 'map_rom_pages')
+    uint16_t data[1];           // ROM content
+};
+
+typedef struct rom_map_s {
+    struct rom_map_s *p_next;
+    vm16_rom_t *p_rom;          // referenced ROM
+    uint8_t *p_mapped;          // mapped OS pages, or NULL
+    uint32_t mapped_size;       // number of mapped bytes
+}rom_map_t;
+
+typedef struct block_s {
+    struct block_s *p_next;     // free list
+    void *p_raw;                // allocated memory
+    uint32_t cls;               // size class
+    uint32_t map_size;          // mapped bytes (0 for blocks from 'calloc')
+    image_t *p_image;           // memory image (see 'get_image'), or NULL
+    rom_map_t *p_roms;          // ROMs mapped into the VM memory
+}block_t;
+
+struct vm16_pool_s {
+    uint32_t max_cached;        // limit for 'cached_bytes'
+    uint32_t cached_bytes;      // size of all free blocks
+    block_t *p_free[VM16_POOL_CLASSES];
+    vm16_pool_stats_t stats[VM16_POOL_CLASSES];
+};
+
+#define BLOCK(C)        ((block_t *)((uint8_t *)(C) - sizeof(block_t)))
+#define VM(p_blk)       ((vm16_t *)((uint8_t *)(p_blk) + sizeof(block_t)))
+
+#ifdef VM16_COW
+static vm16_t *new_mapped_block(uint32_t cls, uint32_t nbytes) {
+    uint32_t map_size = (OS_PAGE + nbytes - offsetof(vm16_t, memory) + OS_PAGE - 1) & ~(OS_PAGE - 1);
+    uint8_t *p_raw = (uint8_t *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uintptr_t addr;
+    block_t *p_blk;
+
+    if(p_raw == MAP_FAILED) {
+        return NULL;
+    }
+    // the memory starts at the second OS page
+    addr = (uintptr_t)p_raw + OS_PAGE - offsetof(vm16_t, memory);
+    p_blk = BLOCK(addr);
+    p_blk->p_raw = p_raw;
+    p_blk->cls = cls;
+    p_blk->map_size = map_size;
+    return (vm16_t *)addr;
+}
+
+static void unref_image(image_t *p_img) {
+    if((p_img != NULL) && (--p_img->refs == 0)) {
+        close(p_img->fd);
+        free(p_img);
+    }
+}
+
+static bool is_zero(const uint8_t *p_data, uint32_t len) {
+    for(uint32_t i = 0; i < len; i++) {
+        if(p_data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Create an image with the 'size' bytes of 'p_data' at the file offset 'offs'
+static image_t *new_image(const uint8_t *p_data, uint32_t size, uint32_t offs) {
+    image_t *p_img = (image_t *)calloc(1, sizeof(image_t));
+    uint32_t pos = 0;
+
+    if(p_img == NULL) {
+        return NULL;
+    }
+    p_img->fd = memfd_create("vm16", MFD_CLOEXEC);
+    if((p_img->fd >= 0) && (ftruncate(p_img->fd, offs + size) == 0)) {
+        // zero pages stay holes of the file
+        while(pos < size) {
+            uint32_t len = MIN(OS_PAGE - ((offs + pos) & (OS_PAGE - 1)), size - pos);
+            if(!is_zero(p_data + pos, len) && (pwrite(p_img->fd, p_data + pos, len, offs + pos) != len)) {
+                break;
+            }
+            pos += len;
+        }
+    }
+    if((p_img->fd < 0) || (pos < size)) {
+        if(p_img->fd >= 0) {
+            close(p_img->fd);
+        }
+        free(p_img);
+        return NULL;
+    }
+    return p_img;
+}
+
+// Map 'size' bytes of the image from the file offset 'offs' copy-on-write to
+// 'p_addr'. The old pages are replaced atomically, they stay valid on error.
+static bool map_image(void *p_addr, uint32_t size, image_t *p_img, uint32_t offs) {
+    void *p_tmp = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, p_img->fd, offs);
+    if(p_tmp == MAP_FAILED) {
+        return false;
+    }
+    if(mremap(p_tmp, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, p_addr) == MAP_FAILED) {
+        munmap(p_tmp, size);
+        return false;
+    }
+    return true;
+}
+
+// Return the memory image of the VM. A new image is taken, if pages
+// were written since the last one. The memory of a clone is mapped from
+// the new image, to share its pages with its own clones.
+static image_t *get_image(vm16_t *C) {
+    block_t *p_blk = BLOCK(C);
+    uint32_t size = MEM_BYTES(p_blk->cls);
+    uint32_t num_pages = size / (VM16_PAGE_WORDS * 2);
+    image_t *p_img;
+
+    if((p_blk->p_image != NULL) && (vm16_get_dirty_pages(C, VM16_IMAGE, NULL) == num_pages)) {
+        return p_blk->p_image;
+    }
+    vm16_load_pages(C);
+    p_img = new_image((const uint8_t *)C->memory, size, 0);
+    if(p_img == NULL) {
+        return NULL;
+    }
+    if((p_blk->map_size > 0) && !map_image(C->memory, size, p_img, 0)) {
+        close(p_img->fd);
+        free(p_img);
+        return NULL;
+    }
+    unref_image(p_blk->p_image);
+    p_img->refs = 1;
+    p_blk->p_image = p_img;
+    vm16_set_page_flags(C, (p_blk->map_size > 0) ? VM16_SHARED | VM16_IMAGE : VM16_IMAGE);
+    return p_img;
+}
+
+static vm16_t *new_clone_block(vm16_pool_t *p_pool, vm16_t *C) {
+    block_t *p_blk = BLOCK(C);
+    image_t *p_img = get_image(C);
+    vm16_t *C2;
+
+    if(p_img == NULL) {
+        return NULL;
+    }
+    C2 = new_mapped_block(p_blk->cls, p_pool->stats[p_blk->cls].block_size);
+    if(C2 == NULL) {
+        return NULL;
+    }
+    if(!map_image(C2->memory, MEM_BYTES(p_blk->cls), p_img, 0)) {
+        munmap(BLOCK(C2)->p_raw, BLOCK(C2)->map_size);
+        return NULL;
+    }
+    BLOCK(C2)->p_image = p_img;
+    p_img->refs++;
+    return C2;
+}
+
+// Return the image of the ROM for the start address 'p_start' in a VM memory
+static image_t *get_rom_image(vm16_rom_t *p_rom, uint8_t *p_start) {
+    uint32_t shift = (uintptr_t)p_start & (OS_PAGE - 1);
+    rom_image_t *p_ri;
+
+    for(p_ri = p_rom->p_images; p_ri != NULL; p_ri = p_ri->p_next) {
+        if(p_ri->shift == shift) {
+            return p_ri->p_image;
+        }
+    }
+    p_ri = (rom_image_t *)calloc(1, sizeof(rom_image_t));
+    if(p_ri == NULL) {
+        return NULL;
+    }
+    p_ri->p_image = new_image((const uint8_t *)p_rom->data, p_rom->size * 2, shift);
+    if(p_ri->p_image == NULL) {
+        free(p_ri);
+        return NULL;
+    }
+    p_ri->p_image->refs = 1;
+    p_ri->shift = shift;
+    p_ri->p_next = p_rom->p_images;
+    p_rom->p_images = p_ri;
+    return p_ri->p_image;
+}
+
+// Map the OS pages inside the ROM range and copy the words at the edges.
+// Returns false, if nothing is mapped (the ROM has to be copied).
+static bool map_rom_pages(vm16_t *C, rom_map_t *p_map) {
+    vm16_rom_t *p_rom = p_map->p_rom;
+    uint8_t *p_start = (uint8_t *)&C->memory[p_rom->addr];
+    uint8_t *p_end = p_start + p_rom->size * 2;
+    uint8_t *p_first = (uint8_t *)(((uintptr_t)p_start + OS_PAGE - 1) & ~(uintptr_t)(OS_PAGE - 1));
+    uint8_t *p_last = (uint8_t *)((uintptr_t)p_end & ~(uintptr_t)(OS_PAGE - 1));
+    image_t *p_img;
+    uint32_t offs;
+
+    if((p_last <= p_first) || (sysconf(_SC_PAGESIZE) != OS_PAGE)) {
+        return false;
+    }
+    p_img = get_rom_image(p_rom, p_start);
+    offs = (uintptr_t)p_first - ((uintptr_t)p_start & ~(uintptr_t)(OS_PAGE - 1));
+    if((p_img == NULL) || !map_image(p_first, p_last - p_first, p_img, offs)) {
+        return false;
+    }
+    p_map->p_mapped = p_first;
+    p_map->mapped_size = p_last - p_first;
+    memcpy(p_start, p_rom->data, p_first - p_start);
+    memcpy(p_last, (uint8_t *)p_rom->data + (p_last - p_start), p_end - p_last);
+    // the memory pages at the edges are shared in part
+    vm16_set_rom(C, p_rom->addr, p_rom->size / VM16_PAGE_WORDS, true);
+    return true;
+}
+
+// Replace the mapped ROM pages of a pool block by anonymous pages
+static bool unmap_rom_pages(rom_map_t *p_map) {
+    if(p_map->p_mapped != NULL) {
+        void *p_addr = mmap(p_map->p_mapped, p_map->mapped_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return p_addr != MAP_FAILED;
+    }
+    return true;
+}
+#endif
+
+static vm16_t *new_block(uint32_t cls, uint32_t nbytes) {
+    uint8_t *p_raw = (uint8_t *)calloc(1, nbytes + sizeof(block_t) + CACHE_LINE);
+    uintptr_t addr;
+    block_t *p_blk;
+
+    if(p_raw == NULL) {
+        return NULL;
+    }
+    addr = ((uintptr_t)p_raw + sizeof(block_t) + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+    p_blk = BLOCK(addr);
+    p_blk->p_raw = p_raw;
+    p_blk->cls = cls;
+    return (vm16_t *)addr;
+}
+
+static void free_block(block_t *p_blk) {
+#ifdef VM16_COW
+    if(p_blk->map_size > 0) {
+        munmap(p_blk->p_raw, p_blk->map_size);
+        return;
+    }
+#endif
+    free(p_blk->p_raw);
+}
+
+vm16_pool_t *vm16_pool_create(uint32_t max_cached) {
+    vm16_pool_t *p_pool = (vm16_pool_t *)calloc(1, sizeof(vm16_pool_t));
+    if(p_pool != NULL) {
+        p_pool->max_cached = max_cached;
+        for(uint32_t i = 0; i < VM16_POOL_CLASSES; i++) {
+            p_pool->stats[i].block_size = vm16_calc_size(i);
+        }
+    }
+    return p_pool;
+}
+
+static void trim(vm16_pool_t *p_pool) {
+    for(uint32_t i = VM16_POOL_CLASSES; (i > 0) && (p_pool->cached_bytes > p_pool->max_cached); i--) {
+        uint32_t cls = i - 1;
+        while((p_pool->p_free[cls] != NULL) && (p_pool->cached_bytes > p_pool->max_cached)) {
+            block_t *p_blk = p_pool->p_free[cls];
+            p_pool->p_free[cls] = p_blk->p_next;
+            p_pool->cached_bytes -= p_pool->stats[cls].block_size;
+            p_pool->stats[cls].cached--;
+            free_block(p_blk);
+        }
+    }
+}
+
+void vm16_pool_destroy(vm16_pool_t *p_pool) {
+    if(p_pool != NULL) {
+        p_pool->max_cached = 0;
+        trim(p_pool);
+        free(p_pool);
+    }
+}
+
+void vm16_pool_set_limit(vm16_pool_t *p_pool, uint32_t max_cached) {
+    p_pool->max_cached = max_cached;
+    trim(p_pool);
+}
+
+// Zero the used memory pages and all data behind the memory
+static void clear_block(vm16_t *C, uint32_t cls, uint32_t block_size) {
+    uint32_t words = (uint32_t)C->mem_mask + 1;
+    uint8_t pages[VM16_MAX_PAGES];
+    uint32_t num;
+
+    if(words != MEM_BYTES(cls) / sizeof(uint16_t)) {
+        memset(C, 0, block_size);
+        return;
+    }
+    num = vm16_get_dirty_pages(C, VM16_USED, pages);
+    for(uint32_t i = 0; i < num; i++) {
+        uint32_t addr = pages[i] * VM16_PAGE_WORDS;
+        memset(&C->memory[addr], 0, MIN(VM16_PAGE_WORDS, words - addr) * sizeof(uint16_t));
+    }
+    memset(&C->memory[words], 0, block_size - offsetof(vm16_t, memory) - words * sizeof(uint16_t));
+    memset(C, 0, offsetof(vm16_t, memory));
+}
+
+vm16_t *vm16_pool_alloc(vm16_pool_t *p_pool, uint8_t size) {
+    uint32_t cls = MIN(size, VM16_POOL_CLASSES - 1);
+    vm16_pool_stats_t *p_stats = &p_pool->stats[cls];
+    block_t *p_blk = p_pool->p_free[cls];
+    vm16_t *C;
+
+    if(p_blk != NULL) {
+        p_pool->p_free[cls] = p_blk->p_next;
+        p_pool->cached_bytes -= p_stats->block_size;
+        p_stats->cached--;
+        p_stats->reused++;
+        C = VM(p_blk);
+        clear_block(C, cls, p_stats->block_size);
+    } else {
+        C = new_block(cls, p_stats->block_size);
+        if(C == NULL) {
+            return NULL;
+        }
+    }
+    p_stats->allocs++;
+    p_stats->in_use++;
+    vm16_init_zeroed(C, p_stats->block_size);
+    return C;
+}
+
+void vm16_pool_free(vm16_pool_t *p_pool, vm16_t *C) {
+    if(C != NULL) {
+        block_t *p_blk = BLOCK(C);
+        bool valid = true;
+        vm16_release(C);
+#ifdef VM16_COW
+        unref_image(p_blk->p_image);
+        p_blk->p_image = NULL;
+#endif
+        while(p_blk->p_roms != NULL) {
+            rom_map_t *p_map = p_blk->p_roms;
+#ifdef VM16_COW
+            if(p_blk->map_size == 0) {
+                valid &= unmap_rom_pages(p_map);
+            }
+#endif
+            p_blk->p_roms = p_map->p_next;
+            vm16_rom_release(p_map->p_rom);
+            free(p_map);
+        }
+        if(p_pool != NULL) {
+            vm16_pool_stats_t *p_stats = &p_pool->stats[p_blk->cls];
+            p_stats->in_use--;
+        }
+        if(!valid) {
+            // the block still maps a ROM file, it can't be reused
+            return;
+        }
+        if(p_pool != NULL) {
+            vm16_pool_stats_t *p_stats = &p_pool->stats[p_blk->cls];
+            if((p_blk->map_size == 0) && (p_pool->cached_bytes + p_stats->block_size <= p_pool->max_cached)) {
+                p_blk->p_next = p_pool->p_free[p_blk->cls];
+                p_pool->p_free[p_blk->cls] = p_blk;
+                p_pool->cached_bytes += p_stats->block_size;
+                p_stats->cached++;
+                return;
+            }
+        }
+        free_block(p_blk);
+    }
+}
+
+vm16_t *vm16_pool_clone(vm16_pool_t *p_pool, vm16_t *C) {
+    uint32_t cls = BLOCK(C)->cls;
+    vm16_t *C2 = NULL;
+
+#ifdef VM16_COW
+    if((cls >= VM16_COW_MIN_CLASS) && (sysconf(_SC_PAGESIZE) == OS_PAGE)) {
+        C2 = new_clone_block(p_pool, C);
+    }
+    if(C2 != NULL) {
+        vm16_pool_stats_t *p_stats = &p_pool->stats[cls];
+        p_stats->allocs++;
+        p_stats->in_use++;
+        vm16_init_zeroed(C2, p_stats->block_size);
+        vm16_init_clone(C2, C, true);
+        return C2;
+    }
+#endif
+    // private copy
+    C2 = vm16_pool_alloc(p_pool, cls);
+    if(C2 != NULL) {
+        vm16_init_clone(C2, C, false);
+    }
+    return C2;
+}
+
+vm16_rom_t *vm16_rom_create(char *s) {
+    uint32_t vm_size = vm16_calc_size(VM16_POOL_CLASSES - 1);
+    vm16_t *C = (vm16_t *)calloc(1, vm_size);
+    vm16_rom_t *p_rom = NULL;
+    uint8_t pages[VM16_MAX_PAGES];
+    uint32_t num;
+
+    if(C == NULL) {
+        return NULL;
+    }
+    // the ROM range is taken from the written pages
+    vm16_init_zeroed(C, vm_size);
+    vm16_checkpoint(C);
+    if(vm16_write_h16(C, s)) {
+        num = vm16_get_dirty_pages(C, VM16_DIRTY_CHECKPOINT, pages);
+        if(num > 0) {
+            uint32_t addr = pages[0] * VM16_PAGE_WORDS;
+            uint32_t size = (pages[num - 1] + 1) * VM16_PAGE_WORDS - addr;
+            p_rom = (vm16_rom_t *)calloc(1, sizeof(vm16_rom_t) + size * sizeof(uint16_t));
+            if(p_rom != NULL) {
+                p_rom->refs = 1;
+                p_rom->addr = (uint16_t)addr;
+                p_rom->size = size;
+                memcpy(p_rom->data, &C->memory[addr], size * sizeof(uint16_t));
+            }
+        }
+    }
+    vm16_release(C);
+    free(C);
+    return p_rom;
+}
+
+void vm16_rom_release(vm16_rom_t *p_rom) {
+    if((p_rom != NULL) && (--p_rom->refs == 0)) {
+        while(p_rom->p_images != NULL) {
+            rom_image_t *p_ri = p_rom->p_images;
+            p_rom->p_images = p_ri->p_next;
+#ifdef VM16_COW
+            unref_image(p_ri->p_image);
+#endif
+            free(p_ri);
+        }
+        free(p_rom);
+    }
+}
+
+uint16_t vm16_rom_addr(vm16_rom_t *p_rom, uint32_t *p_size) {
+    *p_size = p_rom->size;
+    return p_rom->addr;
+}
+
+bool vm16_pool_map_rom(vm16_t *C, vm16_rom_t *p_rom) {
+    block_t *p_blk = BLOCK(C);
+    rom_map_t *p_map;
+
+    if((uint32_t)p_rom->addr + p_rom->size > MEM_BYTES(p_blk->cls) / sizeof(uint16_t)) {
+        return false;
+    }
+    for(p_map = p_blk->p_roms; p_map != NULL; p_map = p_map->p_next) {
+        if(p_map->p_rom == p_rom) {
+            break;
+        }
+    }
+    if(p_map == NULL) {
+        p_map = (rom_map_t *)calloc(1, sizeof(rom_map_t));
+        if(p_map == NULL) {
+            return false;
+        }
+        p_map->p_rom = p_rom;
+        p_rom->refs++;
+        p_map->p_next = p_blk->p_roms;
+        p_blk->p_roms = p_map;
+    }
+    // pending pages would overwrite the ROM
+    vm16_load_pages(C);
+#ifdef VM16_COW
+    if(map_rom_pages(C, p_map)) {
+        return true;
+    }
+#endif
+    memcpy(&C->memory[p_rom->addr], p_rom->data, p_rom->size * sizeof(uint16_t));
+    vm16_set_rom(C, p_rom->addr, p_rom->size / VM16_PAGE_WORDS, false);
+    return true;
+}
+
+bool vm16_pool_stats(vm16_pool_t *p_pool, uint8_t size, vm16_pool_stats_t *p_stats) {
+    if(size < VM16_POOL_CLASSES) {
+        *p_stats = p_pool->stats[size];
+        return true;
+    }
+    return false;
+}
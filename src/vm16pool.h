@@ -0,0 +1,118 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Pool allocator for VM memory blocks (one size class per memory size)
+*/
+
+#ifndef vm16pool_h
+#define vm16pool_h
+
+#include "vm16.h"
+
+#define VM16_POOL_CLASSES   (11)    // memory sizes 64 << 0..10 words
+
+#if defined(__linux__) && !defined(VM16_NO_COW)
+#define VM16_COW                    // copy-on-write clones (see 'vm16_pool_clone')
+#define VM16_COW_MIN_CLASS  (5)     // memory sizes of 4 KB (one OS page) and more
+#endif
+
+typedef struct {
+    uint32_t block_size;    // bytes per block
+    uint32_t in_use;        // number of allocated blocks
+    uint32_t cached;        // number of free blocks in the pool
+    uint32_t allocs;        // number of allocations
+    uint32_t reused;        // number of allocations served from the pool
+}vm16_pool_stats_t;
+
+typedef struct vm16_pool_s vm16_pool_t;
+typedef struct vm16_rom_s vm16_rom_t;
+
+/*
+** Create a pool, which keeps up to 'max_cached' bytes of free blocks.
+** Returns NULL on error.
+*/
+vm16_pool_t *vm16_pool_create(uint32_t max_cached);
+
+/*
+** Free the pool and all cached blocks (blocks in use stay valid and
+** are freed by 'vm16_pool_free').
+*/
+void vm16_pool_destroy(vm16_pool_t *p_pool);
+
+/*
+** Change the number of bytes of cached free blocks
+*/
+void vm16_pool_set_limit(vm16_pool_t *p_pool, uint32_t max_cached);
+
+/*
+** Allocate and initialize a VM with the memory size 'size' (see
+** 'vm16_calc_size'). The block is cache line aligned. Returns NULL on error.
+*/
+vm16_t *vm16_pool_alloc(vm16_pool_t *p_pool, uint8_t size);
+
+/*
+** Release the VM (see 'vm16_release') and return the block to the pool.
+** 'p_pool' can be NULL, if the pool is already destroyed.
+*/
+void vm16_pool_free(vm16_pool_t *p_pool, vm16_t *C);
+
+/*
+** Allocate a clone of the pool VM 'C' (see 'vm16_init_clone'), with the
+** same size class. With VM16_COW, the memory of the clone is mapped
+** copy-on-write from a shared, reference counted image of the memory of
+** 'C' (pages are copied by the OS on the first write), otherwise the
+** memory is copied. Returns NULL on error.
+*/
+vm16_t *vm16_pool_clone(vm16_pool_t *p_pool, vm16_t *C);
+
+/*
+** Create a reference counted ROM image from the H16 string 's'. The ROM
+** covers the memory pages from the first to the last written page.
+** Returns NULL on error.
+*/
+vm16_rom_t *vm16_rom_create(char *s);
+
+/*
+** Release the ROM reference of the creator. The ROM is freed, when it is
+** no longer mapped into a VM.
+*/
+void vm16_rom_release(vm16_rom_t *p_rom);
+
+/*
+** Return the start address and the number of words ('p_size') of the ROM
+*/
+uint16_t vm16_rom_addr(vm16_rom_t *p_rom, uint32_t *p_size);
+
+/*
+** Map the ROM read-only into the memory of the pool VM 'C' (see
+** 'vm16_set_rom'), the VM keeps a reference until it is freed. With
+** VM16_COW, all VMs share the OS pages of the ROM, otherwise the ROM is
+** copied. Returns false, if the ROM doesn't fit into the VM memory.
+*/
+bool vm16_pool_map_rom(vm16_t *C, vm16_rom_t *p_rom);
+
+/*
+** Copy the statistics of the size class 'size' to 'p_stats'.
+** Returns false if 'size' is invalid.
+*/
+bool vm16_pool_stats(vm16_pool_t *p_pool, uint8_t size, vm16_pool_stats_t *p_stats);
+
+#endif
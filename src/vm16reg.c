@@ -0,0 +1,267 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** VM registry
+**
+** Open addressing with linear probing. The table size is a power of two
+** and at most half full. Removed entries are not marked as deleted, the
+** following entries of the probe sequence are shifted back instead.
+** The time of the last run is updated per sweep (see 'vm16_reg_update'),
+** 'vm16_run' only counts the calls and lookups only set a flag.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16.h"
+#include "vm16reg.h"
+
+#define EMPTY           (UINT64_MAX)
+#define MIN_SIZE        (64)
+
+struct vm16_reg_s {
+    uint32_t size;          // number of slots (power of two)
+    uint32_t num;           // number of entries
+    uint32_t now;           // time of the last update (seconds)
+    vm16_reg_entry_t *p_tbl;
+};
+
+typedef struct {
+    uint32_t last_run;
+    uint32_t bytes;
+    uint64_t key;
+}lru_item_t;
+
+static inline uint32_t slot(uint64_t key, uint32_t size) {
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 32;
+    return (uint32_t)key & (size - 1);
+}
+
+static vm16_reg_entry_t *alloc_table(uint32_t size) {
+    vm16_reg_entry_t *p_tbl = (vm16_reg_entry_t *)malloc(size * sizeof(vm16_reg_entry_t));
+    if(p_tbl != NULL) {
+        for(uint32_t i = 0; i < size; i++) {
+            p_tbl[i].key = EMPTY;
+        }
+    }
+    return p_tbl;
+}
+
+static bool resize(vm16_reg_t *p_reg, uint32_t size) {
+    vm16_reg_entry_t *p_tbl = alloc_table(size);
+    if(p_tbl == NULL) {
+        return false;
+    }
+    for(uint32_t i = 0; i < p_reg->size; i++) {
+        vm16_reg_entry_t *p_ent = &p_reg->p_tbl[i];
+        if(p_ent->key != EMPTY) {
+            uint32_t idx = slot(p_ent->key, size);
+            while(p_tbl[idx].key != EMPTY) {
+                idx = (idx + 1) & (size - 1);
+            }
+            p_tbl[idx] = *p_ent;
+        }
+    }
+    free(p_reg->p_tbl);
+    p_reg->p_tbl = p_tbl;
+    p_reg->size = size;
+    return true;
+}
+
+uint64_t vm16_reg_key(int16_t x, int16_t y, int16_t z) {
+    return ((uint64_t)(uint16_t)(x + 32768) << 32) |
+           ((uint64_t)(uint16_t)(y + 32768) << 16) |
+            (uint64_t)(uint16_t)(z + 32768);
+}
+
+void vm16_reg_pos(uint64_t key, int16_t *p_x, int16_t *p_y, int16_t *p_z) {
+    *p_x = (int16_t)(((key >> 32) & 0xFFFF) - 32768);
+    *p_y = (int16_t)(((key >> 16) & 0xFFFF) - 32768);
+    *p_z = (int16_t)((key & 0xFFFF) - 32768);
+}
+
+vm16_reg_t *vm16_reg_create(void) {
+    vm16_reg_t *p_reg = (vm16_reg_t *)calloc(1, sizeof(vm16_reg_t));
+    if(p_reg != NULL) {
+        p_reg->p_tbl = alloc_table(MIN_SIZE);
+        if(p_reg->p_tbl == NULL) {
+            free(p_reg);
+            return NULL;
+        }
+        p_reg->size = MIN_SIZE;
+    }
+    return p_reg;
+}
+
+void vm16_reg_destroy(vm16_reg_t *p_reg) {
+    if(p_reg != NULL) {
+        free(p_reg->p_tbl);
+        free(p_reg);
+    }
+}
+
+uint32_t vm16_reg_num(vm16_reg_t *p_reg) {
+    return p_reg->num;
+}
+
+vm16_reg_entry_t *vm16_reg_get(vm16_reg_t *p_reg, uint64_t key) {
+    uint32_t mask = p_reg->size - 1;
+    uint32_t idx = slot(key, p_reg->size);
+    while(p_reg->p_tbl[idx].key != EMPTY) {
+        if(p_reg->p_tbl[idx].key == key) {
+            return &p_reg->p_tbl[idx];
+        }
+        idx = (idx + 1) & mask;
+    }
+    return NULL;
+}
+
+vm16_reg_entry_t *vm16_reg_put(vm16_reg_t *p_reg, uint64_t key) {
+    vm16_reg_entry_t *p_ent = vm16_reg_get(p_reg, key);
+    if(p_ent == NULL) {
+        uint32_t idx;
+        if(((p_reg->num + 1) * 2 > p_reg->size) && !resize(p_reg, p_reg->size * 2)) {
+            return NULL;
+        }
+        idx = slot(key, p_reg->size);
+        while(p_reg->p_tbl[idx].key != EMPTY) {
+            idx = (idx + 1) & (p_reg->size - 1);
+        }
+        p_ent = &p_reg->p_tbl[idx];
+        p_ent->key = key;
+        p_ent->C = NULL;
+        p_ent->ref = 0;
+        p_ent->runs = 0;
+        p_ent->last_run = p_reg->now;
+        p_ent->used = true;
+        p_reg->num++;
+    }
+    return p_ent;
+}
+
+bool vm16_reg_remove(vm16_reg_t *p_reg, uint64_t key, vm16_reg_entry_t *p_old) {
+    uint32_t mask = p_reg->size - 1;
+    vm16_reg_entry_t *p_ent = vm16_reg_get(p_reg, key);
+    uint32_t hole, idx;
+
+    if(p_ent == NULL) {
+        return false;
+    }
+    if(p_old != NULL) {
+        *p_old = *p_ent;
+    }
+    // shift the following entries back, if the hole is on their probe sequence
+    hole = (uint32_t)(p_ent - p_reg->p_tbl);
+    idx = (hole + 1) & mask;
+    while(p_reg->p_tbl[idx].key != EMPTY) {
+        uint32_t home = slot(p_reg->p_tbl[idx].key, p_reg->size);
+        if(((idx - home) & mask) >= ((idx - hole) & mask)) {
+            p_reg->p_tbl[hole] = p_reg->p_tbl[idx];
+            hole = idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    p_reg->p_tbl[hole].key = EMPTY;
+    p_reg->num--;
+    return true;
+}
+
+vm16_reg_entry_t *vm16_reg_next(vm16_reg_t *p_reg, uint32_t *p_idx) {
+    while(*p_idx < p_reg->size) {
+        vm16_reg_entry_t *p_ent = &p_reg->p_tbl[(*p_idx)++];
+        if(p_ent->key != EMPTY) {
+            return p_ent;
+        }
+    }
+    return NULL;
+}
+
+void vm16_reg_update(vm16_reg_t *p_reg, uint32_t now) {
+    p_reg->now = now;
+    for(uint32_t i = 0; i < p_reg->size; i++) {
+        vm16_reg_entry_t *p_ent = &p_reg->p_tbl[i];
+        if(p_ent->key != EMPTY) {
+            uint32_t runs = vm16_get_runs(p_ent->C);
+            if(p_ent->used || (runs != p_ent->runs)) {
+                p_ent->runs = runs;
+                p_ent->last_run = now;
+                p_ent->used = false;
+            }
+        }
+    }
+}
+
+void vm16_reg_touch(vm16_reg_entry_t *p_ent) {
+    p_ent->used = true;
+}
+
+// oldest first, the key makes the order deterministic
+static int cmp_lru(const void *p1, const void *p2) {
+    const lru_item_t *p_item1 = (const lru_item_t *)p1;
+    const lru_item_t *p_item2 = (const lru_item_t *)p2;
+    if(p_item1->last_run != p_item2->last_run) {
+        return (p_item1->last_run < p_item2->last_run) ? -1 : 1;
+    }
+    return (p_item1->key < p_item2->key) ? -1 : (p_item1->key > p_item2->key);
+}
+
+uint32_t vm16_reg_lru(vm16_reg_t *p_reg, uint64_t budget, uint32_t min_idle,
+                      uint64_t *p_keys, uint32_t max_keys, uint64_t *p_bytes) {
+    lru_item_t *p_items;
+    uint64_t bytes = 0;
+    uint32_t num_items = 0;
+    uint32_t num = 0;
+
+    for(uint32_t i = 0; i < p_reg->size; i++) {
+        if(p_reg->p_tbl[i].key != EMPTY) {
+            bytes += vm16_get_mem_usage(p_reg->p_tbl[i].C);
+        }
+    }
+    *p_bytes = bytes;
+    if((bytes <= budget) || (max_keys == 0)) {
+        return 0;
+    }
+    p_items = (lru_item_t *)malloc(p_reg->num * sizeof(lru_item_t));
+    if(p_items == NULL) {
+        return 0;
+    }
+    for(uint32_t i = 0; i < p_reg->size; i++) {
+        vm16_reg_entry_t *p_ent = &p_reg->p_tbl[i];
+        if((p_ent->key != EMPTY) && ((int32_t)(p_reg->now - p_ent->last_run) >= (int32_t)min_idle) &&
+           !vm16_has_io_state(p_ent->C)) {
+            p_items[num_items].last_run = p_ent->last_run;
+            p_items[num_items].bytes = vm16_get_mem_usage(p_ent->C);
+            p_items[num_items].key = p_ent->key;
+            num_items++;
+        }
+    }
+    qsort(p_items, num_items, sizeof(lru_item_t), cmp_lru);
+    for(uint32_t i = 0; (i < num_items) && (num < max_keys) && (bytes > budget); i++) {
+        p_keys[num++] = p_items[i].key;
+        bytes -= p_items[i].bytes;
+    }
+    free(p_items);
+    return num;
+}
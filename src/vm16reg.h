@@ -0,0 +1,112 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Registry of the active VMs (open addressing hash map with the block
+** position as key)
+*/
+
+#ifndef vm16reg_h
+#define vm16reg_h
+
+#include "vm16.h"
+
+typedef struct {
+    uint64_t key;           // packed position (see 'vm16_reg_key')
+    vm16_t *C;              // VM
+    int32_t ref;            // reference of the VM owner (Lua userdata)
+    uint32_t runs;          // 'vm16_get_runs' at the last update
+    uint32_t last_run;      // time of the last run or access (see 'vm16_reg_update')
+    bool used;              // accessed since the last update (see 'vm16_reg_touch')
+}vm16_reg_entry_t;
+
+typedef struct vm16_reg_s vm16_reg_t;
+
+/*
+** Pack the block position to a 48-bit key
+*/
+uint64_t vm16_reg_key(int16_t x, int16_t y, int16_t z);
+
+/*
+** Unpack the block position from the key
+*/
+void vm16_reg_pos(uint64_t key, int16_t *p_x, int16_t *p_y, int16_t *p_z);
+
+/*
+** Create an empty registry. Returns NULL on error.
+*/
+vm16_reg_t *vm16_reg_create(void);
+
+/*
+** Free the registry (the VMs are not freed)
+*/
+void vm16_reg_destroy(vm16_reg_t *p_reg);
+
+/*
+** Return the number of registered VMs
+*/
+uint32_t vm16_reg_num(vm16_reg_t *p_reg);
+
+/*
+** Return the entry of 'key', or NULL.
+*/
+vm16_reg_entry_t *vm16_reg_get(vm16_reg_t *p_reg, uint64_t key);
+
+/*
+** Return the entry of 'key', a new entry ('C' = NULL) is added if
+** the key is not registered. Returns NULL on error.
+*/
+vm16_reg_entry_t *vm16_reg_put(vm16_reg_t *p_reg, uint64_t key);
+
+/*
+** Remove the entry of 'key' and copy it to 'p_old'.
+** Returns false if the key is not registered.
+*/
+bool vm16_reg_remove(vm16_reg_t *p_reg, uint64_t key, vm16_reg_entry_t *p_old);
+
+/*
+** Iterate over the entries, starting with '*p_idx' = 0.
+** Returns the next entry, or NULL at the end.
+** Removing entries during an iteration can skip entries.
+*/
+vm16_reg_entry_t *vm16_reg_next(vm16_reg_t *p_reg, uint32_t *p_idx);
+
+/*
+** Set the registry time to 'now' (seconds) and the last run time of all
+** VMs, which ran or were accessed since the last update.
+*/
+void vm16_reg_update(vm16_reg_t *p_reg, uint32_t now);
+
+/*
+** Mark the entry as accessed (the time is set by the next update)
+*/
+void vm16_reg_touch(vm16_reg_entry_t *p_ent);
+
+/*
+** Select the VMs to be evicted to reduce the memory usage of all VMs
+** (see 'vm16_get_mem_usage') to 'budget' bytes: VMs idle for at least
+** 'min_idle' seconds (without I/O state), least recently used first.
+** Up to 'max_keys' keys are copied to 'p_keys', the number is returned.
+** The memory usage of all VMs is stored in '*p_bytes'.
+*/
+uint32_t vm16_reg_lru(vm16_reg_t *p_reg, uint64_t budget, uint32_t min_idle,
+                      uint64_t *p_keys, uint32_t max_keys, uint64_t *p_bytes);
+
+#endif
@@ -0,0 +1,413 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** 'vm16_run' instance template, included by vm16core.c once per instance
+** (therefore without include guard) and based on its handler macros:
+**   RUN_FUNC    - function name
+**   RUN_MASK    - memory address mask, a constant for the memory size
+**                 specialized instances
+**   RUN_GENERIC - defined for the generic instance, which uses 'C->pcnt'
+**                 as PC and 'C->mem_mask' as 'RUN_MASK'
+**
+** The specialized instances hold the PC in the local variable 'pc' and
+** store it back before leaving the run loop or calling the JIT.
+** Instructions with PC operand (e.g. 'move PC, A' or 'inc PC') are executed
+** by the generic instance (without decode cache, 'cached' = false).
+*/
+
+#ifdef RUN_GENERIC
+#define VM_PC               C->pcnt
+#define VM_SAVE_PC()
+#define VM_LOAD_PC()
+#define VM_PC_OPERAND()
+#define VM_PC_ENTRY
+#else
+#define VM_PC               pc
+#define VM_SAVE_PC()        C->pcnt = pc
+#define VM_LOAD_PC()        pc = C->pcnt
+#define IS_PC_OPERAND()     ((addr_mode1 == PCNT) || (addr_mode2 == PCNT))
+#define VM_PC_STEP()                                            \
+    {                                                           \
+        uint32_t step_ran;                                      \
+        int res;                                                \
+        C->pcnt = pc - 1;                                       \
+        res = run_generic(C, 1, &step_ran, false);              \
+        pc = C->pcnt;                                           \
+        if(res != VM16_OK) {                                    \
+            if(res != VM16_ERROR) {                             \
+                *ran = num_cycles - num;                        \
+            }                                                   \
+            return res;                                         \
+        }                                                       \
+    }
+#ifdef VM16_THREADED_CODE
+#define VM_PC_OPERAND()     if(IS_PC_OPERAND()) { goto L_PC_OPERAND; }
+#define VM_PC_ENTRY         L_PC_OPERAND: VM_PC_STEP(); VM_NEXT;
+#else
+#define VM_PC_OPERAND()     if(IS_PC_OPERAND()) { VM_PC_STEP(); continue; }
+#define VM_PC_ENTRY
+#endif
+#endif
+
+static int RUN_FUNC(vm16_t *C, uint32_t num_cycles, uint32_t *ran, bool cached) {
+    const uint16_t mask = RUN_MASK;
+    vm16_rt_t *rt = RT_ADDR(C, mask);
+#ifdef VM16_THREADED_CODE
+    static const void *const JumpTable[64] = {
+        &&L_NOP,   &&L_BRK,   &&L_SYS,   &&L_ERROR, &&L_JUMP,  &&L_CALL,  &&L_RETN,  &&L_HALT,
+        &&L_MOVE,  &&L_XCHG,  &&L_INC,   &&L_DEC,   &&L_ADD,   &&L_SUB,   &&L_MUL,   &&L_DIV,
+        &&L_AND,   &&L_OR,    &&L_XOR,   &&L_NOT,   &&L_BNZE,  &&L_BZE,   &&L_BPOS,  &&L_BNEG,
+        &&L_IN,    &&L_OUT,   &&L_PUSH,  &&L_POP,   &&L_SWAP,  &&L_DBNZ,  &&L_MOD,   &&L_SHL,
+        &&L_SHR,   &&L_ADDC,  &&L_MULC,  &&L_SKNE,  &&L_SKEQ,  &&L_SKLT,  &&L_SKGT,  &&L_MSB,
+        &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR,
+        &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR,
+        &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR, &&L_ERROR,
+    };
+    // specialized handler per [opcode][operand class 1][operand class 2], 0 = generic
+    static const int32_t SpecTable[64][OPD_NUM][OPD_NUM] = {
+        SPEC_ENTRIES_0(NOP)
+        SPEC_ENTRIES_0(RETN)
+        SPEC_ENTRIES_0(HALT)
+        SPEC_ENTRIES_V1(JUMP)
+        SPEC_ENTRIES_V1(CALL)
+        SPEC_ENTRIES_V1(PUSH)
+        SPEC_ENTRIES_P1(INC)
+        SPEC_ENTRIES_P1(DEC)
+        SPEC_ENTRIES_P1(NOT)
+        SPEC_ENTRIES_P1(SWAP)
+        SPEC_ENTRIES_P1(POP)
+        SPEC_ENTRIES_2(MOVE)
+        SPEC_ENTRIES_2(ADD)
+        SPEC_ENTRIES_2(SUB)
+        SPEC_ENTRIES_2(MUL)
+        SPEC_ENTRIES_2(DIV)
+        SPEC_ENTRIES_2(MOD)
+        SPEC_ENTRIES_2(AND)
+        SPEC_ENTRIES_2(OR)
+        SPEC_ENTRIES_2(XOR)
+        SPEC_ENTRIES_2(SHL)
+        SPEC_ENTRIES_2(SHR)
+        SPEC_ENTRIES_2(ADDC)
+        SPEC_ENTRIES_2(MULC)
+        SPEC_ENTRIES_2(MSB)
+        SPEC_ENTRIES_2(DBNZ)
+        SPEC_ENTRIES_2(BNZE)
+        SPEC_ENTRIES_2(BZE)
+        SPEC_ENTRIES_2(BPOS)
+        SPEC_ENTRIES_2(BNEG)
+        SPEC_ENTRIES_2(SKNE)
+        SPEC_ENTRIES_2(SKEQ)
+        SPEC_ENTRIES_2(SKLT)
+        SPEC_ENTRIES_2(SKGT)
+    };
+    // fused handler per [row][opcode][operand class 1][operand class 2], 0 = none
+    static const int32_t FuseTable[FUSE_ROW_NUM][64][OPD_NUM][OPD_NUM] = {
+        FUSE_ENTRIES_JUMP_2(SKNE)
+        FUSE_ENTRIES_JUMP_2(SKEQ)
+        FUSE_ENTRIES_JUMP_2(SKLT)
+        FUSE_ENTRIES_JUMP_2(SKGT)
+        FUSE_ENTRIES_JUMP_P1(INC)
+        FUSE_ENTRIES_JUMP_P1(DEC)
+        FUSE_ENTRIES_LOAD(ADD)
+        FUSE_ENTRIES_LOAD(SUB)
+        FUSE_ENTRIES_LOAD(SKNE)
+        FUSE_ENTRIES_LOAD(SKEQ)
+        FUSE_ENTRIES_LOAD(SKLT)
+        FUSE_ENTRIES_LOAD(SKGT)
+    };
+    uint32_t *p_hits = rt->fusion_hits;
+    vm16_dc_t *p_cache = cached ? rt->p_cache : NULL;
+    vm16_dc_t *p_entry = NULL;
+    uint8_t dc_opd1 = 0, dc_opd2 = 0;
+#ifdef VM16_JIT
+    vm16_jit_t *p_jit = cached ? rt->p_jit : NULL;
+#endif
+#endif
+#ifndef RUN_GENERIC
+    uint16_t pc = C->pcnt;
+#endif
+    uint32_t num = num_cycles;
+    uint16_t code = 0;
+    uint8_t opcode = 0, addr_mode1 = 0, addr_mode2 = 0;
+
+    VM_DISPATCH_BEGIN
+        VM_CASE(NOP) {
+            VM_SAVE_PC();
+            C->p_in_dest = &C->areg;
+            *ran = num_cycles - num;
+            return VM16_NOP;
+        }
+        VM_CASE(BRK) {
+            C->p_in_dest = &C->areg;
+            C->l_addr = code & 0x03FF;
+            *ran = num_cycles - num;
+            VM_PC--;
+            VM_SAVE_PC();
+            return VM16_BREAK;
+        }
+        VM_CASE(SYS) {
+            VM_SAVE_PC();
+            if((rt->p_sys != NULL) && sys_call(C, rt->p_sys, code & 0x03FF, &num)) {
+                VM_NEXT;
+            }
+            C->p_in_dest = &C->areg;
+            C->l_addr = code & 0x03FF;
+            *ran = num_cycles - num;
+            return VM16_SYS;
+        }
+        VM_CASE(JUMP) {
+            DO_JUMP(VAL_G(1));
+            VM_BRANCH;
+        }
+        VM_CASE(CALL) {
+            DO_CALL(VAL_G(1));
+            VM_BRANCH;
+        }
+        VM_CASE(RETN) {
+            // PC = pop()
+            uint16_t addr = *RUN_SRC(C->sptr);
+            C->sptr = C->sptr + 1;
+            VM_PC = addr;
+            C->bptr = C->sptr;
+            VM_BRANCH;
+        }
+        VM_CASE(HALT) {
+            *ran = num_cycles - num;
+            VM_PC--;
+            VM_SAVE_PC();
+            return VM16_HALT;
+        }
+        VM_CASE(MOVE) {
+            DO_MOVE(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(XCHG) {
+            uint16_t *p_opd1 = ADDR_G(1);
+            uint16_t *p_opd2 = ADDR_G(2);
+            uint16_t temp = *p_opd1;
+            *p_opd1 = *p_opd2;
+            *p_opd2 = temp;
+            VM_NEXT;
+        }
+        VM_CASE(INC) {
+            DO_INC(ADDR_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(DEC) {
+            DO_DEC(ADDR_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(ADD) {
+            DO_ADD(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(SUB) {
+            DO_SUB(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(MUL) {
+            DO_MUL(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(DIV) {
+            DO_DIV(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(AND) {
+            DO_AND(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(OR) {
+            DO_OR(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(XOR) {
+            DO_XOR(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(NOT) {
+            DO_NOT(ADDR_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(BNZE) {
+            DO_BNZE(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(BZE) {
+            DO_BZE(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(BPOS) {
+            DO_BPOS(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(BNEG) {
+            DO_BNEG(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(IN) {
+            uint16_t *p_dst = ADDR_G(1);
+            uint16_t addr = VAL_G(2);
+            if((rt->p_ports != NULL) && port_in(rt->p_ports, addr, p_dst)) {
+                VM_NEXT;
+            }
+            C->p_in_dest = p_dst;
+            C->l_addr = addr;
+            VM_SAVE_PC();
+            *ran = num_cycles - num;
+            return VM16_IN;
+        }
+        VM_CASE(OUT) {
+            uint16_t addr = VAL_G(1);
+            uint16_t data = VAL_G(2);
+            if((rt->p_ports != NULL) && port_out(rt->p_ports, addr, data)) {
+                VM_NEXT;
+            }
+            if((rt->p_outbuf != NULL) && out_buffer(rt->p_outbuf, addr, data, C->breg, &num)) {
+                VM_NEXT;
+            }
+            C->l_addr = addr;
+            C->l_data = data;
+            VM_SAVE_PC();
+            *ran = num_cycles - num;
+            return VM16_OUT;
+        }
+        VM_CASE(PUSH) {
+            DO_PUSH(VAL_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(POP) {
+            DO_POP(ADDR_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(SWAP) {
+            DO_SWAP(ADDR_G(1));
+            VM_NEXT;
+        }
+        VM_CASE(DBNZ) {
+            DO_DBNZ(ADDR_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(MOD) {
+            DO_MOD(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(SHL) {
+            DO_SHL(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(SHR) {
+            DO_SHR(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(ADDC) {
+            DO_ADDC(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(MULC) {
+            DO_MULC(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_CASE(SKNE) {
+            DO_SKNE(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(SKEQ) {
+            DO_SKEQ(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(SKLT) {
+            DO_SKLT(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(SKGT) {
+            DO_SKGT(VAL_G(1), VAL_G(2));
+            VM_BRANCH;
+        }
+        VM_CASE(MSB) {
+            DO_MSB(ADDR_G(1), VAL_G(2));
+            VM_NEXT;
+        }
+        VM_DEFAULT {
+            VM_SAVE_PC();
+            return VM16_ERROR;
+        }
+#ifdef VM16_THREADED_CODE
+        VM_HANDLERS_V1(JUMP, BRANCH)
+        VM_HANDLERS_V1(CALL, BRANCH)
+        VM_HANDLERS_V1(PUSH, NEXT)
+        VM_HANDLERS_P1(INC, NEXT)
+        VM_HANDLERS_P1(DEC, NEXT)
+        VM_HANDLERS_P1(NOT, NEXT)
+        VM_HANDLERS_P1(SWAP, NEXT)
+        VM_HANDLERS_P1(POP, NEXT)
+        VM_HANDLERS_P1V2(MOVE, NEXT)
+        VM_HANDLERS_P1V2(ADD, NEXT)
+        VM_HANDLERS_P1V2(SUB, NEXT)
+        VM_HANDLERS_P1V2(MUL, NEXT)
+        VM_HANDLERS_P1V2(DIV, NEXT)
+        VM_HANDLERS_P1V2(MOD, NEXT)
+        VM_HANDLERS_P1V2(AND, NEXT)
+        VM_HANDLERS_P1V2(OR, NEXT)
+        VM_HANDLERS_P1V2(XOR, NEXT)
+        VM_HANDLERS_P1V2(SHL, NEXT)
+        VM_HANDLERS_P1V2(SHR, NEXT)
+        VM_HANDLERS_P1V2(ADDC, NEXT)
+        VM_HANDLERS_P1V2(MULC, NEXT)
+        VM_HANDLERS_P1V2(MSB, NEXT)
+        VM_HANDLERS_P1V2(DBNZ, BRANCH)
+        VM_HANDLERS_V1V2(BNZE, BRANCH)
+        VM_HANDLERS_V1V2(BZE, BRANCH)
+        VM_HANDLERS_V1V2(BPOS, BRANCH)
+        VM_HANDLERS_V1V2(BNEG, BRANCH)
+        VM_HANDLERS_V1V2(SKNE, BRANCH)
+        VM_HANDLERS_V1V2(SKEQ, BRANCH)
+        VM_HANDLERS_V1V2(SKLT, BRANCH)
+        VM_HANDLERS_V1V2(SKGT, BRANCH)
+        VM_FUSED_SKIP_JUMP(SKNE)
+        VM_FUSED_SKIP_JUMP(SKEQ)
+        VM_FUSED_SKIP_JUMP(SKLT)
+        VM_FUSED_SKIP_JUMP(SKGT)
+        VM_FUSED_STEP_JUMP(INC)
+        VM_FUSED_STEP_JUMP(DEC)
+        VM_FUSED_LOAD_OP(ADD)
+        VM_FUSED_LOAD_OP(SUB)
+        VM_FUSED_LOAD_SKIP_JUMP(SKNE)
+        VM_FUSED_LOAD_SKIP_JUMP(SKEQ)
+        VM_FUSED_LOAD_SKIP_JUMP(SKLT)
+        VM_FUSED_LOAD_SKIP_JUMP(SKGT)
+#endif
+    VM_DISPATCH_END
+    VM_SAVE_PC();
+    *ran = num_cycles - num;
+    return VM16_OK;
+}
+
+#undef VM_PC
+#undef VM_SAVE_PC
+#undef VM_LOAD_PC
+#undef VM_PC_OPERAND
+#undef VM_PC_ENTRY
+#undef IS_PC_OPERAND
+#undef VM_PC_STEP
+#undef RUN_FUNC
+#undef RUN_MASK
+#undef RUN_GENERIC
@@ -0,0 +1,256 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Parallel VM scheduler
+**
+** The VMs are independent memory blocks without shared state, therefore
+** they can be executed in parallel. The scheduler has a fixed pool of
+** worker threads, the calling thread is worker 0.
+**
+** Each run distributes the VM indices in equal ranges [lo, hi) to the
+** workers. A worker takes VMs from the front of its own range. If the
+** range is empty, it steals VMs from the back of the ranges of the other
+** workers, so that VMs which stop early (I/O) don't lead to idle threads.
+** The result of each VM is parked in its slot, the caller processes the
+** slots after the run (the VMs' callbacks are not thread-safe).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16.h"
+#include "vm16sched.h"
+
+#ifdef VM16_THREADS
+
+#include <pthread.h>
+
+#define CACHE_LINE      (64)
+
+typedef struct {
+    pthread_mutex_t mutex;
+    uint32_t lo, hi;            // VM indices to be run
+    struct vm16_sched_s *p_sched;
+    uint32_t id;
+}__attribute__((aligned(CACHE_LINE))) worker_t;
+
+struct vm16_sched_s {
+    uint32_t num_threads;
+    worker_t *p_workers;        // one per thread
+    pthread_t *p_threads;       // 'num_threads - 1' threads (without caller)
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;  // new run or stop
+    pthread_cond_t done_cond;   // all workers idle
+    uint32_t generation;        // run counter
+    uint32_t busy;              // number of working threads
+    bool stop;
+    // current run
+    vm16_t **pp_vms;
+    uint32_t *p_cycles;
+    vm16_event_t *p_slots;
+};
+
+static bool take_vm(worker_t *p_worker, uint32_t *p_idx) {
+    bool res = false;
+    pthread_mutex_lock(&p_worker->mutex);
+    if(p_worker->lo < p_worker->hi) {
+        *p_idx = p_worker->lo++;
+        res = true;
+    }
+    pthread_mutex_unlock(&p_worker->mutex);
+    return res;
+}
+
+static bool steal_vm(vm16_sched_t *p_sched, uint32_t id, uint32_t *p_idx) {
+    for(uint32_t i = 1; i < p_sched->num_threads; i++) {
+        worker_t *p_victim = &p_sched->p_workers[(id + i) % p_sched->num_threads];
+        bool res = false;
+        pthread_mutex_lock(&p_victim->mutex);
+        if(p_victim->lo < p_victim->hi) {
+            *p_idx = --p_victim->hi;
+            res = true;
+        }
+        pthread_mutex_unlock(&p_victim->mutex);
+        if(res) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run VMs until all ranges are empty
+static void run_vms(vm16_sched_t *p_sched, uint32_t id) {
+    uint32_t idx;
+    while(take_vm(&p_sched->p_workers[id], &idx) || steal_vm(p_sched, id, &idx)) {
+        vm16_event_t *p_slot = &p_sched->p_slots[idx];
+        p_slot->index = idx;
+        p_slot->ran = 0;
+        p_slot->resp = vm16_run(p_sched->pp_vms[idx], p_sched->p_cycles[idx], &p_slot->ran);
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *p_worker = (worker_t *)arg;
+    vm16_sched_t *p_sched = p_worker->p_sched;
+    uint32_t generation = 0;
+
+    pthread_mutex_lock(&p_sched->mutex);
+    while(1) {
+        while(!p_sched->stop && (p_sched->generation == generation)) {
+            pthread_cond_wait(&p_sched->start_cond, &p_sched->mutex);
+        }
+        if(p_sched->stop) {
+            break;
+        }
+        generation = p_sched->generation;
+        pthread_mutex_unlock(&p_sched->mutex);
+
+        run_vms(p_sched, p_worker->id);
+
+        pthread_mutex_lock(&p_sched->mutex);
+        if(--p_sched->busy == 0) {
+            pthread_cond_signal(&p_sched->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&p_sched->mutex);
+    return NULL;
+}
+
+vm16_sched_t *vm16_sched_create(uint32_t num_threads) {
+    vm16_sched_t *p_sched;
+    uint32_t started = 0;
+
+    if(num_threads == 0) {
+        return NULL;
+    }
+    p_sched = (vm16_sched_t *)calloc(1, sizeof(vm16_sched_t));
+    if(p_sched == NULL) {
+        return NULL;
+    }
+    if(posix_memalign((void **)&p_sched->p_workers, CACHE_LINE, num_threads * sizeof(worker_t)) != 0) {
+        free(p_sched);
+        return NULL;
+    }
+    memset(p_sched->p_workers, 0, num_threads * sizeof(worker_t));
+    p_sched->p_threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    pthread_mutex_init(&p_sched->mutex, NULL);
+    pthread_cond_init(&p_sched->start_cond, NULL);
+    pthread_cond_init(&p_sched->done_cond, NULL);
+    for(uint32_t i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&p_sched->p_workers[i].mutex, NULL);
+        p_sched->p_workers[i].p_sched = p_sched;
+        p_sched->p_workers[i].id = i;
+    }
+    if(p_sched->p_threads != NULL) {
+        for(uint32_t i = 1; i < num_threads; i++) {
+            if(pthread_create(&p_sched->p_threads[i - 1], NULL, worker_main, &p_sched->p_workers[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+    // continue with the started threads
+    p_sched->num_threads = started + 1;
+    return p_sched;
+}
+
+void vm16_sched_destroy(vm16_sched_t *p_sched) {
+    if(p_sched != NULL) {
+        pthread_mutex_lock(&p_sched->mutex);
+        p_sched->stop = true;
+        pthread_cond_broadcast(&p_sched->start_cond);
+        pthread_mutex_unlock(&p_sched->mutex);
+        for(uint32_t i = 1; i < p_sched->num_threads; i++) {
+            pthread_join(p_sched->p_threads[i - 1], NULL);
+        }
+        for(uint32_t i = 0; i < p_sched->num_threads; i++) {
+            pthread_mutex_destroy(&p_sched->p_workers[i].mutex);
+        }
+        pthread_cond_destroy(&p_sched->done_cond);
+        pthread_cond_destroy(&p_sched->start_cond);
+        pthread_mutex_destroy(&p_sched->mutex);
+        free(p_sched->p_threads);
+        free(p_sched->p_workers);
+        free(p_sched);
+    }
+}
+
+uint32_t vm16_sched_num_threads(vm16_sched_t *p_sched) {
+    return p_sched != NULL ? p_sched->num_threads : 0;
+}
+
+uint32_t vm16_sched_run(vm16_sched_t *p_sched, vm16_t **pp_vms, uint32_t num, uint32_t *p_cycles, vm16_event_t *p_slots) {
+    uint32_t num_threads = p_sched->num_threads;
+    uint32_t num_stopped = 0;
+
+    if(num == 0) {
+        return 0;
+    }
+    for(uint32_t i = 0; i < num_threads; i++) {
+        p_sched->p_workers[i].lo = (uint32_t)(((uint64_t)num * i) / num_threads);
+        p_sched->p_workers[i].hi = (uint32_t)(((uint64_t)num * (i + 1)) / num_threads);
+    }
+    p_sched->pp_vms = pp_vms;
+    p_sched->p_cycles = p_cycles;
+    p_sched->p_slots = p_slots;
+
+    pthread_mutex_lock(&p_sched->mutex);
+    p_sched->busy = num_threads - 1;
+    p_sched->generation++;
+    pthread_cond_broadcast(&p_sched->start_cond);
+    pthread_mutex_unlock(&p_sched->mutex);
+
+    run_vms(p_sched, 0);
+
+    pthread_mutex_lock(&p_sched->mutex);
+    while(p_sched->busy > 0) {
+        pthread_cond_wait(&p_sched->done_cond, &p_sched->mutex);
+    }
+    pthread_mutex_unlock(&p_sched->mutex);
+
+    for(uint32_t i = 0; i < num; i++) {
+        if(p_slots[i].resp != VM16_OK) {
+            num_stopped++;
+        }
+    }
+    return num_stopped;
+}
+
+#else
+
+vm16_sched_t *vm16_sched_create(uint32_t num_threads) {
+    return NULL;
+}
+
+void vm16_sched_destroy(vm16_sched_t *p_sched) {
+}
+
+uint32_t vm16_sched_num_threads(vm16_sched_t *p_sched) {
+    return 0;
+}
+
+uint32_t vm16_sched_run(vm16_sched_t *p_sched, vm16_t **pp_vms, uint32_t num, uint32_t *p_cycles, vm16_event_t *p_slots) {
+    return 0;
+}
+
+#endif
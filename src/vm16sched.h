@@ -0,0 +1,61 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+** Parallel VM scheduler (fixed thread pool with work stealing)
+*/
+
+#ifndef vm16sched_h
+#define vm16sched_h
+
+#include "vm16.h"
+
+#if defined(__unix__) && !defined(VM16_NO_THREADS)
+#define VM16_THREADS
+#endif
+
+typedef struct vm16_sched_s vm16_sched_t;
+
+/*
+** Create a scheduler with 'num_threads' threads, inclusive the calling
+** thread of 'vm16_sched_run'. Returns NULL if threads are not available.
+*/
+vm16_sched_t *vm16_sched_create(uint32_t num_threads);
+
+/*
+** Stop all threads and free the scheduler
+*/
+void vm16_sched_destroy(vm16_sched_t *p_sched);
+
+/*
+** Return the number of threads
+*/
+uint32_t vm16_sched_num_threads(vm16_sched_t *p_sched);
+
+/*
+** Run 'num' independent VMs in parallel, each with the number of machine
+** cycles from 'p_cycles'. The result of each VM is parked in its slot
+** 'p_slots[i]' ('resp' is VM16_OK if the VM ran to the end), to be
+** processed by the caller afterwards.
+** Returns the number of VMs which stopped before the end.
+*/
+uint32_t vm16_sched_run(vm16_sched_t *p_sched, vm16_t **pp_vms, uint32_t num, uint32_t *p_cycles, vm16_event_t *p_slots);
+
+#endif
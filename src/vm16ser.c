@@ -0,0 +1,273 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+** Background serializer
+**
+** Storing many VMs (server shutdown, periodic storage) should not block the
+** server step. The VMs are copied by the calling thread (see 'vm16_copy'),
+** the copies are encoded by the worker thread. All jobs are kept in one
+** queue in the order of submission, 'p_todo' is the next job to be encoded.
+** The caller collects the encoded jobs from the head of the queue.
+** The released copies are kept by 'vm16_ser_collect' and reused by the
+** next 'vm16_ser_submit' (no allocation and page faults for the copy).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm16.h"
+#include "vm16sched.h"
+#include "vm16ser.h"
+
+#ifdef VM16_THREADS
+#include <pthread.h>
+#endif
+
+#define MAX_FREE        (8)
+
+struct vm16_ser_s {
+#ifdef VM16_THREADS
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t todo_cond;   // new job or stop
+    pthread_cond_t done_cond;   // job encoded
+#endif
+    bool threaded;              // worker thread is running
+    bool stop;
+    uint32_t num;               // number of jobs
+    vm16_ser_job_t *p_head;     // oldest job
+    vm16_ser_job_t *p_tail;     // newest job
+    vm16_ser_job_t *p_todo;     // next job to be encoded
+    uint32_t num_free;
+    vm16_t *p_free[MAX_FREE];   // released copies (used by the caller only)
+};
+
+static void encode(vm16_ser_job_t *p_job) {
+    vm16_t *C = p_job->C;
+    uint32_t size;
+
+    switch(p_job->type) {
+        case VM16_SER_STRING: size = vm16_get_string_size(C); break;
+        case VM16_SER_SNAPSHOT: size = vm16_get_snapshot_size(C); break;
+        default: size = vm16_get_compressed_size(C); break;
+    }
+    p_job->p_data = (uint8_t *)malloc(size);
+    if(p_job->p_data != NULL) {
+        switch(p_job->type) {
+            case VM16_SER_STRING:
+                size = (vm16_get_vm_as_str(C, size, (char *)p_job->p_data) != NULL) ? size : 0;
+                break;
+            case VM16_SER_SNAPSHOT: size = vm16_get_snapshot(C, size, p_job->p_data); break;
+            case VM16_SER_COMPRESSED: size = vm16_get_compressed(C, size, p_job->p_data); break;
+            default: size = vm16_get_delta(C, size, p_job->p_data); break;
+        }
+        if((size > 0) && (p_job->type >= VM16_SER_COMPRESSED)) {
+            // the buffer has the size of the worst case
+            uint8_t *p_data = (uint8_t *)realloc(p_job->p_data, size);
+            if(p_data != NULL) {
+                p_job->p_data = p_data;
+            }
+        }
+        p_job->size = size;
+    }
+    vm16_release(C);
+}
+
+static vm16_t *get_block(vm16_ser_t *p_ser, vm16_t *C) {
+    for(uint32_t i = 0; i < p_ser->num_free; i++) {
+        vm16_t *C2 = p_ser->p_free[i];
+        if(C2->mem_size == C->mem_size) {
+            p_ser->p_free[i] = p_ser->p_free[--p_ser->num_free];
+            return C2;
+        }
+    }
+    return NULL;
+}
+
+static void put_block(vm16_ser_t *p_ser, vm16_t *C) {
+    if(p_ser->num_free < MAX_FREE) {
+        p_ser->p_free[p_ser->num_free++] = C;
+    } else {
+        free(C);
+    }
+}
+
+#ifdef VM16_THREADS
+static void *worker_main(void *arg) {
+    vm16_ser_t *p_ser = (vm16_ser_t *)arg;
+
+    pthread_mutex_lock(&p_ser->mutex);
+    while(1) {
+        vm16_ser_job_t *p_job;
+        while(!p_ser->stop && (p_ser->p_todo == NULL)) {
+            pthread_cond_wait(&p_ser->todo_cond, &p_ser->mutex);
+        }
+        if(p_ser->stop) {
+            break;
+        }
+        p_job = p_ser->p_todo;
+        p_ser->p_todo = p_job->p_next;
+        pthread_mutex_unlock(&p_ser->mutex);
+
+        encode(p_job);
+
+        pthread_mutex_lock(&p_ser->mutex);
+        p_job->done = true;
+        pthread_cond_broadcast(&p_ser->done_cond);
+    }
+    pthread_mutex_unlock(&p_ser->mutex);
+    return NULL;
+}
+#endif
+
+vm16_ser_t *vm16_ser_create(void) {
+    vm16_ser_t *p_ser = (vm16_ser_t *)calloc(1, sizeof(vm16_ser_t));
+    if(p_ser == NULL) {
+        return NULL;
+    }
+#ifdef VM16_THREADS
+    pthread_mutex_init(&p_ser->mutex, NULL);
+    pthread_cond_init(&p_ser->todo_cond, NULL);
+    pthread_cond_init(&p_ser->done_cond, NULL);
+    // continue without thread on error
+    p_ser->threaded = pthread_create(&p_ser->thread, NULL, worker_main, p_ser) == 0;
+#endif
+    return p_ser;
+}
+
+void vm16_ser_destroy(vm16_ser_t *p_ser) {
+    if(p_ser != NULL) {
+#ifdef VM16_THREADS
+        pthread_mutex_lock(&p_ser->mutex);
+        p_ser->stop = true;
+        pthread_cond_broadcast(&p_ser->todo_cond);
+        pthread_mutex_unlock(&p_ser->mutex);
+        if(p_ser->threaded) {
+            pthread_join(p_ser->thread, NULL);
+        }
+        pthread_cond_destroy(&p_ser->done_cond);
+        pthread_cond_destroy(&p_ser->todo_cond);
+        pthread_mutex_destroy(&p_ser->mutex);
+#endif
+        while(p_ser->p_head != NULL) {
+            vm16_ser_job_t *p_job = p_ser->p_head;
+            p_ser->p_head = p_job->p_next;
+            vm16_ser_free_job(p_job);
+        }
+        for(uint32_t i = 0; i < p_ser->num_free; i++) {
+            free(p_ser->p_free[i]);
+        }
+        free(p_ser);
+    }
+}
+
+bool vm16_ser_submit(vm16_ser_t *p_ser, vm16_t *C, uint8_t type, const char *p_tag, uint32_t tag_len) {
+    vm16_ser_job_t *p_job;
+    vm16_t *C2;
+
+    if(type > VM16_SER_DELTA) {
+        return false;
+    }
+    p_job = (vm16_ser_job_t *)calloc(1, sizeof(vm16_ser_job_t) + tag_len);
+    if(p_job == NULL) {
+        return false;
+    }
+    C2 = get_block(p_ser, C);
+    p_job->C = vm16_copy(C, C2, type == VM16_SER_DELTA);
+    if(p_job->C == NULL) {
+        free(C2);
+        free(p_job);
+        return false;
+    }
+    p_job->type = type;
+    p_job->tag_len = tag_len;
+    memcpy(p_job->tag, p_tag, tag_len);
+    if(!p_ser->threaded) {
+        encode(p_job);
+        p_job->done = true;
+    }
+#ifdef VM16_THREADS
+    pthread_mutex_lock(&p_ser->mutex);
+#endif
+    if(p_ser->p_tail != NULL) {
+        p_ser->p_tail->p_next = p_job;
+    } else {
+        p_ser->p_head = p_job;
+    }
+    p_ser->p_tail = p_job;
+    p_ser->num++;
+#ifdef VM16_THREADS
+    if(p_ser->threaded) {
+        if(p_ser->p_todo == NULL) {
+            p_ser->p_todo = p_job;
+        }
+        pthread_cond_signal(&p_ser->todo_cond);
+    }
+    pthread_mutex_unlock(&p_ser->mutex);
+#endif
+    return true;
+}
+
+uint32_t vm16_ser_num_jobs(vm16_ser_t *p_ser) {
+    return p_ser->num;
+}
+
+vm16_ser_job_t *vm16_ser_collect(vm16_ser_t *p_ser, bool wait) {
+    vm16_ser_job_t *p_job = NULL;
+#ifdef VM16_THREADS
+    pthread_mutex_lock(&p_ser->mutex);
+    while(wait && (p_ser->p_head != NULL) && !p_ser->p_head->done) {
+        pthread_cond_wait(&p_ser->done_cond, &p_ser->mutex);
+    }
+#endif
+    if((p_ser->p_head != NULL) && p_ser->p_head->done) {
+        p_job = p_ser->p_head;
+        p_ser->p_head = p_job->p_next;
+        if(p_ser->p_head == NULL) {
+            p_ser->p_tail = NULL;
+        }
+        p_ser->num--;
+        p_job->p_next = NULL;
+    }
+#ifdef VM16_THREADS
+    pthread_mutex_unlock(&p_ser->mutex);
+#endif
+    if(p_job != NULL) {
+        // released by 'encode'
+        put_block(p_ser, p_job->C);
+        p_job->C = NULL;
+    }
+    return p_job;
+}
+
+void vm16_ser_free_job(vm16_ser_job_t *p_job) {
+    if(p_job != NULL) {
+        if(p_job->C != NULL) {
+            vm16_release(p_job->C);
+            free(p_job->C);
+        }
+        free(p_job->p_data);
+        free(p_job);
+    }
+}
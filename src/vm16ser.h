@@ -0,0 +1,84 @@
+/*
+VM16
+Copyright (C) 2019-2023 Joe <iauit@gmx.de>
+
+This file is part of VM16.
+
+VM16 is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VM16 is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VM16.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+** Background serializer (worker thread which encodes copies of the VMs)
+*/
+
+#ifndef vm16ser_h
+#define vm16ser_h
+
+#include "vm16.h"
+
+#define VM16_SER_STRING     (0)  // ASCII string (see 'vm16_get_vm_as_str')
+#define VM16_SER_SNAPSHOT   (1)  // binary snapshot (see 'vm16_get_snapshot')
+#define VM16_SER_COMPRESSED (2)  // compressed snapshot (see 'vm16_get_compressed')
+#define VM16_SER_DELTA      (3)  // delta snapshot (see 'vm16_get_delta')
+
+typedef struct vm16_ser_job_s {
+    struct vm16_ser_job_s *p_next;  // job queue
+    vm16_t *C;              // copy of the VM (released after encoding)
+    uint8_t type;           // VM16_SER_...
+    bool done;              // job is encoded
+    uint32_t size;          // size of 'p_data' (0 on error)
+    uint8_t *p_data;        // encoded VM
+    uint32_t tag_len;       // length of 'tag'
+    char tag[1];            // tag of the caller (like the storage key)
+}vm16_ser_job_t;
+
+typedef struct vm16_ser_s vm16_ser_t;
+
+/*
+** Create a serializer with one worker thread. Without threads, the
+** VMs are encoded by 'vm16_ser_submit'. Returns NULL on error.
+*/
+vm16_ser_t *vm16_ser_create(void);
+
+/*
+** Stop the worker thread and free the serializer and all jobs
+*/
+void vm16_ser_destroy(vm16_ser_t *p_ser);
+
+/*
+** Copy the VM (see 'vm16_copy') and queue it to be encoded as 'type'
+** (VM16_SER_...). The VM can be used or freed afterwards.
+** Returns false on error.
+*/
+bool vm16_ser_submit(vm16_ser_t *p_ser, vm16_t *C, uint8_t type, const char *p_tag, uint32_t tag_len);
+
+/*
+** Return the number of jobs which are not collected so far
+*/
+uint32_t vm16_ser_num_jobs(vm16_ser_t *p_ser);
+
+/*
+** Return the next encoded job (in the order of 'vm16_ser_submit'), or NULL.
+** With 'wait', the call blocks until the next job is encoded.
+** The job has to be freed with 'vm16_ser_free_job'.
+*/
+vm16_ser_job_t *vm16_ser_collect(vm16_ser_t *p_ser, bool wait);
+
+/*
+** Free the job and the encoded data
+*/
+void vm16_ser_free_job(vm16_ser_job_t *p_job);
+
+#endif
@@ -0,0 +1,74 @@
+--[[
+	vm16
+	====
+
+	Copyright (C) 2019-2023 Joachim Stolberg
+
+	GPL v3
+	See LICENSE.txt for more information
+
+	Call overhead of the Lua C API binding (vm16lib) compared with the
+	LuaJIT FFI binding (vm16ffi.lua), run with:
+	luajit test/bench_ffi.lua
+]]--
+
+local MP = "/home/joachim/minetest5/mods/vm16"
+local vm16lib = require("vm16lib")
+local vm16ffi = assert(loadfile(MP.."/vm16ffi.lua"))(_G)
+assert(vm16ffi, "LuaJIT FFI is not available")
+
+local NUM = 10000000
+
+local vm = vm16lib.init(1)
+local p = vm16ffi.cast(vm)
+vm16lib.write_mem(vm, 0, {0x0000, 0x1200, 0x0000})  -- nop / jump #0
+
+local function bench(name, func)
+	local t = os.clock()
+	func()
+	t = os.clock() - t
+	print(string.format("%-12s %6.1f ns/call", name, t * 1000000000 / NUM))
+end
+
+bench("lib.peek", function()
+	local peek = vm16lib.peek
+	local sum = 0
+	for i = 1, NUM do sum = sum + peek(vm, i) end
+end)
+
+bench("ffi.peek", function()
+	local peek = vm16ffi.peek
+	local sum = 0
+	for i = 1, NUM do sum = sum + peek(p, i) end
+end)
+
+bench("lib.poke", function()
+	local poke = vm16lib.poke
+	for i = 1, NUM do poke(vm, 0x100 + i % 256, i) end
+end)
+
+bench("ffi.poke", function()
+	local poke = vm16ffi.poke
+	for i = 1, NUM do poke(p, 0x100 + i % 256, i) end
+end)
+
+bench("lib.run", function()
+	local run = vm16lib.run
+	for i = 1, NUM do run(vm, 1) end
+end)
+
+bench("ffi.run", function()
+	local run = vm16ffi.run
+	for i = 1, NUM do run(p, 1) end
+end)
+
+bench("lib.get_pc", function()
+	local get_pc = vm16lib.get_pc
+	local sum = 0
+	for i = 1, NUM do sum = sum + get_pc(vm) end
+end)
+
+bench("ffi.pcnt", function()
+	local sum = 0
+	for i = 1, NUM do sum = sum + p.pcnt end
+end)
@@ -0,0 +1,132 @@
+--[[
+	vm16
+	====
+
+	Copyright (C) 2019-2023 Joachim Stolberg
+
+	GPL v3
+	See LICENSE.txt for more information
+
+	Size and save/load time of the VM storage formats (ASCII string,
+	binary snapshot, compressed snapshot) for the compiler test programs,
+	loaded into 1 Kword (demo CPU) and 64 Kword VMs and run for a while.
+	Run with: lua test/bench_snapshot.lua
+]]--
+
+local MP = '/home/joachim/Projekte/lua/minetest_unittest/lib'
+
+core = {}
+
+dofile(MP.."/misc_helpers.lua")
+dofile(MP.."/vector.lua")
+
+minetest = core
+-------------------------------------------------------------------------------
+-------------------------------------------------------------------------------
+local MP = "/home/joachim/minetest5/mods/vm16"
+vm16 = {}
+local vm16lib = require("vm16lib")
+assert(loadfile(MP.."/api.lua"))(vm16lib)
+dofile(MP.."/lib.lua")
+dofile(MP.."/asm/asm.lua")
+dofile(MP.."/asm/tools.lua")
+
+dofile(MP.."/bcomp/bgenerator.lua")
+dofile(MP.."/bcomp/bscanner.lua")
+dofile(MP.."/bcomp/bsymbols.lua")
+dofile(MP.."/bcomp/bexpression.lua")
+dofile(MP.."/bcomp/bconst_expr.lua")
+dofile(MP.."/bcomp/bparser.lua")
+dofile(MP.."/bcomp/bcompiler.lua")
+
+local NUM = 100
+
+local startup_code1 = {
+	"call main",
+	"halt",
+}
+
+local startup_code2 = {
+	-- Reserved area 0002 - 0007:
+	"jump 8",
+	".org 8",
+	"call @init",
+	"call init",
+	"@loop:",
+	"call loop",
+	"nop",
+	"jump @loop",
+}
+
+local function read_file(pos, filename)
+	local file = io.open(MP .. "/test/compiler/" .. filename, "rt")
+	if file then
+		local text = file:read("*all")
+		file:close()
+		return text
+	end
+end
+
+-- Compile the program and load it into a new VM, like the debugger does
+local function load_vm(filename, size)
+	local pos = {x=0, y=0, z=0}
+	local sts, obj = vm16.compile(pos, filename, read_file, {startup_code = startup_code1})
+	if not sts then
+		-- program with 'init' and 'loop' function
+		sts, obj = vm16.compile(pos, filename, read_file, {startup_code = startup_code2})
+		if not sts then
+			return
+		end
+	end
+	local vm = vm16lib.init(size)
+	for _, item in ipairs(obj.lCode) do
+		local ctype, _, address, opcodes = unpack(item)
+		if ctype == "code" then
+			for i, opc in pairs(opcodes or {}) do
+				vm16lib.poke(vm, address + i - 1, opc)
+			end
+		end
+	end
+	vm16lib.set_pc(vm, 0)
+	vm16lib.run(vm, 10000)
+	return vm
+end
+
+local function bench(vms, get, set)
+	local bytes = 0
+	local t = os.clock()
+	local strings = {}
+	for i = 1, NUM do
+		for j, vm in ipairs(vms) do
+			strings[j] = get(vm)
+		end
+	end
+	local t_save = os.clock() - t
+	for j = 1, #vms do
+		bytes = bytes + #strings[j]
+	end
+	t = os.clock()
+	for i = 1, NUM do
+		for j, vm in ipairs(vms) do
+			set(vm, strings[j])
+		end
+	end
+	local t_load = os.clock() - t
+	return bytes, t_save * 1000000 / NUM, t_load * 1000000 / NUM
+end
+
+for _, size in ipairs({4, 10}) do
+	local vms = {}
+	for i = 1, 18 do
+		vms[#vms + 1] = load_vm(string.format("test%02u.c", i), size)
+	end
+	print(string.format("%u VMs with %u words:", #vms, 64 * 2^size))
+	for _, item in ipairs({
+		{"string", vm16lib.get_vm, vm16lib.set_vm},
+		{"snapshot", vm16lib.get_snapshot, vm16lib.set_snapshot},
+		{"compressed", function(vm) return vm16lib.get_snapshot(vm, true) end, vm16lib.set_snapshot},
+	}) do
+		local bytes, t_save, t_load = bench(vms, item[2], item[3])
+		print(string.format("  %-12s %8u bytes %8.0f us save %8.0f us load", item[1], bytes, t_save, t_load))
+	end
+end
@@ -2,7 +2,14 @@
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
 #include "../src/vm16.h"
+#include "../src/vm16sched.h"
+#include "../src/vm16reg.h"
+#include "../src/vm16pool.h"
+#include "../src/vm16lz.h"
+#include "../src/vm16ser.h"
 
 
 void dump(vm16_t *C) {
@@ -21,6 +28,11 @@ void test1(void) {
         0xFFFF, 0x1800, 0x2220, 0x1000, 0x2090, 0x1001, 0x2101, 0x2880,
         0x2142, 0x2143, 0x1C00
     };
+    static uint16_t loop[] = {
+        0x2010, 0x0000, 0x3010, 0x0001, 0x2020, 0x4030, 0x00FF, 0x4841,
+        0x2100, 0x2880, 0x4090, 0x00FF, 0x8C30, 0x0000, 0x1200, 0x0114,
+        0x1200, 0x0102, 0x0000, 0x0000, 0x6800, 0x6C60, 0x1200, 0x0102
+    };
     clock_t t;
     uint32_t ran;
     int64_t num_cycles;
@@ -58,6 +70,14 @@ void test1(void) {
     t = clock() - t;
     printf("Performance = %li MIPS\n", ran / t);
 
+    // instruction mix with changing dispatch targets
+    vm16_write_mem(C, 0x100, sizeof(loop) / 2, loop);
+    vm16_set_pc(C, 0x100);
+    t = clock();
+    vm16_run(C, 50000000, &ran);
+    t = clock() - t;
+    printf("Performance = %li MIPS (mixed)\n", ran / t);
+
     // test some random code to try to break the VM
     for(int i=0; i<10000; i++) {
         for(int ii=0; ii<4096; ii++) {
@@ -70,6 +90,7 @@ void test1(void) {
             num_cycles = num_cycles - ran;
         }
     }
+    dump(C);
 
     free(C);
 }
@@ -231,6 +252,1402 @@ void test6(void) {
     free(C);
 }
 
+// decode cache test, random (self-modifying) code has to run
+// identically with and without cache
+void test7(void) {
+    uint32_t ran1, ran2;
+    uint16_t val;
+    int res1, res2;
+    uint32_t size = vm16_calc_size(3);
+    vm16_t *C1 = (vm16_t *)malloc(size);
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    vm16_init(C1, size);
+    vm16_init(C2, size);
+    printf("Test decode cache...");
+    if(!vm16_set_decode_cache(C2, true)) {
+        printf("(not available)...");
+    }
+    for(int i=0; i<1000; i++) {
+        for(int ii=0; ii<512; ii++) {
+            val = (uint16_t)random();
+            vm16_poke(C1, ii, val);
+            vm16_poke(C2, ii, val);
+        }
+        for(int ii=0; ii<100; ii++) {
+            res1 = vm16_run(C1, 1000, &ran1);
+            res2 = vm16_run(C2, 1000, &ran2);
+            assert(res1 == res2);
+            assert(memcmp(&C1->areg, &C2->areg, 14 * sizeof(uint16_t)) == 0);
+            assert(memcmp(C1->memory, C2->memory, 512 * sizeof(uint16_t)) == 0);
+        }
+    }
+    printf("ok\n");
+
+    vm16_release(C2);
+    free(C1);
+    free(C2);
+}
+
+// true if the process has pages which are writable and executable
+static bool has_wx_pages(void) {
+    char line[256];
+    bool res = false;
+    FILE *fp = fopen("/proc/self/maps", "r");
+    if(fp != NULL) {
+        while(fgets(line, sizeof(line), fp) != NULL) {
+            if(strstr(line, " rwx") != NULL) {
+                res = true;
+            }
+        }
+        fclose(fp);
+    }
+    return res;
+}
+
+// JIT test, random (self-modifying) code has to run identically
+// with the interpreter and with the compiled blocks
+void test8(void) {
+    static uint16_t loop[] = {
+        0x2010, 0x0000, 0x3010, 0x0001, 0x2020, 0x4030, 0x00FF, 0x4841,
+        0x2100, 0x2880, 0x4090, 0x00FF, 0x8C30, 0x0000, 0x1200, 0x0114,
+        0x1200, 0x0102, 0x0000, 0x0000, 0x6800, 0x6C60, 0x1200, 0x0102
+    };
+    clock_t t;
+    uint32_t ran1, ran2;
+    uint16_t val;
+    int res1, res2;
+    uint32_t size = vm16_calc_size(3);
+    vm16_t *C1 = (vm16_t *)malloc(size);
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    vm16_init(C1, size);
+    vm16_init(C2, size);
+    printf("Test jit...");
+    if(!vm16_set_jit(C2, true)) {
+        printf("(not available)...");
+    }
+    for(int i=0; i<1000; i++) {
+        for(int ii=0; ii<512; ii++) {
+            val = (uint16_t)random();
+            // more branches to get hot blocks
+            if((ii % 8) == 7) {
+                val = (val & 0x03FF) | 0x7400;  // dbnz
+            }
+            vm16_poke(C1, ii, val);
+            vm16_poke(C2, ii, val);
+        }
+        for(int ii=0; ii<100; ii++) {
+            res1 = vm16_run(C1, 1000, &ran1);
+            res2 = vm16_run(C2, 1000, &ran2);
+            assert(res1 == res2);
+            assert((res1 == VM16_ERROR) || (ran1 == ran2));
+            assert(memcmp(&C1->areg, &C2->areg, 14 * sizeof(uint16_t)) == 0);
+            assert(memcmp(C1->memory, C2->memory, 512 * sizeof(uint16_t)) == 0);
+        }
+    }
+    // the code buffer is not writable while it is executable
+    assert(!has_wx_pages());
+    printf("ok\n");
+
+    vm16_write_mem(C2, 0x100, sizeof(loop) / 2, loop);
+    vm16_set_pc(C2, 0x100);
+    t = clock();
+    vm16_run(C2, 50000000, &ran2);
+    t = clock() - t;
+    printf("Performance = %li MIPS (mixed, jit)\n", ran2 / t);
+
+    vm16_release(C2);
+    free(C1);
+    free(C2);
+}
+
+#define OP(op, m1, m2)  (uint16_t)(((op) << 10) | ((m1) << 5) | (m2))
+
+// random code with compiler-like instruction sequences
+static uint16_t gen_sequence(uint16_t *p_mem, uint16_t addr) {
+    uint16_t reg = random() % 4;
+    uint16_t skip = 0x23 + random() % 4;  // skne..skgt
+    uint16_t opd = random() % 2 ? 0x10 : 0x0C + random() % 2;  // #k, #0, #1
+    switch(random() % 5) {
+        case 0:  // skxx + jump
+            p_mem[addr++] = OP(skip, random() % 2 ? reg : 0x13, random() % 2 ? opd : 0x13);
+            p_mem[addr++] = random() % 8;
+            p_mem[addr++] = random() % 8;
+            p_mem[addr++] = OP(0x04, 0x10, 0);
+            p_mem[addr++] = random() % 512;
+            break;
+        case 1:  // inc/dec + jump, [SP+n] modifies the sequence
+            p_mem[addr++] = OP(0x08, 0x07, 0x10);  // move SP, #addr
+            p_mem[addr] = addr + 1;
+            addr++;
+            p_mem[addr++] = OP(0x0A + random() % 2, random() % 2 ? random() % 8 : 0x13, 0);
+            p_mem[addr++] = random() % 4;
+            p_mem[addr++] = OP(0x04, 0x10, 0);
+            p_mem[addr++] = random() % 512;
+            break;
+        case 2:  // load + add/sub
+            p_mem[addr++] = OP(0x08, reg, 0x13);
+            p_mem[addr++] = random() % 8;
+            p_mem[addr++] = OP(0x0C + random() % 2, random() % 8 ? reg : 0, opd);
+            p_mem[addr++] = random();
+            break;
+        case 3:  // load + skxx + jump
+            p_mem[addr++] = OP(0x08, reg, 0x13);
+            p_mem[addr++] = random() % 8;
+            p_mem[addr++] = OP(skip, reg, opd);
+            p_mem[addr++] = random() % 8;
+            p_mem[addr++] = OP(0x04, 0x10, 0);
+            p_mem[addr++] = random() % 512;
+            break;
+        default:  // store to [SP+n] (self-modifying)
+            p_mem[addr++] = OP(0x08, 0x13, random() % 8);
+            p_mem[addr++] = random() % 8;
+            break;
+    }
+    return addr;
+}
+
+// fusion test, fused instruction sequences have to run identically
+// to single instructions, also with small cycle numbers
+void test9(void) {
+    static uint16_t loop[] = {
+        OP(0x08, 0x07, 0x10), 0x0300,   // move SP, #300
+        OP(0x08, 0x13, 0x0C), 0x0000,   // move [SP+0], #0
+        OP(0x08, 0x00, 0x13), 0x0000,   // move A, [SP+0]
+        OP(0x25, 0x00, 0x10), 1000,     // sklt A, #1000
+        OP(0x04, 0x10, 0x00), 0x0102,   // jump #102
+        OP(0x08, 0x00, 0x13), 0x0001,   // move A, [SP+1]
+        OP(0x0C, 0x00, 0x10), 0x0003,   // add A, #3
+        OP(0x08, 0x13, 0x00), 0x0001,   // move [SP+1], A
+        OP(0x0A, 0x13, 0x00), 0x0000,   // inc [SP+0]
+        OP(0x04, 0x10, 0x00), 0x0104,   // jump #104
+    };
+    uint16_t code[512 + 8];
+    uint32_t hits[VM16_NUM_FUSIONS];
+    uint32_t ran1, ran2, num;
+    int res1, res2;
+    clock_t t;
+    uint32_t size = vm16_calc_size(3);
+    vm16_t *C1 = (vm16_t *)malloc(size);
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    vm16_init(C1, size);
+    vm16_init(C2, size);
+    printf("Test fusion...");
+    if(!vm16_set_decode_cache(C2, true)) {
+        printf("(not available)...");
+    }
+    for(int i=0; i<2000; i++) {
+        uint16_t addr = 0;
+        while(addr < 512) {
+            addr = gen_sequence(code, addr);
+        }
+        vm16_write_mem(C1, 0, 512, code);
+        vm16_write_mem(C2, 0, 512, code);
+        for(int ii=0; ii<100; ii++) {
+            num = 1 + random() % 64;
+            res1 = vm16_run(C1, num, &ran1);
+            res2 = vm16_run(C2, num, &ran2);
+            assert(res1 == res2);
+            assert((res1 == VM16_ERROR) || (ran1 == ran2));
+            assert(memcmp(&C1->areg, &C2->areg, 14 * sizeof(uint16_t)) == 0);
+            assert(memcmp(C1->memory, C2->memory, 512 * sizeof(uint16_t)) == 0);
+        }
+    }
+    printf("ok\n");
+
+    // fusion report of a compiled 'for' loop
+    vm16_get_fusion_stats(C2, VM16_NUM_FUSIONS, hits, true);
+    vm16_write_mem(C2, 0x100, sizeof(loop) / 2, loop);
+    vm16_set_pc(C2, 0x100);
+    t = clock();
+    vm16_run(C2, 50000000, &ran2);
+    t = clock() - t;
+    printf("Performance = %li MIPS (loop)\n", ran2 / t);
+    num = vm16_get_fusion_stats(C2, VM16_NUM_FUSIONS, hits, true);
+    for(uint32_t i=0; i<num; i++) {
+        printf("  %-16s %u\n", vm16_fusion_name(i), hits[i]);
+    }
+
+    vm16_release(C2);
+    free(C1);
+    free(C2);
+}
+
+// all memory sizes, specialized and generic run loops have to give the same result
+void test10(void) {
+    static uint16_t loop[] = {
+        OP(0x08, 0x00, 0x0C),           // move A, #0
+        OP(0x0C, 0x00, 0x0D),           // add A, #1
+        OP(0x08, 0x01, 0x00),           // move B, A
+        OP(0x10, 0x01, 0x10), 0x000F,   // and B, #0F
+        OP(0x1A, 0x00, 0x00),           // push A
+        OP(0x1B, 0x03, 0x00),           // pop D
+        OP(0x23, 0x01, 0x0C),           // skne B, #0
+        OP(0x08, 0x06, 0x10), 0x000C,   // move PC, #0C
+        OP(0x04, 0x10, 0x00), 0x0001,   // jump #1
+        OP(0x0A, 0x02, 0x00),           // inc C
+        OP(0x08, 0x04, 0x06),           // move X, PC
+        OP(0x04, 0x10, 0x00), 0x0001,   // jump #1
+    };
+    uint16_t regs[2][8];
+    uint32_t ran[2];
+    long mips[11];
+    clock_t t;
+
+    printf("Test run loops...");
+    for(int size=0; size<=10; size++) {
+        uint32_t vm_size = vm16_calc_size(size);
+        vm16_t *C = (vm16_t *)malloc(vm_size);
+        for(int cached=0; cached<2; cached++) {
+            vm16_init(C, vm_size);
+            vm16_set_decode_cache(C, cached);
+            vm16_write_mem(C, 0, sizeof(loop) / 2, loop);
+            t = clock();
+            vm16_run(C, 20000000, &ran[cached]);
+            t = clock() - t;
+            if(size == 0) {
+                memcpy(regs[cached], C->regs, sizeof(C->regs));
+            }
+            assert(memcmp(regs[cached], C->regs, sizeof(C->regs)) == 0);
+            vm16_release(C);
+        }
+        assert(ran[0] == ran[1]);
+        mips[size] = ran[1] / t;
+        free(C);
+    }
+    assert(memcmp(regs[0], regs[1], sizeof(regs[0])) == 0);
+    printf("ok\n");
+    for(int size=0; size<=10; size++) {
+        printf("  size %2u: %li MIPS\n", size, mips[size]);
+    }
+}
+
+void test11(void) {
+    static uint16_t code[3][2] = {
+        {OP(0x04, 0x10, 0x00), 0x0000}, // jump #0
+        {OP(0x0A, 0x00, 0x00), OP(0x07, 0x00, 0x00)}, // inc A / halt
+        {OP(0x00, 0x00, 0x00), 0x0000}, // nop
+    };
+    vm16_t *vms[3];
+    uint32_t cycles[3] = {1000, 1000, 1000};
+    vm16_event_t events[3];
+    uint32_t num;
+    uint32_t size = vm16_calc_size(1);
+
+    printf("Test batch run...");
+    for(int i=0; i<3; i++) {
+        vms[i] = (vm16_t *)malloc(size);
+        vm16_init(vms[i], size);
+        vm16_write_mem(vms[i], 0, 2, code[i]);
+    }
+    num = vm16_run_batch(vms, 3, cycles, events);
+    assert(num == 2);
+    assert((events[0].index == 1) && (events[0].resp == VM16_HALT) && (events[0].ran == 2));
+    assert((events[1].index == 2) && (events[1].resp == VM16_NOP) && (events[1].ran == 1));
+    num = vm16_run_batch(vms, 1, cycles, events);
+    assert(num == 0);
+    for(int i=0; i<3; i++) {
+        free(vms[i]);
+    }
+    printf("ok\n");
+}
+
+static double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// thread pool scheduler has to give the same result as the batch run
+void test12(void) {
+    static uint16_t code[2][3] = {
+        {OP(0x0A, 0x00, 0x00), OP(0x04, 0x10, 0x00), 0x0000}, // inc A / jump #0
+        {OP(0x0A, 0x00, 0x00), OP(0x07, 0x00, 0x00), 0x0000}, // inc A / halt
+    };
+    enum {NUM_VMS = 64};
+    vm16_t *vms[2][NUM_VMS];
+    uint32_t cycles[NUM_VMS];
+    vm16_event_t events[NUM_VMS];
+    vm16_event_t slots[NUM_VMS];
+    uint32_t size = vm16_calc_size(1);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads = cpus > 4 ? (uint32_t)cpus : 4;
+    vm16_sched_t *p_sched;
+    uint32_t num;
+
+    printf("Test sched run...");
+    for(int n=0; n<2; n++) {
+        for(int i=0; i<NUM_VMS; i++) {
+            vms[n][i] = (vm16_t *)malloc(size);
+            vm16_init(vms[n][i], size);
+            vm16_write_mem(vms[n][i], 0, 3, code[(i % 5) == 0]);
+            cycles[i] = 1000 + i;
+        }
+    }
+    num = vm16_run_batch(vms[0], NUM_VMS, cycles, events);
+    p_sched = vm16_sched_create(4);
+    if(p_sched != NULL) {
+        assert(vm16_sched_run(p_sched, vms[1], NUM_VMS, cycles, slots) == num);
+        for(uint32_t i=0, j=0; i<NUM_VMS; i++) {
+            assert(slots[i].index == i);
+            if(slots[i].resp != VM16_OK) {
+                assert(slots[i].resp == events[j].resp);
+                assert(slots[i].ran == events[j].ran);
+                assert(events[j++].index == i);
+            }
+            assert(memcmp(vms[0][i]->regs, vms[1][i]->regs, sizeof(vms[0][i]->regs)) == 0);
+        }
+        vm16_sched_destroy(p_sched);
+    }
+    printf("ok\n");
+
+    // scaling with long running VMs
+    for(int i=0; i<NUM_VMS; i++) {
+        vm16_write_mem(vms[1][i], 0, 3, code[0]);
+        vm16_set_pc(vms[1][i], 0);
+        cycles[i] = 2000000;
+    }
+    for(uint32_t threads=1; threads<=max_threads; threads*=2) {
+        double t;
+        p_sched = vm16_sched_create(threads);
+        if(p_sched == NULL) {
+            break;
+        }
+        t = wall_time();
+        vm16_sched_run(p_sched, vms[1], NUM_VMS, cycles, slots);
+        t = wall_time() - t;
+        printf("  threads %2u: %li MIPS\n", vm16_sched_num_threads(p_sched), (long)(NUM_VMS * 2.0 / t));
+        vm16_sched_destroy(p_sched);
+    }
+    for(int n=0; n<2; n++) {
+        for(int i=0; i<NUM_VMS; i++) {
+            free(vms[n][i]);
+        }
+    }
+}
+
+// I/O ports served within 'vm16_run'
+void test13(void) {
+    static uint16_t code[] = {
+        OP(0x19, 0x10, 0x00), 0x0001,   // out #1, A
+        OP(0x0A, 0x00, 0x00),           // inc A
+        OP(0x18, 0x01, 0x10), 0x0002,   // in B, #2
+        OP(0x19, 0x10, 0x01), 0x0003,   // out #3, B
+        OP(0x04, 0x10, 0x00), 0x0000,   // jump #0
+    };
+    uint32_t size = vm16_calc_size(1);
+    vm16_t *C = (vm16_t *)malloc(size);
+    uint16_t buffer[8] = {7, 8, 9};
+    uint16_t addrs[VM16_MAX_PORTS];
+    uint32_t ran;
+    clock_t t;
+
+    printf("Test I/O ports...");
+    vm16_init(C, size);
+    vm16_write_mem(C, 0, sizeof(code) / 2, code);
+    // not registered: leave the run loop
+    assert(vm16_run(C, 100, &ran) == VM16_OUT);
+    assert((ran == 1) && (C->l_addr == 1));
+    vm16_set_pc(C, 0);
+    assert(vm16_register_port(C, 1, VM16_PORT_LATCH, 0) == true);
+    assert(vm16_register_port(C, 2, VM16_PORT_RING, 3) == true);
+    assert(vm16_register_port(C, 3, VM16_PORT_RING, 4) == true);
+    assert(vm16_register_port(C, 4, 3, 0) == false);
+    assert(vm16_get_ports(C, VM16_MAX_PORTS, addrs) == 3);
+    assert(vm16_port_type(C, 2) == VM16_PORT_RING);
+    assert(vm16_write_port(C, 2, 8, buffer) == 4);  // ring size rounded up to 4
+    // RX buffer empty after 4 loops
+    assert(vm16_run(C, 100, &ran) == VM16_IN);
+    assert(ran == 23);
+    assert(vm16_read_port(C, 1, 8, buffer) == 1);
+    assert(buffer[0] == 4);
+    assert(vm16_read_port(C, 3, 8, buffer) == 4);
+    assert((buffer[0] == 7) && (buffer[1] == 8) && (buffer[2] == 9) && (buffer[3] == 0));
+    assert(vm16_read_port(C, 3, 8, buffer) == 0);
+    // latched ports only
+    assert(vm16_register_port(C, 2, VM16_PORT_LATCH, 0) == true);
+    assert(vm16_register_port(C, 3, VM16_PORT_LATCH, 0) == true);
+    vm16_set_pc(C, 0);
+    t = clock();
+    assert(vm16_run(C, 20000000, &ran) == VM16_OK);
+    t = clock() - t;
+    assert(vm16_register_port(C, 3, VM16_PORT_NONE, 0) == true);
+    assert(vm16_port_type(C, 3) == VM16_PORT_NONE);
+    vm16_release(C);
+    free(C);
+    printf("ok\n");
+    printf("  ports: %li MIPS\n", ran / t);
+}
+
+// buffered 'out' instructions
+void test14(void) {
+    static uint16_t code[] = {
+        OP(0x0A, 0x00, 0x00),           // inc A
+        OP(0x19, 0x10, 0x00), 0x0002,   // out #2, A
+        OP(0x04, 0x10, 0x00), 0x0000,   // jump #0
+    };
+    uint32_t size = vm16_calc_size(1);
+    vm16_t *C = (vm16_t *)malloc(size);
+    vm16_out_t records[8];
+    uint32_t ran;
+
+    printf("Test output buffer...");
+    vm16_init(C, size);
+    vm16_write_mem(C, 0, sizeof(code) / 2, code);
+    assert(vm16_set_out_buffer(C, 4, 10) == true);
+    // buffer full after 4 records
+    assert(vm16_run(C, 1000, &ran) == VM16_OUT);
+    assert(ran == 4 * (3 + 10) + 2);
+    assert((C->l_addr == 2) && (C->l_data == 5));
+    assert(vm16_read_out_buffer(C, 3, records) == 3);
+    assert((records[0].addr == 2) && (records[0].data == 1) && (records[2].data == 3));
+    assert(vm16_read_out_buffer(C, 8, records) == 1);
+    assert(records[0].data == 4);
+    // costs are charged within the run
+    assert(vm16_run(C, 26, &ran) == VM16_OK);
+    assert(vm16_read_out_buffer(C, 8, records) == 2);
+    assert(vm16_set_out_buffer(C, 0, 0) == true);
+    assert(vm16_run(C, 1000, &ran) == VM16_OUT);
+    assert(vm16_read_out_buffer(C, 8, records) == 0);
+    vm16_release(C);
+    free(C);
+    printf("ok\n");
+}
+
+static int32_t sys_double(vm16_t *C, uint16_t num, void *p_ctx) {
+    if(C->areg > 100) {
+        return -1;  // handled by the caller
+    }
+    C->areg = C->areg * 2;
+    (*(uint32_t *)p_ctx)++;
+    return 5;
+}
+
+// native system call handlers
+void test15(void) {
+    static uint16_t code[] = {
+        OP(0x0A, 0x00, 0x00),           // inc A
+        OP(0x02, 0x00, 0x01),           // sys #1
+        OP(0x02, 0x00, 0x00),           // sys #0
+        OP(0x04, 0x10, 0x00), 0x0000,   // jump #0
+    };
+    uint32_t size = vm16_calc_size(1);
+    vm16_t *C = (vm16_t *)malloc(size);
+    uint16_t buffer[8];
+    uint32_t calls = 0;
+    uint32_t ran;
+
+    printf("Test native sys...");
+    vm16_init(C, size);
+    vm16_write_mem(C, 0, sizeof(code) / 2, code);
+    assert(vm16_register_sys(C, 1, sys_double, &calls, false) == true);
+    assert(vm16_register_sys_buffer(C, 0, 8, 2, -1) == true);
+    assert(vm16_get_sys_ctx(C, 1) == &calls);
+    // A: 1, 2 / 3, 6 / 7, 14 / 15, 30 / 31, 62 / 63, 126 / 127 => Lua
+    assert(vm16_run(C, 1000, &ran) == VM16_SYS);
+    assert((C->l_addr == 1) && (C->areg == 127) && (calls == 6));
+    assert(ran == 6 * (5 + 2 + 4) + 2);
+    assert(vm16_read_sys_buffer(C, 0, 8, buffer) == 6);
+    assert((buffer[0] == 2) && (buffer[5] == 126));
+    assert(vm16_read_sys_buffer(C, 0, 8, buffer) == 0);
+    assert(vm16_read_sys_buffer(C, 1, 8, buffer) == 0);  // no buffer
+    // the output buffer keeps the handlers
+    assert(vm16_set_out_buffer(C, 4, 10) == true);
+    assert(vm16_set_out_buffer(C, 0, 0) == true);
+    vm16_set_pc(C, 0);
+    C->areg = 0;
+    calls = 0;
+    assert(vm16_run(C, 1000, &ran) == VM16_SYS);
+    assert((C->l_addr == 1) && (C->areg == 127) && (calls == 6));
+    assert(vm16_read_sys_buffer(C, 0, 8, buffer) == 6);
+    // unregistered
+    assert(vm16_register_sys(C, 1, NULL, NULL, false) == true);
+    assert(vm16_get_sys_ctx(C, 1) == NULL);
+    vm16_set_pc(C, 0);
+    assert(vm16_run(C, 1000, &ran) == VM16_SYS);
+    assert((C->l_addr == 1) && (ran == 2));
+    // buffer with result (A = 0)
+    assert(vm16_register_sys_buffer(C, 1, 4, 3, 0) == true);
+    vm16_set_pc(C, 0);
+    C->areg = 0;
+    assert(vm16_run(C, 1000, &ran) == VM16_SYS);
+    assert((C->l_addr == 1) && (C->areg == 1));
+    assert(vm16_read_sys_buffer(C, 1, 8, buffer) == 4);
+    assert((buffer[0] == 1) && (buffer[3] == 1));
+    assert(vm16_read_sys_buffer(C, 0, 8, buffer) == 4);
+    assert((buffer[0] == 0) && (buffer[3] == 0));
+    vm16_release(C);
+    free(C);
+    printf("ok\n");
+}
+
+// VM registry
+void test16(void) {
+    vm16_reg_t *p_reg = vm16_reg_create();
+    vm16_reg_entry_t *p_ent;
+    vm16_reg_entry_t old;
+    vm16_t vms[2];
+    uint32_t idx = 0;
+    uint32_t num = 0;
+    int16_t x, y, z;
+
+    printf("Test VM registry...");
+    assert(vm16_reg_key(-32768, 0, 32767) == 0x000000008000FFFFULL);
+    vm16_reg_pos(vm16_reg_key(-100, 200, -300), &x, &y, &z);
+    assert((x == -100) && (y == 200) && (z == -300));
+    // grow the table
+    for(int i = 0; i < 1000; i++) {
+        p_ent = vm16_reg_put(p_reg, vm16_reg_key(i, -i, i * 7));
+        assert((p_ent != NULL) && (p_ent->C == NULL));
+        p_ent->C = &vms[i % 2];
+        p_ent->ref = i;
+    }
+    assert(vm16_reg_num(p_reg) == 1000);
+    assert(vm16_reg_put(p_reg, vm16_reg_key(5, -5, 35))->ref == 5);
+    assert(vm16_reg_num(p_reg) == 1000);
+    // remove every third entry, the others have to be found
+    for(int i = 0; i < 1000; i += 3) {
+        assert(vm16_reg_remove(p_reg, vm16_reg_key(i, -i, i * 7), &old) == true);
+        assert((old.ref == i) && (old.C == &vms[i % 2]));
+    }
+    assert(vm16_reg_remove(p_reg, vm16_reg_key(0, 0, 0), NULL) == false);
+    for(int i = 0; i < 1000; i++) {
+        p_ent = vm16_reg_get(p_reg, vm16_reg_key(i, -i, i * 7));
+        assert((i % 3 == 0) ? (p_ent == NULL) : (p_ent->ref == i));
+    }
+    while((p_ent = vm16_reg_next(p_reg, &idx)) != NULL) {
+        assert(p_ent->ref % 3 != 0);
+        num++;
+    }
+    assert((num == 666) && (vm16_reg_num(p_reg) == 666));
+    vm16_reg_destroy(p_reg);
+    printf("ok\n");
+}
+
+// VM block pool
+void test17(void) {
+    vm16_pool_t *p_pool = vm16_pool_create(2 * vm16_calc_size(6));
+    vm16_pool_stats_t stats;
+    vm16_t *vms[3];
+    uint32_t ran;
+    double t;
+
+    printf("Test VM pool...");
+    for(int i = 0; i < 3; i++) {
+        vms[i] = vm16_pool_alloc(p_pool, 6);
+        assert((vms[i] != NULL) && (((uintptr_t)vms[i] & 63) == 0));
+        assert((vms[i]->mem_size == 4096) && (vms[i]->tptr == 0xFFFF));
+        vm16_poke(vms[i], 0x0FFF, 0x1234);
+    }
+    assert(vm16_set_decode_cache(vms[0], true) == true);
+    vm16_checkpoint(vms[1]);  // keeps the used pages
+    for(int i = 0; i < 3; i++) {
+        vm16_pool_free(p_pool, vms[i]);
+    }
+    // only two blocks are cached
+    assert(vm16_pool_stats(p_pool, 6, &stats) == true);
+    assert((stats.in_use == 0) && (stats.cached == 2) && (stats.allocs == 3) && (stats.reused == 0));
+    assert(stats.block_size == vm16_calc_size(6));
+    // recycled blocks are zeroed (the used pages only)
+    vms[0] = vm16_pool_alloc(p_pool, 6);
+    assert((vm16_peek(vms[0], 0x0FFF) == 0) && (vms[0]->pcnt == 0));
+    assert(vm16_get_dirty_pages(vms[0], VM16_USED, NULL) == 0);
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY, NULL) == 16);
+    assert(vm16_run(vms[0], 10, &ran) != VM16_ERROR);
+    vms[1] = vm16_pool_alloc(p_pool, 1);
+    assert(vms[1]->mem_size == 128);
+    assert(vm16_pool_stats(p_pool, 6, &stats) && (stats.cached == 1) && (stats.reused == 1));
+    vm16_pool_set_limit(p_pool, 0);
+    assert(vm16_pool_stats(p_pool, 6, &stats) && (stats.cached == 0));
+    assert(vm16_pool_stats(p_pool, VM16_POOL_CLASSES, &stats) == false);
+    vm16_pool_free(p_pool, vms[1]);
+    vm16_pool_destroy(p_pool);
+    vm16_pool_free(NULL, vms[0]);  // after the pool
+    printf("ok\n");
+
+    // allocation churn with 64 Kwords VMs
+    p_pool = vm16_pool_create(16 * 1024 * 1024);
+    t = wall_time();
+    for(int i = 0; i < 1000; i++) {
+        vm16_t *C = (vm16_t *)malloc(vm16_calc_size(10));
+        vm16_init(C, vm16_calc_size(10));
+        vm16_poke(C, i, 1);
+        vm16_release(C);
+        free(C);
+    }
+    printf("  malloc: %.1f us per VM\n", (wall_time() - t) * 1000);
+    t = wall_time();
+    for(int i = 0; i < 1000; i++) {
+        vm16_t *C = vm16_pool_alloc(p_pool, 10);
+        vm16_poke(C, i, 1);
+        vm16_pool_free(p_pool, C);
+    }
+    printf("  pool:   %.1f us per VM\n", (wall_time() - t) * 1000);
+    vm16_pool_destroy(p_pool);
+}
+
+void test18(void) {
+    uint32_t size = vm16_calc_size(10);
+    vm16_t *C = (vm16_t *)malloc(size);
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    uint32_t snap_size, str_size;
+    uint8_t *p_snap;
+    char *p_str;
+    double t;
+
+    printf("Test snapshot...");
+    vm16_init(C, size);
+    vm16_init(C2, size);
+    for(int i = 0; i < 0x10000; i += 7) {
+        vm16_poke(C, i, (uint16_t)(i * 31));
+    }
+    vm16_poke(C, 0, 0x1234);
+    for(int i = 0; i < 8; i++) {
+        C->regs[i] = (uint16_t)(0x1111 * i);
+    }
+    C->bptr = 0xABCD;
+    C->l_addr = 0x55;
+    C->p_in_dest = &C->memory[0x100];
+
+    snap_size = vm16_get_snapshot_size(C);
+    str_size = vm16_get_string_size(C);
+    assert(snap_size * 2 <= str_size);
+    p_snap = (uint8_t *)malloc(snap_size);
+    assert(vm16_get_snapshot(C, snap_size - 1, p_snap) == 0);
+    assert(vm16_get_snapshot(C, snap_size, p_snap) == snap_size);
+    assert(vm16_is_snapshot(snap_size, p_snap) == true);
+    assert((p_snap[40] == 0x34) && (p_snap[41] == 0x12));  // little-endian
+    assert(vm16_set_snapshot(C2, snap_size, p_snap) == snap_size);
+    assert(memcmp(C->memory, C2->memory, 0x10000 * 2) == 0);
+    assert(memcmp(C->regs, C2->regs, sizeof(C->regs)) == 0);
+    assert((C2->bptr == 0xABCD) && (C2->tptr == 0xFFFF) && (C2->l_addr == 0x55));
+    assert(C2->p_in_dest == &C2->memory[0x100]);
+
+    // checksum, size and memory size mismatch
+    p_snap[1000] ^= 1;
+    assert(vm16_set_snapshot(C2, snap_size, p_snap) == 0);
+    p_snap[1000] ^= 1;
+    assert(vm16_set_snapshot(C2, snap_size - 1, p_snap) == 0);
+    free(C2);
+    C2 = (vm16_t *)malloc(vm16_calc_size(6));
+    vm16_init(C2, vm16_calc_size(6));
+    assert(vm16_set_snapshot(C2, snap_size, p_snap) == 0);
+    free(C2);
+    printf("ok\n");
+
+    // 64 Kwords VM, ASCII string vs binary snapshot
+    p_str = (char *)malloc(str_size);
+    assert(vm16_is_snapshot(str_size, (uint8_t *)vm16_get_vm_as_str(C, str_size, p_str)) == false);
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_get_vm_as_str(C, str_size, p_str);
+        vm16_set_vm_as_str(C, str_size, p_str);
+    }
+    printf("  string:   %u bytes, %.0f us save+load\n", str_size, (wall_time() - t) * 10000);
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_get_snapshot(C, snap_size, p_snap);
+        vm16_set_snapshot(C, snap_size, p_snap);
+    }
+    printf("  snapshot: %u bytes, %.0f us save+load\n", snap_size, (wall_time() - t) * 10000);
+    free(p_str);
+    free(p_snap);
+    free(C);
+}
+
+void test19(void) {
+    static uint16_t code[] = {
+        0x2010, 0x0000, 0x3010, 0x0001, 0x2020, 0x4030, 0x00FF, 0x4841,
+        0x2100, 0x2880, 0x4090, 0x00FF, 0x8C30, 0x0000, 0x1200, 0x0114,
+        0x1200, 0x0102, 0x0000, 0x0000, 0x6800, 0x6C60, 0x1200, 0x0102
+    };
+    uint16_t words[VM16_LZ_MAX_WORDS], out[VM16_LZ_MAX_WORDS];
+    uint8_t buffer[VM16_LZ_MAX_WORDS * 3];
+    uint32_t size = vm16_calc_size(10);
+    vm16_t *C = (vm16_t *)malloc(size);
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    uint32_t len, snap_size, zsize;
+    uint8_t *p_snap, *p_zsnap;
+    double t;
+
+    printf("Test compressed snapshot...");
+    // LZ codec: runs, literals and random data
+    for(int n = 0; n < 4; n++) {
+        for(int i = 0; i < VM16_LZ_MAX_WORDS; i++) {
+            switch(n) {
+                case 0: words[i] = 0; break;
+                case 1: words[i] = (uint16_t)(i / 3); break;
+                case 2: words[i] = code[i % 24]; break;
+                default: words[i] = (uint16_t)random(); break;
+            }
+        }
+        len = vm16_lz_encode(words, VM16_LZ_MAX_WORDS, buffer, sizeof(buffer));
+        assert((len > 0) && vm16_lz_decode(buffer, len, out, VM16_LZ_MAX_WORDS));
+        assert(memcmp(words, out, sizeof(words)) == 0);
+        assert((n == 3) || (len < VM16_LZ_MAX_WORDS * 2));
+        assert(vm16_lz_encode(words, VM16_LZ_MAX_WORDS, buffer, len - 1) == 0);
+        assert(vm16_lz_decode(buffer, len - 1, out, VM16_LZ_MAX_WORDS) == false);
+        assert(vm16_lz_decode(buffer, len, out, VM16_LZ_MAX_WORDS - 1) == false);
+    }
+    buffer[0] = 0x80;  // match without data
+    buffer[1] = 0;
+    assert(vm16_lz_decode(buffer, 2, out, 2) == false);
+
+    // sparse 64 Kwords VM: code, data and stack
+    vm16_init(C, size);
+    vm16_init(C2, size);
+    for(int i = 0; i < 0x1000; i++) {
+        vm16_poke(C, i, code[i % 24]);
+    }
+    for(int i = 0x8000; i < 0x8400; i += 2) {
+        vm16_poke(C, i, (uint16_t)random() & 0xFF);
+    }
+    vm16_poke(C, 0xFFF0, 0x1234);
+    C->sptr = 0xFFF0;
+    snap_size = vm16_get_snapshot_size(C);
+    p_snap = (uint8_t *)malloc(snap_size);
+    p_zsnap = (uint8_t *)malloc(vm16_get_compressed_size(C));
+    assert(vm16_get_compressed(C, vm16_get_compressed_size(C) - 1, p_zsnap) == 0);
+    zsize = vm16_get_compressed(C, vm16_get_compressed_size(C), p_zsnap);
+    assert((zsize > 0) && (zsize < snap_size / 8));
+    assert(vm16_is_snapshot(zsize, p_zsnap) == true);
+    assert(vm16_set_snapshot(C2, zsize, p_zsnap) == zsize);
+    assert(memcmp(C->memory, C2->memory, 0x10000 * 2) == 0);
+    assert(C2->sptr == 0xFFF0);
+    p_zsnap[zsize / 2] ^= 1;
+    assert(vm16_set_snapshot(C2, zsize, p_zsnap) == 0);
+    p_zsnap[zsize / 2] ^= 1;
+    assert(vm16_set_snapshot(C2, zsize - 1, p_zsnap) == 0);
+    printf("ok\n");
+
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_get_snapshot(C, snap_size, p_snap);
+    }
+    printf("  snapshot:   %u bytes, %.0f us save", snap_size, (wall_time() - t) * 10000);
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_set_snapshot(C2, snap_size, p_snap);
+    }
+    printf(", %.0f us load\n", (wall_time() - t) * 10000);
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_get_compressed(C, vm16_get_compressed_size(C), p_zsnap);
+    }
+    printf("  compressed: %u bytes, %.0f us save", zsize, (wall_time() - t) * 10000);
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_set_snapshot(C2, zsize, p_zsnap);
+    }
+    printf(", %.0f us load\n", (wall_time() - t) * 10000);
+    free(p_snap);
+    free(p_zsnap);
+    free(C);
+    free(C2);
+}
+
+void test20(void) {
+    static uint16_t code[] = {
+        OP(0x08, 0x11, 0x00), 0x3000,   // move 0x3000, A
+        OP(0x08, 0x0A, 0x00),           // move [X++], A
+        OP(0x1A, 0x00, 0x00),           // push A
+        OP(0x1B, 0x01, 0x00),           // pop B
+        OP(0x0A, 0x00, 0x00),           // inc A
+        OP(0x04, 0x10, 0x00), 0x0000,   // jump #0
+    };
+    static uint8_t expected[] = {0x30, 0x50, 0x51, 0x52, 0x53, 0x54, 0x7F};
+    uint32_t size = vm16_calc_size(10);
+    vm16_t *vms[3];
+    vm16_t *C2 = (vm16_t *)malloc(size);
+    uint8_t pages[VM16_MAX_PAGES];
+    uint32_t ran, zsize, dsize;
+    uint8_t *p_base, *p_delta;
+
+    printf("Test dirty pages...");
+    // interpreter, decode cache and JIT
+    for(int i = 0; i < 3; i++) {
+        vm16_t *C = vms[i] = (vm16_t *)malloc(size);
+        vm16_init(C, size);
+        assert(vm16_get_dirty_pages(C, VM16_DIRTY_CHECKPOINT, NULL) == VM16_MAX_PAGES);
+        vm16_write_mem(C, 0, sizeof(code) / 2, code);
+        vm16_set_decode_cache(C, i > 0);
+        if((i == 2) && !vm16_set_jit(C, true)) {
+            vm16_set_decode_cache(C, false);  // JIT not available
+        }
+        C->xreg = 0x5000;
+        C->sptr = 0x8000;
+        vm16_run(C, 600, &ran);
+        vm16_checkpoint(C);
+        assert(vm16_get_dirty_pages(C, VM16_DIRTY, pages) == 0);
+        vm16_run(C, 6144, &ran);
+        assert(C->xreg == 0x5464);
+        assert(vm16_get_dirty_pages(C, VM16_DIRTY_CHECKPOINT, pages) == sizeof(expected));
+        assert(memcmp(pages, expected, sizeof(expected)) == 0);
+        assert(memcmp(vms[0]->memory, C->memory, 0x10000 * 2) == 0);
+    }
+    // API writes
+    vm16_checkpoint(vms[0]);
+    vm16_poke(vms[0], 0xA000, 1);
+    vm16_write_mem(vms[0], 0xB0FF, 2, code);
+    vm16_set_pc(vms[0], 0xC000);
+    vm16_deposit(vms[0], 1);
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY_DELTA, pages) == 4);
+    assert((pages[0] == 0xA0) && (pages[1] == 0xB0) && (pages[2] == 0xB1) && (pages[3] == 0xC0));
+
+    // checkpoint snapshot (with 32 Kwords of data) and delta
+    for(int i = 0x8000; i < 0x10000; i++) {
+        vm16_poke(vms[0], i, (uint16_t)random());
+    }
+    vm16_init(C2, size);
+    p_base = (uint8_t *)malloc(vm16_get_compressed_size(vms[0]));
+    p_delta = (uint8_t *)malloc(vm16_get_compressed_size(vms[0]));
+    zsize = vm16_get_compressed(vms[0], vm16_get_compressed_size(vms[0]), p_base);
+    vm16_checkpoint(vms[0]);
+    vm16_set_pc(vms[0], 0);
+    vm16_run(vms[0], 6144, &ran);
+    dsize = vm16_get_delta(vms[0], vm16_get_compressed_size(vms[0]), p_delta);
+    assert((dsize > 0) && (dsize < zsize));
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY_DELTA, NULL) == 0);
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY_CHECKPOINT, NULL) == 7);
+    assert(vm16_set_snapshot(C2, zsize, p_base) == zsize);
+    assert(vm16_get_dirty_pages(C2, VM16_DIRTY, NULL) == VM16_MAX_PAGES);
+    vm16_checkpoint(C2);
+    assert(vm16_set_snapshot(C2, dsize, p_delta) == dsize);
+    assert(vm16_get_dirty_pages(C2, VM16_DIRTY_CHECKPOINT, NULL) == 7);
+    assert(vm16_get_dirty_pages(C2, VM16_DIRTY_DELTA, NULL) == 0);
+    assert(memcmp(vms[0]->memory, C2->memory, 0x10000 * 2) == 0);
+    assert(memcmp(vms[0]->regs, C2->regs, sizeof(C2->regs)) == 0);
+    printf("ok\n");
+    printf("  checkpoint: %u bytes, delta: %u bytes\n", zsize, dsize);
+
+    for(int i = 0; i < 3; i++) {
+        vm16_release(vms[i]);
+        free(vms[i]);
+    }
+    free(C2);
+    free(p_base);
+    free(p_delta);
+}
+
+void test21(void) {
+    static uint16_t code[] = {
+        0x2010, 0x0000, 0x3010, 0x0001, 0x2020, 0x4030, 0x00FF, 0x4841,
+        0x2100, 0x2880, 0x4090, 0x00FF, 0x8C30, 0x0000, 0x1200, 0x0114
+    };
+    static int counts[] = {1, 10, 100};
+    uint32_t size = vm16_calc_size(10);
+    vm16_t *C = (vm16_t *)malloc(size);
+    vm16_t *vms[100];
+    uint16_t words[2];
+    uint32_t zsize, dsize, csize = 0;
+    uint8_t *p_zsnap, *p_delta, *p_copy;
+    double t;
+
+    printf("Test lazy restore...");
+    // 64 Kwords VM with code, data and stack
+    vm16_init(C, size);
+    for(int i = 0; i < 0x1000; i++) {
+        vm16_poke(C, i, code[i % 16]);
+    }
+    for(int i = 0x8000; i < 0x8400; i += 2) {
+        vm16_poke(C, i, (uint16_t)random() & 0xFF);
+    }
+    vm16_poke(C, 0xFFF0, 0x1234);
+    C->sptr = 0xFFF0;
+    p_zsnap = (uint8_t *)malloc(vm16_get_compressed_size(C));
+    p_delta = (uint8_t *)malloc(vm16_get_compressed_size(C));
+    p_copy = (uint8_t *)malloc(vm16_get_compressed_size(C));
+    zsize = vm16_get_compressed(C, vm16_get_compressed_size(C), p_zsnap);
+    vm16_checkpoint(C);
+    vm16_poke(C, 0x9000, 0x4711);
+    dsize = vm16_get_delta(C, vm16_get_compressed_size(C), p_delta);
+    for(int i = 0; i < 100; i++) {
+        vms[i] = (vm16_t *)malloc(size);
+        vm16_init(vms[i], size);
+    }
+
+    // registers immediately, pages on first access
+    assert(vm16_set_snapshot_lazy(vms[0], zsize, p_zsnap) == zsize);
+    assert(vm16_get_pending_pages(vms[0]) == VM16_MAX_PAGES);
+    assert(vms[0]->sptr == 0xFFF0);
+    assert(vm16_peek(vms[0], 0x8001) == C->memory[0x8001]);
+    assert(vm16_get_pending_pages(vms[0]) == VM16_MAX_PAGES - 1);
+    assert(vm16_read_mem(vms[0], 0x80FF, 2, words) == 2);
+    assert((words[0] == C->memory[0x80FF]) && (words[1] == C->memory[0x8100]));
+    assert(vm16_get_pending_pages(vms[0]) == VM16_MAX_PAGES - 2);
+    // pending pages are stored without decoding
+    csize = vm16_get_compressed(vms[0], vm16_get_compressed_size(C), p_copy);
+    assert((csize == zsize) && (memcmp(p_copy, p_zsnap, zsize) == 0));
+    assert(vm16_get_pending_pages(vms[0]) == VM16_MAX_PAGES - 2);
+    // the delta overwrites its pages
+    assert(vm16_set_snapshot(vms[0], dsize, p_delta) == dsize);
+    assert(vm16_get_pending_pages(vms[0]) == VM16_MAX_PAGES - 3);
+    // all pages on the first run
+    vm16_set_pc(vms[0], 0x2000);
+    vm16_run(vms[0], 1, &csize);
+    assert(vm16_get_pending_pages(vms[0]) == 0);
+    assert(memcmp(vms[0]->memory, C->memory, 0x10000 * 2) == 0);
+    // invalid snapshot, other snapshots are restored immediately
+    p_zsnap[zsize / 2] ^= 1;
+    assert(vm16_set_snapshot_lazy(vms[1], zsize, p_zsnap) == 0);
+    p_zsnap[zsize / 2] ^= 1;
+    assert(vm16_get_pending_pages(vms[1]) == 0);
+    assert(vm16_set_snapshot_lazy(vms[1], dsize, p_delta) == dsize);
+    assert(vm16_get_pending_pages(vms[1]) == 0);
+    assert(vm16_set_snapshot_lazy(vms[1], zsize, p_zsnap) == zsize);
+    assert(vm16_set_snapshot(vms[1], zsize, p_zsnap) == zsize);
+    assert(vm16_get_pending_pages(vms[1]) == 0);
+    printf("ok\n");
+
+    for(int n = 0; n < 3; n++) {
+        printf("  restore %3d VMs:", counts[n]);
+        t = wall_time();
+        for(int i = 0; i < counts[n]; i++) {
+            vm16_set_snapshot(vms[i], zsize, p_zsnap);
+        }
+        printf(" %5.0f us eager", (wall_time() - t) * 1000000);
+        t = wall_time();
+        for(int i = 0; i < counts[n]; i++) {
+            vm16_set_snapshot_lazy(vms[i], zsize, p_zsnap);
+        }
+        printf(", %4.0f us lazy\n", (wall_time() - t) * 1000000);
+    }
+
+    for(int i = 0; i < 100; i++) {
+        vm16_release(vms[i]);
+        free(vms[i]);
+    }
+    free(C);
+    free(p_zsnap);
+    free(p_delta);
+    free(p_copy);
+}
+
+void test22(void) {
+    static uint8_t types[] = {VM16_SER_STRING, VM16_SER_SNAPSHOT, VM16_SER_COMPRESSED, VM16_SER_DELTA};
+    uint32_t size = vm16_calc_size(10);
+    vm16_ser_t *p_ser = vm16_ser_create();
+    vm16_t *vms[100];
+    uint8_t *p_expected[4];
+    uint32_t sizes[4], zmax;
+    vm16_ser_job_t *p_job;
+    double t, t_sync, t_submit;
+
+    printf("Test serializer...");
+    assert(p_ser != NULL);
+    for(int i = 0; i < 100; i++) {
+        vm16_t *C = vms[i] = (vm16_t *)malloc(size);
+        vm16_init(C, size);
+        for(int addr = 0; addr < 0x1000; addr++) {
+            vm16_poke(C, addr, (uint16_t)(addr * 7 + i));
+        }
+        for(int addr = 0x8000; addr < 0x8400; addr += 2) {
+            vm16_poke(C, addr, (uint16_t)random() & 0xFF);
+        }
+        C->sptr = 0xFFF0;
+    }
+    // expected strings (delta with one page)
+    vm16_checkpoint(vms[0]);
+    vm16_poke(vms[0], 0x9000, 0x4711);
+    sizes[0] = vm16_get_string_size(vms[0]);
+    sizes[1] = vm16_get_snapshot_size(vms[0]);
+    sizes[2] = sizes[3] = zmax = vm16_get_compressed_size(vms[0]);
+    for(int i = 0; i < 4; i++) {
+        p_expected[i] = (uint8_t *)malloc(sizes[i]);
+    }
+    vm16_get_vm_as_str(vms[0], sizes[0], (char *)p_expected[0]);
+    sizes[1] = vm16_get_snapshot(vms[0], sizes[1], p_expected[1]);
+    sizes[2] = vm16_get_compressed(vms[0], sizes[2], p_expected[2]);
+    sizes[3] = vm16_get_delta(vms[0], sizes[3], p_expected[3]);
+    vm16_poke(vms[0], 0x9000, 0x4711);  // delta flag again
+
+    // the VM is copied and can be changed after submission
+    for(int i = 0; i < 4; i++) {
+        assert(vm16_ser_submit(p_ser, vms[0], types[i], "tag", 3 + (i == 3)));
+    }
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY_DELTA, NULL) == 0);
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY_CHECKPOINT, NULL) == 1);
+    vm16_poke(vms[0], 0x0000, 0xFFFF);
+    vms[0]->areg = 0x1234;
+    assert(vm16_ser_num_jobs(p_ser) == 4);
+    for(int i = 0; i < 4; i++) {
+        p_job = vm16_ser_collect(p_ser, true);
+        assert((p_job != NULL) && (p_job->type == types[i]));
+        assert((p_job->tag_len == 3u + (i == 3)) && (memcmp(p_job->tag, "tag", 3) == 0));
+        assert(p_job->size == sizes[i]);
+        if(types[i] == VM16_SER_STRING) {
+            // without the 'p_in_dest' pointer of the copy
+            uint32_t offs = offsetof(vm16_t, p_in_dest) * 2;
+            uint32_t end = offs + sizeof(uint16_t *) * 2;
+            assert(memcmp(p_job->p_data, p_expected[i], offs) == 0);
+            assert(memcmp(p_job->p_data + end, p_expected[i] + end, sizes[i] - end) == 0);
+        } else {
+            assert(memcmp(p_job->p_data, p_expected[i], sizes[i]) == 0);
+        }
+        vm16_ser_free_job(p_job);
+    }
+    assert(vm16_ser_collect(p_ser, true) == NULL);
+    assert(vm16_ser_num_jobs(p_ser) == 0);
+
+    // lazy restored VM: pending pages are not decoded
+    assert(vm16_set_snapshot_lazy(vms[1], sizes[2], p_expected[2]) == sizes[2]);
+    assert(vm16_ser_submit(p_ser, vms[1], VM16_SER_COMPRESSED, "", 0));
+    assert(vm16_ser_submit(p_ser, vms[1], VM16_SER_SNAPSHOT, "", 0));
+    assert(vm16_get_pending_pages(vms[1]) == VM16_MAX_PAGES);
+    p_job = vm16_ser_collect(p_ser, true);
+    assert((p_job->size == sizes[2]) && (memcmp(p_job->p_data, p_expected[2], sizes[2]) == 0));
+    vm16_ser_free_job(p_job);
+    p_job = vm16_ser_collect(p_ser, true);
+    assert((p_job->size == sizes[1]) && (memcmp(p_job->p_data, p_expected[1], sizes[1]) == 0));
+    vm16_ser_free_job(p_job);
+    // jobs are freed with the serializer
+    assert(vm16_ser_submit(p_ser, vms[1], VM16_SER_STRING, "", 0));
+    vm16_ser_destroy(p_ser);
+    printf("ok\n");
+
+    // store 100 VMs (compressed)
+    p_ser = vm16_ser_create();
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_get_compressed(vms[i], zmax, p_expected[3]);
+    }
+    t_sync = wall_time() - t;
+    t = wall_time();
+    for(int i = 0; i < 100; i++) {
+        vm16_ser_submit(p_ser, vms[i], VM16_SER_COMPRESSED, "", 0);
+    }
+    t_submit = wall_time() - t;
+    while((p_job = vm16_ser_collect(p_ser, true)) != NULL) {
+        vm16_ser_free_job(p_job);
+    }
+    printf("  serialize 100 VMs: %.0f us encoding, %.0f us submit, %.0f us until collected\n",
+           t_sync * 1000000, t_submit * 1000000, (wall_time() - t) * 1000000);
+    vm16_ser_destroy(p_ser);
+
+    for(int i = 0; i < 100; i++) {
+        vm16_release(vms[i]);
+        free(vms[i]);
+    }
+    for(int i = 0; i < 4; i++) {
+        free(p_expected[i]);
+    }
+}
+
+// LRU eviction
+void test23(void) {
+    uint32_t size = vm16_calc_size(4);
+    vm16_reg_t *p_reg = vm16_reg_create();
+    vm16_t *vms[1000];
+    uint64_t keys[1000];
+    uint64_t bytes;
+    uint32_t usage, ran;
+    double t;
+
+    printf("Test LRU eviction...");
+    for(int i = 0; i < 1000; i++) {
+        vms[i] = (vm16_t *)malloc(size);
+        vm16_init(vms[i], size);
+    }
+    for(int i = 0; i < 4; i++) {
+        vm16_reg_put(p_reg, vm16_reg_key(i, 0, 0))->C = vms[i];
+    }
+    usage = vm16_get_mem_usage(vms[0]);
+    assert(usage == size);
+    vm16_reg_update(p_reg, 100);
+    // VM 1 runs, VM 2 is accessed
+    vm16_run(vms[1], 10, &ran);
+    vm16_reg_touch(vm16_reg_get(p_reg, vm16_reg_key(2, 0, 0)));
+    vm16_reg_update(p_reg, 200);
+    assert(vm16_reg_get(p_reg, vm16_reg_key(1, 0, 0))->last_run == 200);
+    assert(vm16_reg_get(p_reg, vm16_reg_key(3, 0, 0))->last_run == 100);
+    // within the budget
+    assert(vm16_reg_lru(p_reg, 4 * usage, 50, keys, 1000, &bytes) == 0);
+    assert(bytes == 4 * usage);
+    // least recently used first
+    assert(vm16_reg_lru(p_reg, 2 * usage, 50, keys, 1000, &bytes) == 2);
+    assert((keys[0] == vm16_reg_key(0, 0, 0)) && (keys[1] == vm16_reg_key(3, 0, 0)));
+    assert(vm16_reg_lru(p_reg, 3 * usage, 50, keys, 1000, &bytes) == 1);
+    assert(vm16_reg_lru(p_reg, 0, 50, keys, 1, &bytes) == 1);
+    // not idle long enough
+    assert(vm16_reg_lru(p_reg, 0, 150, keys, 1000, &bytes) == 0);
+    assert(vm16_reg_lru(p_reg, 0, 100, keys, 1000, &bytes) == 2);
+    // decode cache and I/O state
+    assert(vm16_set_decode_cache(vms[3], true));
+    assert(vm16_get_mem_usage(vms[3]) > usage);
+    assert(vm16_register_port(vms[0], 1, VM16_PORT_LATCH, 0));
+    assert(vm16_has_io_state(vms[0]) && !vm16_has_io_state(vms[1]));
+    assert(vm16_reg_lru(p_reg, 2 * usage, 50, keys, 1000, &bytes) == 1);
+    assert(keys[0] == vm16_reg_key(3, 0, 0));
+    vm16_reg_destroy(p_reg);
+    printf("ok\n");
+
+    // sweep over 1000 registered VMs
+    p_reg = vm16_reg_create();
+    for(int i = 0; i < 1000; i++) {
+        vm16_reg_put(p_reg, vm16_reg_key(i, 1, 0))->C = vms[i];
+    }
+    vm16_reg_update(p_reg, 0);
+    t = wall_time();
+    vm16_reg_update(p_reg, 100);
+    assert(vm16_reg_lru(p_reg, 500 * usage, 50, keys, 1000, &bytes) == 500);
+    printf("  eviction sweep 1000 VMs: %.0f us\n", (wall_time() - t) * 1000000);
+    vm16_reg_destroy(p_reg);
+
+    for(int i = 0; i < 1000; i++) {
+        vm16_release(vms[i]);
+        free(vms[i]);
+    }
+}
+
+// proportional set size of the process in KB (0 if not available)
+uint32_t pss_kb(void) {
+    uint32_t kb = 0;
+#ifdef __linux__
+    char line[128];
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if(fp != NULL) {
+        while(fgets(line, sizeof(line), fp) != NULL) {
+            if(sscanf(line, "Pss: %u kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+#endif
+    return kb;
+}
+
+void test24(void) {
+    static uint16_t code[] = {0x2010, 0x1111, 0x1C00};  // move A, #$1111; halt
+    vm16_pool_t *p_pool = vm16_pool_create(0);
+    vm16_t *C = vm16_pool_alloc(p_pool, 10);
+    vm16_t *vms[100];
+    uint16_t buf[0x4000];
+    uint32_t usage, total = 0, ran, pss;
+    double t;
+
+    printf("Test VM cloning...");
+    for(uint32_t addr = 0; addr < 0x4000; addr++) {
+        vm16_poke(C, addr, (uint16_t)(addr * 7 + 1));
+    }
+    vm16_write_mem(C, 0x100, 3, code);
+    vm16_set_pc(C, 0x100);
+    C->breg = 0x1234;
+    vms[0] = vm16_pool_clone(p_pool, C);
+    assert(vms[0] != NULL);
+    assert((vms[0]->breg == 0x1234) && (vm16_get_pc(vms[0]) == 0x100));
+    assert(vm16_peek(vms[0], 0x3FFF) == (uint16_t)(0x3FFF * 7 + 1));
+    assert(vm16_peek(vms[0], 0x4000) == 0);
+#ifdef VM16_COW
+    assert(vm16_get_dirty_pages(C, VM16_SHARED, NULL) == 0);
+    assert(vm16_get_dirty_pages(C, VM16_IMAGE, NULL) == 256);
+    assert(vm16_get_dirty_pages(vms[0], VM16_SHARED, NULL) == 256);
+    usage = vm16_get_mem_usage(vms[0]);
+    assert(usage + 128 * 1024 == vm16_calc_size(10));
+#endif
+    // writes are private
+    assert(vm16_run(vms[0], 10, &ran) == VM16_HALT);
+    assert((vms[0]->areg == 0x1111) && (C->areg == 0));
+    assert(vm16_poke(vms[0], 0x10, 0xAAAA));
+    assert(vm16_poke(C, 0x20, 0xBBBB));
+    assert((vm16_peek(C, 0x10) == 0x10 * 7 + 1) && (vm16_peek(vms[0], 0x20) == 0x20 * 7 + 1));
+    assert((vm16_peek(vms[0], 0x10) == 0xAAAA) && (vm16_peek(C, 0x20) == 0xBBBB));
+#ifdef VM16_COW
+    assert(vm16_get_dirty_pages(vms[0], VM16_SHARED, NULL) == 255);
+    assert(vm16_get_dirty_pages(C, VM16_IMAGE, NULL) == 255);
+    assert(vm16_get_mem_usage(vms[0]) == usage + 4096);
+    // the checkpoint keeps the shared flags
+    vm16_checkpoint(vms[0]);
+    assert(vm16_get_dirty_pages(vms[0], VM16_SHARED, NULL) == 255);
+    assert(vm16_get_dirty_pages(vms[0], VM16_DIRTY, NULL) == 0);
+#endif
+    // a clone of a written VM gets the current memory
+    vms[1] = vm16_pool_clone(p_pool, C);
+    assert((vm16_peek(vms[1], 0x20) == 0xBBBB) && (vm16_peek(vms[1], 0x10) == 0x10 * 7 + 1));
+    assert(vm16_peek(vms[0], 0x20) == 0x20 * 7 + 1);
+    vms[2] = vm16_pool_clone(p_pool, vms[0]);
+    assert((vm16_peek(vms[2], 0x10) == 0xAAAA) && (vms[2]->areg == 0x1111));
+    // the clones stay valid without the original
+    vm16_pool_free(p_pool, C);
+    assert(vm16_peek(vms[1], 0x3FFF) == (uint16_t)(0x3FFF * 7 + 1));
+    assert(vm16_run(vms[1], 10, &ran) == VM16_HALT);
+    assert(vms[1]->areg == 0x1111);
+    printf("ok\n");
+
+    pss = pss_kb();
+    t = wall_time();
+    for(int i = 3; i < 100; i++) {
+        vms[i] = vm16_pool_clone(p_pool, vms[1]);
+        assert(vms[i] != NULL);
+    }
+    t = wall_time() - t;
+    // the clones read the "firmware" and write a few words
+    for(int i = 3; i < 100; i++) {
+        assert(vm16_read_mem(vms[i], 0, 0x4000, buf) == 0x4000);
+        assert(buf[0x3FFF] == (uint16_t)(0x3FFF * 7 + 1));
+        vm16_set_pc(vms[i], 0x100);
+        assert(vm16_run(vms[i], 10, &ran) == VM16_HALT);
+        vm16_poke(vms[i], 0x8000, i);
+    }
+    for(int i = 0; i < 100; i++) {
+        total += vm16_get_mem_usage(vms[i]);
+    }
+    printf("  clone 97 VMs: %.0f us, +%u KB memory (VM usage of 100 VMs: %u KB, private copies: %u KB)\n",
+           t * 1000000, pss_kb() - pss, total / 1024, 100 * vm16_calc_size(10) / 1024);
+    for(int i = 0; i < 100; i++) {
+        vm16_pool_free(p_pool, vms[i]);
+    }
+    vm16_pool_destroy(p_pool);
+}
+
+// ROM with code at $1000, followed by data words
+static uint16_t rom_word(uint16_t addr) {
+    static uint16_t code[] = {
+        OP(0x08, 0x00, 0x10), 0x1111,   // move A, #$1111
+        OP(0x08, 0x11, 0x00), 0x1100,   // move $1100, A    (ignored)
+        OP(0x08, 0x04, 0x10), 0x2000,   // move X, #$2000
+        OP(0x08, 0x08, 0x00),           // move [X], A      (ignored)
+        OP(0x08, 0x07, 0x10), 0x1800,   // move SP, #$1800
+        OP(0x1A, 0x00, 0x00),           // push A           (ignored)
+        OP(0x1B, 0x01, 0x00),           // pop B
+        OP(0x08, 0x11, 0x00), 0x0200,   // move $0200, A
+        OP(0x08, 0x11, 0x0C), 0x1000,   // move $1000, #0   (ignored)
+        OP(0x08, 0x02, 0x0C),           // move C, #0
+        OP(0x1D, 0x11, 0x10), 0x1020, 0x1014,   // dbnz $1020, #$1014  (1 => 0)
+        OP(0x0A, 0x02, 0x00),           // inc C
+        OP(0x1D, 0x11, 0x10), 0x1021, 0x1018,   // dbnz $1021, #$1018  (0 => $FFFF)
+        OP(0x0A, 0x02, 0x00),           // inc C
+        OP(0x08, 0x04, 0x10), 0x1020,   // move X, #$1020
+        OP(0x1D, 0x08, 0x10), 0x101D,   // dbnz [X], #$101D    (1 => 0)
+        OP(0x0A, 0x02, 0x00),           // inc C
+        0x1C00,                         // halt
+        0x0000, 0x0000, 0x0001, 0x0000, // data at $1020
+    };
+    if(addr - 0x1000u < sizeof(code) / 2) {
+        return code[addr - 0x1000];
+    }
+    return (uint16_t)(addr * 5 + 3);
+}
+
+static void check_rom_vm(vm16_t *C) {
+    uint32_t ran;
+    vm16_set_pc(C, 0x1000);
+    assert(vm16_run(C, 100, &ran) == VM16_HALT);
+    assert((C->areg == 0x1111) && (C->breg == rom_word(0x17FF)) && (C->sptr == 0x1800));
+    // 'dbnz' on ROM words tests the decremented value
+    assert(C->creg == 2);
+    assert(vm16_peek(C, 0x0200) == 0x1111);
+    assert(vm16_peek(C, 0x1100) == rom_word(0x1100));
+    assert(vm16_peek(C, 0x2000) == rom_word(0x2000));
+    assert(vm16_peek(C, 0x17FF) == rom_word(0x17FF));
+    assert(vm16_peek(C, 0x1000) == rom_word(0x1000));
+}
+
+void test25(void) {
+    char *s = (char *)malloc(0x4000 / 8 * 42 + 16);
+    char *p = s;
+    vm16_pool_t *p_pool = vm16_pool_create(0x100000);
+    vm16_t *vms[100];
+    vm16_t *C;
+    vm16_rom_t *p_rom;
+    uint16_t buf[4] = {1, 2, 3, 4};
+    uint32_t size, shared = 0, snap_size, ran;
+    uint8_t *p_snap;
+    double t;
+
+    printf("Test ROM images...");
+    for(uint32_t addr = 0x1000; addr < 0x5000; addr += 8) {
+        p += sprintf(p, ":8%04X00", addr);
+        for(uint32_t i = 0; i < 8; i++) {
+            p += sprintf(p, "%04X", rom_word(addr + i));
+        }
+        *p++ = '\n';
+    }
+    strcpy(p, ":00000FF");
+    p_rom = vm16_rom_create(s);
+    assert(p_rom != NULL);
+    assert((vm16_rom_addr(p_rom, &size) == 0x1000) && (size == 0x4000));
+
+    // ROM doesn't fit
+    C = vm16_pool_alloc(p_pool, 7);
+    assert(!vm16_pool_map_rom(C, p_rom));
+    vm16_pool_free(p_pool, C);
+
+    // guest and API writes are ignored
+    C = vm16_pool_alloc(p_pool, 9);
+    vm16_poke(C, 0x2000, 0xAAAA);
+    vm16_poke(C, 0x0FFF, 0xBBBB);
+    assert(vm16_pool_map_rom(C, p_rom));
+    assert((vm16_peek(C, 0x2000) == rom_word(0x2000)) && (vm16_peek(C, 0x0FFF) == 0xBBBB));
+    assert(vm16_get_dirty_pages(C, VM16_ROM, NULL) == 64);
+    check_rom_vm(C);
+    vm16_poke(C, 0x1100, 0xAAAA);
+    vm16_write_mem(C, 0x4FFE, 4, buf);
+    assert((vm16_peek(C, 0x1100) == rom_word(0x1100)) && (vm16_peek(C, 0x4FFF) == rom_word(0x4FFF)));
+    assert((vm16_peek(C, 0x5000) == 3) && (vm16_peek(C, 0x5001) == 4));
+#ifdef VM16_COW
+    assert(vm16_get_mem_usage(C) + 5 * 4096 <= vm16_calc_size(9));
+#endif
+    // the ROM pages are read-only for the JIT as well
+    vms[0] = vm16_pool_alloc(p_pool, 9);
+    assert(vm16_pool_map_rom(vms[0], p_rom));
+    vm16_set_jit(vms[0], true);
+    for(int i = 0; i < 32; i++) {
+        check_rom_vm(vms[0]);
+    }
+    // clones keep the ROM pages
+    vms[1] = vm16_pool_clone(p_pool, C);
+    assert(vm16_get_dirty_pages(vms[1], VM16_ROM, NULL) == 64);
+    check_rom_vm(vms[1]);
+    // 'in' to a ROM word: the value is discarded, also after a restore
+    buf[0] = OP(0x18, 0x11, 0x10);  // in $1100, #4
+    buf[1] = 0x1100;
+    buf[2] = 0x0004;
+    buf[3] = 0x1C00;                // halt
+    vm16_write_mem(vms[1], 0x0300, 4, buf);
+    vm16_set_pc(vms[1], 0x0300);
+    assert(vm16_run(vms[1], 10, &ran) == VM16_IN);
+    snap_size = vm16_get_snapshot_size(vms[1]);
+    p_snap = (uint8_t *)malloc(snap_size);
+    assert(vm16_get_snapshot(vms[1], snap_size, p_snap) == snap_size);
+    vms[2] = vm16_pool_alloc(p_pool, 9);
+    assert(vm16_set_snapshot(vms[2], snap_size, p_snap) == snap_size);
+    *vms[1]->p_in_dest = 0x5555;
+    *vms[2]->p_in_dest = 0x5555;
+    assert((vm16_peek(vms[1], 0x1100) == rom_word(0x1100)) && (vm16_peek(vms[2], 0x1100) == rom_word(0x1100)));
+    assert(vm16_run(vms[2], 10, &ran) == VM16_HALT);
+    vm16_pool_free(p_pool, vms[2]);
+    free(p_snap);
+    // a reused block is RAM again
+    vm16_pool_free(p_pool, C);
+    C = vm16_pool_alloc(p_pool, 9);
+    assert((vm16_peek(C, 0x2000) == 0) && vm16_poke(C, 0x2000, 0xAAAA));
+    assert(vm16_peek(C, 0x2000) == 0xAAAA);
+    vm16_pool_free(p_pool, C);
+    printf("ok\n");
+
+    t = wall_time();
+    for(int i = 2; i < 100; i++) {
+        vms[i] = vm16_pool_alloc(p_pool, 9);
+        assert(vm16_pool_map_rom(vms[i], p_rom));
+    }
+    t = wall_time() - t;
+    for(int i = 2; i < 100; i++) {
+        shared += vm16_calc_size(9) - vm16_get_mem_usage(vms[i]);
+    }
+    // the VMs are freed after the ROM is released by the creator
+    vm16_rom_release(p_rom);
+    for(int i = 2; i < 100; i++) {
+        check_rom_vm(vms[i]);
+    }
+    printf("  map ROM into 98 VMs: %.0f us, %u KB of %u KB ROM memory shared per VM\n",
+           t * 1000000, shared / 98 / 1024, size * 2 / 1024);
+    for(int i = 0; i < 100; i++) {
+        vm16_pool_free(p_pool, vms[i]);
+    }
+    vm16_pool_destroy(p_pool);
+    free(s);
+}
+
 char *hash_uint16(uint16_t val, char *s) {
     *s++ = 48 + (val % 64);
     val = val / 64;
@@ -263,5 +1680,24 @@ int main() {
     //printf("%s", buffer);
 
     //test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test25();
     return 0;
 }
@@ -16,7 +16,8 @@ local MP = "/home/joachim/minetest5/mods/vm16"
 vm16 = {}
 local vm16lib = require("vm16lib")
 print("vm16 version = " .. vm16lib.version())
-assert(loadfile(MP.."/api.lua"))(vm16lib)
+local vm16ffi = jit and assert(loadfile(MP.."/vm16ffi.lua"))(_G)
+assert(loadfile(MP.."/api.lua"))(vm16lib, vm16ffi)
 dofile(MP.."/lib.lua")
 dofile(MP.."/asm/asm.lua")
 
@@ -26,6 +27,8 @@ for i = 1,10 do
 
 	local vm = vm16lib.init(6)
 	assert(vm16lib.mem_size(vm) == 4096)
+	assert(vm16lib.decode_cache(vm, i % 2 == 0) == true)
+	vm16lib.jit(vm, i % 4 == 0)  -- not available on all platforms
 
 	assert(vm16lib.set_pc(vm, 0x1234) == true)
 	assert(vm16lib.get_pc(vm) == 0x1234)
@@ -42,6 +45,59 @@ for i = 1,10 do
 	assert(#s == (8*1024 + 54) * 2)
 	assert(vm16lib.set_vm(vm, s) == true)
 
+	-- binary snapshot, the ASCII string is accepted, too
+	local snap = vm16lib.get_snapshot(vm)
+	assert(#snap == vm16lib.mem_size(vm) * 2 + 44)
+	assert(vm16lib.set_snapshot(vm, snap) == true)
+	assert(vm16lib.set_snapshot(vm, s) == true)
+	assert(vm16lib.set_snapshot(vm, snap:sub(1, -2) .. "x") == false)
+	assert(vm16lib.set_snapshot(vm, snap .. "x") == false)
+	assert(vm16lib.get_snapshot(vm) == snap)
+	local zsnap = vm16lib.get_snapshot(vm, true)
+	assert(#zsnap < #snap / 4)
+	assert(vm16lib.set_snapshot(vm, zsnap) == true)
+	assert(vm16lib.get_snapshot(vm) == snap)
+	assert(vm16lib.set_snapshot(vm, zsnap:sub(1, -2)) == false)
+
+	-- dirty pages and delta
+	vm16lib.checkpoint(vm)
+	local pages, num_pages = vm16lib.dirty_pages(vm)
+	assert(#pages == 0 and num_pages == vm16lib.mem_size(vm) / 256)
+	assert(vm16lib.poke(vm, 0x301, 7) == true)
+	assert(table.equals(vm16lib.dirty_pages(vm), {3}) == true)
+	local delta = vm16lib.get_delta(vm)
+	assert(#vm16lib.dirty_pages(vm, true) == 0)
+	assert(vm16lib.set_snapshot(vm, zsnap) == true)
+	assert(#vm16lib.dirty_pages(vm) == num_pages)
+	vm16lib.checkpoint(vm)
+	assert(vm16lib.set_snapshot(vm, delta) == true)
+	assert(vm16lib.peek(vm, 0x301) == 7)
+	assert(table.equals(vm16lib.dirty_pages(vm), {3}) == true)
+
+	-- lazy restore
+	assert(vm16lib.set_snapshot(vm, zsnap, true) == true)
+	assert(vm16lib.pending_pages(vm) == num_pages)
+	assert(vm16lib.peek(vm, 1) == 2)
+	assert(vm16lib.pending_pages(vm) == num_pages - 1)
+	assert(vm16lib.get_snapshot(vm, true) == zsnap)
+	assert(vm16lib.set_snapshot(vm, zsnap:sub(1, -2), true) == false)
+	assert(vm16lib.get_snapshot(vm) == snap)
+	assert(vm16lib.pending_pages(vm) == 0)
+	assert(vm16lib.set_snapshot(vm, snap) == true)
+
+	-- background serializer
+	vm16lib.serialize(vm, "compressed", "key1")
+	vm16lib.serialize(vm, "snapshot", "key2")
+	assert(vm16lib.num_jobs() == 2)
+	assert(vm16lib.poke(vm, 0x301, 8) == true)  -- copied before
+	local tag, s, typ = vm16lib.collect(true)
+	assert(tag == "key1" and s == zsnap and typ == "compressed")
+	tag, s, typ = vm16lib.collect(true)
+	assert(tag == "key2" and s == snap and typ == "snapshot")
+	assert(vm16lib.collect(true) == nil and vm16lib.num_jobs() == 0)
+	assert(pcall(vm16lib.serialize, vm, "json", "key") == false)
+	assert(vm16lib.poke(vm, 0x301, 7) == true)
+
 	local tbl = vm16lib.read_mem(vm, 0 ,4)
 	assert(table.equals(tbl, {1,2,3,4}) == true)
 	assert(#vm16lib.read_mem(vm, 0 ,0x2345) == 0)
@@ -211,6 +267,279 @@ vm16.write_mem(pos, 0, {0xff00, 0xff00, 0xff00, 0xff00})
 assert(vm16.set_pc(pos, 0) == true)
 assert(vm16.run(pos, cpu_def) == vm16.ERROR)
 
+-- breakpoints patch the cached code
+local breakpoints = {}
+vm16.write_mem(pos, 0, {0x1200, 0x0002, 0x1200, 0x0000})  -- jump #2 / jump #0
+assert(vm16.set_pc(pos, 0) == true)
+assert(vm16.run(pos, cpu_def, breakpoints) == vm16.OK)
+vm16.set_breakpoint(pos, 2, breakpoints)
+assert(vm16.run(pos, cpu_def, breakpoints) == vm16.BREAK)
+assert(vm16.get_pc(pos) == 2)
+vm16.reset_breakpoint(pos, 2, breakpoints)
+assert(vm16.run(pos, cpu_def, breakpoints) == vm16.OK)
+assert(vm16.run(pos, cpu_def, breakpoints) == vm16.OK)
+
+-- fused instruction sequence (with decode cache)
+vm16.write_mem(pos, 0, {0x2800, 0x1200, 0x0000})  -- inc A / jump #0
+assert(vm16.set_pc(pos, 0) == true)
+vm16.fusion_report(pos, true)
+assert(vm16.run(pos, cpu_def) == vm16.OK)
+assert(vm16.fusion_report(pos)["step+jump"] > 0)
+
+-- batch run: only stopped VMs are reported
+local vms = {vm16lib.init(1), vm16lib.init(1), vm16lib.init(1)}
+vm16lib.write_mem(vms[1], 0, {0x1200, 0x0000})  -- jump #0
+vm16lib.write_mem(vms[2], 0, {0x2800, 0x1C00})  -- inc A / halt
+vm16lib.write_mem(vms[3], 0, {0x0000})          -- nop
+local events = vm16lib.run_batch(vms, 1000)
+assert(table.equals(events, {2, vm16.HALT, 2, 3, vm16.NOP, 1}))
+events = vm16lib.run_batch(vms, {10, 0, 0})
+assert(#events == 0)
+-- the same with the thread pool (if available)
+assert(vm16lib.threads(4) >= 1)
+vm16lib.set_pc(vms[2], 0)
+vm16lib.set_pc(vms[3], 0)
+events = vm16lib.run_batch(vms, 1000)
+assert(table.equals(events, {2, vm16.HALT, 2, 3, vm16.NOP, 1}))
+assert(vm16lib.threads(1) == 1)
+
+local pos2 = {x=1, y=0, z=0}
+vm16.create(pos2, 1)
+vm16.write_mem(pos2, 0, {0x2800, 0x1C00})  -- inc A / halt
+vm16.write_mem(pos, 0, {0x6600, 0x0001, 0x1200, 0x0000})  -- out #1, A / jump #0
+assert(vm16.set_pc(pos, 0) == true)
+local batch_def = table.copy(cpu_def)
+local outputs = 0
+batch_def.on_output = function(pos, address, val1, val2)
+	outputs = outputs + 1
+	return 100
+end
+local results = vm16.run_batch({{pos = pos, cpu_def = batch_def}, {pos = pos2, cpu_def = batch_def}})
+assert(table.equals(results, {vm16.OUT, vm16.HALT}))
+assert(outputs == 99)  -- 10000 cycles, 102 per output (incl. costs)
+vm16.destroy(pos2)
+
+-- I/O ports served by the VM
+local vm = vm16lib.init(1)
+vm16lib.write_mem(vm, 0, {0x6600, 0x0001, 0x2800, 0x6030, 0x0002, 0x6601, 0x0003, 0x1200, 0x0000})
+-- out #1, A / inc A / in B, #2 / out #3, B / jump #0
+assert(vm16lib.register_port(vm, 1, vm16.PORT_LATCH) == true)
+assert(vm16lib.register_port(vm, 2, vm16.PORT_LATCH) == true)
+assert(vm16lib.register_port(vm, 3, vm16.PORT_RING, 4) == true)
+assert(vm16lib.write_ports(vm, {[2] = 7}) == 1)
+local resp, ran = vm16lib.run(vm, 100)
+assert(resp == vm16.OUT and ran == 24)  -- TX buffer full
+local ports = vm16lib.read_ports(vm)
+assert(ports[1] == 4 and ports[2] == 7)
+assert(table.equals(ports[3], {7, 7, 7, 7}))
+assert(vm16lib.register_port(vm, 1, vm16.PORT_NONE) == true)
+assert(vm16lib.read_ports(vm)[1] == nil)
+assert(vm16.register_port(pos, 2, vm16.PORT_RING) == true)
+assert(vm16.write_ports(pos, {[2] = {1, 2, 3}}) == 3)
+assert(vm16.read_ports(pos)[2] == nil)  -- no TX data
+assert(vm16.register_port(pos, 2, vm16.PORT_NONE) == true)
+
+-- buffered output
+vm16.write_mem(pos, 0, {0x2800, 0x6600, 0x0002, 0x1200, 0x0000})  -- inc A / out #2, A / jump #0
+vm16.set_cpu_reg(pos, {A = 0, B = 0, C = 0, D = 0, X = 0, Y = 0, PC = 0, SP = 0})
+assert(vm16.set_out_buffer(pos, 16, batch_def.output_costs) == true)
+local records = {}
+batch_def.on_output_batch = function(pos, recs)
+	for _, v in ipairs(recs) do records[#records + 1] = v end
+end
+assert(vm16.run(pos, batch_def, nil, 10 * (batch_def.output_costs + 3)) == vm16.OK)
+assert(#records == 30 and records[1] == 2 and records[2] == 1 and records[29] == 10)
+assert(vm16.set_out_buffer(pos, 0) == true)
+
+-- system call buffer
+local pos3 = {x=2, y=0, z=0}
+vm16.create(pos3, 1)
+vm16.write_mem(pos3, 0, {0x2800, 0x0800, 0x1200, 0x0000})  -- inc A / sys #0 / jump #0
+local sys_def = table.copy(batch_def)
+local values = {}
+sys_def.sys_buffers = {[0] = {size = 4, costs = 10}}
+sys_def.on_system_batch = function(pos, num, vals)
+	for _, v in ipairs(vals) do values[#values + 1] = v end
+end
+sys_def.on_system = function(pos, address, val1)
+	values[#values + 1] = -val1  -- buffer full
+	return val1, 10
+end
+assert(vm16.run(pos3, sys_def, nil, 130) == vm16.OK)
+assert(table.equals(values, {1, 2, 3, 4, -5, 6, 7, 8, 9, -10}))
+-- the output buffer keeps the system call buffers
+assert(vm16.set_out_buffer(pos3, 16, sys_def.output_costs) == true)
+values = {}
+assert(vm16.run(pos3, sys_def, nil, 130) == vm16.OK)
+assert(table.equals(values, {11, 12, 13, 14, -15, 16, 17, 18, 19, -20}))
+vm16.destroy(pos3)
+-- with result (A = 0)
+vm16.create(pos3, 1)
+vm16.write_mem(pos3, 0, {0x2800, 0x0800, 0x1200, 0x0000})
+sys_def.sys_buffers = {[0] = {size = 4, costs = 10, result = 0}}
+values = {}
+assert(vm16.run(pos3, sys_def, nil, 130) == vm16.OK)
+assert(table.equals(values, {1, 1, 1, 1, -1, 2, 1, 1, 1, -1}))
+vm16.destroy(pos3)
+
+-- C event loop
+local ctx = vm16lib.event_ctx({
+	on_input = function(pos, addr) return addr + 1, 10 end,
+	on_output = function(pos, addr, data, B) return 20 end,
+	input_costs = 1, output_costs = 2,
+})
+vm16lib.write_mem(vm, 0, {0x6010, 0x0004, 0x6600, 0x0005, 0x1C00})  -- in A, #4 / out #5, A / halt
+vm16lib.set_pc(vm, 0)
+local resp, cycles, handled = vm16lib.run_loop(vm, ctx, pos, 100)
+assert(resp == vm16.HALT and cycles == 100 - 3 - 10 - 20 and handled == false)
+assert(vm16lib.get_cpu_reg(vm).A == 5)
+vm16lib.set_pc(vm, 2)
+resp, cycles, handled = vm16lib.run_loop(vm, ctx, pos, 10)
+assert(resp == vm16.OUT and cycles == 10 - 1 - 20 and handled == true)
+
+-- allocation-free register and I/O exchange
+local regs = {}
+assert(vm16lib.get_cpu_reg(vm, regs) == regs and regs.PC == 4 and regs.A == 5)
+local mem = {1, 2, 3, 4, 5, 6}
+assert(vm16lib.read_mem(vm, 0, 5, mem) == mem)
+assert(table.equals(mem, {0x6010, 0x0004, 0x6600, 0x0005, 0x1C00, 6}))
+local size = vm16lib.mem_size(vm)
+assert(#vm16lib.read_mem(vm, 0, size) == size and #vm16lib.read_mem(vm, 0, size + 1) == 0)
+vm16lib.set_pc(vm, 0)
+assert(vm16lib.run(vm, 10) == vm16.IN)
+local addr, data, A, B, C = vm16lib.io_regs(vm)
+assert(addr == 4 and A == 5)
+vm16lib.set_io_value(vm, 9)
+assert(vm16lib.run(vm, 10) == vm16.OUT)
+addr, data, A, B, C = vm16lib.io_regs(vm)
+assert(addr == 5 and data == 9 and A == 9)
+if jit then jit.off() end  -- trace compilation allocates
+collectgarbage("stop")
+local kbytes = collectgarbage("count")
+for i = 1, 1000 do
+	vm16lib.set_pc(vm, 0)
+	vm16lib.run(vm, 10)
+	addr = vm16lib.io_regs(vm)
+	vm16lib.set_io_value(vm, i)
+	vm16lib.run(vm, 10)
+	addr, data = vm16lib.io_regs(vm)
+	vm16lib.get_cpu_reg(vm, regs)
+	vm16lib.read_mem(vm, 0, 5, mem)
+end
+assert(collectgarbage("count") == kbytes)
+collectgarbage("restart")
+if jit then jit.on() end
+
+-- VM registry
+local num = vm16lib.num_vms()
+local key = vm16lib.pos_key({x = -100, y = 200, z = 30000})
+assert(table.equals(vm16lib.key_pos(key), {x = -100, y = 200, z = 30000}))
+assert(vm16lib.lookup(key) == nil)
+assert(vm16lib.register_vm({x = -100, y = 200, z = 30000}, vm) == key)
+assert(vm16lib.lookup(key) == vm and vm16lib.lookup({x = -100, y = 200, z = 30000}) == vm)
+assert(vm16lib.lookup(pos) ~= nil and vm16lib.num_vms() == num + 1)
+local found = 0
+local idx, k, v = vm16lib.next_vm(0)
+while idx do
+	if k == key then found = found + 1; assert(v == vm) end
+	idx, k, v = vm16lib.next_vm(idx)
+end
+assert(found == 1)
+assert(vm16lib.unregister_vm(key) == true and vm16lib.unregister_vm(key) == false)
+assert(vm16lib.lookup(key) == nil and vm16lib.num_vms() == num)
+
+-- CPU handle
+local cpu = vm16.get(pos)
+assert(cpu and vm16.get(pos) == cpu and cpu:is_loaded())
+assert(vm16.get({x = 5, y = 5, z = 5}) == nil)
+assert(cpu:poke(0x10, 0x1234) == true and cpu:peek(0x10) == 0x1234 and vm16.peek(pos, 0x10) == 0x1234)
+assert(cpu:write_mem(0, {0x2010, 0x0004, 0x6600, 0x0005, 0x1C00}) == 5)  -- move A, #4 / out #5, A / halt
+assert(cpu:set_pc(0) == true and cpu:get_pc() == 0)
+assert(cpu:mem_size() == vm16.mem_size(pos))
+local outputs = {}
+local handle_def = table.copy(batch_def)
+handle_def.on_output = function(pos, addr, data) outputs[#outputs + 1] = data; return 1 end
+assert(cpu:run(handle_def, nil, 100) == vm16.HALT and outputs[1] == 4)
+assert(cpu:get_cpu_reg().A == 4)
+vm16.on_power_off(pos)
+assert(not cpu:is_loaded() and cpu:peek(0) == nil and cpu:run(handle_def) == vm16.ERROR)
+assert(vm16.get(pos) == nil)
+vm16.on_power_on(pos, 1)
+assert(cpu:is_loaded() and vm16.get(pos) == cpu and cpu:peek(0x10) == 0)
+
+-- LRU eviction
+local vm3 = vm16lib.init(2)
+assert(vm16lib.register_vm(key, vm3) == key)
+local now = math.floor(minetest.get_us_time() / 1000000)
+local keys, bytes = vm16lib.evict_vms(now, 0, 10)  -- all VMs were used
+assert(#keys == 0 and bytes >= vm16lib.mem_usage(vm16lib.lookup(pos)) + vm16lib.mem_usage(vm3))
+keys = vm16lib.evict_vms(now + 20, 0, 10)
+assert(table.equals(keys, {key}))  -- the VM at 'pos' was accessed by 'lookup'
+assert(#vm16lib.evict_vms(now + 40, math.huge, 10) == 0)
+assert(vm16lib.unregister_vm(key) == true)
+vm16lib.free(vm3)
+local estats = vm16.eviction_stats()
+assert(estats.evicted == 0 and estats.num_vms == vm16lib.num_vms() and estats.bytes > 0)
+
+-- VM block pool
+local stats = vm16.pool_stats()[128] or {in_use = 0, allocs = 0, reused = 0}
+local vm1 = vm16lib.init(1)
+vm16lib.poke(vm1, 0x7F, 0x1234)
+vm16lib.free(vm1)
+assert(pcall(vm16lib.peek, vm1, 0) == false)  -- freed
+local vm2 = vm16lib.init(1)
+assert(vm16lib.peek(vm2, 0x7F) == 0 and vm16lib.mem_size(vm2) == 128)
+local stats2 = vm16.pool_stats()[128]
+assert(stats2.allocs == stats.allocs + 2 and stats2.reused == stats.reused + 1)
+assert(stats2.in_use == stats.in_use + 1)
+vm16lib.free(vm2)
+
+-- VM cloning
+local vm4 = vm16lib.init(5)
+assert(vm16lib.write_mem(vm4, 0x100, {0x2010, 0x0004, 0x1C00}) == 3)  -- move A, #4 / halt
+vm16lib.set_pc(vm4, 0x100)
+local vm5 = vm16lib.clone(vm4)
+assert(vm5 and vm16lib.mem_size(vm5) == vm16lib.mem_size(vm4) and vm16lib.get_pc(vm5) == 0x100)
+assert(vm16lib.mem_usage(vm5) <= vm16lib.mem_usage(vm4))
+assert(vm16lib.run(vm5, 10) == vm16.HALT and vm16lib.get_cpu_reg(vm5).A == 4)
+assert(vm16lib.poke(vm5, 0x101, 5) and vm16lib.peek(vm4, 0x101) == 4)
+assert(vm16lib.get_cpu_reg(vm4).A == 0)
+vm16lib.free(vm4)
+assert(vm16lib.peek(vm5, 0x100) == 0x2010)
+vm16lib.free(vm5)
+assert(vm16.clone({x = 5, y = 5, z = 5}, pos) and vm16.peek({x = 5, y = 5, z = 5}, 0x10) == vm16.peek(pos, 0x10))
+vm16.destroy({x = 5, y = 5, z = 5})
+
+-- ROM images
+local rom = vm16.create_rom(":801000020100042222001001C00000000000000\n:00000FF")  -- move A, #$42 / move $100, A / halt
+local vm6 = vm16lib.init(5)
+local vm7 = vm16lib.init(2)
+assert(rom and table.equals({vm16lib.rom_info(rom)}, {0x100, 0x100}))
+assert(vm16lib.map_rom(vm6, rom) and not vm16lib.map_rom(vm7, rom))
+assert(vm16lib.peek(vm6, 0x102) == 0x2220)
+vm16lib.set_pc(vm6, 0x100)
+assert(vm16lib.run(vm6, 10) == vm16.HALT and vm16lib.get_cpu_reg(vm6).A == 0x42)
+assert(vm16lib.peek(vm6, 0x100) == 0x2010)  -- write ignored
+vm16lib.poke(vm6, 0x101, 0)
+assert(vm16lib.peek(vm6, 0x101) == 0x42 and vm16lib.poke(vm6, 0x200, 1) and vm16lib.peek(vm6, 0x200) == 1)
+rom = nil
+vm16lib.free(vm6)
+vm16lib.free(vm7)
+assert(vm16.create_rom("nonsense") == nil)
+
+-- FFI binding (LuaJIT only)
+if vm16.ffi then
+	local p = vm16.get_cpu_ptr(pos)
+	local F = vm16.ffi
+	assert(F.write_mem(p, 0, {0x2010, 0x0004, 0x6600, 0x0005, 0x1C00}) == 5)  -- move A, #4 / out #5, A / halt
+	assert(F.peek(p, 1) == 4 and vm16.peek(pos, 1) == 4)
+	assert(F.poke(p, 1, 7) == true and vm16.peek(pos, 1) == 7)
+	p.pcnt = 0
+	local resp, ran = F.run(p, 100)
+	assert(resp == vm16.OUT and ran == 2 and p.areg == 7 and p.l_addr == 5 and p.l_data == 7)
+	assert(table.equals(F.read_mem(p, 0, 3), {0x2010, 0x0007, 0x6600}))
+end
+
 vm16.write_mem_as_str(pos, 0x100, "111122223333444455AAEEFF")
 local buff = vm16.read_mem_as_str(pos, 0x100, 6)
 print(buff)
@@ -0,0 +1,122 @@
+--[[
+	vm16
+	====
+
+	Copyright (C) 2019-2023 Joachim Stolberg
+
+	GPL v3
+	See LICENSE.txt for more information
+
+	LuaJIT FFI binding to the VM16 core (vm16lib.so)
+
+	The functions operate on a `vm16_t*` cdata pointer (see `cast`), so that
+	calls from JIT compiled code are not aborted by the Lua C API.
+	The pointer does not keep the VM alive, the VM userdata has to be
+	referenced by the caller as long as the pointer is used.
+	Registers can be read and written directly (`p.areg`, `p.pcnt`, ...),
+	memory is read directly, but has to be written via `poke`/`write_mem`
+	(to invalidate decode cache and JIT code).
+	Returns nil if FFI or the library is not available (fallback: vm16lib).
+]]--
+
+local IE = ...
+local ok, ffi = pcall(IE.require, "ffi")
+if not ok or not IE.package.searchpath then
+	return
+end
+local path = IE.package.searchpath("vm16lib", IE.package.cpath)
+if not path then
+	return
+end
+local bit = IE.require("bit")
+local band = bit.band
+
+pcall(ffi.cdef, [[
+typedef struct {
+	uint32_t ident;
+	uint16_t version;
+	union {
+		struct {
+			uint16_t areg, breg, creg, dreg, xreg, yreg, pcnt, sptr;
+		};
+		uint16_t regs[8];
+	};
+	uint16_t bptr;
+	uint16_t tptr;
+	uint16_t l_addr;
+	uint16_t l_data;
+	uint16_t mem_size;
+	uint16_t mem_mask;
+	uint16_t *p_in_dest;
+	uint16_t memory[1];
+}vm16_t;
+
+int vm16_run(vm16_t *C, uint32_t num_cycles, uint32_t *ran);
+uint16_t vm16_peek(vm16_t *C, uint16_t addr);
+bool vm16_poke(vm16_t *C, uint16_t addr, uint16_t val);
+uint32_t vm16_read_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buffer);
+uint32_t vm16_write_mem(vm16_t *C, uint16_t addr, uint16_t num, uint16_t *p_buffer);
+void vm16_load_pages(vm16_t *C);
+]])
+
+local ok, lib = pcall(ffi.load, path)
+if not ok then
+	return
+end
+
+local vm16ffi = {}
+
+local Ran = ffi.new("uint32_t[1]")
+local Buffer = ffi.new("uint16_t[256]")  -- for 'write_mem'
+
+-- Return the `vm16_t*` pointer of the VM userdata (from `vm16lib.init`),
+-- the userdata is a pointer to the VM block.
+-- Pending memory pages of a lazy restored VM are decoded, because the
+-- memory is read directly.
+function vm16ffi.cast(vm)
+	local p = ffi.cast("vm16_t**", vm)[0]
+	lib.vm16_load_pages(p)
+	return p
+end
+
+function vm16ffi.peek(p, addr)
+	return p.memory[band(addr, p.mem_mask)]
+end
+
+function vm16ffi.poke(p, addr, val)
+	return lib.vm16_poke(p, addr, val)
+end
+
+-- Returns resp, ran
+function vm16ffi.run(p, cycles)
+	local resp = lib.vm16_run(p, cycles, Ran)
+	return resp, Ran[0]
+end
+
+-- Read 'num' words to the table 'tbl' (optional), returns the table
+function vm16ffi.read_mem(p, addr, num, tbl)
+	local mask = p.mem_mask
+	local mem = p.memory
+	tbl = tbl or {}
+	for i = 1, num do
+		tbl[i] = mem[band(addr + i - 1, mask)]
+	end
+	return tbl
+end
+
+-- Write the values of 'tbl' to the VM memory, returns the number of words
+function vm16ffi.write_mem(p, addr, tbl)
+	local num = #tbl
+	for offs = 0, num - 1, 256 do
+		local words = math.min(num - offs, 256)
+		for i = 0, words - 1 do
+			Buffer[i] = tbl[offs + i + 1]
+		end
+		if lib.vm16_write_mem(p, addr + offs, words, Buffer) ~= words then
+			return offs
+		end
+	end
+	return num
+end
+
+return vm16ffi